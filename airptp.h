@@ -15,6 +15,293 @@
 
 struct airptp_handle;
 
+// The clock that the timestamps in PTP messages are from. MONOTONIC is slewed
+// by NTP and starts at an arbitrary point, MONOTONIC_RAW isn't slewed, TAI is
+// the same on all hosts that have their clocks synchronized (and know the TAI
+// offset), REALTIME is UTC. Only Linux has MONOTONIC_RAW and TAI.
+enum airptp_timebase
+{
+  AIRPTP_TIMEBASE_MONOTONIC = 0,
+  AIRPTP_TIMEBASE_MONOTONIC_RAW = 1,
+  AIRPTP_TIMEBASE_TAI = 2,
+  AIRPTP_TIMEBASE_REALTIME = 3,
+};
+
+#define AIRPTP_NUM_TIMEBASES 4
+
+enum airptp_daemon_option
+{
+  // Max Delay_Req and Pdelay_Req per second that will be answered from a single
+  // address that isn't a registered peer. 0 disables rate limiting, max
+  // 1000000.
+  AIRPTP_OPT_RATELIMIT_RATE,
+  // Max burst of requests from a single address that isn't a registered peer,
+  // max 100000
+  AIRPTP_OPT_RATELIMIT_BURST,
+  // If non-zero, only answer Delay_Req and Pdelay_Req from registered peers
+  AIRPTP_OPT_PEERS_ONLY,
+  // Number of threads answering Delay_Req, each with its own socket on the
+  // event port (SO_REUSEPORT, Linux only), max 8. 0 (default) means the daemon
+  // thread answers. This rebinds the event port, so it requires the same
+  // privileges as airptp_daemon_bind().
+  AIRPTP_OPT_RX_WORKERS,
+  // If non-zero, Announce, Signaling and Sync are sent from a separate thread,
+  // so that sending to many peers doesn't delay answering requests
+  AIRPTP_OPT_TX_THREAD,
+  // If non-zero, the daemon thread receives and sends with io_uring (Linux
+  // only, if built with support). Falls back to the normal sockets if the
+  // kernel doesn't support it.
+  AIRPTP_OPT_IO_URING,
+  // Experimental: index of a network interface where PTP event messages should
+  // be received and sent with AF_XDP (Linux only, IPv4 only, queue 0 only).
+  // Requires CAP_NET_ADMIN and CAP_BPF when the daemon starts. Falls back to
+  // the UDP socket for peers we haven't heard from yet, or if AF_XDP can't be
+  // set up. Rx workers won't get any traffic from that interface.
+  AIRPTP_OPT_XDP_IFINDEX,
+  // If non-zero, the XDP program is attached in generic mode even if the driver
+  // supports native mode. Slower, mostly for testing.
+  AIRPTP_OPT_XDP_GENERIC,
+  // If non-zero, each peer gets its own UDP socket per port, connected to the
+  // peer, bound with SO_REUSEPORT next to the daemon's sockets. Saves a route
+  // lookup per packet, and an ICMP unreachable from a peer is reported as an
+  // error for that peer instead of being lost. The sockets are bound when peers
+  // are added, so the daemon must keep the privileges to bind the ports. Not
+  // used for sending from the tx thread.
+  AIRPTP_OPT_CONNECTED_PEERS,
+  // If non-zero, timestamps are read from the TSC (x86-64 only) and converted
+  // to the timebase, which is faster than clock_gettime() where the vDSO
+  // can't read the clock, e.g. on some virtual machines. The TSC is calibrated
+  // when the daemon starts, and only used if it is invariant and stable.
+  // Applies to the whole process, like AIRPTP_OPT_TIMEBASE.
+  AIRPTP_OPT_TSC,
+  // One of enum airptp_timebase, default AIRPTP_TIMEBASE_MONOTONIC. Applies to
+  // the whole process, so airptp_daemon_start() fails if another daemon in the
+  // process is running with a different value.
+  AIRPTP_OPT_TIMEBASE,
+  // If non-zero, each Sync is queued this many microseconds (max 100000) ahead
+  // with SO_TXTIME (Linux only), so that it leaves exactly on the Sync interval
+  // regardless of when the daemon thread gets to run. Needs the etf qdisc on
+  // the interface, for the event port only, since etf drops packets without a
+  // launch time. Software tx timestamps are used to check the Syncs left on
+  // time, if they don't, Syncs go back to being sent the normal way. Not used
+  // with AIRPTP_OPT_TX_THREAD or AIRPTP_OPT_IO_URING.
+  AIRPTP_OPT_TXTIME,
+  // If non-zero, the daemon sends a Pdelay_Req to each peer at this interval in
+  // milliseconds (min 100), and measures the link delay to it from the
+  // responses, see airptp_peer_delay_get(). Peers that don't answer Pdelay_Req
+  // just won't have a measurement.
+  AIRPTP_OPT_PDELAY_INTERVAL,
+  // priority1 and priority2 that we announce, 0-255, default 128. Lower wins
+  // when other masters are heard, see airptp_port_info_get(). priority1 is
+  // compared before the clock quality, priority2 after.
+  AIRPTP_OPT_PRIORITY1,
+  AIRPTP_OPT_PRIORITY2,
+  // If non-zero, we follow the better master instead of just going PASSIVE, see
+  // airptp_ptp_time_get(). The master must send us Sync, i.e. have us as a
+  // peer, and with AIRPTP_OPT_PEERS_ONLY we must have it as a peer.
+  AIRPTP_OPT_SLAVE,
+  // Hot standby: like AIRPTP_OPT_SLAVE, but if there has been no Sync from the
+  // master for this many ms (250-10000), we take over as master and continue
+  // its timeline. Clients on the standby should add the same peers as on the
+  // master, so they are served right away. 0 (default) disables.
+  AIRPTP_OPT_STANDBY,
+  // If non-zero, we are a boundary clock: like AIRPTP_OPT_SLAVE, but our peers
+  // are served while we follow the master, with its time and its Announce
+  // (stepsRemoved + 1). For receivers on a subnet far from the master.
+  AIRPTP_OPT_BOUNDARY,
+};
+
+// If we hear Announce from another master that is better than us according to
+// the Best Master Clock Algorithm, we go PASSIVE and stop sending Announce,
+// Signaling and Sync to our peers, so that they don't flap between masters.
+// Delay_Req and Pdelay_Req are still answered. When the other master has been
+// quiet for 3 of its announce intervals we go back to being MASTER.
+enum airptp_port_state
+{
+  AIRPTP_PORT_MASTER = 0,
+  AIRPTP_PORT_PASSIVE = 1,
+  // See AIRPTP_OPT_SLAVE. A boundary clock serves peers also when SLAVE.
+  AIRPTP_PORT_SLAVE = 2,
+};
+
+// On Linux, packets that aren't PTP for our domain, and with
+// AIRPTP_OPT_PEERS_ONLY also packets other than Announce from unregistered
+// addresses, are dropped by a socket filter in the kernel and aren't counted
+// here
+struct airptp_stats
+{
+  uint64_t rx_packets;
+  // Not a PTPv2 message in our domain, or shorter than its type requires
+  uint64_t rx_dropped_invalid;
+  // From an address that isn't a registered peer, and sending too fast
+  uint64_t rx_dropped_ratelimit;
+  // Requests from an address that isn't a registered peer, see
+  // AIRPTP_OPT_PEERS_ONLY
+  uint64_t rx_dropped_unregistered;
+  // Control and management messages that didn't come from localhost
+  uint64_t rx_dropped_ctrl;
+
+  // Errors sending Announce, Signaling and Sync, by cause. Our socket buffer
+  // was full (EAGAIN/EWOULDBLOCK, ENOBUFS), these don't count against the peer:
+  uint64_t tx_errors_nobufs;
+  // EHOSTUNREACH, ENETUNREACH, EHOSTDOWN, ENETDOWN:
+  uint64_t tx_errors_unreachable;
+  // ECONNREFUSED, only seen with AIRPTP_OPT_CONNECTED_PEERS:
+  uint64_t tx_errors_refused;
+  uint64_t tx_errors_other;
+  // Peers that were dropped after repeated send errors
+  uint64_t tx_peers_dropped;
+
+  // Syncs sent with AIRPTP_OPT_TXTIME, and of those the ones that didn't leave
+  // on time according to their tx timestamp
+  uint64_t tx_sync_scheduled;
+  uint64_t tx_sync_missed;
+};
+
+struct airptp_timebase_info
+{
+  enum airptp_timebase timebase;
+  // Add offset_ns[x] to a PTP timestamp (as ns) to get the time in timebase x.
+  // Updated by the daemon every second. 0 for the daemon's own timebase and
+  // for timebases the platform doesn't have.
+  int64_t offset_ns[AIRPTP_NUM_TIMEBASES];
+};
+
+// Link delay to a peer measured with AIRPTP_OPT_PDELAY_INTERVAL. Times are in
+// nanoseconds, and measured in userspace, so they include some scheduling
+// delay on our side.
+struct airptp_peer_delay
+{
+  uint32_t peer_id;
+  // Exponential average of the minimum over the last 8 measurements, which is
+  // what to use for sizing buffers
+  int64_t delay_ns;
+  // Minimum and latest of the last 8 measurements
+  int64_t delay_min_ns;
+  int64_t delay_last_ns;
+  // Mean variation between consecutive round trip times, like RFC 3550
+  int64_t rtt_jitter_ns;
+  uint32_t samples;
+  // Requests that got no response before the next one was sent
+  uint32_t lost;
+};
+
+enum airptp_sync_state
+{
+  // No usable Delay_Req from the peer yet
+  AIRPTP_SYNC_UNKNOWN = 0,
+  // Still converging, or the offset is more than 1 ms (2 ms once locked)
+  AIRPTP_SYNC_UNLOCKED = 1,
+  AIRPTP_SYNC_LOCKED = 2,
+};
+
+// How well a peer is following our clock. Peers put their estimate of our time
+// in the originTimestamp of their Delay_Req, so comparing that with when we
+// received it tells us how far off they are. Peers that send zero there, or
+// don't send Delay_Req, stay AIRPTP_SYNC_UNKNOWN.
+struct airptp_peer_sync
+{
+  uint32_t peer_id;
+  enum airptp_sync_state state;
+  // The peer's time minus ours. The link delay is subtracted if it is measured
+  // with AIRPTP_OPT_PDELAY_INTERVAL, otherwise it is included.
+  int64_t offset_ns;
+  // How fast the offset is changing, positive if the peer's clock is fast
+  double drift_ppm;
+  // Mean deviation of the samples from the estimate
+  int64_t deviation_ns;
+  uint32_t samples;
+  // Samples too far from the estimate to be used
+  uint32_t outliers;
+  // Share of outliers among the recent samples
+  uint32_t outlier_permille;
+};
+
+struct airptp_port_info
+{
+  enum airptp_port_state state;
+  // Incremented on every state change, so a client polling can tell if it
+  // missed one
+  uint32_t state_changes;
+  // Foreign masters we have heard recently, whether better than us or not
+  int num_foreign_masters;
+  // The best foreign master, all 0 if there is none. Its grandmaster is the
+  // one we lost to if PASSIVE.
+  uint64_t best_clock_id;
+  uint64_t best_grandmaster_id;
+  uint8_t best_priority1;
+  uint8_t best_clock_class;
+  uint8_t best_priority2;
+};
+
+enum airptp_servo_state
+{
+  // Not following a master
+  AIRPTP_SERVO_NONE = 0,
+  // The clock was set to the master's, but isn't steady yet
+  AIRPTP_SERVO_UNLOCKED = 1,
+  // Within 100 us of the master for a while
+  AIRPTP_SERVO_LOCKED = 2,
+};
+
+struct airptp_slave_info
+{
+  // The master we follow, 0 if none
+  uint64_t master_clock_id;
+  enum airptp_servo_state state;
+  // Of our clock from the master's at the last Sync, before correction
+  int64_t offset_ns;
+  // One way, measured with Delay_Req
+  int64_t path_delay_ns;
+  // How much faster than the timebase our clock runs to follow the master
+  double freq_ppb;
+  // Times the clock was set because it was too far off to be slewed
+  uint32_t steps;
+  uint32_t samples;
+};
+
+enum airptp_event_type
+{
+  // Not heard from in AIRPTP_STALE_SECS, or too many send errors. Nothing is
+  // sent to the peer until it resumes.
+  AIRPTP_EVENT_PEER_STALE = 1,
+  AIRPTP_EVENT_PEER_RESUMED = 2,
+  // A Delay_Req from a registered peer was answered
+  AIRPTP_EVENT_DELAY_REQ = 3,
+  // value is the errno
+  AIRPTP_EVENT_SEND_FAILED = 4,
+  // An Announce from a clock_id we haven't heard from recently
+  AIRPTP_EVENT_FOREIGN_MASTER = 5,
+  // value is the new enum airptp_port_state, clock_id the better master if
+  // not MASTER
+  AIRPTP_EVENT_PORT_STATE = 6,
+};
+
+// Fixed size, so the daemon can write them to a ring in shared memory without
+// blocking, see airptp_event_read()
+struct airptp_event
+{
+  // Position in the ring, one more than the previous event
+  uint64_t seq;
+  // When the daemon saw it, in its timebase
+  uint64_t ts_ns;
+  // Of the peer or foreign master, 0 if unknown
+  uint64_t clock_id;
+  // 0 if not about a registered peer
+  uint32_t peer_id;
+  // enum airptp_event_type
+  uint16_t type;
+  int32_t value;
+};
+
+// For org extension TLVs that other clocks send in Signaling and Follow_Up,
+// e.g. Apple's (org 0x000D93). org and subtype are the 24 bit organizationId
+// and organizationSubType, data is what follows them and is only valid during
+// the call. The handler is called on the daemon thread while it handles the
+// message, so it must return quickly: no blocking, sleeping or I/O, and no
+// calls to airptp. Copy what is needed and leave the rest to another thread.
+typedef void (*airptp_tlv_cb)(uint32_t org, uint32_t subtype, uint64_t clock_id, const uint8_t *data, size_t data_len, void *arg);
+
 struct airptp_callbacks
 {
   // Optional - set name of thread
@@ -23,6 +310,11 @@ struct airptp_callbacks
   // Debugging
   void (*hexdump)(const char *msg, uint8_t *data, size_t data_len);
   void (*logmsg)(const char *fmt, ...);
+
+  // Optional - called from the daemon thread when another daemon has taken
+  // over with airptp_daemon_takeover(). The daemon has stopped, and the app
+  // should call airptp_end() and usually exit.
+  void (*handed_over)(void);
 };
 
 void
@@ -34,21 +326,75 @@ airptp_callbacks_register(struct airptp_callbacks *cb);
 struct airptp_handle *
 airptp_daemon_bind(const char *node);
 
+// Instead of airptp_daemon_bind(), for upgrading a running shared daemon
+// without receivers noticing. Gets the bound ports from it, and its clock id,
+// peers, groups, clients, sequence numbers and timebase. The running daemon
+// stops sending and calls the handed_over callback. airptp_daemon_start() must
+// then be called right away, with is_shared, and resumes sending on the Sync
+// phase of the previous daemon. AIRPTP_OPT_RX_WORKERS and
+// AIRPTP_OPT_CONNECTED_PEERS can't be set, since they rebind the ports.
+struct airptp_handle *
+airptp_daemon_takeover(void);
+
+// Options must be set after binding and before starting the daemon
+int
+airptp_daemon_option_set(struct airptp_handle *hdl, enum airptp_daemon_option option, int value);
+
+// Registers a handler for an org extension TLV, see airptp_tlv_cb. Like options
+// it must be done after binding and before starting the daemon, so only works
+// with a daemon of our own. Our own org is reserved for control messages.
+int
+airptp_tlv_handler_register(uint32_t org, uint32_t subtype, airptp_tlv_cb cb, void *arg, struct airptp_handle *hdl);
+
 // Starts a PTP daemon. Ports must have been bound already. Starting the daemon
 // does not require privileges.
 int
 airptp_daemon_start(struct airptp_handle *hdl, uint64_t clock_id_seed, bool is_shared);
 
-// Returns a handle if the host is running a compatible airptp daemon.
+// Returns a handle if the host is running a compatible airptp daemon. If the
+// daemon stops or crashes, the handle notices right away, and when a daemon is
+// running again it registers the handle's groups and peers with it, with the
+// same ids. Event positions start over then, see airptp_event_read().
 struct airptp_handle *
 airptp_daemon_find(void);
 
 int
 airptp_peer_add(uint32_t *peer_id, const char *addr, struct airptp_handle *hdl);
 
+// For peers that don't use the standard ports, e.g. another airptp daemon
+// started after airptp_ports_override(). The peer's general port must be
+// event_port + 1.
+int
+airptp_peer_add_port(uint32_t *peer_id, const char *addr, unsigned short event_port, struct airptp_handle *hdl);
+
 void
 airptp_peer_remove(uint32_t peer_id, struct airptp_handle *hdl);
 
+// Peer groups are sets of peers that are started, stopped and removed together,
+// e.g. the speakers of one playback session. A group is owned by the handle
+// that created it, and only that handle can control it. Peers in a stopped
+// group are kept, but nothing is sent to them. Within each sync interval, peers
+// in groups with higher priority are served first. New groups are stopped.
+// Peers added with airptp_peer_add() are not in a group and have priority 0.
+int
+airptp_group_add(uint32_t *group_id, const char *name, struct airptp_handle *hdl);
+
+int
+airptp_group_peer_add(uint32_t *peer_id, const char *addr, uint32_t group_id, struct airptp_handle *hdl);
+
+int
+airptp_group_start(uint32_t group_id, uint8_t priority, struct airptp_handle *hdl);
+
+int
+airptp_group_stop(uint32_t group_id, struct airptp_handle *hdl);
+
+int
+airptp_group_priority_set(uint32_t group_id, uint8_t priority, struct airptp_handle *hdl);
+
+// Removes the group and all its peers
+void
+airptp_group_remove(uint32_t group_id, struct airptp_handle *hdl);
+
 // Frees ressources (incl. stops daemon if relevant)
 void
 airptp_end(struct airptp_handle *hdl);
@@ -58,6 +404,57 @@ airptp_end(struct airptp_handle *hdl);
 int
 airptp_clock_id_get(uint64_t *clock_id, struct airptp_handle *hdl);
 
+// Counters from the daemon, also works for handles from airptp_daemon_find()
+int
+airptp_stats_get(struct airptp_stats *stats, struct airptp_handle *hdl);
+
+// Returns -1 if there is no measurement for the peer (yet)
+int
+airptp_peer_delay_get(struct airptp_peer_delay *delay, uint32_t peer_id, struct airptp_handle *hdl);
+
+// Returns -1 if the peer hasn't sent any usable Delay_Req (yet)
+int
+airptp_peer_sync_get(struct airptp_peer_sync *sync, uint32_t peer_id, struct airptp_handle *hdl);
+
+// The daemon's master state, also works for handles from airptp_daemon_find()
+int
+airptp_port_info_get(struct airptp_port_info *pinfo, struct airptp_handle *hdl);
+
+// Following a master, see AIRPTP_OPT_SLAVE. Also works for handles from
+// airptp_daemon_find().
+int
+airptp_slave_info_get(struct airptp_slave_info *sinfo, struct airptp_handle *hdl);
+
+// Now on the PTP timeline in ns: our own timebase when we are master, or the
+// timeline we took over with AIRPTP_OPT_STANDBY, and the master's time when we
+// follow one. Returns -1 if we are PASSIVE, or SLAVE
+// without a Sync from the master yet. Also works for handles from
+// airptp_daemon_find().
+int
+airptp_ptp_time_get(uint64_t *ns, struct airptp_handle *hdl);
+
+// Events are read from a ring the daemon writes to, each reader keeps its own
+// position. This gets the position of the next event the daemon will write,
+// i.e. where to start to only get new events. Also works for handles from
+// airptp_daemon_find().
+int
+airptp_event_position_get(uint64_t *pos, struct airptp_handle *hdl);
+
+// Reads the event at *pos and advances *pos past it. If there is none yet,
+// waits up to timeout_ms for it (-1 waits forever, 0 not at all). Returns 1 if
+// an event was read, 0 on timeout and -1 on error. A reader that is too slow
+// will have events overwritten before it gets to them. Then the oldest event
+// still in the ring is returned, and event->seq - *pos (as it was before the
+// call) events were lost. If the daemon has restarted, *pos may be past
+// its ring, and -1 is returned until a new position is fetched.
+int
+airptp_event_read(struct airptp_event *event, uint64_t *pos, int timeout_ms, struct airptp_handle *hdl);
+
+// The daemon's timebase, and how to convert from it to the others. Also works
+// for handles from airptp_daemon_find().
+int
+airptp_timebase_get(struct airptp_timebase_info *tbinfo, struct airptp_handle *hdl);
+
 const char *
 airptp_errmsg_get(void);
 
@@ -42,6 +42,7 @@ SOFTWARE.
 #include <stdint.h>
 #include <getopt.h>
 #include <syslog.h>
+#include <net/if.h>
 
 #include <event2/event.h>
 #include <event2/thread.h>
@@ -58,11 +59,31 @@ SOFTWARE.
 struct event_base *evbase_main;
 
 static struct event *sig_event;
+static struct event *handed_over_event;
+static int handed_over_pipe[2] = { -1, -1 };
 static int main_exit;
 static bool run_background = true;
 
 static int ptp_event_port;
 static int ptp_general_port;
+static int ratelimit_rate = -1;
+static int ratelimit_burst = -1;
+static bool peers_only;
+static int rx_workers;
+static bool tx_thread;
+static bool io_uring;
+static int xdp_ifindex;
+static bool connected_peers;
+static bool tsc;
+static int timebase = -1;
+static int txtime_lead_us;
+static int pdelay_interval_ms;
+static int priority1 = -1;
+static int priority2 = -1;
+static bool slave;
+static int standby_ms;
+static bool boundary;
+static bool upgrade;
 
 static void
 version(void)
@@ -70,6 +91,21 @@ version(void)
   fprintf(stdout, "%s %s\n", PACKAGE_NAME, PACKAGE_VERSION);
 }
 
+static int
+timebase_parse(const char *name)
+{
+  if (strcmp(name, "monotonic") == 0)
+    return AIRPTP_TIMEBASE_MONOTONIC;
+  else if (strcmp(name, "raw") == 0)
+    return AIRPTP_TIMEBASE_MONOTONIC_RAW;
+  else if (strcmp(name, "tai") == 0)
+    return AIRPTP_TIMEBASE_TAI;
+  else if (strcmp(name, "realtime") == 0)
+    return AIRPTP_TIMEBASE_REALTIME;
+
+  return -1;
+}
+
 static void
 usage(char *program)
 {
@@ -81,6 +117,24 @@ usage(char *program)
   printf("  -v              Increase verbosity\n");
   printf("  -E              Port for PTP event messages (default 319)\n");
   printf("  -G              Port for PTP general messages (default 320)\n");
+  printf("  -R              Max requests/sec from an unregistered address, 0 disables\n");
+  printf("  -B              Max burst of requests from an unregistered address\n");
+  printf("  -P              Only answer requests from registered peers\n");
+  printf("  -w              Number of threads answering Delay_Req (Linux only)\n");
+  printf("  -T              Send Announce, Signaling and Sync from a separate thread\n");
+  printf("  -U              Use io_uring for receiving and sending (Linux only)\n");
+  printf("  -C              Use a connected socket per peer\n");
+  printf("  -b <timebase>   Timebase for timestamps: monotonic (default), raw, tai or realtime\n");
+  printf("  -S <us>         Queue each Sync this far ahead with SO_TXTIME (needs etf qdisc)\n");
+  printf("  -D <ms>         Measure the link delay to each peer with Pdelay_Req at this interval\n");
+  printf("  -1 <0-255>      Announce this priority1, lower wins against other masters\n");
+  printf("  -2 <0-255>      Announce this priority2\n");
+  printf("  -s              Follow a better master instead of going passive\n");
+  printf("  -H <ms>         Hot standby: follow, and take over if the master's Sync stop for this long\n");
+  printf("  -r              Boundary clock: follow the master and serve our peers with its time\n");
+  printf("  -u              Upgrade: take over the ports, peers and clients of a running airptpd\n");
+  printf("  -K              Read timestamps from the TSC if it is stable (x86-64 only)\n");
+  printf("  -X <interface>  Experimental: use AF_XDP for PTP event messages on interface\n");
   printf("  -V              Display version information\n");
   printf("\n");
 }
@@ -157,6 +211,24 @@ daemonize(void)
   return -1;
 }
 
+// From the ptp daemon thread, which has stopped after another airptpd took over
+static void
+handed_over(void)
+{
+  char byte = 1;
+
+  if (write(handed_over_pipe[1], &byte, 1) < 0)
+    logerror("Error writing to handover pipe: %s\n", strerror(errno));
+}
+
+static void
+handed_over_cb(int fd, short event, void *arg)
+{
+  logerror("Handed over to new airptpd, exiting\n");
+  main_exit = 1;
+  event_base_loopbreak(evbase_main);
+}
+
 #ifdef HAVE_SIGNALFD
 static void
 signal_signalfd_cb(int fd, short event, void *arg)
@@ -231,7 +303,7 @@ int
 main(int argc, char **argv)
 {
   struct airptp_handle *ptpd_hdl = NULL;
-  struct airptp_callbacks logs_cb = { .logmsg = logmsg, };
+  struct airptp_callbacks cb = { .handed_over = handed_over, };
   int option;
   bool be_verbose;
   sigset_t sigs;
@@ -247,11 +319,29 @@ main(int argc, char **argv)
     { "verbose",       0, NULL, 'v' },
     { "eventport",     1, NULL, 'E' },
     { "generalport",   1, NULL, 'G' },
+    { "ratelimit",     1, NULL, 'R' },
+    { "burst",         1, NULL, 'B' },
+    { "peersonly",     0, NULL, 'P' },
+    { "rxworkers",     1, NULL, 'w' },
+    { "txthread",      0, NULL, 'T' },
+    { "iouring",       0, NULL, 'U' },
+    { "xdp",           1, NULL, 'X' },
+    { "connected",     0, NULL, 'C' },
+    { "tsc",           0, NULL, 'K' },
+    { "timebase",      1, NULL, 'b' },
+    { "txtime",        1, NULL, 'S' },
+    { "pdelay",        1, NULL, 'D' },
+    { "priority1",     1, NULL, '1' },
+    { "priority2",     1, NULL, '2' },
+    { "slave",         0, NULL, 's' },
+    { "standby",       1, NULL, 'H' },
+    { "boundary",      0, NULL, 'r' },
+    { "upgrade",       0, NULL, 'u' },
 
     { NULL,            0, NULL, 0   }
   };
 
-  while ((option = getopt_long(argc, argv, "fvVE:G:", option_map, NULL)) != -1) {
+  while ((option = getopt_long(argc, argv, "fvVE:G:R:B:Pw:TUX:CKb:S:D:1:2:sH:ru", option_map, NULL)) != -1) {
     switch (option) {
       case 'f':
         run_background = false;
@@ -274,6 +364,86 @@ main(int argc, char **argv)
         ptp_general_port = atoi(optarg);
         break;
 
+      case 'R':
+        ratelimit_rate = atoi(optarg);
+        break;
+
+      case 'B':
+        ratelimit_burst = atoi(optarg);
+        break;
+
+      case 'P':
+        peers_only = true;
+        break;
+
+      case 'w':
+        rx_workers = atoi(optarg);
+        break;
+
+      case 'T':
+        tx_thread = true;
+        break;
+
+      case 'U':
+        io_uring = true;
+        break;
+
+      case 'C':
+        connected_peers = true;
+        break;
+
+      case 'K':
+        tsc = true;
+        break;
+
+      case 'D':
+        pdelay_interval_ms = atoi(optarg);
+        break;
+
+      case 'S':
+        txtime_lead_us = atoi(optarg);
+        break;
+
+      case '1':
+        priority1 = atoi(optarg);
+        break;
+
+      case '2':
+        priority2 = atoi(optarg);
+        break;
+
+      case 's':
+        slave = true;
+        break;
+
+      case 'H':
+        standby_ms = atoi(optarg);
+        break;
+
+      case 'r':
+        boundary = true;
+        break;
+
+      case 'u':
+        upgrade = true;
+        break;
+
+      case 'b':
+        timebase = timebase_parse(optarg);
+        if (timebase < 0) {
+          fprintf(stderr, "Unknown timebase: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'X':
+        xdp_ifindex = if_nametoindex(optarg);
+        if (xdp_ifindex == 0) {
+          fprintf(stderr, "Unknown interface: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
       default:
         usage(argv[0]);
         return EXIT_FAILURE;
@@ -284,7 +454,14 @@ main(int argc, char **argv)
   if (run_background) {
     openlog(PACKAGE_NAME, 0, LOG_DAEMON);
   } else if (be_verbose) {
-    airptp_callbacks_register(&logs_cb);
+    cb.logmsg = logmsg;
+  }
+
+  airptp_callbacks_register(&cb);
+
+  if (pipe(handed_over_pipe) < 0) {
+    logerror("Could not create handover pipe: %s\n", strerror(errno));
+    goto error;
   }
 
   if (ptp_event_port > 0 && ptp_general_port > 0) {
@@ -294,9 +471,53 @@ main(int argc, char **argv)
     goto error;
   }
 
-  ptpd_hdl = airptp_daemon_bind(NULL);
+  // The ports are those of the running daemon
+  if (upgrade)
+    ptpd_hdl = airptp_daemon_takeover();
+  else
+    ptpd_hdl = airptp_daemon_bind(NULL);
   if (!ptpd_hdl) {
-    logerror("Error binding: %s\n", airptp_errmsg_get());
+    logerror("Error %s: %s\n", upgrade ? "taking over" : "binding", airptp_errmsg_get());
+    goto error;
+  }
+
+  ret = 0;
+  if (ratelimit_rate >= 0)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_RATELIMIT_RATE, ratelimit_rate);
+  if (ratelimit_burst >= 0)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_RATELIMIT_BURST, ratelimit_burst);
+  if (peers_only)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_PEERS_ONLY, 1);
+  if (rx_workers > 0)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_RX_WORKERS, rx_workers);
+  if (tx_thread)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_TX_THREAD, 1);
+  if (io_uring)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_IO_URING, 1);
+  if (connected_peers)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_CONNECTED_PEERS, 1);
+  if (tsc)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_TSC, 1);
+  if (pdelay_interval_ms > 0)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_PDELAY_INTERVAL, pdelay_interval_ms);
+  if (priority1 >= 0)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_PRIORITY1, priority1);
+  if (priority2 >= 0)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_PRIORITY2, priority2);
+  if (slave)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_SLAVE, 1);
+  if (boundary)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_BOUNDARY, 1);
+  if (standby_ms)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_STANDBY, standby_ms);
+  if (txtime_lead_us > 0)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_TXTIME, txtime_lead_us);
+  if (timebase >= 0)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_TIMEBASE, timebase);
+  if (xdp_ifindex > 0)
+    ret |= airptp_daemon_option_set(ptpd_hdl, AIRPTP_OPT_XDP_IFINDEX, xdp_ifindex);
+  if (ret < 0) {
+    logerror("Error setting daemon options: %s\n", airptp_errmsg_get());
     goto error;
   }
 
@@ -375,8 +596,17 @@ main(int argc, char **argv)
 
   event_add(sig_event, NULL);
 
+  handed_over_event = event_new(evbase_main, handed_over_pipe[0], EV_READ, handed_over_cb, NULL);
+  if (!handed_over_event) {
+    logerror("Could not create handover event\n");
+    goto error;
+  }
+
+  event_add(handed_over_event, NULL);
+
   event_base_dispatch(evbase_main);
 
+  event_free(handed_over_event);
   event_free(sig_event);
 
   event_base_free(evbase_main);
@@ -28,16 +28,27 @@ SOFTWARE.
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 // For shm_open
 #include <sys/mman.h>
 #include <sys/stat.h>        /* For mode constants */
 #include <fcntl.h>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 #include "airptp_internal.h"
 #include "ptp_definitions.h"
 #include "daemon.h"
 #include "ptp_msg_handle.h"
+#include "rx_worker.h"
+#include "peer_socket.h"
+#include "timesource.h"
+#include "reconnect.h"
+#include "handoff.h"
 
 
 /* -------------------------------- Globals --------------------------------- */
@@ -86,6 +97,120 @@ airptp_thread_name_set(const char *name)
   airptp_cb.thread_name_set(name);
 }
 
+/* --------------------------------- Helpers -------------------------------- */
+
+// Identifies the handle towards the daemon, e.g. as owner of groups
+static uint32_t
+client_id_make(struct airptp_handle *hdl)
+{
+  struct client_seed
+  {
+    pid_t pid;
+    void *hdl;
+    struct timespec ts;
+  } seed;
+  uint32_t id;
+
+  memset(&seed, 0, sizeof(seed));
+  seed.pid = getpid();
+  seed.hdl = hdl;
+  clock_gettime(CLOCK_MONOTONIC, &seed.ts);
+
+  id = utils_djb_hash(&seed, sizeof(seed));
+  return (id != 0) ? id : 1;
+}
+
+// The daemon's general port, which a reconnecting handle may change from its
+// watch thread, see reconnect.c
+static unsigned short
+ctrl_port_get(struct airptp_handle *hdl)
+{
+  unsigned short port;
+
+  if (hdl->is_daemon)
+    return hdl->general_port;
+
+  pthread_mutex_lock(&hdl->reg_lock);
+  port = hdl->general_port;
+  pthread_mutex_unlock(&hdl->reg_lock);
+  return port;
+}
+
+static int
+peer_add(uint32_t *peer_id, const char *addr, unsigned short event_port, uint32_t group_id, struct airptp_handle *hdl)
+{
+  struct airptp_peer peer = { 0 };
+  char key[128];
+  int ret;
+
+  if (hdl->state != AIRPTP_STATE_RUNNING)
+    RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't add peer, no airptp daemon");
+
+  if (utils_net_sockaddr_get(&peer.naddr, addr, event_port) < 0)
+    RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't add peer, address is invalid");
+
+  if (peer.naddr.sa.sa_family == AF_INET) {
+    if (!hdl->daemon_info.ipv4_enabled)
+      RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't add peer with ipv4 address, daemon in ipv6-only mode");
+    peer.naddr_len = sizeof(peer.naddr.sin);
+  } else if (peer.naddr.sa.sa_family == AF_INET6) {
+    if (!hdl->daemon_info.ipv6_enabled)
+      RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't add peer with ipv6 address, daemon in ipv4-only mode");
+    peer.naddr_len = sizeof(peer.naddr.sin6);
+  } else {
+    RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't add peer, invalid address family");
+  }
+
+  // The same address with other ports is another peer
+  if (event_port != 0) {
+    snprintf(key, sizeof(key), "%s:%u", addr, event_port);
+    peer.id = utils_djb_hash(key, strlen(key));
+  } else {
+    peer.id = utils_djb_hash(addr, strlen(addr));
+  }
+
+  ret = ptp_msg_peer_add_send(&peer, group_id, hdl, ctrl_port_get(hdl));
+  if (ret == AIRPTP_ERR_NOCONNECTION)
+    RETURN_ERROR(ret, "Can't add peer, connection to airptp daemon broken");
+  else if (ret == AIRPTP_ERR_LIMIT)
+    RETURN_ERROR(ret, "Can't add peer, the daemon's limit of peers or clients has been reached");
+  else if (ret < 0)
+    RETURN_ERROR(ret, "Can't add peer, rejected by airptp daemon");
+
+  *peer_id = peer.id;
+
+  reconnect_peer_remember(hdl, peer.id, addr, event_port, group_id);
+
+  return 0;
+
+ error:
+  return -1;
+}
+
+static int
+group_command_send(uint32_t group_id, enum airptp_group_cmd cmd, uint8_t priority, struct airptp_handle *hdl)
+{
+  struct airptp_group group = { .id = group_id, .owner_id = hdl->client_id, .priority = priority };
+  int ret;
+
+  if (hdl->state != AIRPTP_STATE_RUNNING)
+    RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't send group command, no airptp daemon");
+
+  ret = ptp_msg_group_send(&group, cmd, hdl, ctrl_port_get(hdl));
+  if (ret == AIRPTP_ERR_NOCONNECTION)
+    RETURN_ERROR(ret, "Can't send group command, connection to airptp daemon broken");
+  else if (ret < 0)
+    RETURN_ERROR(ret, "Group command rejected by airptp daemon, e.g. unknown group");
+
+  reconnect_group_update(hdl, group_id, cmd, priority);
+
+  return 0;
+
+ error:
+  return -1;
+}
+
+
 /* ----------------------------------- API ---------------------------------- */
 
 void
@@ -97,6 +222,8 @@ airptp_callbacks_register(struct airptp_callbacks *cb)
     airptp_cb.hexdump = cb->hexdump;
   if (cb->logmsg)
     airptp_cb.logmsg = cb->logmsg;
+  if (cb->handed_over)
+    airptp_cb.handed_over = cb->handed_over;
 }
 
 struct airptp_handle *
@@ -131,8 +258,24 @@ airptp_daemon_bind(const char *node)
   hdl->daemon.general_svc.port = airptp_general_port;
   hdl->daemon.general_svc.socket = general_socket;
 
+  hdl->event_port = airptp_event_port;
+  hdl->general_port = airptp_general_port;
+
+  hdl->daemon.config.ratelimit_rate = AIRPTP_RATELIMIT_RATE;
+  hdl->daemon.config.ratelimit_burst = AIRPTP_RATELIMIT_BURST;
+  hdl->daemon.config.priority1 = AIRPTP_PRIORITY_DEFAULT;
+  hdl->daemon.config.priority2 = AIRPTP_PRIORITY_DEFAULT;
+  hdl->daemon.config.peers_only = false;
+
+  if (node) {
+    hdl->daemon.bind_node = strdup(node);
+    if (!hdl->daemon.bind_node)
+      RETURN_ERROR(AIRPTP_ERR_OOM, "Out of memory");
+  }
+
   hdl->state = AIRPTP_STATE_PORTS_BOUND;
   hdl->is_daemon = true;
+  hdl->client_id = client_id_make(hdl);
 
   return hdl;
 
@@ -143,11 +286,197 @@ airptp_daemon_bind(const char *node)
   return NULL;
 }
 
+int
+airptp_tlv_handler_register(uint32_t org, uint32_t subtype, airptp_tlv_cb cb, void *arg, struct airptp_handle *hdl)
+{
+  struct airptp_daemon_config *config = &hdl->daemon.config;
+  uint64_t key = PTP_TLV_ORG_KEY(org, subtype);
+  int i;
+  int ret;
+
+  if (!hdl->is_daemon || hdl->state != AIRPTP_STATE_PORTS_BOUND)
+    RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't register TLV handler, must be done after binding and before starting the daemon");
+  if (!cb || org > 0xFFFFFF || subtype > 0xFFFFFF)
+    RETURN_ERROR(AIRPTP_ERR_INVALID, "Invalid TLV handler, org and subtype are 24 bit");
+  if (org == PTP_TLV_ORG_ID_OWN)
+    RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't register TLV handler, org is reserved");
+  if (config->num_tlv_handlers >= AIRPTP_MAX_TLV_HANDLERS)
+    RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't register TLV handler, too many");
+
+  for (i = 0; i < config->num_tlv_handlers; i++)
+    {
+      if (config->tlv_handlers[i].key == key)
+	RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't register TLV handler, already registered");
+    }
+
+  // Kept sorted for the lookup when messages arrive
+  for (i = config->num_tlv_handlers; i > 0 && config->tlv_handlers[i - 1].key > key; i--)
+    config->tlv_handlers[i] = config->tlv_handlers[i - 1];
+
+  config->tlv_handlers[i].key = key;
+  config->tlv_handlers[i].cb = cb;
+  config->tlv_handlers[i].arg = arg;
+  config->num_tlv_handlers++;
+  return 0;
+
+ error:
+  return ret;
+}
+
+struct airptp_handle *
+airptp_daemon_takeover(void)
+{
+  struct airptp_handle *hdl = NULL;
+  int ret;
+
+  hdl = calloc(1, sizeof(struct airptp_handle));
+  if (!hdl)
+    RETURN_ERROR(AIRPTP_ERR_OOM, "Out of memory");
+
+  hdl->daemon.config.ratelimit_rate = AIRPTP_RATELIMIT_RATE;
+  hdl->daemon.config.ratelimit_burst = AIRPTP_RATELIMIT_BURST;
+  hdl->daemon.config.priority1 = AIRPTP_PRIORITY_DEFAULT;
+  hdl->daemon.config.priority2 = AIRPTP_PRIORITY_DEFAULT;
+  hdl->daemon.config.peers_only = false;
+
+  ret = handoff_takeover(&hdl->daemon);
+  if (ret < 0)
+    goto error; // airptp_errmsg already set
+
+  hdl->event_port = hdl->daemon.event_svc.port;
+  hdl->general_port = hdl->daemon.general_svc.port;
+
+  hdl->state = AIRPTP_STATE_PORTS_BOUND;
+  hdl->is_daemon = true;
+  hdl->client_id = client_id_make(hdl);
+
+  return hdl;
+
+ error:
+  free(hdl);
+  return NULL;
+}
+
+int
+airptp_daemon_option_set(struct airptp_handle *hdl, enum airptp_daemon_option option, int value)
+{
+  struct airptp_daemon_config *config = &hdl->daemon.config;
+  int ret;
+
+  if (!hdl->is_daemon || hdl->state != AIRPTP_STATE_PORTS_BOUND)
+    RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't set option, must be set after binding and before starting the daemon");
+
+  switch (option)
+    {
+      case AIRPTP_OPT_RATELIMIT_RATE:
+	if (value < 0 || value > AIRPTP_RATELIMIT_RATE_MAX)
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Invalid rate limit, must be 0 (disabled) or positive, max 1000000");
+	config->ratelimit_rate = value;
+	break;
+      case AIRPTP_OPT_RATELIMIT_BURST:
+	if (value <= 0 || value > AIRPTP_RATELIMIT_BURST_MAX)
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Invalid rate limit burst, must be positive, max 100000");
+	config->ratelimit_burst = value;
+	break;
+      case AIRPTP_OPT_PEERS_ONLY:
+	config->peers_only = (value != 0);
+	break;
+      case AIRPTP_OPT_TX_THREAD:
+	config->tx_thread = (value != 0);
+	break;
+      case AIRPTP_OPT_IO_URING:
+#ifndef HAVE_IO_URING
+	if (value != 0)
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Not built with io_uring support");
+#endif
+	config->io_uring = (value != 0);
+	break;
+      case AIRPTP_OPT_XDP_IFINDEX:
+#ifndef HAVE_AF_XDP
+	if (value != 0)
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Not built with AF_XDP support");
+#endif
+	if (value < 0)
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Invalid interface index");
+	config->xdp_ifindex = value;
+	break;
+      case AIRPTP_OPT_XDP_GENERIC:
+	config->xdp_generic = (value != 0);
+	break;
+      case AIRPTP_OPT_CONNECTED_PEERS:
+	if (value != 0 && hdl->daemon.is_takeover)
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Connected peers can't be combined with taking over from another daemon");
+	config->connected_peers = (value != 0);
+	if (config->connected_peers && peer_sockets_bind(&hdl->daemon) < 0)
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Could not rebind ports for connected peer sockets, SO_REUSEPORT not supported?");
+	break;
+      case AIRPTP_OPT_TIMEBASE:
+	if (!timesource_timebase_is_supported(value))
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Timebase not supported on this platform");
+	config->timebase = value;
+	break;
+      case AIRPTP_OPT_TXTIME:
+#ifndef HAVE_SO_TXTIME
+	if (value != 0)
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Not built with SO_TXTIME support");
+#endif
+	if (value < 0 || value > 100000)
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Invalid SO_TXTIME lead time");
+	config->txtime_lead_us = value;
+	break;
+      case AIRPTP_OPT_PDELAY_INTERVAL:
+	if (value != 0 && (value < 100 || value > 3600000))
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Invalid pdelay interval");
+	config->pdelay_interval_ms = value;
+	break;
+      case AIRPTP_OPT_PRIORITY1:
+	if (value < 0 || value > 255)
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Invalid priority1, must be 0-255");
+	config->priority1 = value;
+	break;
+      case AIRPTP_OPT_PRIORITY2:
+	if (value < 0 || value > 255)
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Invalid priority2, must be 0-255");
+	config->priority2 = value;
+	break;
+      case AIRPTP_OPT_SLAVE:
+	config->slave = (value != 0);
+	break;
+      case AIRPTP_OPT_BOUNDARY:
+	config->boundary = (value != 0);
+	break;
+      case AIRPTP_OPT_STANDBY:
+	if (value != 0 && (value < 250 || value > 10000))
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Invalid standby takeover time, must be 250-10000 ms");
+	config->standby_ms = value;
+	break;
+      case AIRPTP_OPT_TSC:
+	config->tsc = (value != 0);
+	break;
+      case AIRPTP_OPT_RX_WORKERS:
+	if (value < 0 || value > AIRPTP_MAX_RX_WORKERS)
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Invalid number of rx workers");
+	if (value != 0 && hdl->daemon.is_takeover)
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Rx workers can't be combined with taking over from another daemon");
+	if (rx_workers_bind(&hdl->daemon, value) < 0)
+	  RETURN_ERROR(AIRPTP_ERR_INVALID, "Could not bind the event port for rx workers, SO_REUSEPORT not supported?");
+	break;
+      default:
+	RETURN_ERROR(AIRPTP_ERR_INVALID, "Unknown option");
+    }
+
+  return 0;
+
+ error:
+  return ret;
+}
+
 // Starts a PTP daemon. Ports must have been bound already. Starting the daemon
 // does not require privileges.
 int
 airptp_daemon_start(struct airptp_handle *hdl, uint64_t clock_id_seed, bool is_shared)
 {
+  struct airptp_client client = { 0 };
   int ret;
 
   if (!hdl->is_daemon || hdl->state != AIRPTP_STATE_PORTS_BOUND)
@@ -162,12 +491,29 @@ airptp_daemon_start(struct airptp_handle *hdl, uint64_t clock_id_seed, bool is_s
   // If we had the MAC address at this point we, could make a valid EUI-48 based
   // clocked from mac[0..2] + 0xFFFE + mac[3..5]. However, since we don't, we
   // create a non-EUI-64 clock ID from 0xFFFF + 6 byte seed, ref 7.5.2.2.3.
+  if (hdl->daemon.is_takeover && !is_shared)
+    RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't start daemon, taking over requires a shared daemon");
+
+  // Taking over means keeping the clock id
+  if (hdl->daemon.is_takeover)
+    clock_id_seed = hdl->daemon.clock_id;
+
   ret = daemon_start(&hdl->daemon, &hdl->daemon_info, is_shared, clock_id_seed | 0xFFFF000000000000, airptp_cb);
   if (ret < 0)
     goto error; // errmsg set by daemon_start
 
   hdl->state = AIRPTP_STATE_RUNNING;
 
+  // Our own peers and groups are a client's like any other
+  client.id = hdl->client_id;
+  client.pid = getpid();
+  ret = ptp_msg_client_send(&client, AIRPTP_CLIENT_CMD_ADD, hdl, ctrl_port_get(hdl));
+  if (ret < 0) {
+    daemon_stop(&hdl->daemon);
+    hdl->state = AIRPTP_STATE_PORTS_BOUND;
+    RETURN_ERROR(ret, "Can't start daemon, couldn't register with it");
+  }
+
   return 0;
 
  error:
@@ -178,82 +524,108 @@ struct airptp_handle *
 airptp_daemon_find(void)
 {
   struct airptp_handle *hdl = NULL;
-  struct airptp_daemon_info *daemon_info = MAP_FAILED;
-  time_t now;
-  int fd = -1;
-  int ret __attribute__((unused));
-
-  fd = shm_open(AIRPTP_SHM_NAME, O_RDONLY, 0);
-  if (fd < 0)
-    RETURN_ERROR(AIRPTP_ERR_NOTFOUND, "No airptp daemon found");
-
-  daemon_info = mmap(NULL, sizeof(struct airptp_daemon_info), PROT_READ, MAP_SHARED, fd, 0);
-  if (daemon_info == MAP_FAILED)
-    RETURN_ERROR(AIRPTP_ERR_INTERNAL, "mmap() of shared memory returned an error");
-
-  if (daemon_info->version_major != AIRPTP_SHM_STRUCTS_VERSION_MAJOR)
-    RETURN_ERROR(AIRPTP_ERR_NOTFOUND, "The host is running an incompatible airptp daemon");
-
-  now = time(NULL);
-  if (daemon_info->ts + AIRPTP_STALE_SECS < now)
-    RETURN_ERROR(AIRPTP_ERR_NOTFOUND, "No airptp daemon found (shared mem is stale)");
+  struct airptp_client client = { 0 };
+  int ret;
 
   hdl = calloc(1, sizeof(struct airptp_handle));
   if (!hdl)
     RETURN_ERROR(AIRPTP_ERR_OOM, "Out of memory");
 
-  hdl->state = AIRPTP_STATE_RUNNING;
   hdl->is_daemon = false;
-  memcpy(&hdl->daemon_info, daemon_info, sizeof(struct airptp_daemon_info));
+  hdl->client_id = client_id_make(hdl);
+  hdl->liveness_fd = -1;
+  pthread_mutex_init(&hdl->reg_lock, NULL);
+
+  ret = reconnect_attach(hdl);
+  if (ret < 0)
+    goto error; // airptp_errmsg already set
+
+  hdl->state = AIRPTP_STATE_RUNNING;
 
-  munmap(daemon_info, sizeof(struct airptp_daemon_info));
-  close(fd);
+  // Registering with our pid means the daemon can clean up after us if we
+  // crash or forget to call airptp_end()
+  client.id = hdl->client_id;
+  client.pid = getpid();
+  ret = ptp_msg_client_send(&client, AIRPTP_CLIENT_CMD_ADD, hdl, ctrl_port_get(hdl));
+  if (ret == AIRPTP_ERR_LIMIT)
+    RETURN_ERROR(ret, "The airptp daemon's limit of clients has been reached");
+  else if (ret < 0)
+    RETURN_ERROR(ret, "The airptp daemon did not accept our registration");
 
-  airptp_event_port = hdl->daemon_info.event_port;
-  airptp_general_port = hdl->daemon_info.general_port;
+  // If the daemon restarts we will find it again, not an error if we can't
+  if (reconnect_start(hdl, airptp_cb) < 0)
+    airptp_logmsg("Couldn't start thread watching the airptp daemon, won't reconnect");
 
   return hdl;
 
  error:
+  if (hdl) {
+    if (hdl->shm_info)
+      munmap(hdl->shm_info, sizeof(struct airptp_daemon_info));
+    if (hdl->liveness_fd >= 0)
+      close(hdl->liveness_fd);
+    pthread_mutex_destroy(&hdl->reg_lock);
+  }
   free(hdl);
-  if (daemon_info != MAP_FAILED)
-    munmap(daemon_info, sizeof(struct airptp_daemon_info));
-  if (fd >= 0)
-    close(fd);
   return NULL;
 }
 
 int
 airptp_peer_add(uint32_t *peer_id, const char *addr, struct airptp_handle *hdl)
+{
+  return peer_add(peer_id, addr, 0, 0, hdl);
+}
+
+int
+airptp_peer_add_port(uint32_t *peer_id, const char *addr, unsigned short event_port, struct airptp_handle *hdl)
+{
+  return peer_add(peer_id, addr, event_port, 0, hdl);
+}
+
+void
+airptp_peer_remove(uint32_t peer_id, struct airptp_handle *hdl)
 {
   struct airptp_peer peer = { 0 };
+
+  if (hdl->state != AIRPTP_STATE_RUNNING)
+    return;
+
+  peer.id = peer_id;
+
+  ptp_msg_peer_del_send(&peer, hdl, ctrl_port_get(hdl));
+  reconnect_peer_forget(hdl, peer_id);
+}
+
+int
+airptp_group_add(uint32_t *group_id, const char *name, struct airptp_handle *hdl)
+{
+  struct airptp_group group = { 0 };
   int ret;
 
   if (hdl->state != AIRPTP_STATE_RUNNING)
-    RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't add peer, no airptp daemon");
+    RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't add group, no airptp daemon");
 
-  if (utils_net_sockaddr_get(&peer.naddr, addr, 0) < 0)
-    RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't add peer, address is invalid");
+  if (!name || strlen(name) == 0 || strlen(name) >= sizeof(group.name))
+    RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't add group, name is empty or too long");
 
-  if (peer.naddr.sa.sa_family == AF_INET) {
-    if (!hdl->daemon_info.ipv4_enabled)
-      RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't add peer with ipv4 address, daemon in ipv6-only mode");
-    peer.naddr_len = sizeof(peer.naddr.sin);
-  } else if (peer.naddr.sa.sa_family == AF_INET6) {
-    if (!hdl->daemon_info.ipv6_enabled)
-      RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't add peer with ipv6 address, daemon in ipv4-only mode");
-    peer.naddr_len = sizeof(peer.naddr.sin6);
-  } else {
-    RETURN_ERROR(AIRPTP_ERR_INVALID, "Can't add peer, invalid address family");
-  }
+  // Including the client id means different clients can use the same names
+  group.id = utils_djb_hash(name, strlen(name)) ^ hdl->client_id;
+  if (group.id == 0)
+    group.id = 1;
+  group.owner_id = hdl->client_id;
+  snprintf(group.name, sizeof(group.name), "%s", name);
 
-  peer.id = utils_djb_hash(addr, strlen(addr));
+  ret = ptp_msg_group_send(&group, AIRPTP_GROUP_CMD_ADD, hdl, ctrl_port_get(hdl));
+  if (ret == AIRPTP_ERR_NOCONNECTION)
+    RETURN_ERROR(ret, "Can't add group, connection to airptp daemon broken");
+  else if (ret == AIRPTP_ERR_LIMIT)
+    RETURN_ERROR(ret, "Can't add group, the daemon's limit of groups or clients has been reached");
+  else if (ret < 0)
+    RETURN_ERROR(ret, "Can't add group, rejected by airptp daemon");
 
-  ret = ptp_msg_peer_add_send(&peer, hdl, airptp_general_port);
-  if (ret < 0)
-    RETURN_ERROR(AIRPTP_ERR_NOCONNECTION, "Can't add peer, connection to airptp daemon broken");
+  *group_id = group.id;
 
-  *peer_id = peer.id;
+  reconnect_group_remember(hdl, group.id, group.name);
 
   return 0;
 
@@ -261,29 +633,79 @@ airptp_peer_add(uint32_t *peer_id, const char *addr, struct airptp_handle *hdl)
   return -1;
 }
 
-void
-airptp_peer_remove(uint32_t peer_id, struct airptp_handle *hdl)
+int
+airptp_group_peer_add(uint32_t *peer_id, const char *addr, uint32_t group_id, struct airptp_handle *hdl)
 {
-  struct airptp_peer peer = { 0 };
+  if (group_id == 0) {
+    airptp_errmsg = "Can't add peer to group, invalid group id";
+    return -1;
+  }
 
-  if (hdl->state != AIRPTP_STATE_RUNNING)
-    return;
+  return peer_add(peer_id, addr, 0, group_id, hdl);
+}
 
-  peer.id = peer_id;
+int
+airptp_group_start(uint32_t group_id, uint8_t priority, struct airptp_handle *hdl)
+{
+  return group_command_send(group_id, AIRPTP_GROUP_CMD_START, priority, hdl);
+}
+
+int
+airptp_group_stop(uint32_t group_id, struct airptp_handle *hdl)
+{
+  return group_command_send(group_id, AIRPTP_GROUP_CMD_STOP, 0, hdl);
+}
+
+int
+airptp_group_priority_set(uint32_t group_id, uint8_t priority, struct airptp_handle *hdl)
+{
+  return group_command_send(group_id, AIRPTP_GROUP_CMD_PRIORITY, priority, hdl);
+}
 
-  ptp_msg_peer_del_send(&peer, hdl, airptp_general_port);
+void
+airptp_group_remove(uint32_t group_id, struct airptp_handle *hdl)
+{
+  group_command_send(group_id, AIRPTP_GROUP_CMD_REMOVE, 0, hdl);
 }
 
 void
 airptp_end(struct airptp_handle *hdl)
 {
+  struct airptp_client client = { 0 };
+
   if (!hdl)
     return;
 
+  // Before telling the daemon, so we don't register again
+  reconnect_stop(hdl);
+
+  // Tells a shared daemon to drop our peers and groups
+  if (!hdl->is_daemon && hdl->state == AIRPTP_STATE_RUNNING) {
+    client.id = hdl->client_id;
+    ptp_msg_client_send(&client, AIRPTP_CLIENT_CMD_REMOVE, hdl, ctrl_port_get(hdl));
+  }
+
   if (hdl->is_daemon) {
     daemon_stop(&hdl->daemon);
     utils_net_socket_close(&hdl->daemon.event_svc.socket);
     utils_net_socket_close(&hdl->daemon.general_svc.socket);
+    rx_workers_close(&hdl->daemon);
+    free(hdl->daemon.bind_node);
+    // Taken over but not started, otherwise the daemon thread closed these
+    if (hdl->daemon.is_takeover && hdl->daemon.shm_fd >= 0)
+      close(hdl->daemon.shm_fd);
+    if (hdl->daemon.is_takeover && hdl->daemon.liveness_fd >= 0)
+      close(hdl->daemon.liveness_fd);
+  }
+
+  if (!hdl->is_daemon) {
+    if (hdl->shm_info)
+      munmap(hdl->shm_info, sizeof(struct airptp_daemon_info));
+    if (hdl->shm_retired)
+      munmap(hdl->shm_retired, sizeof(struct airptp_daemon_info));
+    if (hdl->liveness_fd >= 0)
+      close(hdl->liveness_fd);
+    pthread_mutex_destroy(&hdl->reg_lock);
   }
 
   free(hdl);
@@ -299,6 +721,318 @@ airptp_clock_id_get(uint64_t *clock_id, struct airptp_handle *hdl)
   return 0;
 }
 
+int
+airptp_stats_get(struct airptp_stats *stats, struct airptp_handle *hdl)
+{
+  struct airptp_daemon_info *info;
+
+  if (hdl->state != AIRPTP_STATE_RUNNING)
+    return -1;
+
+  info = hdl->is_daemon ? hdl->daemon.info : hdl->shm_info;
+  if (!info || info == MAP_FAILED)
+    return -1;
+
+  memcpy(stats, &info->stats, sizeof(struct airptp_stats));
+  return 0;
+}
+
+// Copies the peer's entry from the shm tables, either of delay and sync may be
+// NULL. Returns -1 if the peer has no entry.
+static int
+peer_stats_read(struct airptp_peer_delay *delay, struct airptp_peer_sync *sync, uint32_t peer_id, struct airptp_handle *hdl)
+{
+  struct airptp_daemon_info *info;
+  uint32_t seq;
+  bool found;
+  int tries;
+  int i;
+
+  if (hdl->state != AIRPTP_STATE_RUNNING)
+    return -1;
+
+  info = hdl->is_daemon ? hdl->daemon.info : hdl->shm_info;
+  if (!info || info == MAP_FAILED)
+    return -1;
+
+  // The daemon writes the tables rarely and quickly, so we shouldn't need many
+  for (tries = 0; tries < 100; tries++) {
+    seq = __atomic_load_n(&info->peer_stats_seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;
+
+    for (i = 0, found = false; i < AIRPTP_MAX_PEERS && !found; i++) {
+      if (info->peer_delays[i].peer_id != peer_id)
+	continue;
+
+      if (delay)
+	memcpy(delay, &info->peer_delays[i], sizeof(struct airptp_peer_delay));
+      if (sync)
+	memcpy(sync, &info->peer_syncs[i], sizeof(struct airptp_peer_sync));
+      found = true;
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&info->peer_stats_seq, __ATOMIC_RELAXED) == seq)
+      return found ? 0 : -1;
+  }
+
+  return -1;
+}
+
+int
+airptp_peer_delay_get(struct airptp_peer_delay *delay, uint32_t peer_id, struct airptp_handle *hdl)
+{
+  if (peer_stats_read(delay, NULL, peer_id, hdl) < 0)
+    return -1;
+
+  return (delay->samples > 0) ? 0 : -1;
+}
+
+int
+airptp_peer_sync_get(struct airptp_peer_sync *sync, uint32_t peer_id, struct airptp_handle *hdl)
+{
+  if (peer_stats_read(NULL, sync, peer_id, hdl) < 0)
+    return -1;
+
+  return (sync->state != AIRPTP_SYNC_UNKNOWN) ? 0 : -1;
+}
+
+int
+airptp_port_info_get(struct airptp_port_info *pinfo, struct airptp_handle *hdl)
+{
+  struct airptp_daemon_info *info;
+  uint32_t seq;
+  int tries;
+
+  if (hdl->state != AIRPTP_STATE_RUNNING)
+    return -1;
+
+  info = hdl->is_daemon ? hdl->daemon.info : hdl->shm_info;
+  if (!info || info == MAP_FAILED)
+    return -1;
+
+  for (tries = 0; tries < 100; tries++) {
+    seq = __atomic_load_n(&info->port_seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;
+
+    memcpy(pinfo, &info->port, sizeof(struct airptp_port_info));
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&info->port_seq, __ATOMIC_RELAXED) == seq)
+      return 0;
+  }
+
+  return -1;
+}
+
+static int
+slave_read(struct airptp_slave_info *sinfo, struct airptp_timemap *tm, struct airptp_handle *hdl)
+{
+  struct airptp_daemon_info *info;
+  uint32_t seq;
+  int tries;
+
+  if (hdl->state != AIRPTP_STATE_RUNNING)
+    return -1;
+
+  info = hdl->is_daemon ? hdl->daemon.info : hdl->shm_info;
+  if (!info || info == MAP_FAILED)
+    return -1;
+
+  for (tries = 0; tries < 100; tries++) {
+    seq = __atomic_load_n(&info->slave_seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;
+
+    if (sinfo)
+      memcpy(sinfo, &info->slave, sizeof(struct airptp_slave_info));
+    if (tm)
+      memcpy(tm, &info->timemap, sizeof(struct airptp_timemap));
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&info->slave_seq, __ATOMIC_RELAXED) == seq)
+      return 0;
+  }
+
+  return -1;
+}
+
+int
+airptp_slave_info_get(struct airptp_slave_info *sinfo, struct airptp_handle *hdl)
+{
+  return slave_read(sinfo, NULL, hdl);
+}
+
+int
+airptp_ptp_time_get(uint64_t *ns, struct airptp_handle *hdl)
+{
+  struct airptp_port_info pinfo;
+  struct airptp_timemap tm;
+  struct airptp_daemon_info *info;
+  int64_t elapsed_ns;
+
+  if (airptp_port_info_get(&pinfo, hdl) < 0)
+    return -1;
+
+  info = hdl->is_daemon ? hdl->daemon.info : hdl->shm_info;
+
+  if (pinfo.state == AIRPTP_PORT_PASSIVE || slave_read(NULL, &tm, hdl) < 0)
+    return -1;
+
+  if (pinfo.state == AIRPTP_PORT_MASTER && tm.local_ns == 0) {
+    *ns = timesource_timebase_now(info->timebase);
+    return 0;
+  }
+
+  if (tm.local_ns == 0)
+    return -1;
+
+  elapsed_ns = timesource_timebase_now(info->timebase) - tm.local_ns;
+  *ns = tm.ptp_ns + elapsed_ns + (int64_t)(elapsed_ns * tm.rate_ppb / 1e9);
+  return 0;
+}
+
+int
+airptp_timebase_get(struct airptp_timebase_info *tbinfo, struct airptp_handle *hdl)
+{
+  struct airptp_daemon_info *info;
+  int i;
+
+  if (hdl->state != AIRPTP_STATE_RUNNING)
+    return -1;
+
+  info = hdl->is_daemon ? hdl->daemon.info : hdl->shm_info;
+  if (!info || info == MAP_FAILED)
+    return -1;
+
+  tbinfo->timebase = info->timebase;
+  for (i = 0; i < AIRPTP_NUM_TIMEBASES; i++)
+    tbinfo->offset_ns[i] = __atomic_load_n(&info->timebase_offset_ns[i], __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+int
+airptp_event_position_get(uint64_t *pos, struct airptp_handle *hdl)
+{
+  struct airptp_daemon_info *info;
+
+  if (hdl->state != AIRPTP_STATE_RUNNING)
+    return -1;
+
+  info = hdl->is_daemon ? hdl->daemon.info : hdl->shm_info;
+  if (!info || info == MAP_FAILED)
+    return -1;
+
+  *pos = __atomic_load_n(&info->event_head, __ATOMIC_ACQUIRE);
+  return 0;
+}
+
+// Copies the event at pos, which must be before the head. Returns -1 if it was
+// overwritten before or while copying, see daemon_event_publish().
+static int
+event_copy(struct airptp_event *event, struct airptp_daemon_info *info, uint64_t pos)
+{
+  struct airptp_event *slot = &info->events[pos % AIRPTP_EVENT_RING_SIZE];
+
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos)
+    return -1;
+
+  memcpy(event, slot, sizeof(struct airptp_event));
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != pos)
+    return -1;
+
+  return 0;
+}
+
+// Waits for the daemon to change event_futex from val, or up to timeout_ms if
+// that isn't -1. Spurious returns are fine, the caller checks again. The
+// daemon only wakes readers it can see in event_waiters, so if we can't write
+// to the shm we poll.
+static void
+event_wait(struct airptp_daemon_info *info, bool is_writable, uint32_t val, int timeout_ms)
+{
+#ifdef __linux__
+  struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+
+  // Not FUTEX_PRIVATE_FLAG since the daemon may be another process. If we
+  // die while waiting the count stays up, then the daemon just wakes nobody.
+  if (is_writable) {
+    __atomic_fetch_add(&info->event_waiters, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &info->event_futex, FUTEX_WAIT, val, (timeout_ms < 0) ? NULL : &ts, NULL, 0);
+    __atomic_fetch_sub(&info->event_waiters, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+#endif
+  usleep((timeout_ms < 0 || timeout_ms > 10) ? 10000 : timeout_ms * 1000);
+}
+
+int
+airptp_event_read(struct airptp_event *event, uint64_t *pos, int timeout_ms, struct airptp_handle *hdl)
+{
+  struct airptp_daemon_info *info;
+  uint64_t deadline_ms;
+  uint64_t now_ms;
+  uint64_t head;
+  uint64_t next;
+  uint32_t val;
+  bool is_writable;
+
+  if (hdl->state != AIRPTP_STATE_RUNNING)
+    return -1;
+
+  if (hdl->is_daemon) {
+    info = hdl->daemon.info;
+    is_writable = true;
+  } else {
+    pthread_mutex_lock(&hdl->reg_lock);
+    info = hdl->shm_info;
+    is_writable = hdl->shm_is_writable;
+    pthread_mutex_unlock(&hdl->reg_lock);
+  }
+  if (!info || info == MAP_FAILED)
+    return -1;
+
+  deadline_ms = (timeout_ms > 0) ? daemon_now_ms() + timeout_ms : 0;
+
+  for (;;) {
+    // Read before the head, so an event published after we look at the head
+    // makes the wait return immediately
+    val = __atomic_load_n(&info->event_futex, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&info->event_head, __ATOMIC_ACQUIRE);
+    if (*pos > head)
+      return -1;
+
+    if (*pos < head) {
+      // Fallen behind, skip to the oldest event still there
+      next = (head - *pos > AIRPTP_EVENT_RING_SIZE) ? head - AIRPTP_EVENT_RING_SIZE : *pos;
+      if (event_copy(event, info, next) == 0) {
+	*pos = next + 1;
+	return 1;
+      }
+      continue;
+    }
+
+    if (timeout_ms == 0)
+      return 0;
+
+    if (timeout_ms < 0) {
+      event_wait(info, is_writable, val, -1);
+      continue;
+    }
+
+    now_ms = daemon_now_ms();
+    if (now_ms >= deadline_ms)
+      return 0;
+
+    event_wait(info, is_writable, val, deadline_ms - now_ms);
+  }
+}
+
 const char *
 airptp_errmsg_get(void)
 {
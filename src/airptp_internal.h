@@ -7,17 +7,69 @@
 
 #include "../airptp.h"
 #include "utils.h"
+#include "ratelimit.h"
+#include "timesource.h"
 
 #define AIRPTP_SHM_NAME "/airptp_shm"
+// A FIFO that the daemon holds the write end of, so clients holding the read
+// end get POLLHUP the moment it stops or crashes, see reconnect.c. It is in a
+// directory only the daemon's user can write to, named by the uid, which
+// clients get from the owner of the shm.
+#define AIRPTP_LIVENESS_DIR_FMT "/tmp/airptp-%u"
+#define AIRPTP_LIVENESS_PATH_FMT AIRPTP_LIVENESS_DIR_FMT "/liveness"
+// Where a shared daemon listens for a new one taking over, see handoff.c
+#define AIRPTP_HANDOFF_PATH "/tmp/airptp_handoff"
 
-#define AIRPTP_SHM_STRUCTS_VERSION_MAJOR 0
-#define AIRPTP_SHM_STRUCTS_VERSION_MINOR 1
+// Clients only check the major version, so new fields go at the end of
+// struct airptp_daemon_info with a minor bump. Any other change of the layout,
+// or of the control messages, needs a major bump.
+#define AIRPTP_SHM_STRUCTS_VERSION_MAJOR 2
+#define AIRPTP_SHM_STRUCTS_VERSION_MINOR 0
 
 // If the ts is older than this we consider the daemon or peer gone
 #define AIRPTP_STALE_SECS 15
+// The daemon updates its ts every 5 secs, so if its process also seems to be
+// gone this is enough, see reconnect.c
+#define AIRPTP_STALE_SECS_NO_PID 7
 
 #define AIRPTP_DOMAIN 0
 #define AIRPTP_MAX_PEERS 32
+#define AIRPTP_MAX_GROUPS 16
+#define AIRPTP_GROUP_NAME_LEN 32
+// Max 32, since a bit mask is used for the clients referencing a peer
+#define AIRPTP_MAX_CLIENTS 16
+#define AIRPTP_MAX_TLV_HANDLERS 16
+// Slots in the event ring in shm, a power of 2. Room for a few seconds of
+// Delay_Req events from all peers.
+#define AIRPTP_EVENT_RING_SIZE 1024
+// Per-client quotas, so that one client can't take all of a shared daemon
+#define AIRPTP_CLIENT_MAX_PEERS 16
+#define AIRPTP_CLIENT_MAX_GROUPS 4
+
+// Defaults for requests from addresses that aren't registered peers. Receivers
+// send Delay_Req at 8 Hz, so this is twice that.
+#define AIRPTP_RATELIMIT_RATE 16
+#define AIRPTP_RATELIMIT_BURST 32
+// Upper bounds for the options, so the token arithmetic in ratelimit.c fits
+#define AIRPTP_RATELIMIT_RATE_MAX 1000000
+#define AIRPTP_RATELIMIT_BURST_MAX 100000
+
+// After a send error to a peer we skip it for a while, starting with one Sync
+// interval and doubling up to the max. After AIRPTP_SEND_MAX_ERRORS errors in
+// a row the peer is dropped.
+#define AIRPTP_SEND_BACKOFF_MIN_MS 125
+#define AIRPTP_SEND_BACKOFF_MAX_MS 4000
+#define AIRPTP_SEND_MAX_ERRORS 8
+
+// Number of Pdelay measurements we take the minimum of
+#define AIRPTP_PDELAY_WINDOW 8
+
+// Other masters we keep track of, see bmca.c
+#define AIRPTP_MAX_FOREIGN_MASTERS 8
+#define AIRPTP_PRIORITY_DEFAULT 128
+
+// Max threads answering Delay_Req, see AIRPTP_OPT_RX_WORKERS
+#define AIRPTP_MAX_RX_WORKERS 8
 
 #define RETURN_ERROR(r, m) \
   do { ret = (r); airptp_errmsg = (m); goto error; } while(0)
@@ -45,6 +97,7 @@ enum airptp_error
   AIRPTP_ERR_NOTFOUND = -3,
   AIRPTP_ERR_OOM = -4,
   AIRPTP_ERR_INTERNAL = -5,
+  AIRPTP_ERR_LIMIT = -6,
 };
 
 enum airptp_state
@@ -54,6 +107,13 @@ enum airptp_state
   AIRPTP_STATE_RUNNING,
 };
 
+struct airptp_timemap
+{
+  uint64_t local_ns;
+  uint64_t ptp_ns;
+  double rate_ppb;
+};
+
 struct airptp_daemon_info
 {
   uint16_t version_major;
@@ -64,6 +124,80 @@ struct airptp_daemon_info
   uint16_t general_port;
   bool ipv4_enabled;
   bool ipv6_enabled;
+
+  // Written by the daemon thread and rx workers, use STATS_INC
+  struct airptp_stats stats;
+
+  // enum airptp_timebase, and offsets from it as in struct
+  // airptp_timebase_info, updated by the daemon thread with atomic stores
+  uint8_t timebase;
+  int64_t timebase_offset_ns[AIRPTP_NUM_TIMEBASES];
+
+  // Written by the daemon thread, see daemon_peer_stats_publish(). The
+  // sequence count is odd while the tables are being written. Entry n of both
+  // is for the same peer, unused entries have peer_id 0.
+  uint32_t peer_stats_seq;
+  struct airptp_peer_delay peer_delays[AIRPTP_MAX_PEERS];
+  struct airptp_peer_sync peer_syncs[AIRPTP_MAX_PEERS];
+
+  // Written by the daemon thread, see bmca.c, with a sequence count like above
+  uint32_t port_seq;
+  struct airptp_port_info port;
+
+  // Written by the daemon thread, see slave.c, with a sequence count like
+  // above. The PTP time is ptp_ns + (t - local_ns) * (1 + rate_ppb / 1e9) for
+  // a time t in the timebase. local_ns is 0 if there is no mapping. When
+  // master, this is the timeline taken over by a standby, if any.
+  uint32_t slave_seq;
+  struct airptp_slave_info slave;
+  struct airptp_timemap timemap;
+
+  // Written by the daemon thread, see daemon_event_publish(). Event n is in
+  // slot n % AIRPTP_EVENT_RING_SIZE, and event_head is the number of events
+  // written. event_futex is incremented after every event, readers can wait
+  // for it to change.
+  uint64_t event_head;
+  uint32_t event_futex;
+  struct airptp_event events[AIRPTP_EVENT_RING_SIZE];
+
+  // Of the daemon process, see reconnect.c
+  pid_t pid;
+
+  // Readers waiting for event_futex to change, the daemon only wakes them if
+  // this isn't 0. Clients that can't map the shm writable poll instead.
+  uint32_t event_waiters;
+};
+
+// Registered with airptp_tlv_handler_register(), key is PTP_TLV_ORG_KEY()
+struct airptp_tlv_handler
+{
+  uint64_t key;
+  airptp_tlv_cb cb;
+  void *arg;
+};
+
+struct airptp_daemon_config
+{
+  int ratelimit_rate;
+  int ratelimit_burst;
+  bool peers_only;
+  bool tx_thread;
+  bool io_uring;
+  int xdp_ifindex;
+  bool xdp_generic;
+  bool connected_peers;
+  bool tsc;
+  enum airptp_timebase timebase;
+  int txtime_lead_us;
+  int pdelay_interval_ms;
+  uint8_t priority1;
+  uint8_t priority2;
+  bool slave;
+  int standby_ms;
+  bool boundary;
+  // Sorted by key
+  struct airptp_tlv_handler tlv_handlers[AIRPTP_MAX_TLV_HANDLERS];
+  int num_tlv_handlers;
 };
 
 struct airptp_service
@@ -72,6 +206,122 @@ struct airptp_service
   unsigned short port;
   struct event *ev4;
   struct event *ev6;
+  struct event *ev_xdp;
+};
+
+enum airptp_group_cmd
+{
+  AIRPTP_GROUP_CMD_ADD = 0,
+  AIRPTP_GROUP_CMD_START = 1,
+  AIRPTP_GROUP_CMD_STOP = 2,
+  AIRPTP_GROUP_CMD_REMOVE = 3,
+  AIRPTP_GROUP_CMD_PRIORITY = 4,
+};
+
+enum airptp_client_cmd
+{
+  AIRPTP_CLIENT_CMD_ADD = 0,
+  AIRPTP_CLIENT_CMD_REMOVE = 1,
+};
+
+// What a master announces, in the order the Best Master Clock Algorithm
+// compares it
+struct airptp_dataset
+{
+  uint8_t priority1;
+  uint8_t clock_class;
+  uint8_t clock_accuracy;
+  uint16_t variance;
+  uint8_t priority2;
+  uint64_t grandmaster_id;
+  uint16_t steps_removed;
+};
+
+struct airptp_foreign_master
+{
+  // From the sourcePortIdentity, 0 if the slot is free
+  uint64_t clock_id;
+  union utils_net_sockaddr addr;
+  struct airptp_dataset dataset;
+  // Announce received, a master isn't considered before the second
+  int announces;
+  // CLOCK_MONOTONIC, the master is dropped when there has been no Announce for
+  // 3 of its announce intervals
+  uint64_t last_announce_ms;
+  uint64_t timeout_ms;
+};
+
+// Following a master, see slave.c. Timestamps are ns, t2 and t3 in the
+// timebase and t1 and t4 in the master's time.
+struct airptp_slave
+{
+  // 0 if we have no master
+  uint64_t master_clock_id;
+  union utils_net_sockaddr master_addr;
+
+  // Of the last Sync, t2_ns is 0 if waiting for its Follow_Up is pointless
+  uint16_t sync_seq;
+  uint64_t t2_ns;
+  int64_t sync_correction_ns;
+
+  // Of the outstanding Delay_Req, t3_ns is 0 if there is none
+  uint16_t delay_req_seq;
+  uint64_t t3_ns;
+  uint64_t last_delay_req_ms;
+
+  // v(t2) - t1 of the last Sync, which the Delay_Resp is paired with
+  int64_t last_ms_ns;
+
+  // Filtered, 0 until the first Delay_Resp
+  int64_t path_delay_ns;
+  bool has_path_delay;
+
+  // The servo's clock, which is what struct airptp_timemap describes
+  struct airptp_timemap timemap;
+  double integral_ppb;
+  int in_range;
+
+  struct airptp_slave_info info;
+};
+
+// Pdelay initiator state for a peer, see pdelay.c. Timestamps are ns in the
+// timebase.
+struct airptp_peer_pdelay
+{
+  uint16_t seq;
+  // Of the outstanding request, t1_ns is 0 if there is none
+  uint64_t t1_ns;
+  uint64_t t2_ns;
+  uint64_t t4_ns;
+  int64_t correction_ns;
+  bool has_resp;
+
+  int64_t window[AIRPTP_PDELAY_WINDOW];
+  int window_len;
+  int window_pos;
+  int64_t last_rtt_ns;
+
+  struct airptp_peer_delay result;
+};
+
+// See syncq.c
+struct airptp_peer_syncq
+{
+  // When the last accepted sample was received, 0 before the first
+  uint64_t last_rx_ns;
+  // Estimate as of last_rx_ns
+  int64_t offset_ns;
+  int64_t drift_ppb;
+  // Start of the current drift measurement
+  uint64_t drift_from_ns;
+  int64_t drift_from_offset_ns;
+  int drift_measurements;
+  int in_row;
+  int outliers_in_row;
+  // In permille << 10
+  uint32_t outlier_rate;
+
+  struct airptp_peer_sync result;
 };
 
 struct airptp_peer
@@ -81,12 +331,131 @@ struct airptp_peer
   socklen_t naddr_len;
   bool is_active;
   uint64_t last_seen;
+
+  // Consecutive send errors, while non-zero nothing is sent to the peer before
+  // send_retry_ms (CLOCK_MONOTONIC), see daemon_peer_send_result()
+  int send_errors;
+  uint64_t send_retry_ms;
+
+  // Sockets connected to the peer, see peer_socket.c. Only valid if
+  // is_connected.
+  bool is_connected;
+  int event_fd;
+  int general_fd;
+  struct event *event_ev;
+  struct event *general_ev;
+
+  struct airptp_peer_pdelay pdelay;
+  struct airptp_peer_syncq syncq;
+
+  // Bit n is set if clients[n] has added the peer, so the number of bits set is
+  // the peer's refcount
+  uint32_t client_mask;
+  // The group each client has put the peer in, 0 if none
+  uint32_t group_ids[AIRPTP_MAX_CLIENTS];
+};
+
+struct airptp_group
+{
+  uint32_t id;
+  uint32_t owner_id;
+  char name[AIRPTP_GROUP_NAME_LEN];
+  uint8_t priority;
+  bool is_started;
+};
+
+// As added by a client, see reconnect.c
+struct airptp_reg_peer
+{
+  uint32_t id;
+  char addr[128];
+  unsigned short event_port;
+  uint32_t group_id;
+};
+
+struct airptp_reg_group
+{
+  uint32_t id;
+  char name[AIRPTP_GROUP_NAME_LEN];
+  uint8_t priority;
+  bool is_started;
+};
+
+struct airptp_client
+{
+  uint32_t id; // 0 if the slot is free
+  pid_t pid; // 0 if unknown
+};
+
+// Peer state the daemon thread publishes for the rx workers and the tx thread.
+// Replaced, not modified, when the peers change, except for the fields the
+// readers write to report back.
+struct airptp_snapshot
+{
+  uint64_t clock_id;
+  // What we announce, see bmca_dataset_announced()
+  struct airptp_dataset dataset;
+  int num_peers;
+  uint32_t peer_ids[AIRPTP_MAX_PEERS];
+  union utils_net_sockaddr peer_addrs[AIRPTP_MAX_PEERS];
+
+  // Indices of the peers to send to, in order
+  int tx_order[AIRPTP_MAX_PEERS];
+  int num_tx;
+
+  // Written by the readers, folded into the peer list by the daemon thread.
+  // send_errno is the last send error, or -1 after a successful send.
+  uint64_t last_seen[AIRPTP_MAX_PEERS];
+  int send_errno[AIRPTP_MAX_PEERS];
+
+  // Replaced snapshots wait here until no reader can be using them
+  struct airptp_snapshot *retired_next;
+};
+
+struct airptp_rx_worker
+{
+  struct airptp_daemon *daemon;
+  pthread_t tid;
+  struct event_base *evbase;
+  int exit_pipe[2];
+  struct event *exit_ev;
+
+  // Socket in the event port's SO_REUSEPORT group
+  struct airptp_service svc;
+  struct ratelimit ratelimit;
+
+  // Set while the worker holds a snapshot pointer
+  int is_reading;
+};
+
+// Does the periodic sending, see AIRPTP_OPT_TX_THREAD
+struct airptp_tx_thread
+{
+  pthread_t tid;
+  struct event_base *evbase;
+  int exit_pipe[2];
+  struct event *exit_ev;
+  // The daemon thread writes a byte when it has published a snapshot
+  int notify_pipe[2];
+  struct event *notify_ev;
+
+  struct event *send_announce_timer;
+  struct event *send_signaling_timer;
+  struct event *send_sync_timer;
+
+  // Set while sending, peers_msg_send() then uses it instead of the peer list
+  struct airptp_snapshot *current;
+  int is_reading;
 };
 
 struct airptp_daemon
 {
   bool is_shared;
+  struct airptp_daemon_config config;
+
+  // Points to shared memory if is_shared, otherwise to private_info
   struct airptp_daemon_info *info;
+  struct airptp_daemon_info private_info;
 
   uint64_t clock_id;
 
@@ -102,10 +471,13 @@ struct airptp_daemon
   struct airptp_service general_svc;
 
   struct event *shm_update_timer;
+  struct event *clients_check_timer;
 
   struct event *send_announce_timer;
   struct event *send_signaling_timer;
   struct event *send_sync_timer;
+  struct event *pdelay_timer;
+  struct event *standby_timer;
 
   uint16_t announce_seq;
   uint16_t signaling_seq;
@@ -115,16 +487,113 @@ struct airptp_daemon
 
   struct airptp_peer peers[AIRPTP_MAX_PEERS];
   int num_peers;
+
+  struct airptp_group groups[AIRPTP_MAX_GROUPS];
+  int num_groups;
+
+  struct airptp_client clients[AIRPTP_MAX_CLIENTS];
+  int num_clients;
+
+  // Indices into peers, in the order they should be served. Only has the peers
+  // that should be served, i.e. not those in stopped groups.
+  int tx_order[AIRPTP_MAX_PEERS];
+  int num_tx;
+
+  // See bmca.c. Unless MASTER no peers are served.
+  enum airptp_port_state port_state;
+  struct airptp_foreign_master foreign_masters[AIRPTP_MAX_FOREIGN_MASTERS];
+  struct airptp_slave slave;
+  // The master's timeline, followed by a boundary clock and continued after a
+  // standby takeover, see slave.c. local_ns is 0 if we use our own.
+  struct airptp_timemap timeline;
+  // The same for our timestamps, which are also taken outside the daemon
+  // thread
+  struct timesource_timeline ts_timeline;
+
+  struct ratelimit ratelimit;
+
+  // Needed to rebind the event port for rx workers
+  char *bind_node;
+
+  struct airptp_rx_worker rx_workers[AIRPTP_MAX_RX_WORKERS];
+  int num_rx_workers;
+  // Workers pass messages they don't handle to the daemon thread here
+  int rx_forward[2];
+  struct event *rx_forward_ev;
+
+  struct airptp_tx_thread tx;
+
+  struct airptp_snapshot *snapshot;
+  struct airptp_snapshot *snapshot_retired;
+
+  // Set if the daemon thread's sockets are served by io_uring, see uring.c
+  struct uring *uring;
+
+  // Scheduled sending of Sync, NULL if not enabled or given up
+  struct txtime *txtime;
+
+  // CLOCK_MONOTONIC, when the last Sync was sent, by whichever thread sends
+  uint64_t sync_sent_ns;
+
+  // Handing over to a new daemon, see handoff.c. The shm and liveness FIFO
+  // are passed on together with the sockets. When taking over, fds and state
+  // are set before the daemon is started, and sync_next_ns is when the
+  // previous daemon would have sent its next Sync.
+  int shm_fd;
+  int liveness_fd;
+  int handoff_fd;
+  struct event *handoff_ev;
+  struct handoff_conn *handoff_conn;
+  bool is_takeover;
+  bool is_handed_over;
+  uint64_t sync_next_ns;
+
+  // See timesource_start()
+  bool is_timesource_started;
 };
 
+// The counters are written from more than one thread
+#define STATS_INC(d, field) __atomic_fetch_add(&(d)->info->stats.field, 1, __ATOMIC_RELAXED)
+
 struct airptp_handle
 {
   bool is_daemon;
+  uint32_t client_id;
   enum airptp_state state;
 
   struct airptp_daemon daemon;
 
   struct airptp_daemon_info daemon_info;
+
+  // The daemon's ports, which control messages are sent to. For handles from
+  // airptp_daemon_find() they change if it restarts, so read them with
+  // reg_lock held.
+  unsigned short event_port;
+  unsigned short general_port;
+
+  // Handles from airptp_daemon_find() keep the shared memory mapped, so they
+  // can read the daemon's live info. When a restarted daemon is found the
+  // mapping is replaced, and the previous one is kept until the next restart
+  // in case another thread is still reading it.
+  struct airptp_daemon_info *shm_info;
+  struct airptp_daemon_info *shm_retired;
+  // If shm_info is mapped writable, read with reg_lock held like the above
+  bool shm_is_writable;
+
+  // Also for handles from airptp_daemon_find(), what has been registered with
+  // the daemon, so it can be registered again if the daemon restarts. See
+  // reconnect.c, which also has the thread that watches the daemon.
+  pthread_mutex_t reg_lock;
+  struct airptp_reg_peer reg_peers[AIRPTP_CLIENT_MAX_PEERS];
+  int num_reg_peers;
+  struct airptp_reg_group reg_groups[AIRPTP_CLIENT_MAX_GROUPS];
+  int num_reg_groups;
+
+  bool is_watching;
+  pthread_t watch_tid;
+  int watch_pipe[2];
+  int liveness_fd;
+  struct airptp_callbacks watch_cb;
 };
 
 void
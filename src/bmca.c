@@ -0,0 +1,292 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "bmca.h"
+#include "daemon.h"
+#include "slave.h"
+#include "snapshot.h"
+
+// Best Master Clock Algorithm. The comparison is the dataset comparison of
+// IEEE 1588 9.3.4, minus the part for comparing paths to the same grandmaster
+// beyond stepsRemoved, since only boundary clocks pass on another's time.
+// Foreign masters are the senders of the Announce we receive. As in 9.3.2.5 a
+// master must have sent two Announce before it is considered, and as with
+// announceReceiptTimeout it is dropped after 3 of its announce intervals
+// without one.
+//
+// As a boundary clock (AIRPTP_OPT_BOUNDARY) we pass on the Announce of the
+// master we follow, with stepsRemoved + 1, see bmca_dataset_announced().
+
+#define BMCA_QUALIFY_ANNOUNCES 2
+
+// What we announce: class 6 (GPS), accuracy 0x21 (100ns), variance 0x436A,
+// same as Apple
+#define BMCA_CLOCK_CLASS 6
+#define BMCA_CLOCK_ACCURACY 0x21
+#define BMCA_VARIANCE 0x436A
+
+// Negative if a is the better master
+static int
+dataset_compare(struct airptp_dataset *a, struct airptp_dataset *b)
+{
+  if (a->priority1 != b->priority1)
+    return a->priority1 - b->priority1;
+  if (a->clock_class != b->clock_class)
+    return a->clock_class - b->clock_class;
+  if (a->clock_accuracy != b->clock_accuracy)
+    return a->clock_accuracy - b->clock_accuracy;
+  if (a->variance != b->variance)
+    return a->variance - b->variance;
+  if (a->priority2 != b->priority2)
+    return a->priority2 - b->priority2;
+  if (a->grandmaster_id != b->grandmaster_id)
+    return (a->grandmaster_id < b->grandmaster_id) ? -1 : 1;
+
+  return a->steps_removed - b->steps_removed;
+}
+
+static uint64_t
+announce_interval_ms(int8_t log_interval)
+{
+  // Guard against silly values, 1/8 s to 16 s
+  if (log_interval < -3)
+    log_interval = -3;
+  else if (log_interval > 4)
+    log_interval = 4;
+
+  return (log_interval < 0) ? (1000 >> -log_interval) : (1000 << log_interval);
+}
+
+static struct airptp_foreign_master *
+foreign_master_get(struct airptp_daemon *daemon, uint64_t clock_id)
+{
+  struct airptp_foreign_master *free_slot = NULL;
+  int i;
+
+  for (i = 0; i < AIRPTP_MAX_FOREIGN_MASTERS; i++) {
+    if (daemon->foreign_masters[i].clock_id == clock_id)
+      return &daemon->foreign_masters[i];
+    if (!free_slot && daemon->foreign_masters[i].clock_id == 0)
+      free_slot = &daemon->foreign_masters[i];
+  }
+
+  if (free_slot) {
+    memset(free_slot, 0, sizeof(struct airptp_foreign_master));
+    free_slot->clock_id = clock_id;
+    daemon_event_publish(daemon, AIRPTP_EVENT_FOREIGN_MASTER, 0, clock_id, 0);
+  }
+
+  return free_slot;
+}
+
+static void
+port_info_publish(struct airptp_daemon *daemon, struct airptp_port_info *pinfo)
+{
+  struct airptp_daemon_info *info = daemon->info;
+  uint32_t seq = info->port_seq;
+
+  if (memcmp(&info->port, pinfo, sizeof(struct airptp_port_info)) == 0)
+    return;
+
+  __atomic_store_n(&info->port_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  memcpy(&info->port, pinfo, sizeof(struct airptp_port_info));
+
+  __atomic_store_n(&info->port_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void
+state_decide(struct airptp_daemon *daemon)
+{
+  struct airptp_port_info pinfo = { 0 };
+  struct airptp_foreign_master *fm;
+  struct airptp_foreign_master *best = NULL;
+  struct airptp_dataset own;
+  int i;
+
+  bmca_dataset_own(&own, daemon);
+
+  for (i = 0; i < AIRPTP_MAX_FOREIGN_MASTERS; i++) {
+    fm = &daemon->foreign_masters[i];
+    if (fm->clock_id == 0)
+      continue;
+
+    pinfo.num_foreign_masters++;
+
+    // Passing on our time, e.g. a boundary clock, not competing with us
+    if (fm->announces < BMCA_QUALIFY_ANNOUNCES || fm->dataset.grandmaster_id == daemon->clock_id)
+      continue;
+
+    if (!best || dataset_compare(&fm->dataset, &best->dataset) < 0)
+      best = fm;
+  }
+
+  if (!best || dataset_compare(&best->dataset, &own) >= 0)
+    pinfo.state = AIRPTP_PORT_MASTER;
+  else
+    pinfo.state = (daemon->config.slave || daemon->config.standby_ms || daemon->config.boundary) ? AIRPTP_PORT_SLAVE : AIRPTP_PORT_PASSIVE;
+  pinfo.state_changes = daemon->info->port.state_changes;
+  if (best) {
+    pinfo.best_clock_id = best->clock_id;
+    pinfo.best_grandmaster_id = best->dataset.grandmaster_id;
+    pinfo.best_priority1 = best->dataset.priority1;
+    pinfo.best_clock_class = best->dataset.clock_class;
+    pinfo.best_priority2 = best->dataset.priority2;
+  }
+
+  if (pinfo.state != daemon->port_state) {
+    if (pinfo.state == AIRPTP_PORT_PASSIVE)
+      airptp_logmsg("Grandmaster %" PRIx64 " is better than us, going passive", best->dataset.grandmaster_id);
+    else if (pinfo.state == AIRPTP_PORT_SLAVE)
+      airptp_logmsg("Grandmaster %" PRIx64 " is better than us, going slave", best->dataset.grandmaster_id);
+    else
+      airptp_logmsg("No better master heard, going back to master");
+
+    pinfo.state_changes++;
+    daemon_port_state_set(daemon, pinfo.state);
+    daemon_event_publish(daemon, AIRPTP_EVENT_PORT_STATE, 0, (pinfo.state != AIRPTP_PORT_MASTER) ? best->clock_id : 0, pinfo.state);
+  }
+
+  // Also if the best master changed while we were slave
+  slave_master_set(daemon, (pinfo.state == AIRPTP_PORT_SLAVE) ? best : NULL);
+
+  port_info_publish(daemon, &pinfo);
+}
+
+
+void
+bmca_dataset_own(struct airptp_dataset *ds, struct airptp_daemon *daemon)
+{
+  ds->priority1 = daemon->config.priority1;
+  ds->clock_class = BMCA_CLOCK_CLASS;
+  ds->clock_accuracy = BMCA_CLOCK_ACCURACY;
+  ds->variance = BMCA_VARIANCE;
+  ds->priority2 = daemon->config.priority2;
+  ds->grandmaster_id = daemon->clock_id;
+  ds->steps_removed = 0;
+}
+
+struct airptp_foreign_master *
+bmca_parent_get(struct airptp_daemon *daemon)
+{
+  int i;
+
+  if (daemon->port_state != AIRPTP_PORT_SLAVE || !daemon->slave.master_clock_id)
+    return NULL;
+
+  for (i = 0; i < AIRPTP_MAX_FOREIGN_MASTERS; i++) {
+    if (daemon->foreign_masters[i].clock_id == daemon->slave.master_clock_id)
+      return &daemon->foreign_masters[i];
+  }
+
+  return NULL;
+}
+
+void
+bmca_dataset_announced(struct airptp_dataset *ds, struct airptp_daemon *daemon)
+{
+  struct airptp_foreign_master *parent = bmca_parent_get(daemon);
+
+  if (!daemon->config.boundary || !parent) {
+    bmca_dataset_own(ds, daemon);
+    return;
+  }
+
+  *ds = parent->dataset;
+  ds->steps_removed++;
+}
+
+void
+bmca_announce_received(struct airptp_daemon *daemon, uint64_t clock_id, struct airptp_dataset *ds, int8_t log_interval, union utils_net_sockaddr *addr)
+{
+  struct airptp_foreign_master *fm;
+  uint64_t now_ms = daemon_now_ms();
+  bool changed = false;
+
+  if (clock_id == daemon->clock_id)
+    return;
+
+  fm = foreign_master_get(daemon, clock_id);
+  if (!fm)
+    return; // Table full, the ones we have will do
+
+  if (fm->announces == 0)
+    airptp_logmsg("Heard from master %" PRIx64 ", grandmaster %" PRIx64 ", priority1 %u, class %u, priority2 %u",
+      clock_id, ds->grandmaster_id, ds->priority1, ds->clock_class, ds->priority2);
+
+  // The tx thread and the rx workers get what we announce from the snapshot
+  if (daemon->config.boundary && clock_id == daemon->slave.master_clock_id && memcmp(&fm->dataset, ds, sizeof(struct airptp_dataset)) != 0)
+    changed = true;
+
+  fm->addr = *addr;
+  fm->dataset = *ds;
+  fm->last_announce_ms = now_ms;
+  fm->timeout_ms = BMCA_ANNOUNCE_RECEIPT_TIMEOUT * announce_interval_ms(log_interval);
+  if (fm->announces < BMCA_QUALIFY_ANNOUNCES)
+    fm->announces++;
+
+  state_decide(daemon);
+
+  if (changed)
+    snapshot_publish(daemon);
+}
+
+void
+bmca_master_lost(struct airptp_daemon *daemon, uint64_t clock_id)
+{
+  struct airptp_foreign_master *fm;
+  int i;
+
+  for (i = 0; i < AIRPTP_MAX_FOREIGN_MASTERS; i++) {
+    fm = &daemon->foreign_masters[i];
+    if (fm->clock_id == clock_id)
+      memset(fm, 0, sizeof(struct airptp_foreign_master));
+  }
+
+  state_decide(daemon);
+}
+
+void
+bmca_check(struct airptp_daemon *daemon)
+{
+  struct airptp_foreign_master *fm;
+  uint64_t now_ms = daemon_now_ms();
+  int i;
+
+  for (i = 0; i < AIRPTP_MAX_FOREIGN_MASTERS; i++) {
+    fm = &daemon->foreign_masters[i];
+    if (fm->clock_id == 0 || fm->last_announce_ms + fm->timeout_ms > now_ms)
+      continue;
+
+    airptp_logmsg("Master %" PRIx64 " timed out", fm->clock_id);
+    memset(fm, 0, sizeof(struct airptp_foreign_master));
+  }
+
+  state_decide(daemon);
+}
@@ -0,0 +1,37 @@
+#ifndef __AIRPTP_BMCA_H__
+#define __AIRPTP_BMCA_H__
+
+#include "airptp_internal.h"
+
+// In announce intervals, as announceReceiptTimeout
+#define BMCA_ANNOUNCE_RECEIPT_TIMEOUT 3
+
+// The below must be called from the daemon thread
+
+// Our own dataset, i.e. what we announce as grandmaster
+void
+bmca_dataset_own(struct airptp_dataset *ds, struct airptp_daemon *daemon);
+
+// The master we follow, NULL unless SLAVE
+struct airptp_foreign_master *
+bmca_parent_get(struct airptp_daemon *daemon);
+
+// What we announce: our own dataset, or as a boundary clock following a master,
+// the master's with stepsRemoved + 1. Other threads get it from the snapshot.
+void
+bmca_dataset_announced(struct airptp_dataset *ds, struct airptp_daemon *daemon);
+
+// From an Announce, clock_id is the sender's from the sourcePortIdentity
+void
+bmca_announce_received(struct airptp_daemon *daemon, uint64_t clock_id, struct airptp_dataset *ds, int8_t log_interval, union utils_net_sockaddr *addr);
+
+// Drops the master without waiting for its Announce to time out, e.g. when a
+// standby takes over
+void
+bmca_master_lost(struct airptp_daemon *daemon, uint64_t clock_id);
+
+// Drops masters that have stopped announcing, call periodically
+void
+bmca_check(struct airptp_daemon *daemon);
+
+#endif // __AIRPTP_BMCA_H__
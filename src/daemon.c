@@ -29,22 +29,45 @@ SOFTWARE.
 #include <unistd.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <signal.h>
 
 // For shm_open
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#endif
+
 #include "airptp_internal.h"
+#include "ptp_definitions.h"
+#include "sockfilter.h"
+#include "rx_worker.h"
+#include "tx_thread.h"
+#include "snapshot.h"
+#include "uring.h"
+#include "xdp.h"
+#include "peer_socket.h"
+#include "timesource.h"
+#include "txtime.h"
+#include "pdelay.h"
+#include "bmca.h"
+#include "slave.h"
 #include "ptp_msg_handle.h"
+#include "handoff.h"
 
 #define DAEMON_INTERVAL_SECS_SHM_UPDATE 5
+#define DAEMON_INTERVAL_SECS_CLIENTS_CHECK 1
 
+// Small enough for a single write to a pipe, the daemon info is copied by the
+// parent thread once the loop is running
 struct daemon_start_result
 {
   enum airptp_error retval;
   const char *errmsg;
-  struct airptp_daemon_info daemon_info;
 };
 
 static struct timeval daemon_send_announce_tv =
@@ -67,6 +90,11 @@ static struct timeval daemon_shm_update_tv =
   .tv_sec = DAEMON_INTERVAL_SECS_SHM_UPDATE,
   .tv_usec = 0
 };
+static struct timeval daemon_clients_check_tv =
+{
+  .tv_sec = DAEMON_INTERVAL_SECS_CLIENTS_CHECK,
+  .tv_usec = 0
+};
 
 static void
 daemon_info_fill(struct airptp_daemon_info *info, uint64_t clock_id, struct airptp_service *event_svc, struct airptp_service *general_svc)
@@ -74,6 +102,7 @@ daemon_info_fill(struct airptp_daemon_info *info, uint64_t clock_id, struct airp
   info->version_major = AIRPTP_SHM_STRUCTS_VERSION_MAJOR;
   info->version_minor = AIRPTP_SHM_STRUCTS_VERSION_MINOR;
   info->clock_id = clock_id;
+  info->pid = getpid();
   info->ts = time(NULL);
   info->event_port = event_svc->port;
   info->general_port = general_svc->port;
@@ -81,14 +110,93 @@ daemon_info_fill(struct airptp_daemon_info *info, uint64_t clock_id, struct airp
   info->ipv6_enabled = (event_svc->socket.fd6 >= 0 && general_svc->socket.fd6 >= 0);
 }
 
+// Anyone can create in /tmp, so someone else may have made the directory
+// before us. Then we don't use it, since they could replace the FIFO.
+static int
+daemon_liveness_dir_make(uid_t uid)
+{
+  char dir[64];
+  struct stat sb;
+
+  snprintf(dir, sizeof(dir), AIRPTP_LIVENESS_DIR_FMT, (unsigned)uid);
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    return -1;
+
+  if (lstat(dir, &sb) < 0)
+    return -1;
+
+  if (!S_ISDIR(sb.st_mode) || sb.st_uid != uid || (sb.st_mode & (S_IWGRP | S_IWOTH))) {
+    airptp_logmsg("%s is not a directory that only we can write to", dir);
+    return -1;
+  }
+
+  return 0;
+}
+
+// We don't need the read end, but opening the write end requires a reader.
+// Never written to, clients only wait for POLLHUP on their read ends.
+static int
+daemon_liveness_create(void)
+{
+  char path[64];
+  int rfd;
+  int wfd;
+
+  if (daemon_liveness_dir_make(geteuid()) < 0)
+    return -1;
+
+  snprintf(path, sizeof(path), AIRPTP_LIVENESS_PATH_FMT, (unsigned)geteuid());
+
+  unlink(path);
+
+  if (mkfifo(path, 0644) < 0)
+    return -1;
+
+  rfd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (rfd < 0)
+    goto error;
+
+  wfd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+  close(rfd);
+  if (wfd < 0)
+    goto error;
+
+  return wfd;
+
+ error:
+  unlink(path);
+  return -1;
+}
+
+// If we took over, the path is named by the uid of the daemon that created it
+static void
+daemon_liveness_destroy(int fd, bool do_unlink)
+{
+  char path[64];
+  struct stat sb;
+
+  if (fd < 0)
+    return;
+
+  if (do_unlink && fstat(fd, &sb) == 0) {
+    snprintf(path, sizeof(path), AIRPTP_LIVENESS_PATH_FMT, (unsigned)sb.st_uid);
+    unlink(path);
+  }
+
+  close(fd);
+}
+
+// Not unlinked if we have handed over, then it is the new daemon's
 static void
-daemon_shm_destroy(struct airptp_daemon_info *shm, int fd)
+daemon_shm_destroy(struct airptp_daemon_info *shm, int fd, bool do_unlink)
 {
   if (shm != MAP_FAILED)
     munmap(shm, sizeof(struct airptp_daemon_info));
   if (fd >= 0)
     close(fd);
-  shm_unlink(AIRPTP_SHM_NAME);
+  if (do_unlink)
+    shm_unlink(AIRPTP_SHM_NAME);
 }
 
 static int
@@ -119,10 +227,28 @@ daemon_shm_create(struct airptp_daemon_info **shm, uint64_t clock_id, struct air
   return fd;
 
  error:
-  daemon_shm_destroy(info, fd);
+  daemon_shm_destroy(info, fd, true);
   return -1;   
 }
 
+// Taking over, the shm is the previous daemon's, so clients keep their mapping
+// and the stats and event ring carry on
+static int
+daemon_shm_attach(struct airptp_daemon_info **shm, int fd, uint64_t clock_id, struct airptp_service *event_svc, struct airptp_service *general_svc)
+{
+  struct airptp_daemon_info *info;
+
+  info = mmap(NULL, sizeof(struct airptp_daemon_info), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (info == MAP_FAILED)
+    return -1;
+
+  daemon_info_fill(info, clock_id, event_svc, general_svc);
+
+  *shm = info;
+
+  return 0;
+}
+
 static void
 service_stop(struct airptp_service *svc)
 {
@@ -130,9 +256,12 @@ service_stop(struct airptp_service *svc)
     event_free(svc->ev4);
   if (svc->ev6)
     event_free(svc->ev6);
+  if (svc->ev_xdp)
+    event_free(svc->ev_xdp);
 
   svc->ev4 = NULL;
   svc->ev6 = NULL;
+  svc->ev_xdp = NULL;
 }
 
 static int
@@ -170,127 +299,812 @@ peer_clear(struct airptp_peer *peer)
   memset(peer, 0, sizeof(struct airptp_peer));
 }
 
+static struct airptp_peer *
+peer_find(struct airptp_daemon *daemon, uint32_t peer_id)
+{
+  int i;
+
+  for (i = 0; i < daemon->num_peers; i++) {
+    if (peer_id == daemon->peers[i].id)
+      return &daemon->peers[i];
+  }
+
+  return NULL;
+}
+
+static struct airptp_group *
+group_find(struct airptp_daemon *daemon, uint32_t group_id)
+{
+  int i;
+
+  if (group_id == 0)
+    return NULL;
+
+  for (i = 0; i < daemon->num_groups; i++) {
+    if (group_id == daemon->groups[i].id)
+      return &daemon->groups[i];
+  }
+
+  return NULL;
+}
+
+static int
+client_find(struct airptp_daemon *daemon, uint32_t client_id)
+{
+  int i;
+
+  for (i = 0; i < AIRPTP_MAX_CLIENTS; i++) {
+    if (client_id == daemon->clients[i].id)
+      return i;
+  }
+
+  return -1;
+}
+
+// Returns the slot of the client, registering it if it is new. Only clients
+// that tell us their pid are registered, so that clients_check() can remove
+// them again.
+static int
+client_add(struct airptp_daemon *daemon, uint32_t client_id, pid_t pid)
+{
+  int slot;
+
+  if (client_id == 0 || pid <= 0)
+    return -1;
+
+  slot = client_find(daemon, client_id);
+  if (slot >= 0) {
+    daemon->clients[slot].pid = pid;
+    return slot;
+  }
+
+  slot = client_find(daemon, 0); // First free slot
+  if (slot < 0) {
+    airptp_logmsg("Max number of clients reached (num_clients %d), can't add %" PRIu32, daemon->num_clients, client_id);
+    return -1;
+  }
+
+  daemon->clients[slot].id = client_id;
+  daemon->clients[slot].pid = pid;
+  daemon->num_clients++;
+
+  airptp_logmsg("Added client id %" PRIu32 ", num_clients %d", client_id, daemon->num_clients);
+  return slot;
+}
+
+static int
+client_num_peers(struct airptp_daemon *daemon, int slot)
+{
+  int i;
+  int n;
+
+  for (i = 0, n = 0; i < daemon->num_peers; i++) {
+    if (daemon->peers[i].client_mask & (1U << slot))
+      n++;
+  }
+
+  return n;
+}
+
+static int
+client_num_groups(struct airptp_daemon *daemon, uint32_t client_id)
+{
+  int i;
+  int n;
+
+  for (i = 0, n = 0; i < daemon->num_groups; i++) {
+    if (daemon->groups[i].owner_id == client_id)
+      n++;
+  }
+
+  return n;
+}
+
+// A peer is served if at least one of the clients that added it has it outside
+// a group or in a started group. It then gets the highest priority of those.
+static bool
+peer_tx_priority_get(uint8_t *priority, struct airptp_daemon *daemon, struct airptp_peer *peer)
+{
+  struct airptp_group *group;
+  bool is_served;
+  int slot;
+
+  *priority = 0;
+
+  for (slot = 0, is_served = false; slot < AIRPTP_MAX_CLIENTS; slot++)
+    {
+      if (!(peer->client_mask & (1U << slot)))
+	continue;
+
+      if (peer->group_ids[slot] == 0)
+	{
+	  is_served = true;
+	  continue;
+	}
+
+      group = group_find(daemon, peer->group_ids[slot]);
+      if (!group || !group->is_started)
+	continue;
+
+      if (!is_served || group->priority > *priority)
+	*priority = group->priority;
+      is_served = true;
+    }
+
+  return is_served;
+}
+
+// While passive another master is serving the peers, see bmca.c. A boundary
+// clock serves them while following, once it has the master's time.
+static bool
+peers_are_served(struct airptp_daemon *daemon)
+{
+  if (daemon->port_state == AIRPTP_PORT_MASTER)
+    return true;
+
+  return (daemon->port_state == AIRPTP_PORT_SLAVE && daemon->config.boundary && daemon->timeline.local_ns != 0);
+}
+
+// Must be called whenever peers or groups change, since tx_order has indices
+// into the peers list. Peers in groups with higher priority go first, otherwise
+// the order of the peers list is kept.
 static void
-peers_prune(struct airptp_daemon *daemon)
+peers_tx_order_update(struct airptp_daemon *daemon)
+{
+  uint8_t priorities[AIRPTP_MAX_PEERS];
+  uint8_t priority;
+  int i;
+  int j;
+  int n;
+
+  for (i = 0, n = 0; i < daemon->num_peers && peers_are_served(daemon); i++)
+    {
+      if (!peer_tx_priority_get(&priority, daemon, &daemon->peers[i]))
+	continue;
+
+      for (j = n; j > 0 && priorities[j - 1] < priority; j--)
+	{
+	  daemon->tx_order[j] = daemon->tx_order[j - 1];
+	  priorities[j] = priorities[j - 1];
+	}
+
+      daemon->tx_order[j] = i;
+      priorities[j] = priority;
+      n++;
+    }
+
+  daemon->num_tx = n;
+
+  // Every change of peers or groups ends up here, so this is where the rx
+  // workers and the tx thread get to know about it
+  snapshot_publish(daemon);
+}
+
+static void
+timers_kick(struct airptp_daemon *daemon)
+{
+  // The tx thread kicks itself when it gets the new snapshot
+  if (daemon->config.tx_thread)
+    return;
+
+  // Trigger announce and signaling immediately
+  event_active(daemon->send_announce_timer, 0, 0);
+  event_active(daemon->send_signaling_timer, 0, 0);
+
+  // We should send sync's at specific interval, so if already running don't
+  // disturb the rhythm. I.e. only trigger if not running already.
+  if (!event_pending(daemon->send_sync_timer, EV_TIMEOUT, NULL))
+    event_add(daemon->send_sync_timer, &daemon_send_sync_tv);
+}
+
+void
+daemon_port_state_set(struct airptp_daemon *daemon, enum airptp_port_state state)
+{
+  daemon->port_state = state;
+
+  peers_tx_order_update(daemon);
+  timers_kick(daemon);
+}
+
+// Drops the client's reference to the peer. The peer is removed by
+// peers_compact() when it has no references left.
+static void
+peer_unref(struct airptp_peer *peer, int slot)
+{
+  peer->client_mask &= ~(1U << slot);
+  peer->group_ids[slot] = 0;
+}
+
+// With peers_only the kernel filter also has the list of peer addresses, so it
+// must be replaced whenever a peer is added or removed
+static void
+peers_filter_update(struct airptp_daemon *daemon)
+{
+  struct airptp_peer *peers = daemon->config.peers_only ? daemon->peers : NULL;
+  int ret;
+  int i;
+
+  ret = sockfilter_attach(&daemon->event_svc.socket, SOCKFILTER_PORT_EVENT, peers, daemon->num_peers);
+  if (ret == 0)
+    ret = sockfilter_attach(&daemon->general_svc.socket, SOCKFILTER_PORT_GENERAL, peers, daemon->num_peers);
+  for (i = 0; ret == 0 && i < daemon->num_rx_workers; i++)
+    ret = sockfilter_attach(&daemon->rx_workers[i].svc.socket, SOCKFILTER_PORT_EVENT, peers, daemon->num_peers);
+  if (ret < 0)
+    airptp_logmsg("Could not attach socket filter: %s", strerror(errno));
+}
+
+// AF_XDP only learns the MAC addresses of our peers
+static void
+xdp_neighs_update(struct airptp_daemon *daemon)
+{
+  uint32_t ips[AIRPTP_MAX_PEERS];
+  int num_ips = 0;
+  int i;
+
+  if (!daemon->event_svc.socket.xsk)
+    return;
+
+  for (i = 0; i < daemon->num_peers; i++) {
+    if (daemon->peers[i].naddr.sa.sa_family == AF_INET)
+      ips[num_ips++] = daemon->peers[i].naddr.sin.sin_addr.s_addr;
+  }
+
+  xdp_socket_neighs_set(daemon->event_svc.socket.xsk, ips, num_ips);
+}
+
+// Called when peers have been added to or removed from the list
+static void
+peers_changed(struct airptp_daemon *daemon)
+{
+  if (daemon->config.peers_only)
+    peers_filter_update(daemon);
+
+  xdp_neighs_update(daemon);
+}
+
+// Removes peers that no client references, keeping the list sequential
+static void
+peers_compact(struct airptp_daemon *daemon)
 {
   struct airptp_peer *peer;
   int i;
-  int n_pruned;
+  int n_removed;
 
-  for (i = 0, n_pruned = 0; i < daemon->num_peers; i++)
+  for (i = 0, n_removed = 0; i < daemon->num_peers; i++)
     {
       peer = &daemon->peers[i];
-      if (!peer->is_active)
+      if (peer->client_mask == 0)
 	{
-	  airptp_logmsg("Removing inactive peer with id %" PRIu32, peer->id);
+	  airptp_logmsg("Removing peer with id %" PRIu32, peer->id);
+	  peer_socket_close(peer);
 	  peer_clear(peer);
-	  n_pruned++;
+	  n_removed++;
 	  continue;
 	}
 
-      if (n_pruned > 0)
-	daemon->peers[i - n_pruned] = *peer;
+      if (n_removed > 0)
+	{
+	  daemon->peers[i - n_removed] = *peer;
+	  peer_clear(peer);
+	}
     }
 
-  daemon->num_peers -= n_pruned;
+  daemon->num_peers -= n_removed;
+
+  if (n_removed == 0)
+    return;
+
+  peers_tx_order_update(daemon);
+  peers_changed(daemon);
 }
 
 static void
-peer_last_seen_update(struct airptp_daemon *daemon, union utils_net_sockaddr *peer_addr, socklen_t peer_addrlen)
+peers_prune(struct airptp_daemon *daemon)
 {
+  struct airptp_peer *peer;
   int i;
 
-  for (i = 0; i < daemon->num_peers; i++) {
-    if (utils_net_address_is_same(peer_addr, &daemon->peers[i].naddr)) {
-      daemon->peers[i].last_seen = time(NULL);
-      break;
+  for (i = 0; i < daemon->num_peers; i++)
+    {
+      peer = &daemon->peers[i];
+      if (peer->is_active)
+	continue;
+
+      airptp_logmsg("Peer with id %" PRIu32 " is inactive, dropping all references", peer->id);
+      peer->client_mask = 0;
     }
+
+  peers_compact(daemon);
+}
+
+// There is only one writer, so no need for anything but ordering the stores.
+// The slot's seq is UINT64_MAX while it is being written, and a reader that
+// sees the seq change while it copies the slot knows it was overwritten, see
+// airptp_event_read(). Readers are never waited for.
+void
+daemon_event_publish(struct airptp_daemon *daemon, enum airptp_event_type type, uint32_t peer_id, uint64_t clock_id, int32_t value)
+{
+  struct airptp_daemon_info *info = daemon->info;
+  struct airptp_event *slot;
+  uint64_t pos = info->event_head;
+
+  slot = &info->events[pos % AIRPTP_EVENT_RING_SIZE];
+
+  __atomic_store_n(&slot->seq, UINT64_MAX, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  slot->ts_ns = timesource_timebase_now(info->timebase);
+  slot->clock_id = clock_id;
+  slot->peer_id = peer_id;
+  slot->type = type;
+  slot->value = value;
+
+  __atomic_store_n(&slot->seq, pos, __ATOMIC_RELEASE);
+  __atomic_store_n(&info->event_head, pos + 1, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&info->event_futex, 1, __ATOMIC_SEQ_CST);
+
+#ifdef __linux__
+  // Pairs with event_wait(), which counts itself before FUTEX_WAIT, so either
+  // we see the waiter or its FUTEX_WAIT sees the new value. Not
+  // FUTEX_PRIVATE_FLAG, the readers are in other processes.
+  if (__atomic_load_n(&info->event_waiters, __ATOMIC_SEQ_CST) > 0)
+    syscall(SYS_futex, &info->event_futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+void
+daemon_peer_active_set(struct airptp_daemon *daemon, struct airptp_peer *peer, bool is_active)
+{
+  if (peer->is_active == is_active)
+    return;
+
+  peer->is_active = is_active;
+  daemon_event_publish(daemon, is_active ? AIRPTP_EVENT_PEER_RESUMED : AIRPTP_EVENT_PEER_STALE, peer->id, 0, 0);
+}
+
+uint64_t
+daemon_now_ns(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+uint64_t
+daemon_now_ms(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void
+daemon_tx_error_count(struct airptp_daemon *daemon, int err)
+{
+  switch (err)
+    {
+      case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+      case EWOULDBLOCK:
+#endif
+      case ENOBUFS:
+	STATS_INC(daemon, tx_errors_nobufs);
+	break;
+      case EHOSTUNREACH:
+      case ENETUNREACH:
+      case EHOSTDOWN:
+      case ENETDOWN:
+	STATS_INC(daemon, tx_errors_unreachable);
+	break;
+      case ECONNREFUSED:
+	STATS_INC(daemon, tx_errors_refused);
+	break;
+      default:
+	STATS_INC(daemon, tx_errors_other);
+    }
+}
+
+bool
+daemon_peer_send_due(struct airptp_peer *peer, uint64_t now_ms)
+{
+  return peer->send_errors == 0 || now_ms >= peer->send_retry_ms;
+}
+
+// A full socket buffer is our problem, not the peer's, so then we just lose the
+// message. Other errors make us back off from the peer, and if it keeps failing
+// we give up on it.
+void
+daemon_peer_send_result(struct airptp_daemon *daemon, struct airptp_peer *peer, int err)
+{
+  uint64_t backoff_ms;
+
+  if (err == 0) {
+    if (peer->send_errors > 0)
+      airptp_logmsg("Sending to peer with id %" PRIu32 " works again", peer->id);
+    peer->send_errors = 0;
+    return;
   }
+
+  // Already given up, this is just a late error from a connected socket
+  if (peer->send_errors >= AIRPTP_SEND_MAX_ERRORS)
+    return;
+  if (err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS || err == EINTR)
+    return;
+
+  daemon_event_publish(daemon, AIRPTP_EVENT_SEND_FAILED, peer->id, 0, err);
+
+  peer->send_errors++;
+  if (peer->send_errors >= AIRPTP_SEND_MAX_ERRORS) {
+    airptp_logmsg("Giving up on peer with id %" PRIu32 " after %d send errors, last was: %s", peer->id, peer->send_errors, strerror(err));
+    STATS_INC(daemon, tx_peers_dropped);
+    daemon_peer_active_set(daemon, peer, false); // Will be removed deferred by peers_prune()
+    return;
+  }
+
+  backoff_ms = (uint64_t)AIRPTP_SEND_BACKOFF_MIN_MS << (peer->send_errors - 1);
+  if (backoff_ms > AIRPTP_SEND_BACKOFF_MAX_MS)
+    backoff_ms = AIRPTP_SEND_BACKOFF_MAX_MS;
+
+  peer->send_retry_ms = daemon_now_ms() + backoff_ms;
+
+  airptp_logmsg("Error sending to peer with id %" PRIu32 ": %s, retrying in %" PRIu64 " ms", peer->id, strerror(err), backoff_ms);
 }
 
-static bool
-peer_exists(struct airptp_daemon *daemon, struct airptp_peer *peer)
+struct airptp_peer *
+daemon_peer_find_by_addr(struct airptp_daemon *daemon, union utils_net_sockaddr *peer_addr)
 {
   int i;
 
   for (i = 0; i < daemon->num_peers; i++) {
-    if (peer->id == daemon->peers[i].id)
-      return true;
+    if (utils_net_address_is_same(peer_addr, &daemon->peers[i].naddr))
+      return &daemon->peers[i];
+  }
+
+  return NULL;
+}
+
+unsigned short
+daemon_peer_port(struct airptp_daemon *daemon, union utils_net_sockaddr *naddr, struct airptp_service *svc)
+{
+  unsigned short port;
+
+  if (naddr->sa.sa_family == AF_INET6)
+    port = ntohs(naddr->sin6.sin6_port);
+  else
+    port = ntohs(naddr->sin.sin_port);
+
+  if (port == 0)
+    return svc->port;
+
+  return (svc == &daemon->general_svc) ? port + 1 : port;
+}
+
+void
+daemon_peer_stats_publish(struct airptp_daemon *daemon)
+{
+  struct airptp_daemon_info *info = daemon->info;
+  struct airptp_peer *peer;
+  uint32_t seq = info->peer_stats_seq;
+  int i;
+  int n;
+
+  __atomic_store_n(&info->peer_stats_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  memset(info->peer_delays, 0, sizeof(info->peer_delays));
+  memset(info->peer_syncs, 0, sizeof(info->peer_syncs));
+  for (i = 0, n = 0; i < daemon->num_peers; i++) {
+    peer = &daemon->peers[i];
+    if (peer->pdelay.result.samples == 0 && peer->pdelay.result.lost == 0 && peer->syncq.result.samples == 0)
+      continue;
+
+    info->peer_delays[n] = peer->pdelay.result;
+    info->peer_delays[n].peer_id = peer->id;
+    info->peer_syncs[n] = peer->syncq.result;
+    info->peer_syncs[n].peer_id = peer->id;
+    n++;
   }
 
-  return false;
+  __atomic_store_n(&info->peer_stats_seq, seq + 2, __ATOMIC_RELEASE);
 }
 
+// Two clients adding the same address get the same peer id. The peer is then
+// shared, with a reference per client, and is only removed when the last of
+// them removes it or goes away.
 int
-daemon_peer_add(struct airptp_daemon *daemon, struct airptp_peer *peer)
+daemon_peer_add(struct airptp_daemon *daemon, struct airptp_peer *peer, uint32_t client_id, uint32_t group_id)
 {
+  struct airptp_peer *existing;
+  struct airptp_group *group;
   char straddr[64];
   uint32_t scope_id;
+  int slot;
 
   // Clean up dead peers
   peers_prune(daemon);
 
   utils_net_address_get(straddr, sizeof(straddr), &peer->naddr);
 
-  if (daemon->num_peers >= AIRPTP_MAX_PEERS) {
-    airptp_logmsg("Max number of PTP peers reached (num_peers %d), can't add %s", daemon->num_peers, straddr);
-    return -1;
+  slot = client_find(daemon, client_id);
+  if (slot < 0 || client_id == 0) {
+    airptp_logmsg("Can't add PTP peer %s, client %" PRIu32 " isn't registered", straddr, client_id);
+    return AIRPTP_ERR_NOTFOUND;
   }
 
-  if (peer_exists(daemon, peer)) {
-    airptp_logmsg("PTP peer %s already in list, num_peers %d", straddr, daemon->num_peers);
-    return -1;
+  group = group_find(daemon, group_id);
+  if (group_id != 0 && (!group || group->owner_id != client_id)) {
+    airptp_logmsg("Can't add PTP peer %s, group %" PRIu32 " doesn't exist or isn't owned by client %" PRIu32, straddr, group_id, client_id);
+    return AIRPTP_ERR_INVALID;
   }
 
-  peer->last_seen = time(NULL);
-  peer->is_active = true;
-  memcpy(&daemon->peers[daemon->num_peers], peer, sizeof(struct airptp_peer));
-  daemon->num_peers++;
+  existing = peer_find(daemon, peer->id);
+  if (existing && (existing->client_mask & (1U << slot))) {
+    // Already added by this client, so just a possible change of group
+    existing->group_ids[slot] = group_id;
+    peers_tx_order_update(daemon);
+    return AIRPTP_OK;
+  }
 
-  // Trigger announce and signaling immediately
-  event_active(daemon->send_announce_timer, 0, 0);
-  event_active(daemon->send_signaling_timer, 0, 0);
+  if (client_num_peers(daemon, slot) >= AIRPTP_CLIENT_MAX_PEERS) {
+    airptp_logmsg("Client %" PRIu32 " has reached its quota of %d peers, can't add %s", client_id, AIRPTP_CLIENT_MAX_PEERS, straddr);
+    return AIRPTP_ERR_LIMIT;
+  }
 
-  // We should send sync's at specific interval, so if already running don't
-  // disturb the rhythm. I.e. only trigger if not running already.
-  if (!event_pending(daemon->send_sync_timer, EV_TIMEOUT, NULL))
-    event_add(daemon->send_sync_timer, &daemon_send_sync_tv);
+  if (!existing && daemon->num_peers >= AIRPTP_MAX_PEERS) {
+    airptp_logmsg("Max number of PTP peers reached (num_peers %d), can't add %s", daemon->num_peers, straddr);
+    return AIRPTP_ERR_LIMIT;
+  }
+
+  if (!existing) {
+    existing = &daemon->peers[daemon->num_peers];
+    memcpy(existing, peer, sizeof(struct airptp_peer));
+    existing->last_seen = time(NULL);
+    existing->is_active = true;
+    existing->client_mask = 0;
+    memset(existing->group_ids, 0, sizeof(existing->group_ids));
+    existing->is_connected = false;
+    daemon->num_peers++;
+
+    if (daemon->config.connected_peers)
+      peer_socket_open(daemon, existing);
+
+    peers_changed(daemon);
+  }
+
+  existing->client_mask |= (1U << slot);
+  existing->group_ids[slot] = group_id;
+
+  peers_tx_order_update(daemon);
+  timers_kick(daemon);
 
   scope_id = (peer->naddr.sa.sa_family == AF_INET6) ? peer->naddr.sin6.sin6_scope_id : 0;
-  airptp_logmsg("Added peer id %" PRIu32 ", address %s, scope id %u, num_peers %d", peer->id, straddr, scope_id, daemon->num_peers);
-  return 0;
+  airptp_logmsg("Added peer id %" PRIu32 ", address %s, scope id %u, client %" PRIu32 ", group %" PRIu32 ", refcount %d, num_peers %d",
+    peer->id, straddr, scope_id, client_id, group_id, __builtin_popcount(existing->client_mask), daemon->num_peers);
+  return AIRPTP_OK;
+}
+
+int
+daemon_peer_del(struct airptp_daemon *daemon, struct airptp_peer *peer, uint32_t client_id)
+{
+  struct airptp_peer *existing;
+  int slot;
+
+  slot = client_find(daemon, client_id);
+  existing = peer_find(daemon, peer->id);
+  if (slot < 0 || !existing || !(existing->client_mask & (1U << slot))) {
+    airptp_logmsg("Can't remove PTP peer %" PRIu32 " for client %" PRIu32 ", not in our list", peer->id, client_id);
+    return AIRPTP_ERR_NOTFOUND;
+  }
+
+  peer_unref(existing, slot);
+
+  airptp_logmsg("Removed reference to peer id %" PRIu32 " from client %" PRIu32 ", refcount %d", peer->id, client_id, __builtin_popcount(existing->client_mask));
+
+  peers_compact(daemon);
+  peers_tx_order_update(daemon);
+  return AIRPTP_OK;
+}
+
+static int
+group_add(struct airptp_daemon *daemon, struct airptp_group *group)
+{
+  int slot;
+
+  if (group->id == 0) {
+    airptp_logmsg("Can't add PTP group '%s', invalid id", group->name);
+    return AIRPTP_ERR_INVALID;
+  }
+
+  slot = client_find(daemon, group->owner_id);
+  if (slot < 0 || group->owner_id == 0) {
+    airptp_logmsg("Can't add PTP group '%s', client %" PRIu32 " isn't registered", group->name, group->owner_id);
+    return AIRPTP_ERR_NOTFOUND;
+  }
+
+  if (group_find(daemon, group->id)) {
+    airptp_logmsg("PTP group '%s' already in list, num_groups %d", group->name, daemon->num_groups);
+    return AIRPTP_ERR_INVALID;
+  }
+
+  if (client_num_groups(daemon, group->owner_id) >= AIRPTP_CLIENT_MAX_GROUPS) {
+    airptp_logmsg("Client %" PRIu32 " has reached its quota of %d groups, can't add '%s'", group->owner_id, AIRPTP_CLIENT_MAX_GROUPS, group->name);
+    return AIRPTP_ERR_LIMIT;
+  }
+
+  if (daemon->num_groups >= AIRPTP_MAX_GROUPS) {
+    airptp_logmsg("Max number of PTP groups reached (num_groups %d), can't add '%s'", daemon->num_groups, group->name);
+    return AIRPTP_ERR_LIMIT;
+  }
+
+  group->is_started = false;
+  group->name[sizeof(group->name) - 1] = '\0';
+  memcpy(&daemon->groups[daemon->num_groups], group, sizeof(struct airptp_group));
+  daemon->num_groups++;
+
+  airptp_logmsg("Added group id %" PRIu32 " ('%s'), owner %" PRIu32 ", num_groups %d", group->id, group->name, group->owner_id, daemon->num_groups);
+  return AIRPTP_OK;
+}
+
+// Drops the owner's references to the peers in the group, and the group itself.
+// Caller must call peers_compact().
+static void
+group_remove(struct airptp_daemon *daemon, struct airptp_group *group)
+{
+  uint32_t group_id = group->id;
+  int slot;
+  int i;
+
+  slot = client_find(daemon, group->owner_id);
+  for (i = 0; slot >= 0 && i < daemon->num_peers; i++) {
+    if (daemon->peers[i].group_ids[slot] == group_id)
+      peer_unref(&daemon->peers[i], slot);
+  }
+
+  // Make sure the list is sequential
+  for (i = group - daemon->groups; i < daemon->num_groups - 1; i++)
+    daemon->groups[i] = daemon->groups[i + 1];
+
+  daemon->num_groups--;
+  memset(&daemon->groups[daemon->num_groups], 0, sizeof(struct airptp_group));
+
+  airptp_logmsg("Removed group id %" PRIu32 ", num_groups %d", group_id, daemon->num_groups);
 }
 
+// All commands take effect for all peers in the group at once, i.e. within
+// the same tick of the event loop
 int
-daemon_peer_del(struct airptp_daemon *daemon, struct airptp_peer *peer)
+daemon_group_command(struct airptp_daemon *daemon, struct airptp_group *group, enum airptp_group_cmd cmd)
 {
-  uint32_t peer_id = peer->id;
-  bool found;
+  struct airptp_group *existing;
+  uint64_t now = time(NULL);
+  int slot;
   int i;
 
-  for (i = 0, found = false; i < daemon->num_peers; i++)
+  if (cmd == AIRPTP_GROUP_CMD_ADD)
+    return group_add(daemon, group);
+
+  existing = group_find(daemon, group->id);
+  if (!existing) {
+    airptp_logmsg("Can't run command %d on PTP group %" PRIu32 ", not in our list", cmd, group->id);
+    return AIRPTP_ERR_NOTFOUND;
+  }
+
+  if (existing->owner_id != group->owner_id) {
+    airptp_logmsg("Rejecting command %d on PTP group %" PRIu32 ", not the owner", cmd, group->id);
+    return AIRPTP_ERR_INVALID;
+  }
+
+  switch (cmd)
     {
-      peer = &daemon->peers[i];
-      if (!found && (peer_id == peer->id))
-	{
-	  peer_clear(peer);
-	  found = true;
-	  continue;
+      case AIRPTP_GROUP_CMD_START:
+	// The peers may not have been in contact while the group was stopped,
+	// so give them a fresh grace period before they are considered stale
+	slot = client_find(daemon, existing->owner_id);
+	for (i = 0; slot >= 0 && i < daemon->num_peers; i++) {
+	  if (daemon->peers[i].group_ids[slot] == existing->id)
+	    daemon->peers[i].last_seen = now;
 	}
-
-      // Make sure the list is sequential
-      if (found)
-	daemon->peers[i - 1] = *peer;
+	existing->priority = group->priority;
+	existing->is_started = true;
+	break;
+      case AIRPTP_GROUP_CMD_STOP:
+	existing->is_started = false;
+	break;
+      case AIRPTP_GROUP_CMD_PRIORITY:
+	existing->priority = group->priority;
+	break;
+      case AIRPTP_GROUP_CMD_REMOVE:
+	group_remove(daemon, existing);
+	peers_compact(daemon);
+	break;
+      default:
+	airptp_logmsg("Unknown PTP group command %d", cmd);
+	return AIRPTP_ERR_INVALID;
     }
 
-  if (!found) {
-    airptp_logmsg("Can't remove PTP peer, not in our list");
-    return -1;
+  peers_tx_order_update(daemon);
+
+  if (cmd == AIRPTP_GROUP_CMD_START)
+    timers_kick(daemon);
+
+  airptp_logmsg("Ran command %d on group id %" PRIu32 ", num_tx %d", cmd, group->id, daemon->num_tx);
+  return AIRPTP_OK;
+}
+
+// Drops everything the client has, i.e. its references to peers and its groups
+static void
+client_remove(struct airptp_daemon *daemon, int slot)
+{
+  uint32_t client_id = daemon->clients[slot].id;
+  int i;
+
+  for (i = daemon->num_groups - 1; i >= 0; i--) {
+    if (daemon->groups[i].owner_id == client_id)
+      group_remove(daemon, &daemon->groups[i]);
   }
 
-  daemon->num_peers--;
-  airptp_logmsg("Removed peer id %" PRIu32 ", num_peers %d", peer_id, daemon->num_peers);
-  return 0;
+  for (i = 0; i < daemon->num_peers; i++)
+    peer_unref(&daemon->peers[i], slot);
+
+  memset(&daemon->clients[slot], 0, sizeof(struct airptp_client));
+  daemon->num_clients--;
+
+  peers_compact(daemon);
+  peers_tx_order_update(daemon);
+
+  airptp_logmsg("Removed client id %" PRIu32 ", num_clients %d, num_peers %d", client_id, daemon->num_clients, daemon->num_peers);
+}
+
+int
+daemon_client_command(struct airptp_daemon *daemon, struct airptp_client *client, enum airptp_client_cmd cmd)
+{
+  int slot;
+
+  switch (cmd)
+    {
+      case AIRPTP_CLIENT_CMD_ADD:
+	if (client->id == 0 || client->pid <= 0)
+	  return AIRPTP_ERR_INVALID;
+	slot = client_add(daemon, client->id, client->pid);
+	if (slot < 0)
+	  return AIRPTP_ERR_LIMIT;
+	break;
+      case AIRPTP_CLIENT_CMD_REMOVE:
+	slot = client_find(daemon, client->id);
+	if (slot < 0 || client->id == 0)
+	  return AIRPTP_ERR_NOTFOUND;
+	client_remove(daemon, slot);
+	break;
+      default:
+	airptp_logmsg("Unknown client command %d", cmd);
+	return AIRPTP_ERR_INVALID;
+    }
+
+  return AIRPTP_OK;
+}
+
+// Clients that crash or forget to call airptp_end() won't remove their peers,
+// so we check if their processes are still around
+static void
+clients_check(struct airptp_daemon *daemon)
+{
+  struct airptp_client *client;
+  int slot;
+
+  for (slot = 0; slot < AIRPTP_MAX_CLIENTS; slot++)
+    {
+      client = &daemon->clients[slot];
+      if (client->id == 0 || client->pid <= 0)
+	continue;
+
+      if (kill(client->pid, 0) == 0 || errno != ESRCH)
+	continue;
+
+      airptp_logmsg("Process %d of client %" PRIu32 " is gone, removing client", (int)client->pid, client->id);
+      client_remove(daemon, slot);
+    }
 }
 
 
@@ -301,7 +1115,7 @@ send_announce_cb(int fd, short what, void *arg)
 {
   struct airptp_daemon *daemon = arg;
 
-  if (daemon->num_peers == 0)
+  if (daemon->num_tx == 0)
     return; // Don't reschedule
 
   ptp_msg_announce_send(daemon);
@@ -314,7 +1128,7 @@ send_signaling_cb(int fd, short what, void *arg)
 {
   struct airptp_daemon *daemon = arg;
 
-  if (daemon->num_peers == 0)
+  if (daemon->num_tx == 0)
     return; // Don't reschedule
 
   ptp_msg_signaling_send(daemon);
@@ -327,14 +1141,67 @@ send_sync_cb(int fd, short what, void *arg)
 {
   struct airptp_daemon *daemon = arg;
 
-  if (daemon->num_peers == 0)
+  if (daemon->num_tx == 0)
     return; // Don't reschedule
 
+  // Reschedules itself
+  if (daemon->txtime && txtime_sync_send(daemon->txtime) == 0)
+    return;
+
+  if (daemon->txtime) {
+    txtime_stop(daemon->txtime);
+    daemon->txtime = NULL;
+  }
+
   ptp_msg_sync_send(daemon);
 
   event_add(daemon->send_sync_timer, &daemon_send_sync_tv);
 }
 
+// Decides from just the header and the source if a message should be handled.
+// Registered peers always get through, others get their requests rate limited
+// so we can't be used for amplification. Control messages are restricted to
+// localhost by the signaling handler.
+bool
+daemon_incoming_admit(struct airptp_daemon *daemon, struct ratelimit *ratelimit, struct ptp_msg_view *view, uint8_t *msg, ssize_t msg_len, union utils_net_sockaddr *peer_addr, bool is_peer)
+{
+  if (ptp_decode(view, msg, msg_len) < 0) {
+    STATS_INC(daemon, rx_dropped_invalid);
+    return false;
+  }
+
+  if (is_peer || (view->type != PTP_MSGTYPE_DELAY_REQ && view->type != PTP_MSGTYPE_PDELAY_REQ))
+    return true;
+
+  if (daemon->config.peers_only) {
+    STATS_INC(daemon, rx_dropped_unregistered);
+    return false;
+  }
+
+  if (!ratelimit_allow(ratelimit, peer_addr, daemon_now_ms())) {
+    STATS_INC(daemon, rx_dropped_ratelimit);
+    return false;
+  }
+
+  return true;
+}
+
+static void
+incoming_handle(struct airptp_daemon *daemon, uint8_t *req, ssize_t len, union utils_net_sockaddr *peer_addr, socklen_t peer_addrlen)
+{
+  struct airptp_peer *peer;
+  struct ptp_msg_view view;
+
+  peer = daemon_peer_find_by_addr(daemon, peer_addr);
+  if (peer)
+    peer->last_seen = time(NULL);
+
+  if (!daemon_incoming_admit(daemon, &daemon->ratelimit, &view, req, len, peer_addr, peer != NULL))
+    return;
+
+  ptp_msg_handle(daemon, &view, peer_addr, peer_addrlen);
+}
+
 static void
 incoming_cb(int fd, short what, void *arg)
 {
@@ -351,14 +1218,85 @@ incoming_cb(int fd, short what, void *arg)
   len = recvfrom(fd, req, sizeof(req), 0, &peer_addr.sa, &peer_addrlen);
   if (len <= 0 || peer_addr.sa.sa_family == AF_UNSPEC)
     {
-      if (len < 0)
+      if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
 	airptp_logmsg("Service read error: %s", strerror(errno));
+      else if (len < 0 && daemon->config.txtime_lead_us)
+	txtime_errqueue_read(daemon->txtime, fd);
       return;
     }
 
-  peer_last_seen_update(daemon, &peer_addr, peer_addrlen);
+  STATS_INC(daemon, rx_packets);
 
-  ptp_msg_handle(daemon, req, len, &peer_addr, peer_addrlen);
+  incoming_handle(daemon, req, len, &peer_addr, peer_addrlen);
+}
+
+// Same as incoming_cb, but the message was received by io_uring or AF_XDP
+static void
+msg_incoming_cb(void *arg, uint8_t *req, ssize_t len, union utils_net_sockaddr *peer_addr, socklen_t peer_addrlen)
+{
+  struct airptp_daemon *daemon = arg;
+
+  STATS_INC(daemon, rx_packets);
+
+  incoming_handle(daemon, req, len, peer_addr, peer_addrlen);
+}
+
+static void
+xdp_incoming_cb(int fd, short what, void *arg)
+{
+  struct airptp_daemon *daemon = arg;
+
+  xdp_socket_recv(daemon->event_svc.socket.xsk, msg_incoming_cb, daemon);
+}
+
+static void
+xdp_start(struct airptp_daemon *daemon)
+{
+  struct airptp_service *svc = &daemon->event_svc;
+
+  svc->socket.xsk = xdp_socket_open(daemon->config.xdp_ifindex, svc->port, daemon->config.xdp_generic);
+  if (!svc->socket.xsk) {
+    airptp_logmsg("Falling back to UDP for the event port");
+    return;
+  }
+
+  svc->ev_xdp = event_new(daemon->evbase, xdp_socket_fd(svc->socket.xsk), EV_READ | EV_PERSIST, xdp_incoming_cb, daemon);
+  if (!svc->ev_xdp) {
+    xdp_socket_close(svc->socket.xsk);
+    svc->socket.xsk = NULL;
+    return;
+  }
+
+  event_add(svc->ev_xdp, NULL);
+
+  // Peers from a daemon we took over from
+  xdp_neighs_update(daemon);
+}
+
+// Messages from the rx workers that they don't handle themselves
+static void
+rx_forward_cb(int fd, short what, void *arg)
+{
+  struct airptp_daemon *daemon = arg;
+  struct rx_forward_header header;
+  struct ptp_msg_view view;
+  uint8_t req[1024];
+  struct iovec iov[2] = { { &header, sizeof(header) }, { req, sizeof(req) } };
+  struct msghdr mh = { .msg_iov = iov, .msg_iovlen = 2 };
+  ssize_t len;
+
+  len = recvmsg(fd, &mh, 0);
+  if (len <= (ssize_t)sizeof(header))
+    return;
+
+  if (!header.rx_ns) {
+    incoming_handle(daemon, req, len - sizeof(header), &header.addr, header.addrlen);
+    return;
+  }
+
+  // An answered Delay_Req, which the worker has decoded already
+  if (ptp_decode(&view, req, len - sizeof(header)) == 0)
+    ptp_msg_delay_req_track(daemon, &view, &header.addr, header.rx_ns);
 }
 
 static void
@@ -371,16 +1309,66 @@ shm_update_cb(int fd, short what, void *arg)
   event_add(daemon->shm_update_timer, &daemon_shm_update_tv);
 }
 
+static void
+standby_cb(int fd, short what, void *arg)
+{
+  struct airptp_daemon *daemon = arg;
+
+  slave_takeover(daemon);
+}
+
+static void
+pdelay_cb(int fd, short what, void *arg)
+{
+  struct airptp_daemon *daemon = arg;
+  struct timeval tv = {
+    .tv_sec = daemon->config.pdelay_interval_ms / 1000,
+    .tv_usec = (daemon->config.pdelay_interval_ms % 1000) * 1000
+  };
+
+  pdelay_send(daemon);
+
+  event_add(daemon->pdelay_timer, &tv);
+}
+
+static void
+timebase_offsets_update(struct airptp_daemon *daemon)
+{
+  int i;
+
+  daemon->info->timebase = daemon->config.timebase;
+  for (i = 0; i < AIRPTP_NUM_TIMEBASES; i++)
+    __atomic_store_n(&daemon->info->timebase_offset_ns[i], timesource_offset_get(i), __ATOMIC_RELAXED);
+}
+
+static void
+clients_check_cb(int fd, short what, void *arg)
+{
+  struct airptp_daemon *daemon = arg;
+
+  clients_check(daemon);
+
+  timesource_calibrate();
+  timebase_offsets_update(daemon);
+  bmca_check(daemon);
+
+  // Sync quality is only published on state changes, and this also drops peers
+  // that have been removed
+  daemon_peer_stats_publish(daemon);
+
+  if (snapshot_fold(daemon))
+    snapshot_publish(daemon);
+
+  event_add(daemon->clients_check_timer, &daemon_clients_check_tv);
+}
+
 // Daemon thread
 static void
-loop_start_signal(enum airptp_error retval, const char *errmsg, int start_fd, struct airptp_daemon_info *info)
+loop_start_signal(enum airptp_error retval, const char *errmsg, int start_fd)
 {
   struct daemon_start_result start_result = { .retval = retval, .errmsg = errmsg };
   int ret;
 
-  if (info)
-    memcpy(&start_result.daemon_info, info, sizeof(struct airptp_daemon_info));
-
   ret = write(start_fd, &start_result, sizeof(start_result));
   if (ret != sizeof(start_result))
     airptp_logmsg("Error writing thread start result");
@@ -388,7 +1376,7 @@ loop_start_signal(enum airptp_error retval, const char *errmsg, int start_fd, st
 
 // Parent thread
 static enum airptp_error
-loop_start_wait(const char **errmsg, int start_fd, struct airptp_daemon_info *info)
+loop_start_wait(const char **errmsg, int start_fd)
 {
   struct daemon_start_result start_result;
   int ret;
@@ -399,8 +1387,6 @@ loop_start_wait(const char **errmsg, int start_fd, struct airptp_daemon_info *in
     start_result.errmsg = "Error reading thread start result";
   }
 
-  memcpy(info, &start_result.daemon_info, sizeof(struct airptp_daemon_info));
-
   *errmsg = start_result.errmsg;
   return start_result.retval;
 }
@@ -413,7 +1399,7 @@ start_stop_cb(int fd, short what, void *arg)
 
   if (what != EV_READ) {
     airptp_logmsg("Starting airptp event loop");
-    loop_start_signal(AIRPTP_OK, NULL, daemon->start_pipe[1], daemon->info);
+    loop_start_signal(AIRPTP_OK, NULL, daemon->start_pipe[1]);
     event_add(daemon->start_stop_ev, NULL);
   } else {
     airptp_logmsg("Stopping airptp event loop");
@@ -424,6 +1410,20 @@ start_stop_cb(int fd, short what, void *arg)
   }
 }
 
+void
+daemon_uring_failed(struct airptp_daemon *daemon)
+{
+  uring_stop(daemon->uring);
+  daemon->uring = NULL;
+
+  airptp_logmsg("Falling back to libevent for the daemon's I/O");
+
+  if (service_start(&daemon->event_svc, incoming_cb, daemon) < 0 || service_start(&daemon->general_svc, incoming_cb, daemon) < 0) {
+    airptp_logmsg("Error creating ptp services, stopping the daemon");
+    event_base_loopbreak(daemon->evbase);
+  }
+}
+
 
 /* ------------------------------- Main loop -------------------------------- */
 
@@ -433,21 +1433,44 @@ static void *
 run(void *arg)
 {
   struct airptp_daemon *daemon = arg;
-  struct airptp_daemon_info info = { 0 };
   struct timeval now = { 0 };
-  int shm_fd = -1;
   int ret;
+  int i;
 
   airptp_callbacks_register(&daemon->cb);
   airptp_thread_name_set("libairptp");
 
-  ret = service_start(&daemon->event_svc, incoming_cb, daemon);
+  // Before any of our threads take timestamps
+  ret = timesource_start(daemon->config.timebase, daemon->config.tsc);
   if (ret < 0)
-    RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Error creating ptp event service");
+    RETURN_ERROR(AIRPTP_ERR_INVALID, "Another daemon in this process uses a different timebase or TSC option");
+  daemon->is_timesource_started = true;
 
-  ret = service_start(&daemon->general_svc, incoming_cb, daemon);
-  if (ret < 0)
-    RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Error creating ptp general service");
+  if (daemon->config.io_uring) {
+    daemon->uring = uring_start(daemon, msg_incoming_cb);
+    if (!daemon->uring)
+      airptp_logmsg("Falling back to libevent for the daemon's I/O");
+  }
+
+  if (!daemon->uring) {
+    ret = service_start(&daemon->event_svc, incoming_cb, daemon);
+    if (ret < 0)
+      RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Error creating ptp event service");
+
+    ret = service_start(&daemon->general_svc, incoming_cb, daemon);
+    if (ret < 0)
+      RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Error creating ptp general service");
+  }
+
+  if (daemon->config.xdp_ifindex > 0)
+    xdp_start(daemon);
+
+  if (daemon->config.txtime_lead_us && (daemon->config.tx_thread || daemon->uring))
+    airptp_logmsg("Scheduled Syncs can't be combined with the tx thread or io_uring, ignoring");
+  else if (daemon->config.txtime_lead_us)
+    daemon->txtime = txtime_start(daemon, daemon->config.txtime_lead_us);
+
+  peers_filter_update(daemon);
 
   daemon->start_stop_ev = event_new(daemon->evbase, daemon->exit_pipe[0], EV_READ, start_stop_cb, daemon);
   if (!daemon->start_stop_ev)
@@ -460,23 +1483,73 @@ run(void *arg)
   if (!daemon->send_announce_timer || !daemon->send_signaling_timer || !daemon->send_sync_timer)
     RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Error creating ptp timers");
 
-  if (daemon->is_shared) {
-    shm_fd = daemon_shm_create(&daemon->info, daemon->clock_id, &daemon->event_svc, &daemon->general_svc);
-    if (shm_fd < 0)
+  if (daemon->config.pdelay_interval_ms > 0) {
+    daemon->pdelay_timer = evtimer_new(daemon->evbase, pdelay_cb, daemon);
+    if (!daemon->pdelay_timer)
+      RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Error creating pdelay timer");
+    event_active(daemon->pdelay_timer, 0, 0);
+  }
+
+  if (daemon->config.standby_ms > 0) {
+    daemon->standby_timer = evtimer_new(daemon->evbase, standby_cb, daemon);
+    if (!daemon->standby_timer)
+      RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Error creating standby timer");
+  }
+
+  daemon->clients_check_timer = evtimer_new(daemon->evbase, clients_check_cb, daemon);
+  if (!daemon->clients_check_timer)
+    RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Error creating clients check timer");
+  event_add(daemon->clients_check_timer, &daemon_clients_check_tv);
+
+  if (daemon->is_shared && daemon->is_takeover) {
+    ret = daemon_shm_attach(&daemon->info, daemon->shm_fd, daemon->clock_id, &daemon->event_svc, &daemon->general_svc);
+    if (ret < 0)
+      RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Error mapping shared memory of previous daemon");
+  } else if (daemon->is_shared) {
+    // Before the shm, so a client that finds the shm also finds this
+    daemon->liveness_fd = daemon_liveness_create();
+    if (daemon->liveness_fd < 0)
+      airptp_logmsg("Could not create liveness FIFO, clients will be slower to notice a restart");
+
+    daemon->shm_fd = daemon_shm_create(&daemon->info, daemon->clock_id, &daemon->event_svc, &daemon->general_svc);
+    if (daemon->shm_fd < 0)
       RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Error creating shared memory");
+  }
+
+  if (daemon->is_shared) {
+    if (handoff_listen(daemon) < 0)
+      airptp_logmsg("Could not listen for a daemon taking over, upgrades will restart");
 
     daemon->shm_update_timer = evtimer_new(daemon->evbase, shm_update_cb, daemon);
     if (!daemon->shm_update_timer)
       RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Error creating shared memory update timer");
     event_add(daemon->shm_update_timer, &daemon_shm_update_tv);
   } else {
-    daemon_info_fill(&info, daemon->clock_id, &daemon->event_svc, &daemon->general_svc);
-    daemon->info = &info;
+    daemon_info_fill(&daemon->private_info, daemon->clock_id, &daemon->event_svc, &daemon->general_svc);
+    daemon->info = &daemon->private_info;
   }
 
+  timebase_offsets_update(daemon);
+
+  snapshot_publish(daemon);
+
+  ret = rx_workers_start(daemon, rx_forward_cb);
+  if (ret < 0)
+    RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Error starting rx workers");
+
+  ret = tx_thread_start(daemon);
+  if (ret < 0)
+    RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Error starting tx thread");
+
+  if (daemon->is_takeover)
+    handoff_resume(daemon);
+
   event_base_dispatch(daemon->evbase);
 
  error:
+  tx_thread_stop(daemon);
+  rx_workers_stop(daemon);
+  snapshot_free(daemon);
   if (daemon->shm_update_timer)
     event_free(daemon->shm_update_timer);
   if (daemon->send_announce_timer)
@@ -485,16 +1558,37 @@ run(void *arg)
     event_free(daemon->send_signaling_timer);
   if (daemon->send_sync_timer)
     event_free(daemon->send_sync_timer);
+  if (daemon->pdelay_timer)
+    event_free(daemon->pdelay_timer);
+  if (daemon->standby_timer)
+    event_free(daemon->standby_timer);
+  if (daemon->clients_check_timer)
+    event_free(daemon->clients_check_timer);
   if (daemon->start_stop_ev)
     event_free(daemon->start_stop_ev);
+  handoff_listen_stop(daemon);
   if (daemon->is_shared)
-    daemon_shm_destroy(daemon->info, shm_fd);
+    daemon_shm_destroy(daemon->info, daemon->shm_fd, !daemon->is_handed_over);
+  daemon_liveness_destroy(daemon->liveness_fd, !daemon->is_handed_over);
+  daemon->shm_fd = -1;
+  daemon->liveness_fd = -1;
+  for (i = 0; i < daemon->num_peers; i++)
+    peer_socket_close(&daemon->peers[i]);
+  txtime_stop(daemon->txtime);
+  daemon->txtime = NULL;
+  uring_stop(daemon->uring);
+  daemon->uring = NULL;
   service_stop(&daemon->general_svc);
   service_stop(&daemon->event_svc);
+  xdp_socket_close(daemon->event_svc.socket.xsk);
+  daemon->event_svc.socket.xsk = NULL;
+  if (daemon->is_timesource_started)
+    timesource_stop();
+  daemon->is_timesource_started = false;
 
   // Initialization error before event loop dispatch, tell our parent
   if (ret != 0)
-    loop_start_signal(ret, airptp_errmsg, daemon->start_pipe[1], NULL);
+    loop_start_signal(ret, airptp_errmsg, daemon->start_pipe[1]);
 
   pthread_exit(NULL);
 }
@@ -536,9 +1630,16 @@ daemon_start(struct airptp_daemon *daemon, struct airptp_daemon_info *info, bool
 
   daemon->info = MAP_FAILED;
   daemon->is_shared = is_shared;
+  daemon->handoff_fd = -1;
+  if (!daemon->is_takeover) {
+    daemon->shm_fd = -1;
+    daemon->liveness_fd = -1;
+  }
   daemon->clock_id = clock_id;
   daemon->cb = cb;
 
+  ratelimit_init(&daemon->ratelimit, daemon->config.ratelimit_rate, daemon->config.ratelimit_burst);
+
   daemon->evbase = event_base_new();
   if (!daemon->evbase)
     RETURN_ERROR(AIRPTP_ERR_OOM, "Out of memory");
@@ -547,10 +1648,14 @@ daemon_start(struct airptp_daemon *daemon, struct airptp_daemon_info *info, bool
   if (ret < 0)
     RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Error spawning daemon thread");
 
-  ret = loop_start_wait(&airptp_errmsg, daemon->start_pipe[0], info);
+  ret = loop_start_wait(&airptp_errmsg, daemon->start_pipe[0]);
   if (ret < 0)
     RETURN_ERROR(ret, airptp_errmsg);
 
+  // Mapped or allocated by the daemon thread before it signalled us. The
+  // daemon thread may be updating it, but we only need the fixed fields.
+  memcpy(info, daemon->info, sizeof(struct airptp_daemon_info));
+
   daemon->is_running = true;
 
   return AIRPTP_OK;
@@ -579,5 +1684,6 @@ daemon_stop(struct airptp_daemon *daemon)
 
  error:
   daemon_cleanup(daemon);
+  daemon->is_running = false;
   return ret;
 }
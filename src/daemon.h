@@ -1,11 +1,74 @@
 #ifndef __AIRPTP_DAEMON_H__
 #define __AIRPTP_DAEMON_H__
 
+#include "ptp_decode.h"
+
+int
+daemon_peer_add(struct airptp_daemon *daemon, struct airptp_peer *peer, uint32_t client_id, uint32_t group_id);
+
+int
+daemon_peer_del(struct airptp_daemon *daemon, struct airptp_peer *peer, uint32_t client_id);
+
 int
-daemon_peer_add(struct airptp_daemon *daemon, struct airptp_peer *peer);
+daemon_group_command(struct airptp_daemon *daemon, struct airptp_group *group, enum airptp_group_cmd cmd);
 
 int
-daemon_peer_del(struct airptp_daemon *daemon, struct airptp_peer *peer);
+daemon_client_command(struct airptp_daemon *daemon, struct airptp_client *client, enum airptp_client_cmd cmd);
+
+// Returns false if the message should be dropped, otherwise the view of it is
+// set. Also used by the rx workers, each with their own ratelimit.
+bool
+daemon_incoming_admit(struct airptp_daemon *daemon, struct ratelimit *ratelimit, struct ptp_msg_view *view, uint8_t *msg, ssize_t msg_len, union utils_net_sockaddr *peer_addr, bool is_peer);
+
+// Whether the peer is due for sending, i.e. not backing off after an error
+bool
+daemon_peer_send_due(struct airptp_peer *peer, uint64_t now_ms);
+
+// Updates the peer's send error state after a send, err is 0 or the errno
+void
+daemon_peer_send_result(struct airptp_daemon *daemon, struct airptp_peer *peer, int err);
+
+// Counts a send error in the stats, any thread
+void
+daemon_tx_error_count(struct airptp_daemon *daemon, int err);
+
+// Called by uring.c when io_uring can't receive, stops it and goes back to
+// libevent for the sockets. Daemon thread only.
+void
+daemon_uring_failed(struct airptp_daemon *daemon);
+
+uint64_t
+daemon_now_ms(void);
+
+// CLOCK_MONOTONIC
+uint64_t
+daemon_now_ns(void);
+
+struct airptp_peer *
+daemon_peer_find_by_addr(struct airptp_daemon *daemon, union utils_net_sockaddr *peer_addr);
+
+// Starts or stops serving peers, see bmca.c
+void
+daemon_port_state_set(struct airptp_daemon *daemon, enum airptp_port_state state);
+
+// The port of the peer (naddr) that messages for svc go to. Peers use the same
+// ports as us, unless added with airptp_peer_add_port(), in which case naddr
+// has the event port and the general port is the next one. Can be called from
+// any thread.
+unsigned short
+daemon_peer_port(struct airptp_daemon *daemon, union utils_net_sockaddr *naddr, struct airptp_service *svc);
+
+// Copies the Pdelay and sync quality results of all peers to shm
+void
+daemon_peer_stats_publish(struct airptp_daemon *daemon);
+
+// Writes an event to the ring in shm, daemon thread only
+void
+daemon_event_publish(struct airptp_daemon *daemon, enum airptp_event_type type, uint32_t peer_id, uint64_t clock_id, int32_t value);
+
+// Sets whether the peer is active, and publishes an event if that changed
+void
+daemon_peer_active_set(struct airptp_daemon *daemon, struct airptp_peer *peer, bool is_active);
 
 enum airptp_error
 daemon_start(struct airptp_daemon *daemon, struct airptp_daemon_info *info, bool is_shared, uint64_t clock_id, struct airptp_callbacks cb);
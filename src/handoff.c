@@ -0,0 +1,833 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Before the system headers, for struct ucred (_GNU_SOURCE)
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <event2/event.h>
+
+#include "handoff.h"
+#include "daemon.h"
+#include "tx_thread.h"
+#include "txtime.h"
+#include "timesource.h"
+
+// A new daemon takes over from a running shared daemon like this:
+//
+//   new: connects to AIRPTP_HANDOFF_PATH and sends a handoff_request
+//   old: stops sending and replies with a handoff_reply and handoff_state,
+//        with the bound sockets, shm and liveness FIFO attached as SCM_RIGHTS
+//   old: stops its loop and calls the handed_over callback
+//   new: is started, and sends its first Sync when the old one would have
+//
+// Both check that the other end is a process of the same user or root, and
+// the old daemon does its part from its event loop without blocking it.
+//
+// The sockets are the same open files in both processes, so whatever arrives
+// in between is queued and read by the new daemon. The state is the internal
+// structs as they are, so both must be the same version of the library.
+
+#define HANDOFF_MAGIC 0x41505448 // APTH
+#define HANDOFF_TIMEOUT_MS 1000
+
+enum handoff_fd
+{
+  HANDOFF_FD_EVENT4 = 0,
+  HANDOFF_FD_EVENT6,
+  HANDOFF_FD_GENERAL4,
+  HANDOFF_FD_GENERAL6,
+  HANDOFF_FD_SHM,
+  HANDOFF_FD_LIVENESS,
+  HANDOFF_NUM_FDS,
+};
+
+struct handoff_request
+{
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  uint32_t state_size;
+};
+
+struct handoff_reply
+{
+  uint32_t magic;
+  int32_t status; // 0 if the state follows, otherwise an enum airptp_error
+  uint32_t state_size;
+  // Bit n is set if fd n of enum handoff_fd is attached
+  uint32_t fd_mask;
+};
+
+struct handoff_state
+{
+  unsigned short event_port;
+  unsigned short general_port;
+  uint64_t clock_id;
+
+  uint16_t announce_seq;
+  uint16_t signaling_seq;
+  uint16_t sync_seq;
+  // CLOCK_MONOTONIC, when the next Sync was due, 0 if none was being sent
+  uint64_t sync_next_ns;
+
+  enum airptp_timebase timebase;
+  enum airptp_port_state port_state;
+  struct airptp_timemap timeline;
+
+  struct airptp_peer peers[AIRPTP_MAX_PEERS];
+  int num_peers;
+  struct airptp_group groups[AIRPTP_MAX_GROUPS];
+  int num_groups;
+  struct airptp_client clients[AIRPTP_MAX_CLIENTS];
+  int num_clients;
+  struct airptp_foreign_master foreign_masters[AIRPTP_MAX_FOREIGN_MASTERS];
+};
+
+// The old daemon's side of a handoff in progress
+struct handoff_conn
+{
+  int fd;
+  struct event *ev;
+  struct airptp_daemon *daemon;
+  uint64_t deadline_ms;
+
+  struct handoff_request req;
+  size_t req_got;
+  // Set once the request is accepted and we are sending
+  struct handoff_state *state;
+  size_t state_sent;
+};
+
+
+/* --------------------------------- Helpers -------------------------------- */
+
+static void
+socket_timeout_set(int fd, int timeout_ms)
+{
+  struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Whoever is on the other end gets or gives the sockets, so it must be a
+// process of our own user or root
+static bool
+peer_is_trusted(int fd)
+{
+  uid_t uid;
+#ifdef __linux__
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+    return false;
+
+  uid = cred.uid;
+#else
+  gid_t gid;
+
+  if (getpeereid(fd, &uid, &gid) < 0)
+    return false;
+#endif
+
+  return (uid == 0 || uid == geteuid());
+}
+
+static int
+sockaddr_make(struct sockaddr_un *sun)
+{
+  memset(sun, 0, sizeof(struct sockaddr_un));
+  sun->sun_family = AF_UNIX;
+  if (strlen(AIRPTP_HANDOFF_PATH) >= sizeof(sun->sun_path))
+    return -1;
+
+  strcpy(sun->sun_path, AIRPTP_HANDOFF_PATH);
+  return 0;
+}
+
+static int
+read_all(int fd, void *buf, size_t len)
+{
+  uint8_t *ptr = buf;
+  ssize_t got;
+
+  while (len > 0)
+    {
+      got = read(fd, ptr, len);
+      if (got < 0 && errno == EINTR)
+	continue;
+      if (got <= 0)
+	return -1;
+
+      ptr += got;
+      len -= got;
+    }
+
+  return 0;
+}
+
+static void
+fds_close(int *fds)
+{
+  int i;
+
+  for (i = 0; i < HANDOFF_NUM_FDS; i++)
+    {
+      if (fds[i] >= 0)
+	close(fds[i]);
+      fds[i] = -1;
+    }
+}
+
+
+/* ------------------------------- Old daemon ------------------------------- */
+
+static void
+sending_stop(struct airptp_daemon *daemon)
+{
+  tx_thread_stop(daemon);
+
+  event_del(daemon->send_announce_timer);
+  event_del(daemon->send_signaling_timer);
+  event_del(daemon->send_sync_timer);
+  if (daemon->pdelay_timer)
+    event_del(daemon->pdelay_timer);
+
+  txtime_stop(daemon->txtime);
+  daemon->txtime = NULL;
+}
+
+// If the handoff failed we carry on, though without scheduled Syncs
+static void
+sending_restart(struct airptp_daemon *daemon)
+{
+  if (tx_thread_start(daemon) < 0)
+    airptp_logmsg("Error restarting tx thread after failed handoff, sending from daemon thread");
+
+  if (daemon->pdelay_timer)
+    event_active(daemon->pdelay_timer, 0, 0);
+
+  daemon_port_state_set(daemon, daemon->port_state);
+}
+
+static void
+state_fill(struct handoff_state *state, struct airptp_daemon *daemon)
+{
+  state->event_port = daemon->event_svc.port;
+  state->general_port = daemon->general_svc.port;
+  state->clock_id = daemon->clock_id;
+
+  state->announce_seq = daemon->announce_seq;
+  state->signaling_seq = daemon->signaling_seq;
+  state->sync_seq = daemon->sync_seq;
+  if (daemon->sync_sent_ns > 0 && daemon->num_tx > 0)
+    state->sync_next_ns = daemon->sync_sent_ns + (uint64_t)AIRPTP_INTERVAL_MS_SYNC * 1000000ULL;
+
+  state->timebase = daemon->config.timebase;
+  state->port_state = daemon->port_state;
+  state->timeline = daemon->timeline;
+
+  memcpy(state->peers, daemon->peers, sizeof(state->peers));
+  state->num_peers = daemon->num_peers;
+  memcpy(state->groups, daemon->groups, sizeof(state->groups));
+  state->num_groups = daemon->num_groups;
+  memcpy(state->clients, daemon->clients, sizeof(state->clients));
+  state->num_clients = daemon->num_clients;
+  memcpy(state->foreign_masters, daemon->foreign_masters, sizeof(state->foreign_masters));
+}
+
+// Sends the reply with the fds attached and as much of the state as fits,
+// returns how much of the state that was or -1
+static ssize_t
+state_send_first(int fd, struct airptp_daemon *daemon, struct handoff_state *state)
+{
+  struct handoff_reply reply = { .magic = HANDOFF_MAGIC, .state_size = sizeof(struct handoff_state) };
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * HANDOFF_NUM_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov[2];
+  struct msghdr msg = { 0 };
+  struct cmsghdr *cmsg;
+  int fds[HANDOFF_NUM_FDS];
+  int num_fds = 0;
+  ssize_t ret;
+  int i;
+
+  fds[HANDOFF_FD_EVENT4] = daemon->event_svc.socket.fd4;
+  fds[HANDOFF_FD_EVENT6] = daemon->event_svc.socket.fd6;
+  fds[HANDOFF_FD_GENERAL4] = daemon->general_svc.socket.fd4;
+  fds[HANDOFF_FD_GENERAL6] = daemon->general_svc.socket.fd6;
+  fds[HANDOFF_FD_SHM] = daemon->shm_fd;
+  fds[HANDOFF_FD_LIVENESS] = daemon->liveness_fd;
+
+  memset(&control, 0, sizeof(control));
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+
+  for (i = 0; i < HANDOFF_NUM_FDS; i++)
+    {
+      if (fds[i] < 0)
+	continue;
+
+      memcpy(CMSG_DATA(cmsg) + num_fds * sizeof(int), &fds[i], sizeof(int));
+      reply.fd_mask |= 1U << i;
+      num_fds++;
+    }
+
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+
+  iov[0].iov_base = &reply;
+  iov[0].iov_len = sizeof(reply);
+  iov[1].iov_base = state;
+  iov[1].iov_len = sizeof(struct handoff_state);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  // The socket is empty, so unless something is badly off there is room for
+  // at least the reply
+  do
+    ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  while (ret < 0 && errno == EINTR);
+  if (ret < (ssize_t)sizeof(reply))
+    return -1;
+
+  return ret - sizeof(reply);
+}
+
+// The fds went with the first part, the rest of the state is just bytes.
+// Returns 1 when all is sent, 0 if the socket is full.
+static int
+state_send_rest(struct handoff_conn *conn)
+{
+  ssize_t ret;
+
+  while (conn->state_sent < sizeof(struct handoff_state))
+    {
+      ret = send(conn->fd, (uint8_t *)conn->state + conn->state_sent, sizeof(struct handoff_state) - conn->state_sent, MSG_NOSIGNAL);
+      if (ret < 0 && errno == EINTR)
+	continue;
+      if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	return 0;
+      if (ret <= 0)
+	return -1;
+
+      conn->state_sent += ret;
+    }
+
+  return 1;
+}
+
+static void
+refusal_send(int fd, enum airptp_error err)
+{
+  struct handoff_reply reply = { .magic = HANDOFF_MAGIC, .status = err };
+
+  if (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply))
+    airptp_logmsg("Error sending handoff refusal: %s", strerror(errno));
+}
+
+static void
+conn_free(struct handoff_conn *conn)
+{
+  struct airptp_daemon *daemon = conn->daemon;
+
+  daemon->handoff_conn = NULL;
+
+  // Next in the backlog
+  if (daemon->handoff_ev && !daemon->is_handed_over)
+    event_add(daemon->handoff_ev, NULL);
+
+  if (conn->ev)
+    event_free(conn->ev);
+  close(conn->fd);
+  free(conn->state);
+  free(conn);
+}
+
+static void
+handed_over(struct handoff_conn *conn)
+{
+  struct airptp_daemon *daemon = conn->daemon;
+
+  daemon->is_handed_over = true;
+  conn_free(conn);
+
+  airptp_logmsg("Handed over to new daemon, stopping");
+
+  event_base_loopbreak(daemon->evbase);
+
+  if (daemon->cb.handed_over)
+    daemon->cb.handed_over();
+}
+
+static void
+conn_cb(int fd, short what, void *arg);
+
+// Validates the request and starts sending the state
+static void
+request_handle(struct handoff_conn *conn)
+{
+  struct airptp_daemon *daemon = conn->daemon;
+  struct handoff_request *req = &conn->req;
+  struct timeval tv = { .tv_sec = HANDOFF_TIMEOUT_MS / 1000, .tv_usec = (HANDOFF_TIMEOUT_MS % 1000) * 1000 };
+  ssize_t sent;
+  int ret;
+
+  if (req->magic != HANDOFF_MAGIC) {
+    airptp_logmsg("Invalid handoff request, ignoring");
+    goto refused;
+  }
+
+  if (req->version_major != AIRPTP_SHM_STRUCTS_VERSION_MAJOR || req->version_minor != AIRPTP_SHM_STRUCTS_VERSION_MINOR || req->state_size != sizeof(struct handoff_state)) {
+    airptp_logmsg("Refusing handoff to daemon with version %hu.%hu, we are %d.%d", req->version_major, req->version_minor, AIRPTP_SHM_STRUCTS_VERSION_MAJOR, AIRPTP_SHM_STRUCTS_VERSION_MINOR);
+    refusal_send(conn->fd, AIRPTP_ERR_INVALID);
+    goto refused;
+  }
+
+  // These have their own sockets bound to the ports, which we can't pass on
+  if (daemon->num_rx_workers > 0 || daemon->config.connected_peers) {
+    airptp_logmsg("Refusing handoff, not supported with rx workers or connected peers");
+    refusal_send(conn->fd, AIRPTP_ERR_INVALID);
+    goto refused;
+  }
+
+  conn->state = calloc(1, sizeof(struct handoff_state));
+  if (!conn->state) {
+    refusal_send(conn->fd, AIRPTP_ERR_OOM);
+    goto refused;
+  }
+
+  // Must be before the state is read, so the sequence numbers don't move
+  sending_stop(daemon);
+  state_fill(conn->state, daemon);
+
+  sent = state_send_first(conn->fd, daemon, conn->state);
+  if (sent < 0)
+    goto send_error;
+
+  conn->state_sent = sent;
+  ret = state_send_rest(conn);
+  if (ret < 0)
+    goto send_error;
+  if (ret > 0) {
+    handed_over(conn);
+    return;
+  }
+
+  // The new daemon is slow to read, wait until it has made room, but not
+  // beyond the deadline
+  event_free(conn->ev);
+  conn->ev = event_new(daemon->evbase, conn->fd, EV_WRITE | EV_PERSIST, conn_cb, conn);
+  if (!conn->ev)
+    goto send_error;
+
+  event_add(conn->ev, &tv);
+  return;
+
+ send_error:
+  airptp_logmsg("Error sending state to new daemon, continuing: %s", strerror(errno));
+  sending_restart(daemon);
+ refused:
+  conn_free(conn);
+}
+
+// Reads the request and then sends the state, without blocking the daemon
+// thread. The whole exchange must be done within HANDOFF_TIMEOUT_MS.
+static void
+conn_cb(int fd, short what, void *arg)
+{
+  struct handoff_conn *conn = arg;
+  ssize_t got;
+  int ret;
+
+  if ((what & EV_TIMEOUT) || daemon_now_ms() > conn->deadline_ms) {
+    if (conn->state) {
+      airptp_logmsg("Timeout sending state to new daemon, continuing");
+      sending_restart(conn->daemon);
+    } else {
+      airptp_logmsg("Timeout reading handoff request, ignoring");
+    }
+    conn_free(conn);
+    return;
+  }
+
+  if (conn->state) {
+    ret = state_send_rest(conn);
+    if (ret < 0) {
+      airptp_logmsg("Error sending state to new daemon, continuing: %s", strerror(errno));
+      sending_restart(conn->daemon);
+      conn_free(conn);
+    } else if (ret > 0) {
+      handed_over(conn);
+    }
+    return;
+  }
+
+  got = read(fd, (uint8_t *)&conn->req + conn->req_got, sizeof(conn->req) - conn->req_got);
+  if (got < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if (got <= 0) {
+    airptp_logmsg("Invalid handoff request, ignoring");
+    conn_free(conn);
+    return;
+  }
+
+  conn->req_got += got;
+  if (conn->req_got == sizeof(conn->req))
+    request_handle(conn);
+}
+
+static void
+handoff_accept_cb(int fd, short what, void *arg)
+{
+  struct airptp_daemon *daemon = arg;
+  struct timeval tv = { .tv_sec = HANDOFF_TIMEOUT_MS / 1000, .tv_usec = (HANDOFF_TIMEOUT_MS % 1000) * 1000 };
+  struct handoff_conn *conn;
+  int cfd;
+
+  cfd = accept(fd, NULL, NULL);
+  if (cfd < 0)
+    return;
+
+  fcntl(cfd, F_SETFD, FD_CLOEXEC);
+
+  if (!peer_is_trusted(cfd)) {
+    airptp_logmsg("Refusing handoff to a process of another user");
+    close(cfd);
+    return;
+  }
+
+  if (fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK) < 0)
+    goto error;
+
+  conn = calloc(1, sizeof(struct handoff_conn));
+  if (!conn)
+    goto error;
+
+  conn->fd = cfd;
+  conn->daemon = daemon;
+  conn->deadline_ms = daemon_now_ms() + HANDOFF_TIMEOUT_MS;
+  conn->ev = event_new(daemon->evbase, cfd, EV_READ | EV_PERSIST, conn_cb, conn);
+  if (!conn->ev) {
+    free(conn);
+    goto error;
+  }
+
+  event_add(conn->ev, &tv);
+  daemon->handoff_conn = conn;
+
+  // One at a time, others wait in the backlog until this one is done
+  event_del(daemon->handoff_ev);
+  return;
+
+ error:
+  airptp_logmsg("Error accepting handoff connection: %s", strerror(errno));
+  close(cfd);
+}
+
+int
+handoff_listen(struct airptp_daemon *daemon)
+{
+  struct sockaddr_un sun;
+  int fd;
+
+  if (sockaddr_make(&sun) < 0)
+    return -1;
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  // A daemon that took over from us would have created its own, and the one
+  // left by a daemon that crashed is stale
+  unlink(AIRPTP_HANDOFF_PATH);
+
+  if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+    goto error;
+
+  // Whoever can connect gets our sockets
+  chmod(AIRPTP_HANDOFF_PATH, 0600);
+
+  if (listen(fd, 1) < 0)
+    goto error;
+
+  daemon->handoff_ev = event_new(daemon->evbase, fd, EV_READ | EV_PERSIST, handoff_accept_cb, daemon);
+  if (!daemon->handoff_ev)
+    goto error;
+
+  event_add(daemon->handoff_ev, NULL);
+
+  daemon->handoff_fd = fd;
+  return 0;
+
+ error:
+  close(fd);
+  unlink(AIRPTP_HANDOFF_PATH);
+  return -1;
+}
+
+void
+handoff_listen_stop(struct airptp_daemon *daemon)
+{
+  if (daemon->handoff_conn)
+    conn_free(daemon->handoff_conn);
+
+  if (daemon->handoff_ev)
+    event_free(daemon->handoff_ev);
+  daemon->handoff_ev = NULL;
+
+  if (daemon->handoff_fd < 0)
+    return;
+
+  close(daemon->handoff_fd);
+  daemon->handoff_fd = -1;
+
+  // If handed over the path is now the new daemon's
+  if (!daemon->is_handed_over)
+    unlink(AIRPTP_HANDOFF_PATH);
+}
+
+
+/* ------------------------------- New daemon ------------------------------- */
+
+static int
+state_recv(int fd, struct handoff_reply *reply, struct handoff_state *state, int *fds)
+{
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * HANDOFF_NUM_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov[2];
+  struct msghdr msg = { 0 };
+  struct cmsghdr *cmsg;
+  int received[HANDOFF_NUM_FDS];
+  int num_received = 0;
+  size_t got;
+  ssize_t ret;
+  int i;
+  int j;
+
+  iov[0].iov_base = reply;
+  iov[0].iov_len = sizeof(struct handoff_reply);
+  iov[1].iov_base = state;
+  iov[1].iov_len = sizeof(struct handoff_state);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  do
+    ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  while (ret < 0 && errno == EINTR);
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); ret >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+	continue;
+
+      num_received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(received, CMSG_DATA(cmsg), num_received * sizeof(int));
+    }
+
+  // In the order of the mask, if they don't match something is off
+  if (num_received != __builtin_popcount(reply->fd_mask)) {
+    for (i = 0; i < num_received; i++)
+      close(received[i]);
+    return AIRPTP_ERR_INVALID;
+  }
+
+  for (i = 0, j = 0; i < HANDOFF_NUM_FDS; i++)
+    {
+      if (reply->fd_mask & (1U << i))
+	fds[i] = received[j++];
+    }
+
+  if (ret < (ssize_t)sizeof(struct handoff_reply) || reply->magic != HANDOFF_MAGIC)
+    return AIRPTP_ERR_NOCONNECTION;
+  if (reply->status != 0)
+    return reply->status;
+  if (reply->state_size != sizeof(struct handoff_state))
+    return AIRPTP_ERR_INVALID;
+
+  got = ret - sizeof(struct handoff_reply);
+  if (read_all(fd, (uint8_t *)state + got, sizeof(struct handoff_state) - got) < 0)
+    return AIRPTP_ERR_NOCONNECTION;
+
+  return 0;
+}
+
+static void
+state_apply(struct airptp_daemon *daemon, struct handoff_state *state, int *fds)
+{
+  struct airptp_peer *peer;
+  int i;
+
+  daemon->event_svc.socket.fd4 = fds[HANDOFF_FD_EVENT4];
+  daemon->event_svc.socket.fd6 = fds[HANDOFF_FD_EVENT6];
+  daemon->event_svc.port = state->event_port;
+  daemon->general_svc.socket.fd4 = fds[HANDOFF_FD_GENERAL4];
+  daemon->general_svc.socket.fd6 = fds[HANDOFF_FD_GENERAL6];
+  daemon->general_svc.port = state->general_port;
+  daemon->shm_fd = fds[HANDOFF_FD_SHM];
+  daemon->liveness_fd = fds[HANDOFF_FD_LIVENESS];
+
+  daemon->clock_id = state->clock_id;
+  daemon->announce_seq = state->announce_seq;
+  daemon->signaling_seq = state->signaling_seq;
+  daemon->sync_seq = state->sync_seq;
+  daemon->sync_next_ns = state->sync_next_ns;
+
+  daemon->config.timebase = state->timebase;
+  daemon->port_state = state->port_state;
+  daemon->timeline = state->timeline;
+
+  memcpy(daemon->peers, state->peers, sizeof(daemon->peers));
+  daemon->num_peers = state->num_peers;
+  memcpy(daemon->groups, state->groups, sizeof(daemon->groups));
+  daemon->num_groups = state->num_groups;
+  memcpy(daemon->clients, state->clients, sizeof(daemon->clients));
+  daemon->num_clients = state->num_clients;
+  memcpy(daemon->foreign_masters, state->foreign_masters, sizeof(daemon->foreign_masters));
+
+  // Pointers and fds of the old process
+  for (i = 0; i < daemon->num_peers; i++)
+    {
+      peer = &daemon->peers[i];
+      peer->is_connected = false;
+      peer->event_fd = -1;
+      peer->general_fd = -1;
+      peer->event_ev = NULL;
+      peer->general_ev = NULL;
+    }
+
+  daemon->is_takeover = true;
+}
+
+int
+handoff_takeover(struct airptp_daemon *daemon)
+{
+  struct handoff_request req = { .magic = HANDOFF_MAGIC, .version_major = AIRPTP_SHM_STRUCTS_VERSION_MAJOR, .version_minor = AIRPTP_SHM_STRUCTS_VERSION_MINOR, .state_size = sizeof(struct handoff_state) };
+  struct handoff_reply reply = { 0 };
+  struct handoff_state *state = NULL;
+  struct sockaddr_un sun;
+  int fds[HANDOFF_NUM_FDS];
+  int fd = -1;
+  int ret;
+  int i;
+
+  for (i = 0; i < HANDOFF_NUM_FDS; i++)
+    fds[i] = -1;
+
+  if (sockaddr_make(&sun) < 0)
+    RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Handoff socket path too long");
+
+  state = calloc(1, sizeof(struct handoff_state));
+  if (!state)
+    RETURN_ERROR(AIRPTP_ERR_OOM, "Out of memory");
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    RETURN_ERROR(AIRPTP_ERR_INTERNAL, "Could not create handoff socket");
+
+  if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+    RETURN_ERROR(AIRPTP_ERR_NOCONNECTION, "No running shared daemon to take over from");
+
+  if (!peer_is_trusted(fd))
+    RETURN_ERROR(AIRPTP_ERR_INVALID, "Handoff socket belongs to a process of another user");
+
+  // The old daemon answers from its event loop, which may be busy for a bit
+  socket_timeout_set(fd, 2 * HANDOFF_TIMEOUT_MS);
+
+  if (write(fd, &req, sizeof(req)) != sizeof(req))
+    RETURN_ERROR(AIRPTP_ERR_NOCONNECTION, "Could not send handoff request to running daemon");
+
+  ret = state_recv(fd, &reply, state, fds);
+  if (ret == AIRPTP_ERR_INVALID)
+    RETURN_ERROR(AIRPTP_ERR_INVALID, "Running daemon refused handoff, different version or rx workers/connected peers enabled");
+  else if (ret == AIRPTP_ERR_OOM)
+    RETURN_ERROR(AIRPTP_ERR_OOM, "Running daemon is out of memory");
+  else if (ret < 0)
+    RETURN_ERROR(AIRPTP_ERR_NOCONNECTION, "Incomplete handoff from running daemon");
+
+  state_apply(daemon, state, fds);
+
+  airptp_logmsg("Took over %d peers from running daemon", daemon->num_peers);
+
+  close(fd);
+  free(state);
+  return 0;
+
+ error:
+  // If the old daemon sent the state it has stopped, and so will clients
+  // once it exits
+  fds_close(fds);
+  if (fd >= 0)
+    close(fd);
+  free(state);
+  return ret;
+}
+
+void
+handoff_resume(struct airptp_daemon *daemon)
+{
+  struct timeval tv = { 0 };
+  uint64_t now_ns;
+  uint64_t delay_us = 0;
+
+  if (daemon->timeline.local_ns)
+    timesource_timeline_set(&daemon->ts_timeline, daemon->timeline.local_ns, daemon->timeline.ptp_ns, daemon->timeline.rate_ppb);
+
+  // Before the kick below, which leaves a pending Sync timer as it is
+  now_ns = daemon_now_ns();
+  if (daemon->sync_next_ns > now_ns)
+    delay_us = (daemon->sync_next_ns - now_ns) / 1000;
+
+  if (daemon->sync_next_ns > 0 && !daemon->config.tx_thread) {
+    tv.tv_sec = delay_us / 1000000;
+    tv.tv_usec = delay_us % 1000000;
+    event_add(daemon->send_sync_timer, &tv);
+  }
+
+  // Recreates the tx order and snapshot, and kicks announce and signaling
+  daemon_port_state_set(daemon, daemon->port_state);
+}
@@ -0,0 +1,24 @@
+#ifndef __AIRPTP_HANDOFF_H__
+#define __AIRPTP_HANDOFF_H__
+
+#include "airptp_internal.h"
+
+// Called by airptp_daemon_takeover(). Gets the sockets, shm, peers and the rest
+// from the running daemon, which stops sending when it has passed them on.
+int
+handoff_takeover(struct airptp_daemon *daemon);
+
+// The below must be called from the daemon thread. A shared daemon listens for
+// another one that wants to take over.
+int
+handoff_listen(struct airptp_daemon *daemon);
+
+void
+handoff_listen_stop(struct airptp_daemon *daemon);
+
+// When started after handoff_takeover(), resumes sending on the Sync phase of
+// the previous daemon
+void
+handoff_resume(struct airptp_daemon *daemon);
+
+#endif // __AIRPTP_HANDOFF_H__
@@ -0,0 +1,153 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "pdelay.h"
+#include "daemon.h"
+#include "ptp_msg_handle.h"
+
+// Pdelay initiator. At each interval we send a Pdelay_Req to every active
+// peer, and when the Pdelay_Resp (and from two-step responders the
+// Pdelay_Resp_Follow_Up) comes back we have, with t1/t4 our send/receive times
+// and t2/t3 the peer's receive/send times:
+//
+//   rtt = (t4 - t1) - (t3 - t2) - correction
+//   delay = rtt / 2
+//
+// Single measurements are noisy, mostly upwards from queuing and scheduling,
+// so we take the minimum of the last AIRPTP_PDELAY_WINDOW and average that
+// exponentially. A request that is still outstanding when the next one is due
+// counts as lost.
+
+// Weight of a new value is 1/8 for the delay, 1/16 for the jitter
+#define PDELAY_EWMA_DIV 8
+#define PDELAY_JITTER_DIV 16
+
+static void
+sample_add(struct airptp_peer_pdelay *pd, int64_t rtt_ns)
+{
+  struct airptp_peer_delay *r = &pd->result;
+  int64_t delay_ns = rtt_ns / 2;
+  int64_t min_ns;
+  int i;
+
+  // The peer's clock stepped between t2 and t3, or it is just bogus
+  if (rtt_ns < 0)
+    return;
+
+  pd->window[pd->window_pos] = delay_ns;
+  pd->window_pos = (pd->window_pos + 1) % AIRPTP_PDELAY_WINDOW;
+  if (pd->window_len < AIRPTP_PDELAY_WINDOW)
+    pd->window_len++;
+
+  min_ns = pd->window[0];
+  for (i = 1; i < pd->window_len; i++) {
+    if (pd->window[i] < min_ns)
+      min_ns = pd->window[i];
+  }
+
+  if (r->samples == 0) {
+    r->delay_ns = min_ns;
+  } else {
+    r->delay_ns += (min_ns - r->delay_ns) / PDELAY_EWMA_DIV;
+    r->rtt_jitter_ns += (llabs(rtt_ns - pd->last_rtt_ns) - r->rtt_jitter_ns) / PDELAY_JITTER_DIV;
+  }
+
+  pd->last_rtt_ns = rtt_ns;
+  r->delay_min_ns = min_ns;
+  r->delay_last_ns = delay_ns;
+  r->samples++;
+}
+
+static void
+measurement_complete(struct airptp_daemon *daemon, struct airptp_peer *peer, uint64_t t3_ns, int64_t correction_ns)
+{
+  struct airptp_peer_pdelay *pd = &peer->pdelay;
+  int64_t rtt_ns;
+
+  rtt_ns = (int64_t)(pd->t4_ns - pd->t1_ns) - (int64_t)(t3_ns - pd->t2_ns) - correction_ns;
+  pd->t1_ns = 0;
+
+  sample_add(pd, rtt_ns);
+  daemon_peer_stats_publish(daemon);
+}
+
+void
+pdelay_resp_received(struct airptp_daemon *daemon, struct airptp_peer *peer, uint16_t seq, uint64_t t2_ns, uint64_t t4_ns, int64_t correction_ns, bool two_step)
+{
+  struct airptp_peer_pdelay *pd = &peer->pdelay;
+
+  if (pd->t1_ns == 0 || seq != pd->seq)
+    return;
+
+  pd->t2_ns = t2_ns;
+  pd->t4_ns = t4_ns;
+  pd->correction_ns = correction_ns;
+  pd->has_resp = true;
+
+  // One-step responders put their turnaround time in the correction
+  if (!two_step)
+    measurement_complete(daemon, peer, t2_ns, correction_ns);
+}
+
+void
+pdelay_resp_follow_up_received(struct airptp_daemon *daemon, struct airptp_peer *peer, uint16_t seq, uint64_t t3_ns, int64_t correction_ns)
+{
+  struct airptp_peer_pdelay *pd = &peer->pdelay;
+
+  if (pd->t1_ns == 0 || !pd->has_resp || seq != pd->seq)
+    return;
+
+  measurement_complete(daemon, peer, t3_ns, pd->correction_ns + correction_ns);
+}
+
+void
+pdelay_send(struct airptp_daemon *daemon)
+{
+  struct airptp_peer *peer;
+  uint64_t now_ms = daemon_now_ms();
+  bool has_lost = false;
+  int i;
+
+  for (i = 0; i < daemon->num_peers; i++) {
+    peer = &daemon->peers[i];
+    if (!peer->is_active || !daemon_peer_send_due(peer, now_ms))
+      continue;
+
+    if (peer->pdelay.t1_ns) {
+      peer->pdelay.result.lost++;
+      has_lost = true;
+    }
+
+    peer->pdelay.seq++;
+    peer->pdelay.has_resp = false;
+    peer->pdelay.t1_ns = ptp_msg_pdelay_req_send(daemon, peer, peer->pdelay.seq);
+  }
+
+  if (has_lost)
+    daemon_peer_stats_publish(daemon);
+}
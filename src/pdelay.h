@@ -0,0 +1,18 @@
+#ifndef __AIRPTP_PDELAY_H__
+#define __AIRPTP_PDELAY_H__
+
+#include "airptp_internal.h"
+
+// Sends a Pdelay_Req to each active peer, call at the interval
+void
+pdelay_send(struct airptp_daemon *daemon);
+
+// From the peer's Pdelay_Resp, t4_ns is when we received it. If the peer isn't
+// two-step, the measurement is completed with this.
+void
+pdelay_resp_received(struct airptp_daemon *daemon, struct airptp_peer *peer, uint16_t seq, uint64_t t2_ns, uint64_t t4_ns, int64_t correction_ns, bool two_step);
+
+void
+pdelay_resp_follow_up_received(struct airptp_daemon *daemon, struct airptp_peer *peer, uint16_t seq, uint64_t t3_ns, int64_t correction_ns);
+
+#endif // __AIRPTP_PDELAY_H__
@@ -0,0 +1,186 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+#include "peer_socket.h"
+#include "daemon.h"
+#include "ptp_msg_handle.h"
+
+// With AIRPTP_OPT_CONNECTED_PEERS each peer has a socket per port that is
+// connected to it. They are in the same SO_REUSEPORT group as the daemon's
+// sockets, and the kernel prefers a connected socket for packets from its
+// peer, so we also receive on them. New sockets are appended to the group, so
+// the indices of the rx workers' sockets, which the steering program uses,
+// don't change.
+
+int
+peer_sockets_bind(struct airptp_daemon *daemon)
+{
+  int ret;
+
+  // With rx workers the event socket is already in a group
+  if (daemon->num_rx_workers == 0) {
+    utils_net_socket_close(&daemon->event_svc.socket);
+    ret = utils_net_bind_reuseport(&daemon->event_svc.socket, daemon->bind_node, daemon->event_svc.port);
+    if (ret < 0)
+      goto error;
+  }
+
+  utils_net_socket_close(&daemon->general_svc.socket);
+  ret = utils_net_bind_reuseport(&daemon->general_svc.socket, daemon->bind_node, daemon->general_svc.port);
+  if (ret < 0)
+    goto error;
+
+  return 0;
+
+ error:
+  // Try to get back to where we were
+  if (daemon->num_rx_workers == 0 && daemon->event_svc.socket.fd4 < 0 && daemon->event_svc.socket.fd6 < 0)
+    utils_net_bind(&daemon->event_svc.socket, daemon->bind_node, daemon->event_svc.port);
+  if (daemon->general_svc.socket.fd4 < 0 && daemon->general_svc.socket.fd6 < 0)
+    utils_net_bind(&daemon->general_svc.socket, daemon->bind_node, daemon->general_svc.port);
+  return -1;
+}
+
+static struct airptp_peer *
+peer_find_by_fd(struct airptp_daemon *daemon, int fd)
+{
+  int i;
+
+  for (i = 0; i < daemon->num_peers; i++) {
+    if (daemon->peers[i].is_connected && (daemon->peers[i].event_fd == fd || daemon->peers[i].general_fd == fd))
+      return &daemon->peers[i];
+  }
+
+  return NULL;
+}
+
+// Like incoming_cb() in daemon.c, except that we know the peer, and that an
+// ICMP error from the peer shows up here as a read error
+static void
+incoming_cb(int fd, short what, void *arg)
+{
+  struct airptp_daemon *daemon = arg;
+  struct airptp_peer *peer;
+  union utils_net_sockaddr peer_addr;
+  socklen_t peer_addrlen = sizeof(peer_addr);
+  struct ptp_msg_view view;
+  uint8_t req[1024];
+  ssize_t len;
+
+  peer = peer_find_by_fd(daemon, fd);
+  if (!peer)
+    return;
+
+  peer_addr.sa.sa_family = AF_UNSPEC;
+
+  len = recvfrom(fd, req, sizeof(req), 0, &peer_addr.sa, &peer_addrlen);
+  if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if (len < 0) {
+    // The error is from an earlier send
+    daemon_tx_error_count(daemon, errno);
+    daemon_peer_send_result(daemon, peer, errno);
+    return;
+  }
+  if (len == 0 || peer_addr.sa.sa_family == AF_UNSPEC)
+    return;
+
+  STATS_INC(daemon, rx_packets);
+
+  peer->last_seen = time(NULL);
+  daemon_peer_send_result(daemon, peer, 0);
+
+  if (!daemon_incoming_admit(daemon, &daemon->ratelimit, &view, req, len, &peer_addr, true))
+    return;
+
+  ptp_msg_handle(daemon, &view, &peer_addr, peer_addrlen);
+}
+
+static int
+socket_open(int *fd, struct event **ev, struct airptp_daemon *daemon, struct airptp_peer *peer, struct airptp_service *svc)
+{
+  union utils_net_sockaddr naddr = peer->naddr;
+  unsigned short peer_port = daemon_peer_port(daemon, &peer->naddr, svc);
+
+  if (naddr.sa.sa_family == AF_INET6)
+    naddr.sin6.sin6_port = htons(peer_port);
+  else
+    naddr.sin.sin_port = htons(peer_port);
+
+  *fd = utils_net_connect_reuseport(daemon->bind_node, svc->port, &naddr);
+  if (*fd < 0)
+    return -1;
+
+  *ev = event_new(daemon->evbase, *fd, EV_READ | EV_PERSIST, incoming_cb, daemon);
+  if (!*ev)
+    return -1;
+
+  event_add(*ev, NULL);
+  return 0;
+}
+
+int
+peer_socket_open(struct airptp_daemon *daemon, struct airptp_peer *peer)
+{
+  peer->event_fd = -1;
+  peer->general_fd = -1;
+  peer->event_ev = NULL;
+  peer->general_ev = NULL;
+  peer->is_connected = true;
+
+  if (socket_open(&peer->event_fd, &peer->event_ev, daemon, peer, &daemon->event_svc) < 0 ||
+      socket_open(&peer->general_fd, &peer->general_ev, daemon, peer, &daemon->general_svc) < 0) {
+    airptp_logmsg("Could not create connected sockets for peer %" PRIu32 ", will use the shared ones: %s", peer->id, strerror(errno));
+    peer_socket_close(peer);
+    return -1;
+  }
+
+  return 0;
+}
+
+void
+peer_socket_close(struct airptp_peer *peer)
+{
+  if (!peer->is_connected)
+    return;
+
+  if (peer->event_ev)
+    event_free(peer->event_ev);
+  if (peer->general_ev)
+    event_free(peer->general_ev);
+  if (peer->event_fd >= 0)
+    close(peer->event_fd);
+  if (peer->general_fd >= 0)
+    close(peer->general_fd);
+
+  peer->is_connected = false;
+}
@@ -0,0 +1,20 @@
+#ifndef __AIRPTP_PEER_SOCKET_H__
+#define __AIRPTP_PEER_SOCKET_H__
+
+#include "airptp_internal.h"
+
+// Called before the daemon is started. Rebinds the daemon's sockets with
+// SO_REUSEPORT, so that connected sockets can be bound next to them.
+int
+peer_sockets_bind(struct airptp_daemon *daemon);
+
+// The below must be called from the daemon thread. Opens the peer's connected
+// sockets, which are then read from the daemon's event loop. On failure the
+// peer is left without, and messages to it go through the daemon's sockets.
+int
+peer_socket_open(struct airptp_daemon *daemon, struct airptp_peer *peer);
+
+void
+peer_socket_close(struct airptp_peer *peer);
+
+#endif // __AIRPTP_PEER_SOCKET_H__
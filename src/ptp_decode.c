@@ -0,0 +1,98 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ptp_decode.h"
+
+// Indexed by messageType, which is 4 bits. A min_len of 0 means the type isn't
+// one we handle. The Follow_Up and Announce from other masters don't have
+// Apple's TLVs, so those are not part of the minimum.
+const struct ptp_decode_layout ptp_decode_layouts[16] =
+{
+  [PTP_MSGTYPE_SYNC] = { "Sync", sizeof(struct ptp_sync_message) },
+  [PTP_MSGTYPE_DELAY_REQ] = { "Delay_Req", sizeof(struct ptp_delay_req_message) },
+  [PTP_MSGTYPE_PDELAY_REQ] = { "Pdelay_Req", sizeof(struct ptp_pdelay_req_message) },
+  [PTP_MSGTYPE_PDELAY_RESP] = { "Pdelay_Resp", sizeof(struct ptp_pdelay_resp_message) },
+  [PTP_MSGTYPE_FOLLOW_UP] = { "Follow_Up", offsetof(struct ptp_follow_up_message, tlv_apple1) },
+  [PTP_MSGTYPE_DELAY_RESP] = { "Delay_Resp", sizeof(struct ptp_delay_resp_message) },
+  [PTP_MSGTYPE_PDELAY_RESP_FOLLOW_UP] = { "Pdelay_Resp_Follow_Up", sizeof(struct ptp_pdelay_resp_follow_up_message) },
+  [PTP_MSGTYPE_ANNOUNCE] = { "Announce", offsetof(struct ptp_announce_message, tlv_path_trace) },
+  [PTP_MSGTYPE_SIGNALING] = { "Signaling", offsetof(struct ptp_signaling_message, tlv_apple1) },
+  [PTP_MSGTYPE_MANAGEMENT] = { "Management", sizeof(struct ptp_management_message) + PTP_TLV_MIN_SIZE + sizeof(uint16_t) },
+};
+
+const char *
+ptp_decode_type_name(uint8_t type)
+{
+  const char *name = ptp_decode_layouts[type & 0x0F].name;
+
+  return name ? name : "Unknown";
+}
+
+const char *
+ptp_decode_error_str(int err)
+{
+  switch (err)
+    {
+      case PTP_DECODE_OK:
+	return "OK";
+      case PTP_DECODE_ERR_SHORT:
+	return "Shorter than a PTP header";
+      case PTP_DECODE_ERR_TYPE:
+	return "Unknown message type";
+      case PTP_DECODE_ERR_VERSION:
+	return "Not PTPv2";
+      case PTP_DECODE_ERR_DOMAIN:
+	return "Other domain";
+      case PTP_DECODE_ERR_LENGTH:
+	return "Invalid messageLength";
+      default:
+	return "Unknown error";
+    }
+}
+
+int
+ptp_view_tlv_next(struct ptp_tlv_view *tlv, struct ptp_msg_view *view, size_t *offset)
+{
+  size_t remaining;
+
+  if (*offset >= view->len)
+    return 0;
+
+  remaining = view->len - *offset;
+  if (remaining < PTP_TLV_MIN_SIZE)
+    return -1;
+
+  tlv->type = ptp_view_u16(view, *offset);
+  tlv->len = ptp_view_u16(view, *offset + sizeof(uint16_t));
+  if (remaining < PTP_TLV_MIN_SIZE + (size_t)tlv->len)
+    return -1;
+
+  tlv->data = view->msg + *offset + PTP_TLV_MIN_SIZE;
+  *offset += PTP_TLV_MIN_SIZE + tlv->len;
+  return 1;
+}
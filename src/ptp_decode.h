@@ -0,0 +1,186 @@
+#ifndef __AIRPTP_PTP_DECODE_H__
+#define __AIRPTP_PTP_DECODE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "airptp_internal.h"
+#include "utils.h"
+#include "ptp_definitions.h"
+
+// A received message that has passed ptp_decode(). The fields are not copied,
+// the accessors below read them from the packet when needed. Offsets are
+// those of the structs in ptp_definitions.h, and everything up to the minimum
+// size of the message type may be read without further checks.
+struct ptp_msg_view
+{
+  uint8_t *msg;
+  uint16_t len; // messageLength, padding after it is ignored
+  uint8_t type;
+};
+
+// Same for a TLV, see ptp_view_tlv_next()
+struct ptp_tlv_view
+{
+  uint16_t type;
+  uint16_t len;
+  uint8_t *data;
+};
+
+enum ptp_decode_error
+{
+  PTP_DECODE_OK = 0,
+  PTP_DECODE_ERR_SHORT = -1,
+  PTP_DECODE_ERR_TYPE = -2,
+  PTP_DECODE_ERR_VERSION = -3,
+  PTP_DECODE_ERR_DOMAIN = -4,
+  PTP_DECODE_ERR_LENGTH = -5,
+};
+
+struct ptp_decode_layout
+{
+  const char *name;
+  uint16_t min_len;
+};
+
+// Indexed by messageType, see ptp_decode.c
+extern const struct ptp_decode_layout ptp_decode_layouts[16];
+
+// Minimum size of a message type, 0 if it is unknown
+static inline uint16_t
+ptp_decode_min_len(uint8_t type)
+{
+  return ptp_decode_layouts[type & 0x0F].min_len;
+}
+
+// Checks that msg is a PTPv2 message of a type we know, in our domain, and
+// that messageLength is within what was received and not less than the
+// minimum for the type. Returns 0 and sets view if so, otherwise a negative
+// enum ptp_decode_error. Called for every received packet, so it is inline
+// and only looks at the header.
+static inline int
+ptp_decode(struct ptp_msg_view *view, uint8_t *msg, size_t len)
+{
+  struct ptp_header *hdr = (struct ptp_header *)msg;
+  uint16_t msg_len;
+  uint16_t min_len;
+
+  if (len < sizeof(struct ptp_header))
+    return PTP_DECODE_ERR_SHORT;
+
+  min_len = ptp_decode_min_len(msg[0]); // Upper bits are transportSpecific
+  if (min_len == 0)
+    return PTP_DECODE_ERR_TYPE;
+
+  // The upper bits are minorVersionPTP, which is 1 from PTP 2.1
+  if ((hdr->versionPTP & 0x0F) != 2)
+    return PTP_DECODE_ERR_VERSION;
+
+  if (hdr->domainNumber != AIRPTP_DOMAIN)
+    return PTP_DECODE_ERR_DOMAIN;
+
+  msg_len = be16toh(hdr->messageLength);
+  if (msg_len < min_len || msg_len > len)
+    return PTP_DECODE_ERR_LENGTH;
+
+  view->msg = msg;
+  view->len = msg_len;
+  view->type = msg[0] & 0x0F;
+  return PTP_DECODE_OK;
+}
+
+const char *
+ptp_decode_type_name(uint8_t type);
+
+const char *
+ptp_decode_error_str(int err);
+
+// Gets the TLV at *offset and advances *offset past it. Returns 1 if there was
+// one, 0 at the end of the message and -1 if what is left isn't a TLV.
+int
+ptp_view_tlv_next(struct ptp_tlv_view *tlv, struct ptp_msg_view *view, size_t *offset);
+
+static inline uint8_t
+ptp_view_u8(struct ptp_msg_view *view, size_t offset)
+{
+  return view->msg[offset];
+}
+
+static inline uint16_t
+ptp_view_u16(struct ptp_msg_view *view, size_t offset)
+{
+  uint16_t be16;
+
+  memcpy(&be16, view->msg + offset, sizeof(be16));
+  return be16toh(be16);
+}
+
+static inline uint32_t
+ptp_view_u32(struct ptp_msg_view *view, size_t offset)
+{
+  uint32_t be32;
+
+  memcpy(&be32, view->msg + offset, sizeof(be32));
+  return be32toh(be32);
+}
+
+static inline uint64_t
+ptp_view_u64(struct ptp_msg_view *view, size_t offset)
+{
+  uint64_t be64;
+
+  memcpy(&be64, view->msg + offset, sizeof(be64));
+  return be64toh(be64);
+}
+
+// A struct ptp_timestamp at offset, in ns
+static inline uint64_t
+ptp_view_timestamp_ns(struct ptp_msg_view *view, size_t offset)
+{
+  uint64_t sec = ((uint64_t)ptp_view_u16(view, offset) << 32) | ptp_view_u32(view, offset + 2);
+
+  return sec * 1000000000ULL + ptp_view_u32(view, offset + 6);
+}
+
+static inline uint16_t
+ptp_view_flags(struct ptp_msg_view *view)
+{
+  return ptp_view_u16(view, offsetof(struct ptp_header, flags));
+}
+
+// correctionField is ns * 2^16
+static inline int64_t
+ptp_view_correction_ns(struct ptp_msg_view *view)
+{
+  return (int64_t)ptp_view_u64(view, offsetof(struct ptp_header, correctionField)) / 65536;
+}
+
+// The clock id part of sourcePortIdentity
+static inline uint64_t
+ptp_view_clock_id(struct ptp_msg_view *view)
+{
+  return ptp_view_u64(view, offsetof(struct ptp_header, sourcePortIdentity));
+}
+
+static inline uint16_t
+ptp_view_sequence_id(struct ptp_msg_view *view)
+{
+  return ptp_view_u16(view, offsetof(struct ptp_header, sequenceId));
+}
+
+static inline int8_t
+ptp_view_log_interval(struct ptp_msg_view *view)
+{
+  return (int8_t)ptp_view_u8(view, offsetof(struct ptp_header, logMessageInterval));
+}
+
+// Wire order, e.g. for copying to requestingPortIdentity
+static inline uint8_t *
+ptp_view_source_port_id(struct ptp_msg_view *view)
+{
+  return view->msg + offsetof(struct ptp_header, sourcePortIdentity);
+}
+
+#endif // __AIRPTP_PTP_DECODE_H__
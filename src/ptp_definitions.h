@@ -155,14 +155,154 @@ struct ptp_peer_signaling_message
 {
   struct ptp_header header;
   uint8_t targetPortIdentity[PTP_PORT_ID_SIZE];
-  uint8_t tlv_peer_info[43]; // TLV_MIN_SIZE + 2 * PTP_TLV_ORG_CODE_SIZE + sizeof(uint32 + uint8 + sockaddr_in6)
+  uint8_t tlv_peer_info[51]; // TLV_MIN_SIZE + 2 * PTP_TLV_ORG_CODE_SIZE + sizeof(uint32 + uint8 + sockaddr_in6 + uint32 + uint32)
 } __attribute__((packed));
 
+// Message 0x0C - our internal variant for group commands
+struct ptp_group_signaling_message
+{
+  struct ptp_header header;
+  uint8_t targetPortIdentity[PTP_PORT_ID_SIZE];
+  uint8_t tlv_group_info[52]; // TLV_MIN_SIZE + 2 * PTP_TLV_ORG_CODE_SIZE + sizeof(uint32 + uint32 + uint8 + uint8) + AIRPTP_GROUP_NAME_LEN
+} __attribute__((packed));
+
+// Message 0x0C - our internal variant for client registration
+struct ptp_client_signaling_message
+{
+  struct ptp_header header;
+  uint8_t targetPortIdentity[PTP_PORT_ID_SIZE];
+  uint8_t tlv_client_info[19]; // TLV_MIN_SIZE + 2 * PTP_TLV_ORG_CODE_SIZE + sizeof(uint32 + uint32 + uint8)
+} __attribute__((packed));
+
+// Message 0x0C - our internal variant, reply from the daemon with the result of
+// one of the above
+struct ptp_result_signaling_message
+{
+  struct ptp_header header;
+  uint8_t targetPortIdentity[PTP_PORT_ID_SIZE];
+  uint8_t tlv_result[14]; // TLV_MIN_SIZE + 2 * PTP_TLV_ORG_CODE_SIZE + sizeof(int32)
+} __attribute__((packed));
+
+// Message 0x0D, followed by a management TLV
+struct ptp_management_message
+{
+  struct ptp_header header;
+  uint8_t targetPortIdentity[PTP_PORT_ID_SIZE];
+  uint8_t startingBoundaryHops;
+  uint8_t boundaryHops;
+  uint8_t actionField; // upper 4 bits are reserved
+  uint8_t reserved;
+} __attribute__((packed));
+
+enum ptp_management_action
+{
+  PTP_MANAGEMENT_GET = 0,
+  PTP_MANAGEMENT_SET = 1,
+  PTP_MANAGEMENT_RESPONSE = 2,
+  PTP_MANAGEMENT_COMMAND = 3,
+  PTP_MANAGEMENT_ACKNOWLEDGE = 4,
+};
+
+// IEEE 1588-2008 15.5.2.3, and our own from the implementation-specific range
+enum ptp_management_id
+{
+  PTP_MANAGEMENT_NULL = 0x0000,
+  PTP_MANAGEMENT_DEFAULT_DATA_SET = 0x2000,
+  PTP_MANAGEMENT_CURRENT_DATA_SET = 0x2001,
+  PTP_MANAGEMENT_TIME_PROPERTIES_DATA_SET = 0x2003,
+  PTP_MANAGEMENT_PORT_DATA_SET = 0x2004,
+  // linuxptp uses the start of the range, so stay clear of it
+  PTP_MANAGEMENT_AIRPTP_PEER_STATS = 0xDF00,
+};
+
+enum ptp_management_error
+{
+  PTP_MANAGEMENT_ERROR_NO_SUCH_ID = 0x0002,
+  PTP_MANAGEMENT_ERROR_NOT_SUPPORTED = 0x0006,
+};
+
+// The dataField of the management TLVs, IEEE 1588-2008 15.5.3
+struct ptp_management_default_data_set
+{
+  uint8_t flags; // bit 0 is twoStepFlag, bit 1 slaveOnly
+  uint8_t reserved1;
+  uint16_t numberPorts;
+  uint8_t priority1;
+  uint8_t clockClass;
+  uint8_t clockAccuracy;
+  uint16_t offsetScaledLogVariance;
+  uint8_t priority2;
+  uint64_t clockIdentity;
+  uint8_t domainNumber;
+  uint8_t reserved2;
+} __attribute__((packed));
+
+struct ptp_management_current_data_set
+{
+  uint16_t stepsRemoved;
+  int64_t offsetFromMaster; // ns * 2^16
+  int64_t meanPathDelay; // ns * 2^16
+} __attribute__((packed));
+
+struct ptp_management_time_properties_data_set
+{
+  int16_t currentUtcOffset;
+  uint8_t flags; // same bits as the lower byte of enum ptp_flag
+  uint8_t timeSource;
+} __attribute__((packed));
+
+struct ptp_management_port_data_set
+{
+  uint8_t portIdentity[PTP_PORT_ID_SIZE];
+  uint8_t portState;
+  int8_t logMinDelayReqInterval;
+  int64_t peerMeanPathDelay; // ns * 2^16
+  int8_t logAnnounceInterval;
+  uint8_t announceReceiptTimeout;
+  int8_t logSyncInterval;
+  uint8_t delayMechanism;
+  int8_t logMinPdelayReqInterval;
+  uint8_t versionNumber;
+} __attribute__((packed));
+
+// PTP_MANAGEMENT_AIRPTP_PEER_STATS is a uint16_t count followed by this for
+// each peer, see struct airptp_peer_delay and airptp_peer_sync
+struct ptp_management_peer_stats
+{
+  uint32_t peerId;
+  uint8_t address[16]; // IPv4 as IPv4-mapped IPv6
+  uint8_t syncState; // enum airptp_sync_state
+  uint8_t reserved;
+  int64_t delayNs;
+  int64_t offsetNs;
+  int32_t driftPpb;
+  uint16_t outlierPermille;
+} __attribute__((packed));
+
+// portState in PORT_DATA_SET
+enum ptp_port_state
+{
+  PTP_PORT_STATE_MASTER = 6,
+  PTP_PORT_STATE_PASSIVE = 7,
+  PTP_PORT_STATE_UNCALIBRATED = 8,
+  PTP_PORT_STATE_SLAVE = 9,
+};
+
 #define PTP_TLV_MIN_SIZE 4 // 2 bytes type + 2 bytes length
 #define PTP_TLV_ORG_CODE_SIZE 3
+#define PTP_TLV_MANAGEMENT 0x0001
+#define PTP_TLV_MANAGEMENT_ERROR_STATUS 0x0002
 #define PTP_TLV_ORG_EXTENSION 0x0003
 #define PTP_TLV_PATH_TRACE 0x0008
 
+// The 3 byte organizationId and 3 byte organizationSubType of an org extension
+// TLV as one 48 bit key, see ptp_msg_handle.c
+#define PTP_TLV_ORG_ID_IEEE 0x0080C2
+#define PTP_TLV_ORG_ID_APPLE 0x000D93
+#define PTP_TLV_ORG_ID_OWN 0x999999
+#define PTP_TLV_ORG_KEY(org, subtype) (((uint64_t)(org) << 24) | (subtype))
+#define PTP_TLV_ORG_KEY_SIZE (2 * PTP_TLV_ORG_CODE_SIZE)
+
 enum ptp_tlv_org
 {
   PTP_TLV_ORG_IEEE = 0,
@@ -187,8 +327,13 @@ enum ptp_tlv_org_own_subtype
 {
   PTP_TLV_ORG_OWN_PEER_ADD = 0,
   PTP_TLV_ORG_OWN_PEER_DEL = 1,
+  PTP_TLV_ORG_OWN_GROUP = 2,
+  PTP_TLV_ORG_OWN_CLIENT = 3,
+  PTP_TLV_ORG_OWN_RESULT = 4,
 };
 
+struct airptp_daemon;
+
 struct ptp_tlv_org_subtype_map
 {
   int index;
@@ -206,4 +351,11 @@ struct ptp_tlv_org_map
   int n_subtypes;
 };
 
+struct ptp_tlv_org_dispatch
+{
+  uint64_t key;
+  struct ptp_tlv_org_map *org;
+  struct ptp_tlv_org_subtype_map *subtype;
+};
+
 #endif // __AIRPTP_PTP_STRUCTS_H__
@@ -24,26 +24,42 @@ SOFTWARE.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
 #include <assert.h>
+#include <poll.h>
 
 #include "airptp_internal.h"
 #include "ptp_definitions.h"
+#include "ptp_decode.h"
 #include "daemon.h"
+#include "uring.h"
+#include "timesource.h"
+#include "txtime.h"
+#include "pdelay.h"
+#include "syncq.h"
+#include "bmca.h"
+#include "slave.h"
 
 // Debugging
 #define AIRPTP_LOG_RECEIVED 0
 #define AIRPTP_LOG_SENT 0
 
+// How long a client waits for the daemon to reply to a control message
+#define AIRPTP_CTRL_REPLY_TIMEOUT_MS 500
+
 // Forward tlv handlers
 static int tlv_handle_org_subtype_generic(struct airptp_daemon *, const char *, struct ptp_tlv_org_subtype_map *, uint8_t *, size_t);
 static int tlv_handle_org_subtype_message_internal(struct airptp_daemon *, const char *, struct ptp_tlv_org_subtype_map *, uint8_t *, size_t);
 static int tlv_handle_org_subtype_peer_add(struct airptp_daemon *, const char *, struct ptp_tlv_org_subtype_map *, uint8_t *, size_t);
 static int tlv_handle_org_subtype_peer_del(struct airptp_daemon *, const char *, struct ptp_tlv_org_subtype_map *, uint8_t *, size_t);
+static int tlv_handle_org_subtype_group(struct airptp_daemon *, const char *, struct ptp_tlv_org_subtype_map *, uint8_t *, size_t);
+static int tlv_handle_org_subtype_client(struct airptp_daemon *, const char *, struct ptp_tlv_org_subtype_map *, uint8_t *, size_t);
+static void tlv_org_registered_dispatch(struct airptp_daemon *, struct ptp_msg_view *, size_t);
 
 static struct ptp_tlv_org_subtype_map ptp_tlv_ieee_subtypes[] =
 {
@@ -62,6 +78,9 @@ static struct ptp_tlv_org_subtype_map ptp_tlv_own_subtypes[] =
 {
   { PTP_TLV_ORG_OWN_PEER_ADD, { 0x00, 0x00, 0x01 }, "Add peer", tlv_handle_org_subtype_peer_add },
   { PTP_TLV_ORG_OWN_PEER_DEL, { 0x00, 0x00, 0x02 }, "Remove peer", tlv_handle_org_subtype_peer_del },
+  { PTP_TLV_ORG_OWN_GROUP, { 0x00, 0x00, 0x03 }, "Group command", tlv_handle_org_subtype_group },
+  { PTP_TLV_ORG_OWN_CLIENT, { 0x00, 0x00, 0x04 }, "Client command", tlv_handle_org_subtype_client },
+  { PTP_TLV_ORG_OWN_RESULT, { 0x00, 0x00, 0x05 }, "Command result", tlv_handle_org_subtype_generic },
 };
 
 static struct ptp_tlv_org_map ptp_tlv_orgs[] =
@@ -71,6 +90,23 @@ static struct ptp_tlv_org_map ptp_tlv_orgs[] =
   { PTP_TLV_ORG_OWN, { 0x99, 0x99, 0x99 }, "OwnTone Ltd", ptp_tlv_own_subtypes, ARRAY_SIZE(ptp_tlv_own_subtypes) },
 };
 
+// All of the above by PTP_TLV_ORG_KEY(), sorted so that an incoming TLV can be
+// found with a binary search. ptp_msg_handle_init() checks the order and that
+// the keys match the codes.
+static const struct ptp_tlv_org_dispatch ptp_tlv_org_dispatch[] =
+{
+  { PTP_TLV_ORG_KEY(PTP_TLV_ORG_ID_APPLE, 0x000001), &ptp_tlv_orgs[PTP_TLV_ORG_APPLE], &ptp_tlv_apple_subtypes[PTP_TLV_ORG_APPLE_UNKNOWN1] },
+  { PTP_TLV_ORG_KEY(PTP_TLV_ORG_ID_APPLE, 0x000004), &ptp_tlv_orgs[PTP_TLV_ORG_APPLE], &ptp_tlv_apple_subtypes[PTP_TLV_ORG_APPLE_CLOCK_ID] },
+  { PTP_TLV_ORG_KEY(PTP_TLV_ORG_ID_APPLE, 0x000005), &ptp_tlv_orgs[PTP_TLV_ORG_APPLE], &ptp_tlv_apple_subtypes[PTP_TLV_ORG_APPLE_UNKNOWN5] },
+  { PTP_TLV_ORG_KEY(PTP_TLV_ORG_ID_IEEE, 0x000001), &ptp_tlv_orgs[PTP_TLV_ORG_IEEE], &ptp_tlv_ieee_subtypes[PTP_TLV_ORG_IEEE_FOLLOW_UP_INFO] },
+  { PTP_TLV_ORG_KEY(PTP_TLV_ORG_ID_IEEE, 0x000002), &ptp_tlv_orgs[PTP_TLV_ORG_IEEE], &ptp_tlv_ieee_subtypes[PTP_TLV_ORG_IEEE_MESSAGE_INTERNAL_REQUEST] },
+  { PTP_TLV_ORG_KEY(PTP_TLV_ORG_ID_OWN, 0x000001), &ptp_tlv_orgs[PTP_TLV_ORG_OWN], &ptp_tlv_own_subtypes[PTP_TLV_ORG_OWN_PEER_ADD] },
+  { PTP_TLV_ORG_KEY(PTP_TLV_ORG_ID_OWN, 0x000002), &ptp_tlv_orgs[PTP_TLV_ORG_OWN], &ptp_tlv_own_subtypes[PTP_TLV_ORG_OWN_PEER_DEL] },
+  { PTP_TLV_ORG_KEY(PTP_TLV_ORG_ID_OWN, 0x000003), &ptp_tlv_orgs[PTP_TLV_ORG_OWN], &ptp_tlv_own_subtypes[PTP_TLV_ORG_OWN_GROUP] },
+  { PTP_TLV_ORG_KEY(PTP_TLV_ORG_ID_OWN, 0x000004), &ptp_tlv_orgs[PTP_TLV_ORG_OWN], &ptp_tlv_own_subtypes[PTP_TLV_ORG_OWN_CLIENT] },
+  { PTP_TLV_ORG_KEY(PTP_TLV_ORG_ID_OWN, 0x000005), &ptp_tlv_orgs[PTP_TLV_ORG_OWN], &ptp_tlv_own_subtypes[PTP_TLV_ORG_OWN_RESULT] },
+};
+
 
 /* --------------------------------- Helpers -------------------------------- */
 
@@ -96,19 +132,42 @@ ptp_timestamp_htobe(struct ptp_timestamp *in)
   return out;
 }
 
+// For timestamps we send, i.e. on our PTP timeline
+static inline struct ptp_timestamp
+current_time_get(struct timesource_timeline *tl)
+{
+  struct timespec now;
+  struct ptp_timestamp out;
+
+  timesource_timeline_get(tl, &now);
+  out.seconds_hi = ((uint64_t)now.tv_sec) >> 32;
+  out.seconds_low = (uint32_t)now.tv_sec;
+  out.nanoseconds = (uint32_t)now.tv_nsec;
+  return out;
+}
+
+// In the timebase, for the slave's t2 and t3, see slave.c
 static inline struct ptp_timestamp
-current_time_get(void)
+local_time_get(void)
 {
   struct timespec now;
   struct ptp_timestamp out;
 
-  clock_gettime(CLOCK_MONOTONIC, &now);
+  timesource_get(&now);
   out.seconds_hi = ((uint64_t)now.tv_sec) >> 32;
   out.seconds_low = (uint32_t)now.tv_sec;
   out.nanoseconds = (uint32_t)now.tv_nsec;
   return out;
 }
 
+static inline uint64_t
+ptp_timestamp_to_ns(struct ptp_timestamp *ts)
+{
+  uint64_t sec = ((uint64_t)ts->seconds_hi << 32) | ts->seconds_low;
+
+  return sec * 1000000000ULL + ts->nanoseconds;
+}
+
 static void
 port_id_htobe(uint8_t *out, uint8_t *in)
 {
@@ -130,25 +189,28 @@ port_set(union utils_net_sockaddr *naddr, unsigned short port)
     naddr->sin.sin_port = htons(port);
 }
 
-#if AIRPTP_LOG_RECEIVED
-static void
-log_received(const char *name, struct ptp_header *header, uint64_t clock_id, struct ptp_timestamp *ts)
+// Replies go to our own ports, unless the requester is a peer with its own, see
+// daemon_peer_port()
+static unsigned short
+reply_port_get(struct airptp_daemon *daemon, union utils_net_sockaddr *peer_addr, struct airptp_service *svc)
 {
-  uint64_t tv_sec;
-  uint32_t tv_nsec;
+  struct airptp_peer *peer = daemon_peer_find_by_addr(daemon, peer_addr);
 
-  tv_sec = ts->seconds_hi;
-  tv_sec = (tv_sec << 32);
-  tv_sec += ts->seconds_low;
-  tv_nsec = ts->nanoseconds;
+  return peer ? daemon_peer_port(daemon, &peer->naddr, svc) : svc->port;
+}
 
-  int8_t logint = header->logMessageInterval;
+#if AIRPTP_LOG_RECEIVED
+static void
+log_received(const char *name, struct ptp_msg_view *view, size_t ts_offset)
+{
+  uint64_t ts_ns = ptp_view_timestamp_ns(view, ts_offset);
 
-  airptp_logmsg("Received %s from clock %" PRIx64 ", logint=%" PRIi8 " with timestamp %" PRIu64 ".%" PRIu32, name, clock_id, logint, tv_sec, tv_nsec);
+  airptp_logmsg("Received %s from clock %" PRIx64 ", logint=%" PRIi8 " with timestamp %" PRIu64 ".%09" PRIu64,
+    name, ptp_view_clock_id(view), ptp_view_log_interval(view), ts_ns / 1000000000ULL, ts_ns % 1000000000ULL);
 }
 #else
 static void
-log_received(const char *name, struct ptp_header *header, uint64_t clock_id, struct ptp_timestamp *ts)
+log_received(const char *name, struct ptp_msg_view *view, size_t ts_offset)
 {
   return;
 }
@@ -254,28 +316,6 @@ header_init(struct ptp_header *hdr, uint8_t type, uint16_t msg_len, uint64_t clo
   hdr->logMessageInterval = log_interval;
 }
 
-static void
-header_read(struct ptp_header *hdr, uint64_t *clock_id_ptr, uint8_t *req)
-{
-  struct ptp_header *in = (struct ptp_header *)req;
-  uint64_t be64;
-  uint64_t clock_id;
-
-  memcpy(hdr, in, sizeof(struct ptp_header));
-
-  hdr->messageLength = be16toh(in->messageLength);
-  hdr->flags = be16toh(in->flags);
-  hdr->correctionField = be64toh(in->correctionField);
-  hdr->sequenceId = be16toh(in->sequenceId);
-
-  memcpy(&be64, in->sourcePortIdentity, sizeof(be64));
-  clock_id = be64toh(be64);
-  memcpy(hdr->sourcePortIdentity, &clock_id, sizeof(clock_id));
-
-  if (clock_id_ptr)
-    *clock_id_ptr = clock_id;
-}
-
 static void
 msg_tlv_write(uint8_t *tlv_dst, size_t tlv_dst_size, uint16_t type, uint16_t length, void *data)
 {
@@ -295,7 +335,7 @@ msg_tlv_write(uint8_t *tlv_dst, size_t tlv_dst_size, uint16_t type, uint16_t len
 }
 
 static void
-msg_announce_make(struct ptp_announce_message *msg, uint64_t clock_id, uint16_t sequence_id, struct ptp_timestamp ts)
+msg_announce_make(struct ptp_announce_message *msg, uint64_t clock_id, struct airptp_dataset *ds, uint16_t sequence_id, struct ptp_timestamp ts)
 {
   uint64_t be64_clock_id = htobe64(clock_id);
   // iOS sets flags to 0x0408 -> UNICAST and TIMESCALE
@@ -307,15 +347,15 @@ msg_announce_make(struct ptp_announce_message *msg, uint64_t clock_id, uint16_t
 
   msg->currentUtcOffset = 0;
   msg->reserved = 0;
-  msg->grandmasterPriority1 = 128;
+  msg->grandmasterPriority1 = ds->priority1;
 
-  // Clock quality: class=6 (GPS), accuracy=0x21 (100ns), variance=0x436A (same as used by Apple)
-  msg->grandmasterClockQuality = htobe32(0x06210000 | 0x436A);
-  msg->grandmasterPriority2 = 128;
+  // Clock quality, see bmca.c
+  msg->grandmasterClockQuality = htobe32((ds->clock_class << 24) | (ds->clock_accuracy << 16) | ds->variance);
+  msg->grandmasterPriority2 = ds->priority2;
 
-  msg->grandmasterIdentity = be64_clock_id;
+  msg->grandmasterIdentity = htobe64(ds->grandmaster_id);
 
-  msg->stepsRemoved = 0;
+  msg->stepsRemoved = htobe16(ds->steps_removed);
   msg->timeSource = 0x20; // GPS
 
   // iOS adding the clock ID again as TLV, wtf?
@@ -421,9 +461,20 @@ msg_sync_follow_up_make(struct ptp_follow_up_message *msg, uint64_t clock_id, ui
   msg_tlv_write(msg->tlv_apple2, sizeof(msg->tlv_apple2), PTP_TLV_ORG_EXTENSION, sizeof(apple_val2), apple_val2);
 }
 
+static void
+msg_delay_req_make(struct ptp_delay_req_message *msg, uint64_t clock_id, uint16_t sequence_id, struct ptp_timestamp ts)
+{
+  uint16_t flags = PTP_FLAG_UNICAST | PTP_FLAG_TIMESCALE;
+
+  // logMessageInterval is 0x7F for Delay_Req
+  header_init(&msg->header, PTP_MSGTYPE_DELAY_REQ, sizeof(struct ptp_delay_req_message), clock_id, sequence_id, 0x7F, flags);
+
+  msg->originTimestamp = ptp_timestamp_htobe(&ts);
+}
+
 static void
 msg_delay_resp_make(struct ptp_delay_resp_message *msg,
- uint64_t clock_id, uint16_t sequence_id, struct ptp_header *req_header, struct ptp_timestamp ts)
+ uint64_t clock_id, uint16_t sequence_id, uint8_t *requesting_port_id, struct ptp_timestamp ts)
 {
   // iOS sets flags to 0x0608 -> UNICAST and TIMESCALE and TWO_STEP
   uint16_t flags = PTP_FLAG_UNICAST | PTP_FLAG_TIMESCALE | PTP_FLAG_TWO_STEP;
@@ -432,13 +483,25 @@ msg_delay_resp_make(struct ptp_delay_resp_message *msg,
 
   msg->receiveTimestamp = ptp_timestamp_htobe(&ts);
 
-  port_id_htobe(msg->requestingPortIdentity, req_header->sourcePortIdentity);
+  memcpy(msg->requestingPortIdentity, requesting_port_id, PTP_PORT_ID_SIZE);
+}
+
+static void
+msg_pdelay_req_make(struct ptp_pdelay_req_message *msg, uint64_t clock_id, uint16_t sequence_id, struct ptp_timestamp ts)
+{
+  uint16_t flags = PTP_FLAG_UNICAST | PTP_FLAG_TIMESCALE;
+
+  memset(msg, 0, sizeof(struct ptp_pdelay_req_message));
+
+  header_init(&msg->header, PTP_MSGTYPE_PDELAY_REQ, sizeof(struct ptp_pdelay_req_message), clock_id, sequence_id, AIRPTP_LOGMESSAGEINT_SYNC, flags);
+
+  msg->originTimestamp = ptp_timestamp_htobe(&ts);
 }
 
 // Haven't seen these messages from iOS, so the implementation is a guess
 static void
 msg_pdelay_resp_make(struct ptp_pdelay_resp_message *msg,
- uint64_t clock_id, uint16_t sequence_id, struct ptp_header *req_header, struct ptp_timestamp ts)
+ uint64_t clock_id, uint16_t sequence_id, uint8_t *requesting_port_id, struct ptp_timestamp ts)
 {
   uint16_t flags = PTP_FLAG_UNICAST | PTP_FLAG_TIMESCALE | PTP_FLAG_TWO_STEP;
 
@@ -446,13 +509,13 @@ msg_pdelay_resp_make(struct ptp_pdelay_resp_message *msg,
 
   msg->requestReceiptTimestamp = ptp_timestamp_htobe(&ts);
 
-  port_id_htobe(msg->requestingPortIdentity, req_header->sourcePortIdentity);
+  memcpy(msg->requestingPortIdentity, requesting_port_id, PTP_PORT_ID_SIZE);
 }
 
 // Haven't seen these messages from iOS, so the implementation is a guess
 static void
 msg_pdelay_resp_follow_up_make(struct ptp_pdelay_resp_follow_up_message *msg,
- uint64_t clock_id, uint16_t sequence_id, struct ptp_header *req_header, struct ptp_timestamp ts)
+ uint64_t clock_id, uint16_t sequence_id, uint8_t *requesting_port_id, struct ptp_timestamp ts)
 {
   uint16_t flags = PTP_FLAG_UNICAST | PTP_FLAG_TIMESCALE;
 
@@ -460,14 +523,16 @@ msg_pdelay_resp_follow_up_make(struct ptp_pdelay_resp_follow_up_message *msg,
 
   msg->responseOriginTimestamp = ptp_timestamp_htobe(&ts);
 
-  port_id_htobe(msg->requestingPortIdentity, req_header->sourcePortIdentity);
+  memcpy(msg->requestingPortIdentity, requesting_port_id, PTP_PORT_ID_SIZE);
 }
 
 static void
-msg_peer_add_make(struct ptp_peer_signaling_message *msg, struct airptp_peer *peer, uint64_t clock_id)
+msg_peer_add_make(struct ptp_peer_signaling_message *msg, struct airptp_peer *peer, uint32_t client_id, uint32_t group_id, uint64_t clock_id)
 {
   uint8_t peerinfo[sizeof(msg->tlv_peer_info) - 4] = { 0 };
   uint32_t be32_peer_id = htobe32(peer->id);
+  uint32_t be32_group_id = htobe32(group_id);
+  uint32_t be32_client_id = htobe32(client_id);
   uint8_t addr_len = peer->naddr_len;
   uint8_t *ptr;
 
@@ -487,14 +552,19 @@ msg_peer_add_make(struct ptp_peer_signaling_message *msg, struct airptp_peer *pe
   memcpy(ptr, &addr_len, sizeof(addr_len));
   ptr += sizeof(addr_len); // 1
   memcpy(ptr, &peer->naddr, addr_len);
+  ptr += addr_len; // Max 28
+  memcpy(ptr, &be32_group_id, sizeof(be32_group_id));
+  ptr += sizeof(be32_group_id); // 4
+  memcpy(ptr, &be32_client_id, sizeof(be32_client_id));
   msg_tlv_write(msg->tlv_peer_info, sizeof(msg->tlv_peer_info), PTP_TLV_ORG_EXTENSION, sizeof(peerinfo), peerinfo);
 }
 
 static void
-msg_peer_del_make(struct ptp_peer_signaling_message *msg, struct airptp_peer *peer, uint64_t clock_id)
+msg_peer_del_make(struct ptp_peer_signaling_message *msg, struct airptp_peer *peer, uint32_t client_id, uint64_t clock_id)
 {
   uint8_t peerinfo[sizeof(msg->tlv_peer_info) - 4] = { 0 };
   uint32_t be32_peer_id = htobe32(peer->id);
+  uint32_t be32_client_id = htobe32(client_id);
   uint8_t *ptr;
 
   header_init(&msg->header, PTP_MSGTYPE_SIGNALING, sizeof(struct ptp_peer_signaling_message), clock_id, 0, 0, PTP_FLAG_UNICAST);
@@ -507,102 +577,201 @@ msg_peer_del_make(struct ptp_peer_signaling_message *msg, struct airptp_peer *pe
   memcpy(ptr, ptp_tlv_own_subtypes[PTP_TLV_ORG_OWN_PEER_DEL].code, PTP_TLV_ORG_CODE_SIZE); // Delete
   ptr += PTP_TLV_ORG_CODE_SIZE; // 3
   memcpy(ptr, &be32_peer_id, sizeof(be32_peer_id));
+  ptr += sizeof(be32_peer_id); // 4
+  memcpy(ptr, &be32_client_id, sizeof(be32_client_id));
   msg_tlv_write(msg->tlv_peer_info, sizeof(msg->tlv_peer_info), PTP_TLV_ORG_EXTENSION, sizeof(peerinfo), peerinfo);
 }
 
+static void
+msg_group_make(struct ptp_group_signaling_message *msg, struct airptp_group *group, enum airptp_group_cmd cmd, uint64_t clock_id)
+{
+  uint8_t groupinfo[sizeof(msg->tlv_group_info) - 4] = { 0 };
+  uint32_t be32_owner_id = htobe32(group->owner_id);
+  uint32_t be32_group_id = htobe32(group->id);
+  uint8_t cmd_byte = cmd;
+  uint8_t *ptr;
+
+  header_init(&msg->header, PTP_MSGTYPE_SIGNALING, sizeof(struct ptp_group_signaling_message), clock_id, 0, 0, PTP_FLAG_UNICAST);
+
+  memset(msg->targetPortIdentity, 0, PTP_PORT_ID_SIZE);
+
+  ptr = groupinfo;
+  memcpy(ptr, ptp_tlv_orgs[PTP_TLV_ORG_OWN].code, PTP_TLV_ORG_CODE_SIZE);
+  ptr += PTP_TLV_ORG_CODE_SIZE; // 3
+  memcpy(ptr, ptp_tlv_own_subtypes[PTP_TLV_ORG_OWN_GROUP].code, PTP_TLV_ORG_CODE_SIZE);
+  ptr += PTP_TLV_ORG_CODE_SIZE; // 3
+  memcpy(ptr, &be32_owner_id, sizeof(be32_owner_id));
+  ptr += sizeof(be32_owner_id); // 4
+  memcpy(ptr, &be32_group_id, sizeof(be32_group_id));
+  ptr += sizeof(be32_group_id); // 4
+  memcpy(ptr, &cmd_byte, sizeof(cmd_byte));
+  ptr += sizeof(cmd_byte); // 1
+  memcpy(ptr, &group->priority, sizeof(group->priority));
+  ptr += sizeof(group->priority); // 1
+  memcpy(ptr, group->name, strnlen(group->name, AIRPTP_GROUP_NAME_LEN - 1));
+  msg_tlv_write(msg->tlv_group_info, sizeof(msg->tlv_group_info), PTP_TLV_ORG_EXTENSION, sizeof(groupinfo), groupinfo);
+}
+
+static void
+msg_client_make(struct ptp_client_signaling_message *msg, struct airptp_client *client, enum airptp_client_cmd cmd, uint64_t clock_id)
+{
+  uint8_t clientinfo[sizeof(msg->tlv_client_info) - 4] = { 0 };
+  uint32_t be32_client_id = htobe32(client->id);
+  uint32_t be32_pid = htobe32(client->pid);
+  uint8_t cmd_byte = cmd;
+  uint8_t *ptr;
+
+  header_init(&msg->header, PTP_MSGTYPE_SIGNALING, sizeof(struct ptp_client_signaling_message), clock_id, 0, 0, PTP_FLAG_UNICAST);
+
+  memset(msg->targetPortIdentity, 0, PTP_PORT_ID_SIZE);
+
+  ptr = clientinfo;
+  memcpy(ptr, ptp_tlv_orgs[PTP_TLV_ORG_OWN].code, PTP_TLV_ORG_CODE_SIZE);
+  ptr += PTP_TLV_ORG_CODE_SIZE; // 3
+  memcpy(ptr, ptp_tlv_own_subtypes[PTP_TLV_ORG_OWN_CLIENT].code, PTP_TLV_ORG_CODE_SIZE);
+  ptr += PTP_TLV_ORG_CODE_SIZE; // 3
+  memcpy(ptr, &be32_client_id, sizeof(be32_client_id));
+  ptr += sizeof(be32_client_id); // 4
+  memcpy(ptr, &be32_pid, sizeof(be32_pid));
+  ptr += sizeof(be32_pid); // 4
+  memcpy(ptr, &cmd_byte, sizeof(cmd_byte));
+  msg_tlv_write(msg->tlv_client_info, sizeof(msg->tlv_client_info), PTP_TLV_ORG_EXTENSION, sizeof(clientinfo), clientinfo);
+}
+
+static void
+msg_result_make(struct ptp_result_signaling_message *msg, uint64_t clock_id, uint16_t sequence_id, int32_t result)
+{
+  uint8_t resultinfo[sizeof(msg->tlv_result) - 4] = { 0 };
+  uint32_t be32_result = htobe32((uint32_t)result);
+  uint8_t *ptr;
+
+  header_init(&msg->header, PTP_MSGTYPE_SIGNALING, sizeof(struct ptp_result_signaling_message), clock_id, sequence_id, 0, PTP_FLAG_UNICAST);
+
+  memset(msg->targetPortIdentity, 0, PTP_PORT_ID_SIZE);
+
+  ptr = resultinfo;
+  memcpy(ptr, ptp_tlv_orgs[PTP_TLV_ORG_OWN].code, PTP_TLV_ORG_CODE_SIZE);
+  ptr += PTP_TLV_ORG_CODE_SIZE; // 3
+  memcpy(ptr, ptp_tlv_own_subtypes[PTP_TLV_ORG_OWN_RESULT].code, PTP_TLV_ORG_CODE_SIZE);
+  ptr += PTP_TLV_ORG_CODE_SIZE; // 3
+  memcpy(ptr, &be32_result, sizeof(be32_result));
+  msg_tlv_write(msg->tlv_result, sizeof(msg->tlv_result), PTP_TLV_ORG_EXTENSION, sizeof(resultinfo), resultinfo);
+}
+
 
 /* ------------------------ Incoming message handling ----------------------- */
 
 static void
-sync_handle(struct airptp_daemon *daemon, uint8_t *req, ssize_t req_len, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
+sync_handle(struct airptp_daemon *daemon, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
 {
-  struct ptp_sync_message *in = (struct ptp_sync_message *)req;
-  struct ptp_sync_message sync = { 0 };
-  uint64_t clock_id;
+  struct ptp_timestamp t2;
+  uint64_t t1_ns;
 
-  if (req_len < sizeof(struct ptp_sync_message))
-    return;
+  t2 = local_time_get();
 
-  header_read(&sync.header, &clock_id, req);
-  sync.originTimestamp = ptp_timestamp_betoh(&in->originTimestamp);
+  log_received("Sync", view, offsetof(struct ptp_sync_message, originTimestamp));
 
-  log_received("Sync", &sync.header, clock_id, &sync.originTimestamp);
+  t1_ns = (ptp_view_flags(view) & PTP_FLAG_TWO_STEP) ? 0 : ptp_view_timestamp_ns(view, offsetof(struct ptp_sync_message, originTimestamp));
+  slave_sync_received(daemon, ptp_view_clock_id(view), peer_addr, ptp_view_sequence_id(view), t1_ns, ptp_timestamp_to_ns(&t2), ptp_view_correction_ns(view));
 }
 
+// Other masters don't add Apple's TLVs, so they are not required
 static void
-follow_up_handle(struct airptp_daemon *daemon, uint8_t *req, ssize_t req_len, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
+follow_up_handle(struct airptp_daemon *daemon, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
 {
-  struct ptp_follow_up_message *in = (struct ptp_follow_up_message *)req;
-  struct ptp_follow_up_message follow_up = { 0 };
-  uint64_t clock_id;
+  size_t ts_offset = offsetof(struct ptp_follow_up_message, preciseOriginTimestamp);
 
-  if (req_len < sizeof(struct ptp_follow_up_message))
-    return;
+  log_received("Follow Up", view, ts_offset);
 
-  header_read(&follow_up.header, &clock_id, req);
-  follow_up.preciseOriginTimestamp = ptp_timestamp_betoh(&in->preciseOriginTimestamp);
+  slave_follow_up_received(daemon, ptp_view_clock_id(view), ptp_view_sequence_id(view), ptp_view_timestamp_ns(view, ts_offset), ptp_view_correction_ns(view));
 
-  log_received("Follow Up", &follow_up.header, clock_id, &follow_up.preciseOriginTimestamp);
+  tlv_org_registered_dispatch(daemon, view, offsetof(struct ptp_follow_up_message, tlv_apple1));
 }
 
+// Answer to our Delay_Req when following a master, see slave.c
 static void
-delay_msg_handle(struct airptp_daemon *daemon, uint8_t *req, ssize_t req_len, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
+delay_resp_handle(struct airptp_daemon *daemon, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
 {
-  struct ptp_delay_req_message *in = (struct ptp_delay_req_message *)req;
-  struct ptp_delay_req_message delay_req = { 0 };
-  uint64_t clock_id;
-  struct ptp_delay_resp_message	delay_resp;
-  struct ptp_timestamp ts;
-  ssize_t len;
+  size_t ts_offset = offsetof(struct ptp_delay_resp_message, receiveTimestamp);
 
-  if (req_len < sizeof(struct ptp_delay_req_message))
+  if (ptp_view_u64(view, offsetof(struct ptp_delay_resp_message, requestingPortIdentity)) != daemon->clock_id)
     return;
 
-  header_read(&delay_req.header, &clock_id, req);
-  delay_req.originTimestamp = ptp_timestamp_betoh(&in->originTimestamp);
+  log_received("Delay Resp", view, ts_offset);
 
-  log_received("Delay Req", &delay_req.header, clock_id, &delay_req.originTimestamp);
+  slave_delay_resp_received(daemon, ptp_view_clock_id(view), ptp_view_sequence_id(view), ptp_view_timestamp_ns(view, ts_offset), ptp_view_correction_ns(view));
+}
 
-  ts = current_time_get();
-  msg_delay_resp_make(&delay_resp, daemon->clock_id, delay_req.header.sequenceId, &delay_req.header, ts);
+// Also called by the rx workers, so must only use what is passed
+uint64_t
+ptp_msg_delay_req_handle(struct airptp_service *general_svc, uint64_t our_clock_id, struct timesource_timeline *tl, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, unsigned short resp_port)
+{
+  struct ptp_delay_resp_message	delay_resp;
+  struct ptp_timestamp ts;
+  ssize_t len;
+
+  log_received("Delay Req", view, offsetof(struct ptp_delay_req_message, originTimestamp));
+
+  ts = current_time_get(tl);
+  msg_delay_resp_make(&delay_resp, our_clock_id, ptp_view_sequence_id(view), ptp_view_source_port_id(view), ts);
 
-  port_set(peer_addr, daemon->general_svc.port);
-  len = utils_net_sendto(&daemon->general_svc.socket, &delay_resp, sizeof(delay_resp), peer_addr);
+  port_set(peer_addr, resp_port);
+  len = utils_net_sendto(&general_svc->socket, &delay_resp, sizeof(delay_resp), peer_addr);
   if (len != sizeof(delay_resp))
     airptp_logmsg("Incomplete send of struct ptp_pdelay_resp_follow_up_message");
 
-  log_sent((uint8_t *)&delay_resp, daemon->general_svc.port);
+  log_sent((uint8_t *)&delay_resp, general_svc->port);
+
+  return ptp_timestamp_to_ns(&ts);
 }
 
-// Since we are announcing ourselves as a very precise clock we always expect to
-// become master clock. Given that assumption holds true, we can just ignore
-// other announcements.
-static void
-announce_handle(struct airptp_daemon *daemon, uint8_t *req, ssize_t req_len, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
+void
+ptp_msg_delay_req_track(struct airptp_daemon *daemon, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, uint64_t rx_ns)
 {
-#if AIRPTP_LOG_RECEIVED
-  struct ptp_announce_message *in = (struct ptp_announce_message *)req;
-  struct ptp_announce_message announce = { 0 };
-  uint64_t clock_id;
+  struct airptp_peer *peer;
 
-  if (req_len < sizeof(struct ptp_announce_message))
+  peer = daemon_peer_find_by_addr(daemon, peer_addr);
+  if (!peer)
     return;
 
-  memcpy(&announce, req, sizeof(struct ptp_announce_message));
+  syncq_sample_add(daemon, peer, ptp_view_timestamp_ns(view, offsetof(struct ptp_delay_req_message, originTimestamp)), rx_ns);
+  daemon_event_publish(daemon, AIRPTP_EVENT_DELAY_REQ, peer->id, ptp_view_clock_id(view), 0);
+}
+
+static void
+delay_msg_handle(struct airptp_daemon *daemon, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
+{
+  uint64_t rx_ns;
+
+  rx_ns = ptp_msg_delay_req_handle(&daemon->general_svc, daemon->clock_id, &daemon->ts_timeline, view, peer_addr, reply_port_get(daemon, peer_addr, &daemon->general_svc));
+  if (rx_ns)
+    ptp_msg_delay_req_track(daemon, view, peer_addr, rx_ns);
+}
 
-  header_read(&announce.header, &clock_id, req);
+// Other masters are compared to us by the BMCA, see bmca.c
+static void
+announce_handle(struct airptp_daemon *daemon, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
+{
+  struct airptp_dataset ds;
+  uint64_t clock_id;
+  uint32_t quality;
+
+  clock_id = ptp_view_clock_id(view);
 
-  announce.grandmasterIdentity = be64toh(in->grandmasterIdentity);
-  announce.grandmasterClockQuality = be32toh(in->grandmasterClockQuality);
-  announce.stepsRemoved = be16toh(in->stepsRemoved);
-  announce.currentUtcOffset = be16toh(in->currentUtcOffset);
+  quality = ptp_view_u32(view, offsetof(struct ptp_announce_message, grandmasterClockQuality));
+  ds.priority1 = ptp_view_u8(view, offsetof(struct ptp_announce_message, grandmasterPriority1));
+  ds.clock_class = (quality >> 24) & 0xFF;
+  ds.clock_accuracy = (quality >> 16) & 0xFF;
+  ds.variance = quality & 0xFFFF;
+  ds.priority2 = ptp_view_u8(view, offsetof(struct ptp_announce_message, grandmasterPriority2));
+  ds.grandmaster_id = ptp_view_u64(view, offsetof(struct ptp_announce_message, grandmasterIdentity));
+  ds.steps_removed = ptp_view_u16(view, offsetof(struct ptp_announce_message, stepsRemoved));
 
-  uint8_t clock_class = (announce.grandmasterClockQuality >> 24) & 0xFF;
-  uint8_t clock_accuracy = (announce.grandmasterClockQuality >> 16) & 0xFF;
-//  uint16_t offset_scaled_log_variance = announce.grandmasterClockQuality & 0xFFFF;
+  bmca_announce_received(daemon, clock_id, &ds, ptp_view_log_interval(view), peer_addr);
 
+#if AIRPTP_LOG_RECEIVED
   const char *time_source_str;
-  switch (announce.timeSource) {
+  switch (ptp_view_u8(view, offsetof(struct ptp_announce_message, timeSource))) {
     case 0x10: time_source_str = "ATOMIC_CLOCK"; break;
     case 0x20: time_source_str = "GPS"; break;
     case 0x30: time_source_str = "TERRESTRIAL_RADIO"; break;
@@ -616,56 +785,44 @@ announce_handle(struct airptp_daemon *daemon, uint8_t *req, ssize_t req_len, uni
 
   // Determine clock class description
   const char *clock_class_desc;
-  if (clock_class == 6) clock_class_desc = "Primary reference (GPS sync)";
-  else if (clock_class == 7) clock_class_desc = "Primary reference";
-  else if (clock_class >= 13 && clock_class <= 58) clock_class_desc = "Application-specific";
-  else if (clock_class >= 187 && clock_class <= 193) clock_class_desc = "Degraded";
-  else if (clock_class == 248) clock_class_desc = "Default";
-  else if (clock_class == 255) clock_class_desc = "Slave-only";
+  if (ds.clock_class == 6) clock_class_desc = "Primary reference (GPS sync)";
+  else if (ds.clock_class == 7) clock_class_desc = "Primary reference";
+  else if (ds.clock_class >= 13 && ds.clock_class <= 58) clock_class_desc = "Application-specific";
+  else if (ds.clock_class >= 187 && ds.clock_class <= 193) clock_class_desc = "Degraded";
+  else if (ds.clock_class == 248) clock_class_desc = "Default";
+  else if (ds.clock_class == 255) clock_class_desc = "Slave-only";
   else clock_class_desc = "Reserved";
 
-  int8_t logint = announce.header.logMessageInterval;
+  int8_t logint = ptp_view_log_interval(view);
 
   airptp_logmsg("Recevied Announce message from %" PRIx64 ", gm %" PRIx64 ", p1=%u p2=%u, src=%s, class=%u (%s), acc=0x%02X, logint=%" PRIi8,
-    clock_id, announce.grandmasterIdentity, announce.grandmasterPriority1, announce.grandmasterPriority2, time_source_str, clock_class, clock_class_desc, clock_accuracy, logint);
-
-/*
-    printf("  Offset Scaled Log Variance: 0x%04X\n", offset_scaled_log_variance);
-    printf("  Steps Removed: %u\n", steps_removed);
-    printf("  Time Source: 0x%02X (%s)\n", time_source, time_source_str);
-    printf("  UTC Offset: %d seconds\n", utc_offset);
-*/
+    clock_id, ds.grandmaster_id, ds.priority1, ds.priority2, time_source_str, ds.clock_class, clock_class_desc, ds.clock_accuracy, logint);
 #endif
 }
 
 static void
-pdelay_msg_handle(struct airptp_daemon *daemon, uint8_t *req, ssize_t req_len, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
+pdelay_msg_handle(struct airptp_daemon *daemon, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
 {
-  struct ptp_header header;
   struct ptp_pdelay_resp_message resp;
   struct ptp_pdelay_resp_follow_up_message followup;
   struct ptp_timestamp ts;
+  uint16_t sequence_id = ptp_view_sequence_id(view);
   ssize_t len;
 
-  if (req_len < sizeof(struct ptp_header))
-    return;
-
-  header_read(&header, NULL, req);
-
-  ts = current_time_get();
-  msg_pdelay_resp_make(&resp, daemon->clock_id, header.sequenceId, &header, ts);
+  ts = current_time_get(&daemon->ts_timeline);
+  msg_pdelay_resp_make(&resp, daemon->clock_id, sequence_id, ptp_view_source_port_id(view), ts);
 
-  port_set(peer_addr, daemon->event_svc.port);
+  port_set(peer_addr, reply_port_get(daemon, peer_addr, &daemon->event_svc));
   len = utils_net_sendto(&daemon->event_svc.socket, &resp, sizeof(resp), peer_addr);
   if (len != sizeof(resp))
     airptp_logmsg("Incomplete send of struct ptp_pdelay_resp_message");
 
   log_sent((uint8_t *)&resp, daemon->event_svc.port);
 
-  ts = current_time_get();
-  msg_pdelay_resp_follow_up_make(&followup, daemon->clock_id, header.sequenceId, &header, ts);
+  ts = current_time_get(&daemon->ts_timeline);
+  msg_pdelay_resp_follow_up_make(&followup, daemon->clock_id, sequence_id, ptp_view_source_port_id(view), ts);
 
-  port_set(peer_addr, daemon->general_svc.port);
+  port_set(peer_addr, reply_port_get(daemon, peer_addr, &daemon->general_svc));
   len = utils_net_sendto(&daemon->general_svc.socket, &followup, sizeof(followup), peer_addr);
   if (len != sizeof(followup))
     airptp_logmsg("Incomplete send of struct ptp_pdelay_resp_follow_up_message");
@@ -673,6 +830,46 @@ pdelay_msg_handle(struct airptp_daemon *daemon, uint8_t *req, ssize_t req_len, u
   log_sent((uint8_t *)&followup, daemon->general_svc.port);
 }
 
+// Responses to our own Pdelay_Req, see pdelay.c. The requesting port identity
+// tells us whether it was us who asked.
+static struct airptp_peer *
+pdelay_resp_peer_get(struct airptp_daemon *daemon, uint64_t requesting_clock_id, union utils_net_sockaddr *peer_addr)
+{
+  if (requesting_clock_id != daemon->clock_id)
+    return NULL;
+
+  return daemon_peer_find_by_addr(daemon, peer_addr);
+}
+
+static void
+pdelay_resp_handle(struct airptp_daemon *daemon, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
+{
+  struct ptp_timestamp t4;
+  struct airptp_peer *peer;
+
+  t4 = current_time_get(&daemon->ts_timeline);
+
+  peer = pdelay_resp_peer_get(daemon, ptp_view_u64(view, offsetof(struct ptp_pdelay_resp_message, requestingPortIdentity)), peer_addr);
+  if (!peer)
+    return;
+
+  pdelay_resp_received(daemon, peer, ptp_view_sequence_id(view), ptp_view_timestamp_ns(view, offsetof(struct ptp_pdelay_resp_message, requestReceiptTimestamp)),
+    ptp_timestamp_to_ns(&t4), ptp_view_correction_ns(view), ptp_view_flags(view) & PTP_FLAG_TWO_STEP);
+}
+
+static void
+pdelay_resp_follow_up_handle(struct airptp_daemon *daemon, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
+{
+  struct airptp_peer *peer;
+
+  peer = pdelay_resp_peer_get(daemon, ptp_view_u64(view, offsetof(struct ptp_pdelay_resp_follow_up_message, requestingPortIdentity)), peer_addr);
+  if (!peer)
+    return;
+
+  pdelay_resp_follow_up_received(daemon, peer, ptp_view_sequence_id(view),
+    ptp_view_timestamp_ns(view, offsetof(struct ptp_pdelay_resp_follow_up_message, responseOriginTimestamp)), ptp_view_correction_ns(view));
+}
+
 static int
 tlv_handle_org_subtype_generic(struct airptp_daemon *daemon, const char *org, struct ptp_tlv_org_subtype_map *subtype, uint8_t *data, size_t len)
 {
@@ -694,6 +891,8 @@ static int
 tlv_handle_org_subtype_peer_add(struct airptp_daemon *daemon, const char *org, struct ptp_tlv_org_subtype_map *subtype, uint8_t *data, size_t len)
 {
   uint32_t be32_peer_id;
+  uint32_t be32_group_id;
+  uint32_t be32_client_id;
   uint8_t addr_len;
   struct airptp_peer peer = { 0 };
   uint8_t *ptr;
@@ -707,71 +906,190 @@ tlv_handle_org_subtype_peer_add(struct airptp_daemon *daemon, const char *org, s
   memcpy(&addr_len, ptr, sizeof(addr_len));
   ptr += sizeof(addr_len);
 
-  if (len < (ptr - data) + addr_len)
+  if (len < (ptr - data) + addr_len + sizeof(be32_group_id) + sizeof(be32_client_id))
+    goto error;
+
+  if (addr_len > sizeof(peer.naddr))
     goto error;
 
   memcpy(&peer.naddr, ptr, addr_len);
+  ptr += addr_len;
+  memcpy(&be32_group_id, ptr, sizeof(be32_group_id));
+  ptr += sizeof(be32_group_id);
+  memcpy(&be32_client_id, ptr, sizeof(be32_client_id));
   peer.id = be32toh(be32_peer_id);
   peer.naddr_len = addr_len;
 
-  daemon_peer_add(daemon, &peer);
-  return 0;
+  return daemon_peer_add(daemon, &peer, be32toh(be32_client_id), be32toh(be32_group_id));
 
  error:
-  return -1;
+  return AIRPTP_ERR_INVALID;
 }
 
 static int
 tlv_handle_org_subtype_peer_del(struct airptp_daemon *daemon, const char *org, struct ptp_tlv_org_subtype_map *subtype, uint8_t *data, size_t len)
 {
   uint32_t be32_peer_id;
+  uint32_t be32_client_id;
   struct airptp_peer peer = { 0 };
 
-  if (len < sizeof(be32_peer_id))
+  if (len < sizeof(be32_peer_id) + sizeof(be32_client_id))
     goto error;
 
   memcpy(&be32_peer_id, data, sizeof(be32_peer_id));
+  memcpy(&be32_client_id, data + sizeof(be32_peer_id), sizeof(be32_client_id));
 
   peer.id = be32toh(be32_peer_id);
 
-  daemon_peer_del(daemon, &peer);
-  return 0;
+  return daemon_peer_del(daemon, &peer, be32toh(be32_client_id));
 
  error:
-  return -1;
+  return AIRPTP_ERR_INVALID;
 }
 
 static int
-tlv_handle_org_extension(struct airptp_daemon *daemon, uint8_t *data, uint16_t len)
+tlv_handle_org_subtype_group(struct airptp_daemon *daemon, const char *org, struct ptp_tlv_org_subtype_map *subtype, uint8_t *data, size_t len)
 {
-  uint8_t orgcode[PTP_TLV_ORG_CODE_SIZE];
-  uint8_t subtype[PTP_TLV_ORG_CODE_SIZE];
-  uint16_t offset = sizeof(orgcode) + sizeof(subtype);
-  struct ptp_tlv_org_map *org;
+  uint32_t be32_owner_id;
+  uint32_t be32_group_id;
+  uint8_t cmd;
+  struct airptp_group group = { 0 };
+  uint8_t *ptr;
 
-  if (len < offset)
-    return -1;
+  if (len < sizeof(be32_owner_id) + sizeof(be32_group_id) + sizeof(cmd) + sizeof(group.priority) + AIRPTP_GROUP_NAME_LEN)
+    goto error;
 
-  memcpy(orgcode, data, PTP_TLV_ORG_CODE_SIZE);
-  memcpy(subtype, data + PTP_TLV_ORG_CODE_SIZE, PTP_TLV_ORG_CODE_SIZE);
+  ptr = data;
+  memcpy(&be32_owner_id, ptr, sizeof(be32_owner_id));
+  ptr += sizeof(be32_owner_id);
+  memcpy(&be32_group_id, ptr, sizeof(be32_group_id));
+  ptr += sizeof(be32_group_id);
+  memcpy(&cmd, ptr, sizeof(cmd));
+  ptr += sizeof(cmd);
+  memcpy(&group.priority, ptr, sizeof(group.priority));
+  ptr += sizeof(group.priority);
+  memcpy(group.name, ptr, AIRPTP_GROUP_NAME_LEN - 1);
 
-  for (int i = 0; i < ARRAY_SIZE(ptp_tlv_orgs); i++)
-    {
-      org = &ptp_tlv_orgs[i];
+  group.owner_id = be32toh(be32_owner_id);
+  group.id = be32toh(be32_group_id);
 
-      if (memcmp(orgcode, org->code, PTP_TLV_ORG_CODE_SIZE) != 0)
-	continue;
+  return daemon_group_command(daemon, &group, cmd);
 
-      for (int j = 0; j < org->n_subtypes; j++)
-	{
-	  if (memcmp(subtype, org->subtypes[j].code, PTP_TLV_ORG_CODE_SIZE) != 0)
-	    continue;
+ error:
+  return AIRPTP_ERR_INVALID;
+}
 
-	  return org->subtypes[j].handler(daemon, org->name, &org->subtypes[j], data + offset, len - offset);
-	}
+static int
+tlv_handle_org_subtype_client(struct airptp_daemon *daemon, const char *org, struct ptp_tlv_org_subtype_map *subtype, uint8_t *data, size_t len)
+{
+  uint32_t be32_client_id;
+  uint32_t be32_pid;
+  uint8_t cmd;
+  struct airptp_client client = { 0 };
+  uint8_t *ptr;
+
+  if (len < sizeof(be32_client_id) + sizeof(be32_pid) + sizeof(cmd))
+    return AIRPTP_ERR_INVALID;
+
+  ptr = data;
+  memcpy(&be32_client_id, ptr, sizeof(be32_client_id));
+  ptr += sizeof(be32_client_id);
+  memcpy(&be32_pid, ptr, sizeof(be32_pid));
+  ptr += sizeof(be32_pid);
+  memcpy(&cmd, ptr, sizeof(cmd));
+
+  client.id = be32toh(be32_client_id);
+  client.pid = (pid_t)be32toh(be32_pid);
+
+  return daemon_client_command(daemon, &client, cmd);
+}
+
+// The org and subtype codes at the start of an org extension TLV
+static uint64_t
+tlv_org_key_read(uint8_t *data)
+{
+  uint64_t key = 0;
+  int i;
+
+  for (i = 0; i < PTP_TLV_ORG_KEY_SIZE; i++)
+    key = (key << 8) | data[i];
+
+  return key;
+}
+
+static int
+tlv_org_dispatch_cmp(const void *key, const void *entry)
+{
+  uint64_t a = *(const uint64_t *)key;
+  uint64_t b = ((const struct ptp_tlv_org_dispatch *)entry)->key;
+
+  return (a > b) - (a < b);
+}
+
+static int
+tlv_org_handler_cmp(const void *key, const void *entry)
+{
+  uint64_t a = *(const uint64_t *)key;
+  uint64_t b = ((const struct airptp_tlv_handler *)entry)->key;
+
+  return (a > b) - (a < b);
+}
+
+// Calls the handler the embedder registered for the TLV, returns false if there
+// is none
+static bool
+tlv_org_registered_call(struct airptp_daemon *daemon, struct ptp_msg_view *view, uint64_t key, uint8_t *data, size_t len)
+{
+  struct airptp_daemon_config *config = &daemon->config;
+  struct airptp_tlv_handler *handler;
+
+  if (config->num_tlv_handlers == 0)
+    return false;
+
+  handler = bsearch(&key, config->tlv_handlers, config->num_tlv_handlers, sizeof(struct airptp_tlv_handler), tlv_org_handler_cmp);
+  if (!handler)
+    return false;
+
+  handler->cb(key >> 24, key & 0xFFFFFF, ptp_view_clock_id(view), data, len, handler->arg);
+  return true;
+}
+
+// For messages where we don't handle the TLVs ourselves, e.g. Follow_Up
+static void
+tlv_org_registered_dispatch(struct airptp_daemon *daemon, struct ptp_msg_view *view, size_t offset)
+{
+  struct ptp_tlv_view tlv;
+
+  if (daemon->config.num_tlv_handlers == 0)
+    return;
+
+  while (ptp_view_tlv_next(&tlv, view, &offset) > 0)
+    {
+      if (tlv.type != PTP_TLV_ORG_EXTENSION || tlv.len < PTP_TLV_ORG_KEY_SIZE)
+	continue;
+
+      tlv_org_registered_call(daemon, view, tlv_org_key_read(tlv.data), tlv.data + PTP_TLV_ORG_KEY_SIZE, tlv.len - PTP_TLV_ORG_KEY_SIZE);
     }
+}
 
-  return -1;
+static int
+tlv_handle_org_extension(struct airptp_daemon *daemon, struct ptp_msg_view *view, uint8_t *data, uint16_t len)
+{
+  const struct ptp_tlv_org_dispatch *entry;
+  uint64_t key;
+  bool is_registered;
+
+  if (len < PTP_TLV_ORG_KEY_SIZE)
+    return -1;
+
+  key = tlv_org_key_read(data);
+  is_registered = tlv_org_registered_call(daemon, view, key, data + PTP_TLV_ORG_KEY_SIZE, len - PTP_TLV_ORG_KEY_SIZE);
+
+  entry = bsearch(&key, ptp_tlv_org_dispatch, ARRAY_SIZE(ptp_tlv_org_dispatch), sizeof(struct ptp_tlv_org_dispatch), tlv_org_dispatch_cmp);
+  if (!entry)
+    return is_registered ? 0 : -1;
+
+  return entry->subtype->handler(daemon, entry->org->name, entry->subtype, data + PTP_TLV_ORG_KEY_SIZE, len - PTP_TLV_ORG_KEY_SIZE);
 }
 
 static int
@@ -784,77 +1102,366 @@ tlv_handle_path_trace(struct airptp_daemon *daemon, uint8_t *data, uint16_t len)
   return 0;
 }
 
-// Returns length of tlv consumed (0 if no tlv), negative if error
-static ssize_t
-tlv_handle(struct airptp_daemon *daemon, uint8_t *tlv, ssize_t tlv_max_size)
+static int
+tlv_handle(struct airptp_daemon *daemon, struct ptp_msg_view *view, struct ptp_tlv_view *tlv)
 {
-  uint8_t *ptr = tlv;
-  uint16_t be16;
-  uint16_t type;
-  uint16_t len;
-  int ret;
+  if (tlv->type == PTP_TLV_ORG_EXTENSION)
+    return tlv_handle_org_extension(daemon, view, tlv->data, tlv->len);
+  else if (tlv->type == PTP_TLV_PATH_TRACE)
+    return tlv_handle_path_trace(daemon, tlv->data, tlv->len);
 
-  if (tlv_max_size == 0)
-    return 0;
-  else if (tlv_max_size < PTP_TLV_MIN_SIZE)
-    return -1;
+  return -1;
+}
 
-  memcpy(&be16, ptr, sizeof(be16));
-  ptr += sizeof(be16);
-  type = be16toh(be16);
+// Control messages from clients are signaling messages with our own org TLV.
+// They get a reply with the result.
+static bool
+msg_is_ctrl(struct ptp_msg_view *view)
+{
+  struct ptp_tlv_view tlv;
+  size_t offset = offsetof(struct ptp_signaling_message, tlv_apple1);
+  uint64_t key;
 
-  memcpy(&be16, ptr, sizeof(be16));
-  ptr += sizeof(be16);
-  len = be16toh(be16);
+  if (ptp_view_tlv_next(&tlv, view, &offset) <= 0)
+    return false;
 
-  if (tlv_max_size < PTP_TLV_MIN_SIZE + len)
-    return -1;
+  if (tlv.type != PTP_TLV_ORG_EXTENSION || tlv.len < PTP_TLV_ORG_KEY_SIZE)
+    return false;
 
-  if (type == PTP_TLV_ORG_EXTENSION)
-    ret = tlv_handle_org_extension(daemon, ptr, len);
-  else if (type == PTP_TLV_PATH_TRACE)
-    ret = tlv_handle_path_trace(daemon, ptr, len);
-  else
-    ret = -1;
+  key = tlv_org_key_read(tlv.data);
+
+  // Don't reply to a reply, i.e. a command result
+  return (key >> 24 == PTP_TLV_ORG_ID_OWN && key != PTP_TLV_ORG_KEY(PTP_TLV_ORG_ID_OWN, 0x000005));
+}
+
+static void
+ctrl_result_send(struct airptp_daemon *daemon, struct ptp_msg_view *view, int32_t result, union utils_net_sockaddr *peer_addr)
+{
+  struct ptp_result_signaling_message msg;
+  ssize_t len;
+
+  msg_result_make(&msg, daemon->clock_id, ptp_view_sequence_id(view), result);
 
-  return (ret < 0) ? ret : PTP_TLV_MIN_SIZE + len;
+  len = utils_net_sendto(&daemon->general_svc.socket, &msg, sizeof(msg), peer_addr);
+  if (len != sizeof(msg))
+    airptp_logmsg("Error sending result of control message: %s", strerror(errno));
 }
 
 static void
-signaling_handle(struct airptp_daemon *daemon, uint8_t *req, ssize_t req_len, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
+signaling_handle(struct airptp_daemon *daemon, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
 {
   // 34 bytes header and then 10 bytes targetPortIdentity
-  size_t tlv_offset = sizeof(struct ptp_header) + PTP_PORT_ID_SIZE;
-  ssize_t req_remaining = req_len - tlv_offset;
-  ssize_t tlv_size;
+  size_t offset = offsetof(struct ptp_signaling_message, tlv_apple1);
+  struct ptp_tlv_view tlv;
+  bool is_ctrl = msg_is_ctrl(view);
+  int ret;
+
+  // Only local clients may control us. No reply, we don't want to be used for
+  // amplification.
+  if (is_ctrl && !utils_net_address_is_loopback(peer_addr)) {
+    STATS_INC(daemon, rx_dropped_ctrl);
+    return;
+  }
 
-  while ((tlv_size = tlv_handle(daemon, req + tlv_offset, req_remaining)) > 0)
+  while ((ret = ptp_view_tlv_next(&tlv, view, &offset)) > 0)
     {
-      req_remaining -= tlv_size;
-      tlv_offset += tlv_size;
+      ret = tlv_handle(daemon, view, &tlv);
+      if (ret < 0)
+	break;
     }
 
-  if (tlv_size < 0)
-    airptp_hexdump("Received invalid or unknown PTP_MSGTYPE_SIGNALING", req, req_len);
+  // The handler has logged the reason if the result is an error
+  if (is_ctrl)
+    ctrl_result_send(daemon, view, (ret < 0) ? ret : AIRPTP_OK, peer_addr);
+  else if (ret < 0)
+    airptp_hexdump("Received invalid or unknown PTP_MSGTYPE_SIGNALING", view->msg, view->len);
+}
+
+// Value of a TimeInterval field, ns * 2^16
+static int64_t
+time_interval_htobe(int64_t ns)
+{
+  return htobe64(ns * 65536);
+}
+
+// log2 of an interval in seconds, rounded down
+static int8_t
+log_interval_get(int interval_ms)
+{
+  int8_t log_interval = 0;
+
+  if (interval_ms <= 0)
+    return 0x7F;
+
+  for (; interval_ms >= 2000; interval_ms /= 2)
+    log_interval++;
+  for (; interval_ms < 1000; interval_ms *= 2)
+    log_interval--;
+
+  return log_interval;
+}
+
+static int
+management_default_data_set(struct airptp_daemon *daemon, uint8_t *data, size_t size)
+{
+  struct ptp_management_default_data_set *dds = (struct ptp_management_default_data_set *)data;
+  struct airptp_dataset ds;
+
+  bmca_dataset_own(&ds, daemon);
+
+  memset(dds, 0, sizeof(struct ptp_management_default_data_set));
+  dds->flags = 0x01; // Two-step
+  dds->numberPorts = htobe16(1);
+  dds->priority1 = ds.priority1;
+  dds->clockClass = ds.clock_class;
+  dds->clockAccuracy = ds.clock_accuracy;
+  dds->offsetScaledLogVariance = htobe16(ds.variance);
+  dds->priority2 = ds.priority2;
+  dds->clockIdentity = htobe64(daemon->clock_id);
+  dds->domainNumber = AIRPTP_DOMAIN;
+
+  return sizeof(struct ptp_management_default_data_set);
+}
+
+static int
+management_current_data_set(struct airptp_daemon *daemon, uint8_t *data, size_t size)
+{
+  struct ptp_management_current_data_set *cds = (struct ptp_management_current_data_set *)data;
+  struct airptp_foreign_master *parent = bmca_parent_get(daemon);
+
+  memset(cds, 0, sizeof(struct ptp_management_current_data_set));
+  if (parent) {
+    cds->stepsRemoved = htobe16(parent->dataset.steps_removed + 1);
+    cds->offsetFromMaster = time_interval_htobe(daemon->slave.info.offset_ns);
+    cds->meanPathDelay = time_interval_htobe(daemon->slave.info.path_delay_ns);
+  }
+
+  return sizeof(struct ptp_management_current_data_set);
+}
+
+static int
+management_time_properties_data_set(struct airptp_daemon *daemon, uint8_t *data, size_t size)
+{
+  struct ptp_management_time_properties_data_set *tpds = (struct ptp_management_time_properties_data_set *)data;
+
+  // Same as in our Announce
+  tpds->currentUtcOffset = 0;
+  tpds->flags = PTP_FLAG_TIMESCALE;
+  tpds->timeSource = 0x20; // GPS
+
+  return sizeof(struct ptp_management_time_properties_data_set);
+}
+
+static int
+management_port_data_set(struct airptp_daemon *daemon, uint8_t *data, size_t size)
+{
+  struct ptp_management_port_data_set *pds = (struct ptp_management_port_data_set *)data;
+  struct ptp_header header;
+
+  // For our port number
+  header_init(&header, 0, 0, daemon->clock_id, 0, 0, 0);
+
+  memset(pds, 0, sizeof(struct ptp_management_port_data_set));
+  memcpy(pds->portIdentity, header.sourcePortIdentity, PTP_PORT_ID_SIZE);
+
+  if (daemon->port_state == AIRPTP_PORT_MASTER)
+    pds->portState = PTP_PORT_STATE_MASTER;
+  else if (daemon->port_state == AIRPTP_PORT_PASSIVE)
+    pds->portState = PTP_PORT_STATE_PASSIVE;
+  else if (daemon->slave.info.state == AIRPTP_SERVO_LOCKED)
+    pds->portState = PTP_PORT_STATE_SLAVE;
+  else
+    pds->portState = PTP_PORT_STATE_UNCALIBRATED;
+
+  pds->logMinDelayReqInterval = AIRPTP_LOGMESSAGEINT_DELAY_RESP;
+  pds->logAnnounceInterval = AIRPTP_LOGMESSAGEINT_ANNOUNCE;
+  pds->announceReceiptTimeout = BMCA_ANNOUNCE_RECEIPT_TIMEOUT;
+  pds->logSyncInterval = AIRPTP_LOGMESSAGEINT_SYNC;
+  pds->delayMechanism = 0x01; // E2E, Pdelay_Req is just for measuring
+  pds->logMinPdelayReqInterval = log_interval_get(daemon->config.pdelay_interval_ms);
+  pds->versionNumber = 2;
+
+  return sizeof(struct ptp_management_port_data_set);
 }
 
+static int
+management_peer_stats(struct airptp_daemon *daemon, uint8_t *data, size_t size)
+{
+  struct ptp_management_peer_stats *ps;
+  struct airptp_peer *peer;
+  uint16_t count = 0;
+  size_t len = sizeof(count);
+  int i;
+
+  for (i = 0; i < daemon->num_peers && len + sizeof(struct ptp_management_peer_stats) <= size; i++) {
+    peer = &daemon->peers[i];
+    ps = (struct ptp_management_peer_stats *)(data + len);
+
+    memset(ps, 0, sizeof(struct ptp_management_peer_stats));
+    ps->peerId = htobe32(peer->id);
+    if (peer->naddr.sa.sa_family == AF_INET6) {
+      memcpy(ps->address, &peer->naddr.sin6.sin6_addr, sizeof(ps->address));
+    } else {
+      ps->address[10] = 0xff;
+      ps->address[11] = 0xff;
+      memcpy(ps->address + 12, &peer->naddr.sin.sin_addr, sizeof(struct in_addr));
+    }
+    ps->syncState = peer->syncq.result.state;
+    ps->delayNs = htobe64(peer->pdelay.result.delay_ns);
+    ps->offsetNs = htobe64(peer->syncq.result.offset_ns);
+    ps->driftPpb = htobe32((int32_t)(peer->syncq.result.drift_ppm * 1000));
+    ps->outlierPermille = htobe16(peer->syncq.result.outlier_permille);
+
+    len += sizeof(struct ptp_management_peer_stats);
+    count++;
+  }
+
+  count = htobe16(count);
+  memcpy(data, &count, sizeof(count));
+  return len;
+}
+
+// Returns the length of the dataField, -1 if we don't have the id
+static int
+management_data_get(struct airptp_daemon *daemon, uint16_t management_id, uint8_t *data, size_t size)
+{
+  switch (management_id)
+    {
+      case PTP_MANAGEMENT_NULL:
+	return 0;
+      case PTP_MANAGEMENT_DEFAULT_DATA_SET:
+	return management_default_data_set(daemon, data, size);
+      case PTP_MANAGEMENT_CURRENT_DATA_SET:
+	return management_current_data_set(daemon, data, size);
+      case PTP_MANAGEMENT_TIME_PROPERTIES_DATA_SET:
+	return management_time_properties_data_set(daemon, data, size);
+      case PTP_MANAGEMENT_PORT_DATA_SET:
+	return management_port_data_set(daemon, data, size);
+      case PTP_MANAGEMENT_AIRPTP_PEER_STATS:
+	return management_peer_stats(daemon, data, size);
+      default:
+	return -1;
+    }
+}
+
+// GET of the management TLVs, e.g. from linuxptp's pmc. Only for tools on the
+// same host, and rate limited, since it is answered by the daemon thread.
 static void
-management_handle(struct airptp_daemon *daemon, uint8_t *req, ssize_t req_len, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
+management_handle(struct airptp_daemon *daemon, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, socklen_t peer_addr_len)
 {
-  airptp_hexdump("Received PTP_MSGTYPE_MANAGEMENT", req, req_len);
+  struct ptp_management_message *in = (struct ptp_management_message *)view->msg;
+  struct ptp_management_message *out;
+  uint8_t buf[1472]; // Fits in an Ethernet frame
+  uint8_t *tlv = buf + sizeof(struct ptp_management_message);
+  uint8_t *data = tlv + PTP_TLV_MIN_SIZE + sizeof(uint16_t);
+  uint16_t be16;
+  uint16_t management_id;
+  uint16_t error = 0;
+  uint64_t target_id;
+  int data_len = 0;
+  ssize_t len;
+
+  if (!utils_net_address_is_loopback(peer_addr)) {
+    STATS_INC(daemon, rx_dropped_ctrl);
+    return;
+  }
+
+  if (!ratelimit_allow(&daemon->ratelimit, peer_addr, daemon_now_ms())) {
+    STATS_INC(daemon, rx_dropped_ratelimit);
+    return;
+  }
+
+  // Don't reply to a reply
+  if ((in->actionField & 0x0F) >= PTP_MANAGEMENT_RESPONSE)
+    return;
+
+  target_id = ptp_view_u64(view, offsetof(struct ptp_management_message, targetPortIdentity));
+  if (target_id != UINT64_MAX && target_id != daemon->clock_id)
+    return;
+
+  if (ptp_view_u16(view, sizeof(struct ptp_management_message)) != PTP_TLV_MANAGEMENT)
+    return;
+
+  management_id = ptp_view_u16(view, sizeof(struct ptp_management_message) + PTP_TLV_MIN_SIZE);
+
+  if ((in->actionField & 0x0F) != PTP_MANAGEMENT_GET)
+    error = PTP_MANAGEMENT_ERROR_NOT_SUPPORTED;
+  else if ((data_len = management_data_get(daemon, management_id, data, buf + sizeof(buf) - data)) < 0)
+    error = PTP_MANAGEMENT_ERROR_NO_SUCH_ID;
+
+  if (error) {
+    // managementErrorId, managementId and 4 reserved bytes
+    memset(data - sizeof(uint16_t), 0, 8);
+    be16 = htobe16(error);
+    memcpy(data - sizeof(uint16_t), &be16, sizeof(be16));
+    be16 = htobe16(management_id);
+    memcpy(data, &be16, sizeof(be16));
+    data_len = 8 - sizeof(uint16_t);
+    be16 = htobe16(PTP_TLV_MANAGEMENT_ERROR_STATUS);
+  } else {
+    be16 = htobe16(management_id);
+    memcpy(data - sizeof(uint16_t), &be16, sizeof(be16));
+    be16 = htobe16(PTP_TLV_MANAGEMENT);
+  }
+
+  memcpy(tlv, &be16, sizeof(be16));
+  be16 = htobe16(sizeof(uint16_t) + data_len);
+  memcpy(tlv + sizeof(be16), &be16, sizeof(be16));
+
+  len = data + data_len - buf;
+
+  out = (struct ptp_management_message *)buf;
+  header_init(&out->header, PTP_MSGTYPE_MANAGEMENT, len, daemon->clock_id, ptp_view_sequence_id(view), 0x7F, 0);
+  out->header.controlField = 0x04; // Management
+  memcpy(out->targetPortIdentity, in->header.sourcePortIdentity, PTP_PORT_ID_SIZE);
+  out->startingBoundaryHops = in->startingBoundaryHops - in->boundaryHops;
+  out->boundaryHops = out->startingBoundaryHops;
+  out->actionField = PTP_MANAGEMENT_RESPONSE;
+  out->reserved = 0;
+
+  len = utils_net_sendto(&daemon->general_svc.socket, buf, len, peer_addr);
+  if (len < 0)
+    airptp_logmsg("Error sending management response: %s", strerror(errno));
 }
 
 
 /* ----------------------------- Message sending ---------------------------- */
 
+static bool
+msg_result_read(int32_t *result, uint8_t *msg, ssize_t msg_len)
+{
+  struct ptp_result_signaling_message *in = (struct ptp_result_signaling_message *)msg;
+  uint8_t *ptr = in->tlv_result + PTP_TLV_MIN_SIZE;
+  uint32_t be32_result;
+
+  if (msg_len < sizeof(struct ptp_result_signaling_message) || (msg[0] & 0x0F) != PTP_MSGTYPE_SIGNALING)
+    return false;
+
+  if (memcmp(ptr, ptp_tlv_orgs[PTP_TLV_ORG_OWN].code, PTP_TLV_ORG_CODE_SIZE) != 0)
+    return false;
+
+  ptr += PTP_TLV_ORG_CODE_SIZE;
+  if (memcmp(ptr, ptp_tlv_own_subtypes[PTP_TLV_ORG_OWN_RESULT].code, PTP_TLV_ORG_CODE_SIZE) != 0)
+    return false;
+
+  ptr += PTP_TLV_ORG_CODE_SIZE;
+  memcpy(&be32_result, ptr, sizeof(be32_result));
+  *result = (int32_t)be32toh(be32_result);
+  return true;
+}
+
+// Sends a control message to the daemon and waits for the reply with the result
 static int
-localhost_msg_send(void *msg, size_t msg_len, unsigned short port)
+ctrl_msg_send(void *msg, size_t msg_len, unsigned short port)
 {
   struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM };
   struct addrinfo *info = NULL;
+  struct pollfd pfd;
+  uint8_t reply[256];
   char strport[8];
+  int32_t result = AIRPTP_ERR_NOCONNECTION;
   int fd = -1;
-  ssize_t len = -1;
+  ssize_t len;
 
   snprintf(strport, sizeof(strport), "%hu", port);
   if (getaddrinfo("localhost", strport, &hints, &info) != 0)
@@ -864,7 +1471,25 @@ localhost_msg_send(void *msg, size_t msg_len, unsigned short port)
   if (fd < 0)
     goto error;
 
-  len = sendto(fd, msg, msg_len, 0, info->ai_addr, info->ai_addrlen);
+  // Connecting means we only get replies from the daemon, and that we get
+  // ECONNREFUSED right away if it isn't there
+  if (connect(fd, info->ai_addr, info->ai_addrlen) < 0)
+    goto error;
+
+  len = send(fd, msg, msg_len, 0);
+  if (len != msg_len)
+    goto error;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while (poll(&pfd, 1, AIRPTP_CTRL_REPLY_TIMEOUT_MS) > 0)
+    {
+      len = recv(fd, reply, sizeof(reply), 0);
+      if (len < 0)
+	break;
+      if (msg_result_read(&result, reply, len))
+	break;
+    }
 
  error:
   if (fd >= 0)
@@ -872,39 +1497,100 @@ localhost_msg_send(void *msg, size_t msg_len, unsigned short port)
   if (info)
     freeaddrinfo(info);
 
-  return (len == msg_len) ? 0 : -1;
+  return result;
 }
 
+// From the tx thread we only have the snapshot, and errors are reported back
+// through it. Peers that are backing off after errors aren't in it.
 static void
-peers_msg_send(struct airptp_daemon *daemon, void *msg, size_t msg_len, struct airptp_service *svc)
+snapshot_msg_send(struct airptp_daemon *daemon, struct airptp_snapshot *snapshot, void *msg, size_t msg_len, struct airptp_service *svc)
+{
+  union utils_net_sockaddr naddr;
+  uint8_t *msg_bin = msg;
+  ssize_t len;
+  int idx;
+
+  for (int i = 0; i < snapshot->num_tx; i++) {
+    idx = snapshot->tx_order[i];
+
+    naddr = snapshot->peer_addrs[idx];
+    port_set(&naddr, daemon_peer_port(daemon, &naddr, svc));
+    len = utils_net_sendto(&svc->socket, msg, msg_len, &naddr);
+    __atomic_store_n(&snapshot->send_errno[idx], (len < 0) ? errno : -1, __ATOMIC_RELAXED);
+    if (len < 0)
+      daemon_tx_error_count(daemon, errno);
+    else if (len != msg_len)
+      airptp_logmsg("Incomplete send of msg %02x", msg_bin[0]);
+    else
+      log_sent(msg_bin, svc->port);
+  }
+}
+
+// If launch_ns is non-zero the message is sent with that launch time, see
+// txtime.c
+static void
+peers_msg_send_at(struct airptp_daemon *daemon, void *msg, size_t msg_len, struct airptp_service *svc, uint64_t launch_ns)
 {
   struct airptp_peer *peer;
   ssize_t len;
   union utils_net_sockaddr naddr;
   uint8_t *msg_bin = msg;
   uint64_t now = time(NULL);
+  uint64_t now_ms = daemon_now_ms();
 
-  for (int i = 0; i < daemon->num_peers; i++) {
-    peer = &daemon->peers[i];
+  if (daemon->tx.current) {
+    snapshot_msg_send(daemon, daemon->tx.current, msg, msg_len, svc);
+    return;
+  }
 
-    peer->is_active = (peer->last_seen + AIRPTP_STALE_SECS > now);
-    if (!peer->is_active)
+  for (int i = 0; i < daemon->num_tx; i++) {
+    peer = &daemon->peers[daemon->tx_order[i]];
+
+    daemon_peer_active_set(daemon, peer, (peer->last_seen + AIRPTP_STALE_SECS > now) && (peer->send_errors < AIRPTP_SEND_MAX_ERRORS));
+    if (!peer->is_active || !daemon_peer_send_due(peer, now_ms))
       continue;
 
     // Copy because we don't want to modify list elements
     memcpy(&naddr, &peer->naddr, peer->naddr_len);
 
-    port_set(&naddr, svc->port);
-    len = utils_net_sendto(&svc->socket, msg, msg_len, &naddr);
-    if (len < 0) {
-      airptp_logmsg("Error sending PTP msg %02x: %s", msg_bin[0], strerror(errno));
-      peer->is_active = false; // Will be removed deferred by peers_prune()
+    port_set(&naddr, daemon_peer_port(daemon, &peer->naddr, svc));
+
+    // Queued sends are submitted together below, and send errors are handled
+    // when they complete
+    if (!launch_ns && !peer->is_connected && daemon->uring && uring_sendto(daemon->uring, &svc->socket, msg, msg_len, &naddr, peer->id) == 0) {
+      log_sent(msg_bin, svc->port);
+      continue;
     }
+
+    if (launch_ns)
+      len = txtime_sendto(&svc->socket, msg, msg_len, &naddr, launch_ns);
+    else if (peer->is_connected)
+      len = send((svc == &daemon->event_svc) ? peer->event_fd : peer->general_fd, msg, msg_len, 0);
+    else
+      len = utils_net_sendto(&svc->socket, msg, msg_len, &naddr);
+    // A connected socket reports an ICMP error from the peer on a later call,
+    // so a successful send doesn't mean the peer is reachable. For those, the
+    // errors are reset when we hear from the peer, see peer_socket.c.
+    if (len < 0)
+      daemon_tx_error_count(daemon, errno);
+    if (len < 0 || !peer->is_connected || launch_ns)
+      daemon_peer_send_result(daemon, peer, (len < 0) ? errno : 0);
+    if (len < 0)
+      continue;
     else if (len != msg_len)
       airptp_logmsg("Incomplete send of msg %02x", msg_bin[0]);
     else
       log_sent(msg_bin, svc->port);
   }
+
+  if (daemon->uring)
+    uring_submit(daemon->uring);
+}
+
+static void
+peers_msg_send(struct airptp_daemon *daemon, void *msg, size_t msg_len, struct airptp_service *svc)
+{
+  peers_msg_send_at(daemon, msg, msg_len, svc, 0);
 }
 
 void
@@ -913,8 +1599,15 @@ ptp_msg_announce_send(struct airptp_daemon *daemon)
   struct ptp_announce_message annnounce;
   struct ptp_timestamp ts = { 0 };
 
+  struct airptp_dataset ds;
+
+  if (daemon->tx.current)
+    ds = daemon->tx.current->dataset;
+  else
+    bmca_dataset_announced(&ds, daemon);
+
   // iOS just sends 0 as originTimestamp, we do the same
-  msg_announce_make(&annnounce, daemon->clock_id, daemon->announce_seq, ts);
+  msg_announce_make(&annnounce, daemon->clock_id, &ds, daemon->announce_seq, ts);
   peers_msg_send(daemon, &annnounce, sizeof(annnounce), &daemon->general_svc);
 
   daemon->announce_seq++;
@@ -941,9 +1634,10 @@ ptp_msg_sync_send(struct airptp_daemon *daemon)
 
   // Two-step PTP is a Sync with a 0 ts and then a Follow-Up with the ts of Sync
   msg_sync_make(&sync, daemon->clock_id, daemon->sync_seq, ts);
-  ts = current_time_get();
+  ts = current_time_get(&daemon->ts_timeline);
 
   peers_msg_send(daemon, &sync, sizeof(sync), &daemon->event_svc);
+  daemon->sync_sent_ns = daemon_now_ns();
 
   // Send Follow Up with precise timestamp after a small delay
   usleep(100);
@@ -953,13 +1647,94 @@ ptp_msg_sync_send(struct airptp_daemon *daemon)
   daemon->sync_seq++;
 }
 
+uint64_t
+ptp_msg_pdelay_req_send(struct airptp_daemon *daemon, struct airptp_peer *peer, uint16_t sequence_id)
+{
+  struct ptp_pdelay_req_message req;
+  struct ptp_timestamp ts;
+  union utils_net_sockaddr naddr;
+  ssize_t len;
+
+  memcpy(&naddr, &peer->naddr, peer->naddr_len);
+  port_set(&naddr, daemon_peer_port(daemon, &peer->naddr, &daemon->event_svc));
+
+  ts = current_time_get(&daemon->ts_timeline);
+  msg_pdelay_req_make(&req, daemon->clock_id, sequence_id, ts);
+
+  if (peer->is_connected)
+    len = send(peer->event_fd, &req, sizeof(req), 0);
+  else
+    len = utils_net_sendto(&daemon->event_svc.socket, &req, sizeof(req), &naddr);
+  if (len < 0) {
+    daemon_tx_error_count(daemon, errno);
+    daemon_peer_send_result(daemon, peer, errno);
+    return 0;
+  }
+
+  log_sent((uint8_t *)&req, daemon->event_svc.port);
+  return ptp_timestamp_to_ns(&ts);
+}
+
+uint64_t
+ptp_msg_delay_req_send(struct airptp_daemon *daemon, union utils_net_sockaddr *naddr, uint16_t sequence_id, uint64_t origin_ns)
+{
+  struct ptp_delay_req_message req;
+  struct ptp_timestamp ts;
+  ssize_t len;
+
+  ts.seconds_hi = (origin_ns / 1000000000ULL) >> 32;
+  ts.seconds_low = (uint32_t)(origin_ns / 1000000000ULL);
+  ts.nanoseconds = (uint32_t)(origin_ns % 1000000000ULL);
+  msg_delay_req_make(&req, daemon->clock_id, sequence_id, ts);
+
+  ts = local_time_get();
+  len = utils_net_sendto(&daemon->event_svc.socket, &req, sizeof(req), naddr);
+  if (len < 0) {
+    daemon_tx_error_count(daemon, errno);
+    return 0;
+  }
+
+  log_sent((uint8_t *)&req, daemon->event_svc.port);
+  return ptp_timestamp_to_ns(&ts);
+}
+
+uint16_t
+ptp_msg_sync_schedule(struct airptp_daemon *daemon, uint64_t launch_ns)
+{
+  struct ptp_sync_message sync;
+  struct ptp_timestamp ts = { 0 };
+  uint16_t sequence_id = daemon->sync_seq;
+
+  msg_sync_make(&sync, daemon->clock_id, sequence_id, ts);
+  peers_msg_send_at(daemon, &sync, sizeof(sync), &daemon->event_svc, launch_ns);
+  daemon->sync_sent_ns = daemon_now_ns();
+
+  daemon->sync_seq++;
+  return sequence_id;
+}
+
+void
+ptp_msg_sync_follow_up_send(struct airptp_daemon *daemon, uint16_t sequence_id, uint64_t ts_ns)
+{
+  struct ptp_follow_up_message followup;
+  struct ptp_timestamp ts;
+
+  ts_ns = timesource_timeline_map(&daemon->ts_timeline, ts_ns);
+  ts.seconds_hi = (ts_ns / 1000000000ULL) >> 32;
+  ts.seconds_low = (uint32_t)(ts_ns / 1000000000ULL);
+  ts.nanoseconds = (uint32_t)(ts_ns % 1000000000ULL);
+
+  msg_sync_follow_up_make(&followup, daemon->clock_id, sequence_id, ts);
+  peers_msg_send(daemon, &followup, sizeof(followup), &daemon->general_svc);
+}
+
 int
-ptp_msg_peer_add_send(struct airptp_peer *peer, struct airptp_handle *hdl, unsigned short port)
+ptp_msg_peer_add_send(struct airptp_peer *peer, uint32_t group_id, struct airptp_handle *hdl, unsigned short port)
 {
   struct ptp_peer_signaling_message msg;
 
-  msg_peer_add_make(&msg, peer, hdl->daemon_info.clock_id);
-  return localhost_msg_send(&msg, sizeof(msg), port);
+  msg_peer_add_make(&msg, peer, hdl->client_id, group_id, hdl->daemon_info.clock_id);
+  return ctrl_msg_send(&msg, sizeof(msg), port);
 }
 
 int
@@ -967,50 +1742,58 @@ ptp_msg_peer_del_send(struct airptp_peer *peer, struct airptp_handle *hdl, unsig
 {
   struct ptp_peer_signaling_message msg;
 
-  msg_peer_del_make(&msg, peer, hdl->daemon_info.clock_id);
-  return localhost_msg_send(&msg, sizeof(msg), port);
+  msg_peer_del_make(&msg, peer, hdl->client_id, hdl->daemon_info.clock_id);
+  return ctrl_msg_send(&msg, sizeof(msg), port);
+}
+
+int
+ptp_msg_group_send(struct airptp_group *group, enum airptp_group_cmd cmd, struct airptp_handle *hdl, unsigned short port)
+{
+  struct ptp_group_signaling_message msg;
+
+  msg_group_make(&msg, group, cmd, hdl->daemon_info.clock_id);
+  return ctrl_msg_send(&msg, sizeof(msg), port);
+}
+
+int
+ptp_msg_client_send(struct airptp_client *client, enum airptp_client_cmd cmd, struct airptp_handle *hdl, unsigned short port)
+{
+  struct ptp_client_signaling_message msg;
+
+  msg_client_make(&msg, client, cmd, hdl->daemon_info.clock_id);
+  return ctrl_msg_send(&msg, sizeof(msg), port);
 }
 
 
 /* ----------------------------- Message handler ---------------------------- */
 
-void
-ptp_msg_handle(struct airptp_daemon *daemon, uint8_t *msg, size_t msg_len, union utils_net_sockaddr *peer_addr, socklen_t peer_addrlen)
+typedef void (*ptp_msg_handler)(struct airptp_daemon *, struct ptp_msg_view *, union utils_net_sockaddr *, socklen_t);
+
+// Indexed by message type, the types that ptp_decode() accepts
+static ptp_msg_handler ptp_msg_handlers[16] =
 {
-  uint8_t msg_type = msg[0] & 0x0F; // Only lower bits are message type
+  [PTP_MSGTYPE_SYNC] = sync_handle,
+  [PTP_MSGTYPE_DELAY_REQ] = delay_msg_handle,
+  [PTP_MSGTYPE_PDELAY_REQ] = pdelay_msg_handle,
+  [PTP_MSGTYPE_PDELAY_RESP] = pdelay_resp_handle,
+  [PTP_MSGTYPE_FOLLOW_UP] = follow_up_handle,
+  [PTP_MSGTYPE_DELAY_RESP] = delay_resp_handle,
+  [PTP_MSGTYPE_PDELAY_RESP_FOLLOW_UP] = pdelay_resp_follow_up_handle,
+  [PTP_MSGTYPE_ANNOUNCE] = announce_handle,
+  [PTP_MSGTYPE_SIGNALING] = signaling_handle,
+  [PTP_MSGTYPE_MANAGEMENT] = management_handle,
+};
 
-  switch (msg_type)
-    {
-      case PTP_MSGTYPE_ANNOUNCE:
-	announce_handle(daemon, msg, msg_len, peer_addr, peer_addrlen);
-	break;
-      case PTP_MSGTYPE_SYNC:
-	sync_handle(daemon, msg, msg_len, peer_addr, peer_addrlen);
-	break;
-      case PTP_MSGTYPE_FOLLOW_UP:
-	follow_up_handle(daemon, msg, msg_len, peer_addr, peer_addrlen);
-	break;
-      case PTP_MSGTYPE_DELAY_REQ:
-	delay_msg_handle(daemon, msg, msg_len, peer_addr, peer_addrlen);
-	break;
-      case PTP_MSGTYPE_PDELAY_REQ:
-	pdelay_msg_handle(daemon, msg, msg_len, peer_addr, peer_addrlen);
-	break;
-      case PTP_MSGTYPE_SIGNALING:
-	signaling_handle(daemon, msg, msg_len, peer_addr, peer_addrlen);
-	break;
-      case PTP_MSGTYPE_MANAGEMENT:
-	management_handle(daemon, msg, msg_len, peer_addr, peer_addrlen);
-	break;
-      default:
-	airptp_hexdump("Received unhandled message", msg, msg_len);
-	return;
-    }
+void
+ptp_msg_handle(struct airptp_daemon *daemon, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, socklen_t peer_addrlen)
+{
+  ptp_msg_handlers[view->type](daemon, view, peer_addr, peer_addrlen);
 }
 
 int
 ptp_msg_handle_init(void)
 {
+  uint8_t code[PTP_TLV_ORG_KEY_SIZE];
   int i;
   int n;
 
@@ -1022,9 +1805,26 @@ ptp_msg_handle_init(void)
     assert(ptp_tlv_ieee_subtypes[i].index == i);
   for (i = 0, n++; i < ARRAY_SIZE(ptp_tlv_own_subtypes); i++)
     assert(ptp_tlv_own_subtypes[i].index == i);
-  for (i = 0; i < ARRAY_SIZE(ptp_tlv_orgs); i++)
-    assert(ptp_tlv_orgs[i].index == i);
-  assert(n == i);
+  assert(n == ARRAY_SIZE(ptp_tlv_orgs));
+  for (i = 0, n = 0; i < ARRAY_SIZE(ptp_tlv_orgs); i++)
+    {
+      assert(ptp_tlv_orgs[i].index == i);
+      n += ptp_tlv_orgs[i].n_subtypes;
+    }
+
+  // The dispatch table must have every subtype, sorted and with the right keys
+  assert(n == ARRAY_SIZE(ptp_tlv_org_dispatch));
+  for (i = 0; i < ARRAY_SIZE(ptp_tlv_org_dispatch); i++)
+    {
+      memcpy(code, ptp_tlv_org_dispatch[i].org->code, PTP_TLV_ORG_CODE_SIZE);
+      memcpy(code + PTP_TLV_ORG_CODE_SIZE, ptp_tlv_org_dispatch[i].subtype->code, PTP_TLV_ORG_CODE_SIZE);
+      assert(tlv_org_key_read(code) == ptp_tlv_org_dispatch[i].key);
+      assert(i == 0 || ptp_tlv_org_dispatch[i - 1].key < ptp_tlv_org_dispatch[i].key);
+    }
+
+  // Every type the decoder lets through must have a handler
+  for (i = 0; i < ARRAY_SIZE(ptp_msg_handlers); i++)
+    assert(!ptp_decode_min_len(i) == !ptp_msg_handlers[i]);
 
   return 0;
 }
@@ -1,6 +1,8 @@
 #ifndef __PTP_MSG_HANDLE_H__
 #define __PTP_MSG_HANDLE_H__
 
+#include "ptp_decode.h"
+
 void
 ptp_msg_announce_send(struct airptp_daemon *daemon);
 
@@ -10,14 +12,50 @@ ptp_msg_signaling_send(struct airptp_daemon *daemon);
 void
 ptp_msg_sync_send(struct airptp_daemon *daemon);
 
+// Returns when it was sent (ns in the timebase), 0 if it couldn't be
+uint64_t
+ptp_msg_pdelay_req_send(struct airptp_daemon *daemon, struct airptp_peer *peer, uint16_t sequence_id);
+
+// Sends a Delay_Req to the master, see slave.c. Returns when it was sent (ns in
+// the timebase), 0 if it couldn't be.
+uint64_t
+ptp_msg_delay_req_send(struct airptp_daemon *daemon, union utils_net_sockaddr *naddr, uint16_t sequence_id, uint64_t origin_ns);
+
+// For scheduled sending, see txtime.c. Sends a Sync that leaves at launch_ns
+// (CLOCK_TAI) and returns its sequence id, then the Follow_Up with the time it
+// left (ns in the timebase).
+uint16_t
+ptp_msg_sync_schedule(struct airptp_daemon *daemon, uint64_t launch_ns);
+
+void
+ptp_msg_sync_follow_up_send(struct airptp_daemon *daemon, uint16_t sequence_id, uint64_t ts_ns);
+
+// The below return the result from the daemon, i.e. 0 or a negative
+// enum airptp_error
 int
-ptp_msg_peer_add_send(struct airptp_peer *peer, struct airptp_handle *hdl, unsigned short port);
+ptp_msg_peer_add_send(struct airptp_peer *peer, uint32_t group_id, struct airptp_handle *hdl, unsigned short port);
 
 int
 ptp_msg_peer_del_send(struct airptp_peer *peer, struct airptp_handle *hdl, unsigned short port);
 
+int
+ptp_msg_group_send(struct airptp_group *group, enum airptp_group_cmd cmd, struct airptp_handle *hdl, unsigned short port);
+
+int
+ptp_msg_client_send(struct airptp_client *client, enum airptp_client_cmd cmd, struct airptp_handle *hdl, unsigned short port);
+
+// Answers a Delay_Req with a Delay_Resp to resp_port, returns when it was
+// received (ns), or 0 if it wasn't answered
+uint64_t
+ptp_msg_delay_req_handle(struct airptp_service *general_svc, uint64_t our_clock_id, struct timesource_timeline *tl, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, unsigned short resp_port);
+
+// Adds an answered Delay_Req from a peer to its sync quality, see syncq.c
+void
+ptp_msg_delay_req_track(struct airptp_daemon *daemon, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, uint64_t rx_ns);
+
+// The view must be from ptp_decode(), see daemon_incoming_admit()
 void
-ptp_msg_handle(struct airptp_daemon *daemon, uint8_t *msg, size_t msg_len, union utils_net_sockaddr *peer_addr, socklen_t peer_addrlen);
+ptp_msg_handle(struct airptp_daemon *daemon, struct ptp_msg_view *view, union utils_net_sockaddr *peer_addr, socklen_t peer_addrlen);
 
 int
 ptp_msg_handle_init(void);
@@ -0,0 +1,142 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "ratelimit.h"
+
+// The total bucket allows this many times the per source rate
+#define RATELIMIT_TOTAL_FACTOR 16
+
+static void
+key_make(uint8_t *key, union utils_net_sockaddr *naddr)
+{
+  if (naddr->sa.sa_family == AF_INET6) {
+    memcpy(key, &naddr->sin6.sin6_addr, 16);
+  } else {
+    memset(key, 0, 10);
+    key[10] = 0xff;
+    key[11] = 0xff;
+    memcpy(key + 12, &naddr->sin.sin_addr, 4);
+  }
+}
+
+static bool
+bucket_take(struct ratelimit_bucket *bucket, uint32_t rate, uint32_t burst, uint64_t now_ms)
+{
+  uint64_t tokens;
+
+  // Refill, rate is tokens per second and we count thousandths of a token, so
+  // rate * elapsed ms is the number of thousandths to add
+  tokens = bucket->tokens + (now_ms - bucket->last_ms) * rate;
+  if (tokens > 1000 * (uint64_t)burst)
+    tokens = 1000 * (uint64_t)burst;
+
+  bucket->last_ms = now_ms;
+
+  if (tokens < 1000) {
+    bucket->tokens = tokens;
+    return false;
+  }
+
+  bucket->tokens = tokens - 1000;
+  return true;
+}
+
+static struct ratelimit_bucket *
+bucket_get(struct ratelimit *rl, uint8_t *key, uint64_t now_ms)
+{
+  struct ratelimit_bucket *bucket;
+  struct ratelimit_bucket *oldest = NULL;
+  uint8_t seeded_key[sizeof(rl->seed) + 16];
+  uint32_t hash;
+  int i;
+
+  memcpy(seeded_key, &rl->seed, sizeof(rl->seed));
+  memcpy(seeded_key + sizeof(rl->seed), key, 16);
+  hash = utils_djb_hash(seeded_key, sizeof(seeded_key));
+
+  for (i = 0; i < RATELIMIT_PROBES; i++)
+    {
+      bucket = &rl->buckets[(hash + i) & (RATELIMIT_TABLE_SIZE - 1)];
+      if (bucket->last_ms != 0 && memcmp(bucket->addr, key, sizeof(bucket->addr)) == 0)
+	return bucket;
+
+      if (!oldest || bucket->last_ms < oldest->last_ms)
+	oldest = bucket;
+    }
+
+  // New source, takes a free slot or evicts the least recently used. It starts
+  // with a full bucket.
+  memcpy(oldest->addr, key, sizeof(oldest->addr));
+  oldest->last_ms = now_ms;
+  oldest->tokens = 1000 * rl->burst;
+  return oldest;
+}
+
+void
+ratelimit_init(struct ratelimit *rl, uint32_t rate, uint32_t burst)
+{
+  struct timespec ts;
+
+  memset(rl, 0, sizeof(struct ratelimit));
+
+  rl->rate = rate;
+  rl->burst = (burst > 0) ? burst : 1;
+  rl->total_rate = RATELIMIT_TOTAL_FACTOR * rl->rate;
+  rl->total_burst = RATELIMIT_TOTAL_FACTOR * rl->burst;
+  rl->total.tokens = 1000 * rl->total_burst;
+
+  // Makes it harder to target a specific source with collisions
+  clock_gettime(CLOCK_REALTIME, &ts);
+  rl->seed = utils_djb_hash(&ts, sizeof(ts));
+}
+
+bool
+ratelimit_allow(struct ratelimit *rl, union utils_net_sockaddr *naddr, uint64_t now_ms)
+{
+  struct ratelimit_bucket *bucket;
+  uint8_t key[16];
+
+  if (rl->rate == 0)
+    return true;
+
+  // Zero means free slot
+  if (now_ms == 0)
+    now_ms = 1;
+
+  if (rl->total.last_ms == 0)
+    rl->total.last_ms = now_ms;
+
+  key_make(key, naddr);
+  bucket = bucket_get(rl, key, now_ms);
+
+  if (!bucket_take(bucket, rl->rate, rl->burst, now_ms))
+    return false;
+
+  return bucket_take(&rl->total, rl->total_rate, rl->total_burst, now_ms);
+}
@@ -0,0 +1,45 @@
+#ifndef __AIRPTP_RATELIMIT_H__
+#define __AIRPTP_RATELIMIT_H__
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "utils.h"
+
+// Must be a power of two
+#define RATELIMIT_TABLE_SIZE 1024
+// How many slots we look at before evicting the least recently used
+#define RATELIMIT_PROBES 4
+
+struct ratelimit_bucket
+{
+  uint8_t addr[16]; // ipv4 addresses are stored as ipv4-mapped
+  uint64_t last_ms; // 0 if the slot is free
+  uint32_t tokens; // In thousandths of a token
+};
+
+struct ratelimit
+{
+  // Tokens per second and max tokens for a single source, rate 0 disables
+  uint32_t rate;
+  uint32_t burst;
+
+  // Bucket shared by all sources, so that a flood from many (spoofed) sources
+  // can't get around the limit by each getting a fresh bucket
+  struct ratelimit_bucket total;
+  uint32_t total_rate;
+  uint32_t total_burst;
+
+  uint32_t seed;
+  struct ratelimit_bucket buckets[RATELIMIT_TABLE_SIZE];
+};
+
+void
+ratelimit_init(struct ratelimit *rl, uint32_t rate, uint32_t burst);
+
+// Takes a token from the source's bucket and the total bucket. Returns false if
+// there isn't one, i.e. the packet should be dropped.
+bool
+ratelimit_allow(struct ratelimit *rl, union utils_net_sockaddr *naddr, uint64_t now_ms);
+
+#endif // __AIRPTP_RATELIMIT_H__
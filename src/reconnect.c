@@ -0,0 +1,456 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+
+// For shm_open
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "reconnect.h"
+#include "ptp_msg_handle.h"
+
+// A client learns that the daemon is gone from POLLHUP on the read end of the
+// daemon's liveness FIFO, which comes as soon as the daemon stops or its
+// process dies. There is no POLLHUP if the FIFO was opened after the daemon
+// died, or if the daemon couldn't create it, so we also check its shm
+// timestamp once in a while. When it
+// is gone we look for a new daemon every RECONNECT_RETRY_MS, and register the
+// client, its groups and its peers with it. The ids are hashes of what was
+// added, so they stay the same.
+
+#define RECONNECT_CHECK_MS 1000
+#define RECONNECT_RETRY_MS 20
+
+// A daemon that crashed leaves its shm behind, with a ts that will only go
+// stale after a while. If its pid is gone we don't wait as long, but the pid
+// is just a hint, since the daemon may be in another pid namespace.
+static bool
+info_is_fresh(struct airptp_daemon_info *info)
+{
+  time_t stale_secs = AIRPTP_STALE_SECS;
+
+  if (info->pid > 0 && kill(info->pid, 0) < 0 && errno == ESRCH)
+    stale_secs = AIRPTP_STALE_SECS_NO_PID;
+
+  return (info->ts + stale_secs >= time(NULL));
+}
+
+// Only the shm's owner can write to the FIFO's directory, but if the daemon
+// couldn't make that directory someone else may have, so we check that it's
+// really the owner's FIFO
+static int
+liveness_open(uid_t owner)
+{
+  char path[64];
+  struct stat sb;
+  int fd;
+
+  snprintf(path, sizeof(path), AIRPTP_LIVENESS_PATH_FMT, (unsigned)owner);
+
+  fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0)
+    return -1;
+
+  if (fstat(fd, &sb) < 0 || !S_ISFIFO(sb.st_mode) || sb.st_uid != owner) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int
+reconnect_attach(struct airptp_handle *hdl)
+{
+  struct airptp_daemon_info *info = MAP_FAILED;
+  struct stat sb;
+  bool is_writable = true;
+  int liveness_fd = -1;
+  int fd = -1;
+  int ret;
+
+  // Writable so we can count ourselves as waiting for events, which only a
+  // client of the daemon's user can
+  fd = shm_open(AIRPTP_SHM_NAME, O_RDWR, 0);
+  if (fd < 0 && errno == EACCES) {
+    is_writable = false;
+    fd = shm_open(AIRPTP_SHM_NAME, O_RDONLY, 0);
+  }
+  if (fd < 0)
+    RETURN_ERROR(AIRPTP_ERR_NOTFOUND, "No airptp daemon found");
+
+  // Reading beyond the size of the object would give us a SIGBUS
+  if (fstat(fd, &sb) < 0 || sb.st_size < sizeof(struct airptp_daemon_info))
+    RETURN_ERROR(AIRPTP_ERR_NOTFOUND, "The host is running an incompatible airptp daemon");
+
+  info = mmap(NULL, sizeof(struct airptp_daemon_info), is_writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  if (info == MAP_FAILED)
+    RETURN_ERROR(AIRPTP_ERR_INTERNAL, "mmap() of shared memory returned an error");
+
+  // The mapping stays valid after closing
+  close(fd);
+  fd = -1;
+
+  if (info->version_major != AIRPTP_SHM_STRUCTS_VERSION_MAJOR)
+    RETURN_ERROR(AIRPTP_ERR_NOTFOUND, "The host is running an incompatible airptp daemon");
+
+  if (!info_is_fresh(info))
+    RETURN_ERROR(AIRPTP_ERR_NOTFOUND, "No airptp daemon found (shared mem is stale)");
+
+  // Not an error, then we notice that the daemon is gone from the ts
+  liveness_fd = liveness_open(sb.st_uid);
+
+  pthread_mutex_lock(&hdl->reg_lock);
+  memcpy(&hdl->daemon_info, info, sizeof(struct airptp_daemon_info));
+  if (hdl->shm_retired)
+    munmap(hdl->shm_retired, sizeof(struct airptp_daemon_info));
+  hdl->shm_retired = hdl->shm_info;
+  __atomic_store_n(&hdl->shm_info, info, __ATOMIC_RELEASE);
+  hdl->shm_is_writable = is_writable;
+  if (hdl->liveness_fd >= 0)
+    close(hdl->liveness_fd);
+  hdl->liveness_fd = liveness_fd;
+  hdl->event_port = info->event_port;
+  hdl->general_port = info->general_port;
+  pthread_mutex_unlock(&hdl->reg_lock);
+
+  return 0;
+
+ error:
+  if (liveness_fd >= 0)
+    close(liveness_fd);
+  if (info != MAP_FAILED)
+    munmap(info, sizeof(struct airptp_daemon_info));
+  if (fd >= 0)
+    close(fd);
+  return ret;
+}
+
+// Through the API like the first time, which also means we remember nothing
+// new. Works on copies, so the lock isn't held while waiting for the daemon.
+// Returns -1 if the daemon didn't answer, e.g. because the shm we found is one
+// a crashed daemon left behind.
+static int
+reregister(struct airptp_handle *hdl)
+{
+  struct airptp_client client = { .id = hdl->client_id, .pid = getpid() };
+  struct airptp_reg_peer peers[AIRPTP_CLIENT_MAX_PEERS];
+  struct airptp_reg_group groups[AIRPTP_CLIENT_MAX_GROUPS];
+  uint32_t id;
+  unsigned short port;
+  int num_peers;
+  int num_groups;
+  int errors = 0;
+  int ret;
+  int i;
+
+  // Only we write the port, but others may read it
+  pthread_mutex_lock(&hdl->reg_lock);
+  port = hdl->general_port;
+  num_peers = hdl->num_reg_peers;
+  memcpy(peers, hdl->reg_peers, num_peers * sizeof(struct airptp_reg_peer));
+  num_groups = hdl->num_reg_groups;
+  memcpy(groups, hdl->reg_groups, num_groups * sizeof(struct airptp_reg_group));
+  pthread_mutex_unlock(&hdl->reg_lock);
+
+  ret = ptp_msg_client_send(&client, AIRPTP_CLIENT_CMD_ADD, hdl, port);
+  if (ret < 0)
+    return -1;
+
+  for (i = 0; i < num_groups; i++)
+    errors += (airptp_group_add(&id, groups[i].name, hdl) < 0);
+
+  for (i = 0; i < num_peers; i++) {
+    if (peers[i].group_id)
+      ret = airptp_group_peer_add(&id, peers[i].addr, peers[i].group_id, hdl);
+    else
+      ret = airptp_peer_add_port(&id, peers[i].addr, peers[i].event_port, hdl);
+    errors += (ret < 0);
+  }
+
+  // Last, so the group's peers are all there when it starts
+  for (i = 0; i < num_groups; i++) {
+    if (groups[i].is_started)
+      errors += (airptp_group_start(groups[i].id, groups[i].priority, hdl) < 0);
+  }
+
+  airptp_logmsg("Registered %d groups and %d peers with new airptp daemon, %d errors", num_groups, num_peers, errors);
+  return 0;
+}
+
+// Closes the FIFO, if there is one, so the next attach can open the new one
+static void
+detach(struct airptp_handle *hdl)
+{
+  pthread_mutex_lock(&hdl->reg_lock);
+  if (hdl->liveness_fd >= 0)
+    close(hdl->liveness_fd);
+  hdl->liveness_fd = -1;
+  pthread_mutex_unlock(&hdl->reg_lock);
+}
+
+// Started after the handle has attached, see airptp_daemon_find()
+static void *
+run(void *arg)
+{
+  struct airptp_handle *hdl = arg;
+  struct pollfd pfd[2];
+  bool is_attached = true;
+  bool is_unanswered_logged = false;
+  int nfds;
+  int ret;
+
+  airptp_callbacks_register(&hdl->watch_cb);
+  airptp_thread_name_set("libairptp watch");
+
+  for (;;) {
+    pfd[0].fd = hdl->watch_pipe[0];
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd = hdl->liveness_fd;
+    pfd[1].events = POLLIN;
+    pfd[1].revents = 0;
+    nfds = (is_attached && hdl->liveness_fd >= 0) ? 2 : 1;
+
+    ret = poll(pfd, nfds, is_attached ? RECONNECT_CHECK_MS : RECONNECT_RETRY_MS);
+    if (ret < 0 && errno != EINTR)
+      break;
+    if (pfd[0].revents)
+      break; // reconnect_stop()
+
+    if (is_attached) {
+      // The daemon never writes, so anything means it's gone
+      // Checking the ts is the fallback for when there is no POLLHUP
+      if (!pfd[1].revents && info_is_fresh(hdl->shm_info))
+	continue;
+
+      airptp_logmsg("airptp daemon is gone, waiting for it to come back");
+
+      detach(hdl);
+      is_attached = false;
+      continue;
+    }
+
+    if (reconnect_attach(hdl) < 0)
+      continue;
+
+    if (reregister(hdl) == 0) {
+      is_attached = true;
+      is_unanswered_logged = false;
+      continue;
+    }
+
+    if (!is_unanswered_logged)
+      airptp_logmsg("Found airptp daemon shm, but the daemon did not accept our registration, retrying");
+    is_unanswered_logged = true;
+
+    detach(hdl);
+  }
+
+  pthread_exit(NULL);
+}
+
+int
+reconnect_start(struct airptp_handle *hdl, struct airptp_callbacks cb)
+{
+  int ret;
+
+  ret = pipe(hdl->watch_pipe);
+  if (ret < 0)
+    return -1;
+
+  hdl->watch_cb = cb;
+
+  ret = pthread_create(&hdl->watch_tid, NULL, run, hdl);
+  if (ret != 0) {
+    close(hdl->watch_pipe[0]);
+    close(hdl->watch_pipe[1]);
+    return -1;
+  }
+
+  hdl->is_watching = true;
+  return 0;
+}
+
+void
+reconnect_stop(struct airptp_handle *hdl)
+{
+  ssize_t len;
+
+  if (!hdl->is_watching)
+    return;
+
+  len = write(hdl->watch_pipe[1], "x", 1);
+  if (len == 1)
+    pthread_join(hdl->watch_tid, NULL);
+  else
+    pthread_cancel(hdl->watch_tid);
+
+  close(hdl->watch_pipe[0]);
+  close(hdl->watch_pipe[1]);
+  hdl->is_watching = false;
+}
+
+void
+reconnect_peer_remember(struct airptp_handle *hdl, uint32_t peer_id, const char *addr, unsigned short event_port, uint32_t group_id)
+{
+  struct airptp_reg_peer *peer = NULL;
+  int i;
+
+  if (hdl->is_daemon)
+    return;
+
+  pthread_mutex_lock(&hdl->reg_lock);
+
+  for (i = 0; i < hdl->num_reg_peers && !peer; i++) {
+    if (hdl->reg_peers[i].id == peer_id)
+      peer = &hdl->reg_peers[i];
+  }
+
+  // The daemon's quota means there is room, unless it has been changed
+  if (!peer && hdl->num_reg_peers < AIRPTP_CLIENT_MAX_PEERS)
+    peer = &hdl->reg_peers[hdl->num_reg_peers++];
+
+  if (peer) {
+    peer->id = peer_id;
+    snprintf(peer->addr, sizeof(peer->addr), "%s", addr);
+    peer->event_port = event_port;
+    peer->group_id = group_id;
+  }
+
+  pthread_mutex_unlock(&hdl->reg_lock);
+}
+
+static void
+peer_forget(struct airptp_handle *hdl, int i)
+{
+  hdl->num_reg_peers--;
+  if (i < hdl->num_reg_peers)
+    memmove(&hdl->reg_peers[i], &hdl->reg_peers[i + 1], (hdl->num_reg_peers - i) * sizeof(struct airptp_reg_peer));
+}
+
+void
+reconnect_peer_forget(struct airptp_handle *hdl, uint32_t peer_id)
+{
+  int i;
+
+  if (hdl->is_daemon)
+    return;
+
+  pthread_mutex_lock(&hdl->reg_lock);
+
+  for (i = 0; i < hdl->num_reg_peers; i++) {
+    if (hdl->reg_peers[i].id == peer_id) {
+      peer_forget(hdl, i);
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&hdl->reg_lock);
+}
+
+void
+reconnect_group_remember(struct airptp_handle *hdl, uint32_t group_id, const char *name)
+{
+  struct airptp_reg_group *group;
+  int i;
+
+  if (hdl->is_daemon)
+    return;
+
+  pthread_mutex_lock(&hdl->reg_lock);
+
+  for (i = 0; i < hdl->num_reg_groups; i++) {
+    if (hdl->reg_groups[i].id == group_id)
+      goto out;
+  }
+
+  if (hdl->num_reg_groups < AIRPTP_CLIENT_MAX_GROUPS) {
+    group = &hdl->reg_groups[hdl->num_reg_groups++];
+    memset(group, 0, sizeof(struct airptp_reg_group));
+    group->id = group_id;
+    snprintf(group->name, sizeof(group->name), "%s", name);
+  }
+
+ out:
+  pthread_mutex_unlock(&hdl->reg_lock);
+}
+
+void
+reconnect_group_update(struct airptp_handle *hdl, uint32_t group_id, enum airptp_group_cmd cmd, uint8_t priority)
+{
+  struct airptp_reg_group *group = NULL;
+  int i;
+
+  if (hdl->is_daemon)
+    return;
+
+  pthread_mutex_lock(&hdl->reg_lock);
+
+  for (i = 0; i < hdl->num_reg_groups && !group; i++) {
+    if (hdl->reg_groups[i].id == group_id)
+      group = &hdl->reg_groups[i];
+  }
+  if (!group)
+    goto out;
+
+  switch (cmd)
+    {
+      case AIRPTP_GROUP_CMD_START:
+	group->is_started = true;
+	group->priority = priority;
+	break;
+      case AIRPTP_GROUP_CMD_STOP:
+	group->is_started = false;
+	break;
+      case AIRPTP_GROUP_CMD_PRIORITY:
+	group->priority = priority;
+	break;
+      case AIRPTP_GROUP_CMD_REMOVE:
+	for (i = hdl->num_reg_peers - 1; i >= 0; i--) {
+	  if (hdl->reg_peers[i].group_id == group_id)
+	    peer_forget(hdl, i);
+	}
+	hdl->num_reg_groups--;
+	i = group - hdl->reg_groups;
+	if (i < hdl->num_reg_groups)
+	  memmove(group, group + 1, (hdl->num_reg_groups - i) * sizeof(struct airptp_reg_group));
+	break;
+      default:
+	break;
+    }
+
+ out:
+  pthread_mutex_unlock(&hdl->reg_lock);
+}
@@ -0,0 +1,35 @@
+#ifndef __AIRPTP_RECONNECT_H__
+#define __AIRPTP_RECONNECT_H__
+
+#include "airptp_internal.h"
+
+// Maps the shm of a running daemon and opens its liveness FIFO, if it has one.
+// On success the handle's shm_info, daemon_info and liveness_fd are replaced,
+// and the ports are set to the daemon's. Sets airptp_errmsg on error.
+int
+reconnect_attach(struct airptp_handle *hdl);
+
+// Starts a thread that watches the daemon, and when it is gone waits for a
+// new one and registers the handle's peers and groups with it
+int
+reconnect_start(struct airptp_handle *hdl, struct airptp_callbacks cb);
+
+void
+reconnect_stop(struct airptp_handle *hdl);
+
+// The below record what the handle has registered, they do nothing for a
+// daemon's own handle
+void
+reconnect_peer_remember(struct airptp_handle *hdl, uint32_t peer_id, const char *addr, unsigned short event_port, uint32_t group_id);
+
+void
+reconnect_peer_forget(struct airptp_handle *hdl, uint32_t peer_id);
+
+void
+reconnect_group_remember(struct airptp_handle *hdl, uint32_t group_id, const char *name);
+
+// Also forgets the group's peers if cmd is AIRPTP_GROUP_CMD_REMOVE
+void
+reconnect_group_update(struct airptp_handle *hdl, uint32_t group_id, enum airptp_group_cmd cmd, uint8_t priority);
+
+#endif // __AIRPTP_RECONNECT_H__
@@ -0,0 +1,346 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "rx_worker.h"
+#include "daemon.h"
+#include "sockfilter.h"
+#include "snapshot.h"
+#include "ptp_msg_handle.h"
+#include "ptp_definitions.h"
+
+// Rx workers each have a socket in a SO_REUSEPORT group with the event socket,
+// and the kernel spreads incoming packets over them by source address. A
+// worker answers Delay_Req itself, using only the snapshot of peer state the
+// daemon thread has published (see snapshot.c). Anything else is passed to the
+// daemon thread, and so are answered Delay_Req from peers, for their sync
+// quality.
+
+
+/* ------------------------------ Worker thread ----------------------------- */
+
+static void
+forward(struct airptp_rx_worker *worker, uint8_t *msg, ssize_t msg_len, union utils_net_sockaddr *peer_addr, socklen_t peer_addrlen, uint64_t rx_ns)
+{
+  struct rx_forward_header header = { .addr = *peer_addr, .addrlen = peer_addrlen, .rx_ns = rx_ns };
+  struct iovec iov[2] = { { &header, sizeof(header) }, { msg, msg_len } };
+  struct msghdr mh = { .msg_iov = iov, .msg_iovlen = 2 };
+
+  // Non-blocking, so drops if the daemon thread is behind
+  if (sendmsg(worker->daemon->rx_forward[1], &mh, MSG_DONTWAIT) < 0)
+    airptp_logmsg("Rx worker couldn't forward message: %s", strerror(errno));
+}
+
+static int
+snapshot_peer_find(struct airptp_snapshot *snapshot, union utils_net_sockaddr *peer_addr)
+{
+  int i;
+
+  for (i = 0; i < snapshot->num_peers; i++) {
+    if (utils_net_address_is_same(peer_addr, &snapshot->peer_addrs[i]))
+      return i;
+  }
+
+  return -1;
+}
+
+static void
+worker_incoming_cb(int fd, short what, void *arg)
+{
+  struct airptp_rx_worker *worker = arg;
+  struct airptp_daemon *daemon = worker->daemon;
+  struct airptp_snapshot *snapshot;
+  union utils_net_sockaddr peer_addr;
+  socklen_t peer_addrlen = sizeof(peer_addr);
+  struct ptp_msg_view view;
+  uint8_t req[1024];
+  ssize_t len;
+  uint64_t rx_ns = 0;
+  unsigned short resp_port;
+  int i;
+
+  peer_addr.sa.sa_family = AF_UNSPEC;
+
+  len = recvfrom(fd, req, sizeof(req), 0, &peer_addr.sa, &peer_addrlen);
+  if (len <= 0 || peer_addr.sa.sa_family == AF_UNSPEC)
+    return;
+
+  STATS_INC(daemon, rx_packets);
+
+  // Garbage is dropped here, so it doesn't cost the daemon thread anything
+  if (ptp_decode(&view, req, len) < 0) {
+    STATS_INC(daemon, rx_dropped_invalid);
+    return;
+  }
+
+  if (view.type != PTP_MSGTYPE_DELAY_REQ) {
+    forward(worker, req, len, &peer_addr, peer_addrlen, 0);
+    return;
+  }
+
+  __atomic_store_n(&worker->is_reading, 1, __ATOMIC_SEQ_CST);
+  snapshot = __atomic_load_n(&daemon->snapshot, __ATOMIC_SEQ_CST);
+
+  i = snapshot_peer_find(snapshot, &peer_addr);
+  if (i >= 0)
+    __atomic_store_n(&snapshot->last_seen[i], time(NULL), __ATOMIC_RELAXED);
+
+  resp_port = (i >= 0) ? daemon_peer_port(daemon, &snapshot->peer_addrs[i], &daemon->general_svc) : daemon->general_svc.port;
+
+  if (daemon_incoming_admit(daemon, &worker->ratelimit, &view, req, len, &peer_addr, i >= 0))
+    rx_ns = ptp_msg_delay_req_handle(&daemon->general_svc, snapshot->clock_id, &daemon->ts_timeline, &view, &peer_addr, resp_port);
+
+  __atomic_store_n(&worker->is_reading, 0, __ATOMIC_RELEASE);
+
+  if (rx_ns && i >= 0)
+    forward(worker, req, len, &peer_addr, peer_addrlen, rx_ns);
+}
+
+static void
+worker_exit_cb(int fd, short what, void *arg)
+{
+  struct airptp_rx_worker *worker = arg;
+
+  event_base_loopbreak(worker->evbase);
+}
+
+static void *
+worker_run(void *arg)
+{
+  struct airptp_rx_worker *worker = arg;
+
+  airptp_callbacks_register(&worker->daemon->cb);
+  airptp_thread_name_set("libairptp rx");
+
+  event_base_dispatch(worker->evbase);
+
+  pthread_exit(NULL);
+}
+
+
+/* ------------------------------ Daemon thread ----------------------------- */
+
+static void
+worker_cleanup(struct airptp_rx_worker *worker)
+{
+  if (worker->svc.ev4)
+    event_free(worker->svc.ev4);
+  if (worker->svc.ev6)
+    event_free(worker->svc.ev6);
+  if (worker->exit_ev)
+    event_free(worker->exit_ev);
+  if (worker->evbase)
+    event_base_free(worker->evbase);
+  if (worker->exit_pipe[0] > 0)
+    close(worker->exit_pipe[0]);
+  if (worker->exit_pipe[1] > 0)
+    close(worker->exit_pipe[1]);
+
+  worker->svc.ev4 = NULL;
+  worker->svc.ev6 = NULL;
+  worker->exit_ev = NULL;
+  worker->evbase = NULL;
+  worker->exit_pipe[0] = -1;
+  worker->exit_pipe[1] = -1;
+}
+
+static int
+worker_start(struct airptp_rx_worker *worker, struct airptp_daemon *daemon)
+{
+  struct airptp_service *svc = &worker->svc;
+  int ret;
+
+  worker->daemon = daemon;
+  ratelimit_init(&worker->ratelimit, daemon->config.ratelimit_rate, daemon->config.ratelimit_burst);
+
+  ret = pipe(worker->exit_pipe);
+  if (ret < 0)
+    goto error;
+
+  worker->evbase = event_base_new();
+  if (!worker->evbase)
+    goto error;
+
+  worker->exit_ev = event_new(worker->evbase, worker->exit_pipe[0], EV_READ, worker_exit_cb, worker);
+  if (!worker->exit_ev)
+    goto error;
+  event_add(worker->exit_ev, NULL);
+
+  if (svc->socket.fd4 >= 0) {
+    svc->ev4 = event_new(worker->evbase, svc->socket.fd4, EV_READ | EV_PERSIST, worker_incoming_cb, worker);
+    if (!svc->ev4)
+      goto error;
+    event_add(svc->ev4, NULL);
+  }
+
+  if (svc->socket.fd6 >= 0) {
+    svc->ev6 = event_new(worker->evbase, svc->socket.fd6, EV_READ | EV_PERSIST, worker_incoming_cb, worker);
+    if (!svc->ev6)
+      goto error;
+    event_add(svc->ev6, NULL);
+  }
+
+  ret = pthread_create(&worker->tid, NULL, worker_run, worker);
+  if (ret != 0)
+    goto error;
+
+  return 0;
+
+ error:
+  worker_cleanup(worker);
+  return -1;
+}
+
+static void
+worker_stop(struct airptp_rx_worker *worker)
+{
+  char byte = 1;
+
+  if (!worker->evbase)
+    return;
+
+  if (write(worker->exit_pipe[1], &byte, 1) == 1)
+    pthread_join(worker->tid, NULL);
+
+  worker_cleanup(worker);
+}
+
+int
+rx_workers_start(struct airptp_daemon *daemon, event_callback_fn forward_cb)
+{
+  int i;
+
+  if (daemon->num_rx_workers == 0)
+    return 0;
+
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, daemon->rx_forward) < 0)
+    goto error;
+
+  daemon->rx_forward_ev = event_new(daemon->evbase, daemon->rx_forward[0], EV_READ | EV_PERSIST, forward_cb, daemon);
+  if (!daemon->rx_forward_ev)
+    goto error;
+  event_add(daemon->rx_forward_ev, NULL);
+
+  for (i = 0; i < daemon->num_rx_workers; i++) {
+    if (worker_start(&daemon->rx_workers[i], daemon) < 0)
+      goto error;
+  }
+
+  airptp_logmsg("Started %d rx workers", daemon->num_rx_workers);
+  return 0;
+
+ error:
+  rx_workers_stop(daemon);
+  return -1;
+}
+
+void
+rx_workers_stop(struct airptp_daemon *daemon)
+{
+  int i;
+
+  for (i = 0; i < daemon->num_rx_workers; i++)
+    worker_stop(&daemon->rx_workers[i]);
+
+  if (daemon->rx_forward_ev)
+    event_free(daemon->rx_forward_ev);
+  if (daemon->rx_forward[0] > 0)
+    close(daemon->rx_forward[0]);
+  if (daemon->rx_forward[1] > 0)
+    close(daemon->rx_forward[1]);
+
+  daemon->rx_forward_ev = NULL;
+  daemon->rx_forward[0] = -1;
+  daemon->rx_forward[1] = -1;
+}
+
+
+/* ------------------------------ Caller thread ----------------------------- */
+
+void
+rx_workers_close(struct airptp_daemon *daemon)
+{
+  int i;
+
+  for (i = 0; i < daemon->num_rx_workers; i++)
+    utils_net_socket_close(&daemon->rx_workers[i].svc.socket);
+
+  daemon->num_rx_workers = 0;
+}
+
+// The event socket must be rebound, since all sockets in a SO_REUSEPORT group
+// must have the option set before binding. This is done at the time of setting
+// the option, since the caller will still have the privileges it had for
+// binding.
+int
+rx_workers_bind(struct airptp_daemon *daemon, int num_workers)
+{
+  struct utils_net_socket *event_socket = &daemon->event_svc.socket;
+  unsigned short port = daemon->event_svc.port;
+  int i;
+
+  rx_workers_close(daemon);
+  utils_net_socket_close(event_socket);
+
+  // Connected peer sockets also need the event socket in a group
+  if (num_workers == 0 && daemon->config.connected_peers)
+    return utils_net_bind_reuseport(event_socket, daemon->bind_node, port);
+  else if (num_workers == 0)
+    return utils_net_bind(event_socket, daemon->bind_node, port);
+
+  if (utils_net_bind_reuseport(event_socket, daemon->bind_node, port) < 0)
+    goto error;
+
+  for (i = 0; i < num_workers; i++) {
+    daemon->rx_workers[i].svc.port = port;
+    if (utils_net_bind_reuseport(&daemon->rx_workers[i].svc.socket, daemon->bind_node, port) < 0)
+      goto error;
+
+    daemon->num_rx_workers++;
+  }
+
+  if (sockfilter_steer_attach(event_socket, num_workers) < 0)
+    airptp_logmsg("Could not attach rx worker steering program, the daemon thread will also get Delay_Req");
+
+  return 0;
+
+ error:
+  rx_workers_close(daemon);
+  utils_net_socket_close(event_socket);
+  // Try to get back to where we were
+  if (daemon->config.connected_peers)
+    utils_net_bind_reuseport(event_socket, daemon->bind_node, port);
+  else
+    utils_net_bind(event_socket, daemon->bind_node, port);
+  return -1;
+}
@@ -0,0 +1,32 @@
+#ifndef __AIRPTP_RX_WORKER_H__
+#define __AIRPTP_RX_WORKER_H__
+
+#include "airptp_internal.h"
+
+// Prepended to messages that the workers pass on to the daemon thread
+struct rx_forward_header
+{
+  union utils_net_sockaddr addr;
+  socklen_t addrlen;
+  // Set for Delay_Req that the worker has answered, to when it received it
+  uint64_t rx_ns;
+};
+
+// Called before the daemon is started. Rebinds the event port with
+// SO_REUSEPORT and binds a socket for each worker. A num_workers of 0 goes back
+// to a single event socket.
+int
+rx_workers_bind(struct airptp_daemon *daemon, int num_workers);
+
+void
+rx_workers_close(struct airptp_daemon *daemon);
+
+// The below must be called from the daemon thread. forward_cb gets messages
+// from rx_forward[0], each starting with a struct rx_forward_header.
+int
+rx_workers_start(struct airptp_daemon *daemon, event_callback_fn forward_cb);
+
+void
+rx_workers_stop(struct airptp_daemon *daemon);
+
+#endif // __AIRPTP_RX_WORKER_H__
@@ -0,0 +1,359 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "slave.h"
+#include "daemon.h"
+#include "timesource.h"
+#include "ptp_msg_handle.h"
+#include "bmca.h"
+
+// Following a master. We don't touch the system clock, instead we keep a
+// virtual clock on top of the timebase, which is what struct airptp_timemap
+// describes, and which is published for airptp_ptp_time_get(). With t1/t4 the
+// master's send/receive times and t2/t3 ours of Sync and Delay_Req, mapped to
+// the virtual clock by v():
+//
+//   path_delay = ((v(t2) - t1) + (t4 - v(t3))) / 2
+//   offset = v(t2) - t1 - path_delay
+//
+// The clock is stepped if it is more than SLAVE_STEP_NS off, otherwise a PI
+// servo sets its rate. The gains are linuxptp's defaults for software
+// timestamps, which unlike its hardware ones don't scale with the Sync interval.
+//
+// A hot standby (AIRPTP_OPT_STANDBY) takes over when the master's Sync stop for
+// standby_ms. The virtual clock then becomes our timeline (see
+// timesource_timeline_set()), holding the last rate, so receivers see the time
+// continue without a jump and only have to switch to our clock identity.
+//
+// A boundary clock (AIRPTP_OPT_BOUNDARY) makes the virtual clock its timeline
+// after every sample, and serves its peers with it. Our Sync carry no
+// correction, since the path delay to the master is taken out by the servo and
+// the timestamps are our own, not the master's passed on.
+
+#define SLAVE_STEP_NS 1000000
+#define SLAVE_KP 0.1
+#define SLAVE_KI 0.001
+#define SLAVE_MAX_PPB 500000.0
+
+// Locked when within SLAVE_LOCK_NS for SLAVE_LOCK_SAMPLES in a row, unlocked
+// again beyond SLAVE_UNLOCK_NS
+#define SLAVE_LOCK_NS 100000
+#define SLAVE_LOCK_SAMPLES 8
+#define SLAVE_UNLOCK_NS 500000
+
+#define SLAVE_DELAY_REQ_INTERVAL_MS 500
+// A Delay_Req without a Delay_Resp after this is considered lost
+#define SLAVE_DELAY_REQ_TIMEOUT_MS 2000
+#define SLAVE_DELAY_EWMA_DIV 8
+
+static uint64_t
+local_now_ns(void)
+{
+  struct timespec ts;
+
+  timesource_get(&ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t
+timemap_apply(struct airptp_timemap *tm, uint64_t local_ns)
+{
+  int64_t elapsed_ns = local_ns - tm->local_ns;
+
+  return tm->ptp_ns + elapsed_ns + (int64_t)(elapsed_ns * tm->rate_ppb / 1e9);
+}
+
+static void
+publish(struct airptp_daemon *daemon)
+{
+  struct airptp_daemon_info *info = daemon->info;
+  struct airptp_slave *slave = &daemon->slave;
+  struct airptp_timemap *tm = (daemon->port_state == AIRPTP_PORT_SLAVE) ? &slave->timemap : &daemon->timeline;
+  uint32_t seq = info->slave_seq;
+
+  __atomic_store_n(&info->slave_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  memcpy(&info->slave, &slave->info, sizeof(struct airptp_slave_info));
+  memcpy(&info->timemap, tm, sizeof(struct airptp_timemap));
+
+  __atomic_store_n(&info->slave_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void
+delay_req_send(struct airptp_daemon *daemon)
+{
+  struct airptp_slave *slave = &daemon->slave;
+  uint64_t now_ms = daemon_now_ms();
+
+  if (slave->t3_ns && slave->last_delay_req_ms + SLAVE_DELAY_REQ_TIMEOUT_MS > now_ms)
+    return;
+  if (slave->last_delay_req_ms + SLAVE_DELAY_REQ_INTERVAL_MS > now_ms)
+    return;
+
+  slave->delay_req_seq++;
+  slave->t3_ns = ptp_msg_delay_req_send(daemon, &slave->master_addr, slave->delay_req_seq, timemap_apply(&slave->timemap, local_now_ns()));
+  slave->last_delay_req_ms = now_ms;
+}
+
+static void
+timeline_set(struct airptp_daemon *daemon)
+{
+  struct airptp_timemap *tm = &daemon->slave.timemap;
+  bool was_set = (daemon->timeline.local_ns != 0);
+
+  daemon->timeline = *tm;
+  timesource_timeline_set(&daemon->ts_timeline, tm->local_ns, tm->ptp_ns, tm->rate_ppb);
+
+  // A boundary clock starts serving its peers now
+  if (!was_set)
+    daemon_port_state_set(daemon, daemon->port_state);
+}
+
+static void
+standby_timer_set(struct airptp_daemon *daemon)
+{
+  struct timeval tv = {
+    .tv_sec = daemon->config.standby_ms / 1000,
+    .tv_usec = (daemon->config.standby_ms % 1000) * 1000
+  };
+
+  if (daemon->standby_timer)
+    evtimer_add(daemon->standby_timer, &tv);
+}
+
+static void
+clock_step(struct airptp_slave *slave, uint64_t t2_ns, uint64_t master_ns)
+{
+  if (slave->info.state != AIRPTP_SERVO_NONE)
+    airptp_logmsg("Clock is %" PRIi64 " ns off master %" PRIx64 ", stepping", slave->info.offset_ns, slave->master_clock_id);
+
+  slave->timemap.local_ns = t2_ns;
+  slave->timemap.ptp_ns = master_ns;
+  slave->in_range = 0;
+
+  // A Delay_Req sent before the step would give a bogus path delay
+  slave->t3_ns = 0;
+
+  slave->info.state = AIRPTP_SERVO_UNLOCKED;
+  slave->info.steps++;
+}
+
+static void
+clock_slew(struct airptp_slave *slave, uint64_t t2_ns, int64_t offset_ns)
+{
+  double rate_ppb;
+
+  slave->integral_ppb += SLAVE_KI * offset_ns;
+  if (slave->integral_ppb > SLAVE_MAX_PPB)
+    slave->integral_ppb = SLAVE_MAX_PPB;
+  else if (slave->integral_ppb < -SLAVE_MAX_PPB)
+    slave->integral_ppb = -SLAVE_MAX_PPB;
+
+  rate_ppb = -(SLAVE_KP * offset_ns + slave->integral_ppb);
+  if (rate_ppb > SLAVE_MAX_PPB)
+    rate_ppb = SLAVE_MAX_PPB;
+  else if (rate_ppb < -SLAVE_MAX_PPB)
+    rate_ppb = -SLAVE_MAX_PPB;
+
+  // Rebase, so the new rate applies from now on
+  slave->timemap.ptp_ns = timemap_apply(&slave->timemap, t2_ns);
+  slave->timemap.local_ns = t2_ns;
+  slave->timemap.rate_ppb = rate_ppb;
+}
+
+static void
+sample_add(struct airptp_daemon *daemon, uint64_t t1_ns, uint64_t t2_ns)
+{
+  struct airptp_slave *slave = &daemon->slave;
+  struct airptp_slave_info *si = &slave->info;
+  bool stepped = false;
+  int64_t offset_ns;
+
+  if (si->state == AIRPTP_SERVO_NONE) {
+    clock_step(slave, t2_ns, t1_ns + slave->path_delay_ns);
+    si->offset_ns = 0;
+    stepped = true;
+  } else {
+    offset_ns = (int64_t)(timemap_apply(&slave->timemap, t2_ns) - t1_ns) - slave->path_delay_ns;
+    si->offset_ns = offset_ns;
+
+    if (llabs(offset_ns) > SLAVE_STEP_NS) {
+      clock_step(slave, t2_ns, t1_ns + slave->path_delay_ns);
+      stepped = true;
+    } else {
+      clock_slew(slave, t2_ns, offset_ns);
+
+      if (llabs(offset_ns) > SLAVE_UNLOCK_NS) {
+	if (si->state == AIRPTP_SERVO_LOCKED)
+	  airptp_logmsg("Lost lock to master %" PRIx64 ", offset %" PRIi64 " ns", slave->master_clock_id, offset_ns);
+	si->state = AIRPTP_SERVO_UNLOCKED;
+	slave->in_range = 0;
+      } else if (llabs(offset_ns) <= SLAVE_LOCK_NS && slave->has_path_delay) {
+	slave->in_range++;
+	if (si->state == AIRPTP_SERVO_UNLOCKED && slave->in_range >= SLAVE_LOCK_SAMPLES) {
+	  airptp_logmsg("Locked to master %" PRIx64 ", offset %" PRIi64 " ns, path delay %" PRIi64 " ns", slave->master_clock_id, offset_ns, slave->path_delay_ns);
+	  si->state = AIRPTP_SERVO_LOCKED;
+	}
+      } else {
+	slave->in_range = 0;
+      }
+    }
+  }
+
+  si->path_delay_ns = slave->path_delay_ns;
+  si->freq_ppb = slave->timemap.rate_ppb;
+  si->samples++;
+
+  if (daemon->config.boundary)
+    timeline_set(daemon);
+
+  publish(daemon);
+
+  // After a step v(t2) - t1 is just our path delay estimate, so wait for the
+  // next Sync before measuring. Slewing doesn't change v(t2).
+  if (stepped)
+    return;
+
+  slave->last_ms_ns = (int64_t)(timemap_apply(&slave->timemap, t2_ns) - t1_ns);
+  delay_req_send(daemon);
+}
+
+void
+slave_master_set(struct airptp_daemon *daemon, struct airptp_foreign_master *fm)
+{
+  struct airptp_slave *slave = &daemon->slave;
+  uint64_t clock_id = fm ? fm->clock_id : 0;
+
+  if (slave->master_clock_id == clock_id)
+    return;
+
+  if (clock_id)
+    airptp_logmsg("Following master %" PRIx64, clock_id);
+  else if (slave->master_clock_id)
+    airptp_logmsg("No longer following master %" PRIx64, slave->master_clock_id);
+
+  memset(slave, 0, sizeof(struct airptp_slave));
+  slave->master_clock_id = clock_id;
+  slave->info.master_clock_id = clock_id;
+
+  // Also covers a master we never get Sync from
+  if (clock_id)
+    standby_timer_set(daemon);
+  else if (daemon->standby_timer)
+    evtimer_del(daemon->standby_timer);
+
+  publish(daemon);
+}
+
+void
+slave_takeover(struct airptp_daemon *daemon)
+{
+  struct airptp_slave *slave = &daemon->slave;
+  struct airptp_timemap *tm = &slave->timemap;
+
+  if (!slave->master_clock_id)
+    return;
+
+  if (slave->info.state == AIRPTP_SERVO_NONE) {
+    airptp_logmsg("No Sync from master %" PRIx64 " for %d ms, taking over with our own timeline", slave->master_clock_id, daemon->config.standby_ms);
+  } else {
+    airptp_logmsg("No Sync from master %" PRIx64 " for %d ms, taking over its timeline (offset was %" PRIi64 " ns, freq %.1f ppb)",
+      slave->master_clock_id, daemon->config.standby_ms, slave->info.offset_ns, tm->rate_ppb);
+
+    timeline_set(daemon);
+  }
+
+  bmca_master_lost(daemon, slave->master_clock_id);
+}
+
+void
+slave_sync_received(struct airptp_daemon *daemon, uint64_t clock_id, union utils_net_sockaddr *addr, uint16_t seq, uint64_t t1_ns, uint64_t t2_ns, int64_t correction_ns)
+{
+  struct airptp_slave *slave = &daemon->slave;
+
+  if (!slave->master_clock_id || clock_id != slave->master_clock_id)
+    return;
+
+  // Delay_Req go to where the Sync come from, i.e. the master's event port
+  slave->master_addr = *addr;
+
+  standby_timer_set(daemon);
+
+  if (t1_ns) {
+    slave->t2_ns = 0;
+    sample_add(daemon, t1_ns + correction_ns, t2_ns);
+    return;
+  }
+
+  slave->sync_seq = seq;
+  slave->t2_ns = t2_ns;
+  slave->sync_correction_ns = correction_ns;
+}
+
+void
+slave_follow_up_received(struct airptp_daemon *daemon, uint64_t clock_id, uint16_t seq, uint64_t t1_ns, int64_t correction_ns)
+{
+  struct airptp_slave *slave = &daemon->slave;
+
+  if (!slave->master_clock_id || clock_id != slave->master_clock_id)
+    return;
+  if (!slave->t2_ns || seq != slave->sync_seq)
+    return;
+
+  sample_add(daemon, t1_ns + slave->sync_correction_ns + correction_ns, slave->t2_ns);
+  slave->t2_ns = 0;
+}
+
+void
+slave_delay_resp_received(struct airptp_daemon *daemon, uint64_t clock_id, uint16_t seq, uint64_t t4_ns, int64_t correction_ns)
+{
+  struct airptp_slave *slave = &daemon->slave;
+  int64_t delay_ns;
+
+  if (!slave->master_clock_id || clock_id != slave->master_clock_id)
+    return;
+  if (!slave->t3_ns || seq != slave->delay_req_seq || slave->info.state == AIRPTP_SERVO_NONE)
+    return;
+
+  delay_ns = (slave->last_ms_ns + (int64_t)(t4_ns - correction_ns - timemap_apply(&slave->timemap, slave->t3_ns))) / 2;
+  slave->t3_ns = 0;
+
+  // Only possible if the clock stepped in between
+  if (delay_ns < 0)
+    return;
+
+  if (!slave->has_path_delay)
+    slave->path_delay_ns = delay_ns;
+  else
+    slave->path_delay_ns += (delay_ns - slave->path_delay_ns) / SLAVE_DELAY_EWMA_DIV;
+
+  slave->has_path_delay = true;
+}
@@ -0,0 +1,30 @@
+#ifndef __AIRPTP_SLAVE_H__
+#define __AIRPTP_SLAVE_H__
+
+#include <stdbool.h>
+
+#include "airptp_internal.h"
+
+// Starts following the master, or stops following if NULL. Called by the BMCA
+// when the best master changes.
+void
+slave_master_set(struct airptp_daemon *daemon, struct airptp_foreign_master *fm);
+
+// With AIRPTP_OPT_STANDBY, called when the master's Sync have stopped. We
+// continue its timeline as master.
+void
+slave_takeover(struct airptp_daemon *daemon);
+
+// From a Sync, t2_ns is when we received it. t1_ns is 0 if the master is
+// two-step, in which case the Follow_Up completes the sample.
+void
+slave_sync_received(struct airptp_daemon *daemon, uint64_t clock_id, union utils_net_sockaddr *addr, uint16_t seq, uint64_t t1_ns, uint64_t t2_ns, int64_t correction_ns);
+
+void
+slave_follow_up_received(struct airptp_daemon *daemon, uint64_t clock_id, uint16_t seq, uint64_t t1_ns, int64_t correction_ns);
+
+// From the Delay_Resp to our Delay_Req, t4_ns is when the master received it
+void
+slave_delay_resp_received(struct airptp_daemon *daemon, uint64_t clock_id, uint16_t seq, uint64_t t4_ns, int64_t correction_ns);
+
+#endif // __AIRPTP_SLAVE_H__
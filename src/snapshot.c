@@ -0,0 +1,182 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "daemon.h"
+#include "bmca.h"
+
+// Snapshots are replaced, never modified (apart from the fields readers use to
+// report back), and the old one is freed when no reader can be using it. A
+// reader sets its is_reading before loading the snapshot pointer, and the
+// daemon thread checks is_reading after swapping the pointer, both seq_cst. So
+// if the daemon thread sees no reader, any later load gets the new snapshot,
+// and the retired ones can be freed. Neither side ever waits for the other.
+
+static bool
+readers_active(struct airptp_daemon *daemon)
+{
+  int i;
+
+  for (i = 0; i < daemon->num_rx_workers; i++) {
+    if (__atomic_load_n(&daemon->rx_workers[i].is_reading, __ATOMIC_SEQ_CST))
+      return true;
+  }
+
+  return __atomic_load_n(&daemon->tx.is_reading, __ATOMIC_SEQ_CST);
+}
+
+static void
+retired_free(struct airptp_daemon *daemon)
+{
+  struct airptp_snapshot *snapshot;
+
+  while ((snapshot = daemon->snapshot_retired)) {
+    daemon->snapshot_retired = snapshot->retired_next;
+    free(snapshot);
+  }
+}
+
+static void
+retired_reclaim(struct airptp_daemon *daemon)
+{
+  if (!daemon->snapshot_retired || readers_active(daemon))
+    return; // Try again later
+
+  retired_free(daemon);
+}
+
+void
+snapshot_publish(struct airptp_daemon *daemon)
+{
+  struct airptp_snapshot *snapshot;
+  struct airptp_snapshot *old;
+  uint64_t now_ms = daemon_now_ms();
+  char byte = 1;
+  int i;
+
+  snapshot = calloc(1, sizeof(struct airptp_snapshot));
+  if (!snapshot) {
+    airptp_logmsg("Out of memory for peer snapshot");
+    return;
+  }
+
+  // Don't lose what the readers have reported since the last snapshot
+  snapshot_fold(daemon);
+
+  snapshot->clock_id = daemon->clock_id;
+  bmca_dataset_announced(&snapshot->dataset, daemon);
+  snapshot->num_peers = daemon->num_peers;
+  for (i = 0; i < daemon->num_peers; i++) {
+    snapshot->peer_ids[i] = daemon->peers[i].id;
+    snapshot->peer_addrs[i] = daemon->peers[i].naddr;
+  }
+
+  for (i = 0; i < daemon->num_tx; i++) {
+    if (daemon->peers[daemon->tx_order[i]].is_active && daemon_peer_send_due(&daemon->peers[daemon->tx_order[i]], now_ms))
+      snapshot->tx_order[snapshot->num_tx++] = daemon->tx_order[i];
+  }
+
+  old = __atomic_exchange_n(&daemon->snapshot, snapshot, __ATOMIC_SEQ_CST);
+  if (old) {
+    old->retired_next = daemon->snapshot_retired;
+    daemon->snapshot_retired = old;
+  }
+
+  retired_reclaim(daemon);
+
+  if (daemon->tx.notify_pipe[1] > 0 && write(daemon->tx.notify_pipe[1], &byte, 1) < 0)
+    airptp_logmsg("Error notifying tx thread of new snapshot");
+}
+
+bool
+snapshot_fold(struct airptp_daemon *daemon)
+{
+  struct airptp_snapshot *snapshot = daemon->snapshot;
+  struct airptp_peer *peer;
+  uint64_t last_seen;
+  uint64_t now = time(NULL);
+  uint64_t now_ms = daemon_now_ms();
+  bool changed = false;
+  bool was_sending;
+  bool is_sending;
+  int err;
+  int i;
+  int j;
+
+  if (!snapshot)
+    return false;
+
+  for (i = 0; i < snapshot->num_peers; i++) {
+    for (j = 0, peer = NULL; j < daemon->num_peers && !peer; j++) {
+      if (daemon->peers[j].id == snapshot->peer_ids[i])
+	peer = &daemon->peers[j];
+    }
+    if (!peer)
+      continue;
+
+    last_seen = __atomic_load_n(&snapshot->last_seen[i], __ATOMIC_RELAXED);
+    if (peer->last_seen < last_seen)
+      peer->last_seen = last_seen;
+
+    // Only the last result since the previous fold counts, so the tx thread's
+    // peers back off a bit slower than the daemon thread's
+    err = __atomic_exchange_n(&snapshot->send_errno[i], 0, __ATOMIC_RELAXED);
+    if (err != 0)
+      daemon_peer_send_result(daemon, peer, (err > 0) ? err : 0);
+
+    // Same as what peers_msg_send() does when sending from the daemon thread.
+    // A peer that starts or stops backing off also means a new snapshot.
+    daemon_peer_active_set(daemon, peer, (peer->last_seen + AIRPTP_STALE_SECS > now) && (peer->send_errors < AIRPTP_SEND_MAX_ERRORS));
+
+    for (j = 0, was_sending = false; j < snapshot->num_tx && !was_sending; j++)
+      was_sending = (snapshot->tx_order[j] == i);
+    for (j = 0, is_sending = false; j < daemon->num_tx && !is_sending; j++)
+      is_sending = (&daemon->peers[daemon->tx_order[j]] == peer);
+    is_sending = is_sending && peer->is_active && daemon_peer_send_due(peer, now_ms);
+
+    changed |= (was_sending != is_sending);
+  }
+
+  retired_reclaim(daemon);
+
+  return changed;
+}
+
+void
+snapshot_free(struct airptp_daemon *daemon)
+{
+  if (daemon->snapshot) {
+    daemon->snapshot->retired_next = daemon->snapshot_retired;
+    daemon->snapshot_retired = daemon->snapshot;
+    daemon->snapshot = NULL;
+  }
+
+  retired_free(daemon);
+}
@@ -0,0 +1,25 @@
+#ifndef __AIRPTP_SNAPSHOT_H__
+#define __AIRPTP_SNAPSHOT_H__
+
+#include <stdbool.h>
+
+#include "airptp_internal.h"
+
+// All of the below must be called from the daemon thread
+
+// Publishes the current peer list for the rx workers and the tx thread. Must be
+// called when peers are added or removed, or the tx order changes.
+void
+snapshot_publish(struct airptp_daemon *daemon);
+
+// Updates the peer list with what the readers have reported, and frees retired
+// snapshots if possible. Returns true if a peer became active or inactive, in
+// which case a new snapshot should be published. Should be called periodically.
+bool
+snapshot_fold(struct airptp_daemon *daemon);
+
+// Only when there are no readers running
+void
+snapshot_free(struct airptp_daemon *daemon);
+
+#endif // __AIRPTP_SNAPSHOT_H__
@@ -0,0 +1,287 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "sockfilter.h"
+#include "ptp_definitions.h"
+
+#ifdef HAVE_LINUX_FILTER_H
+# include <linux/filter.h>
+#endif
+
+#ifdef HAVE_LINUX_FILTER_H
+
+// Header checks, Announce and loopback checks, final return, plus 2 per ipv4
+// peer or 9 per ipv6 peer
+#define SOCKFILTER_MAX_INSNS (40 + 9 * AIRPTP_MAX_PEERS)
+
+// For UDP sockets the filter sees the packet from the UDP header
+#define PAYLOAD_OFF 8
+
+#define ACCEPT 0xFFFFFFFF
+#define DROP 0
+
+struct prog
+{
+  struct sock_filter insns[SOCKFILTER_MAX_INSNS];
+  int len;
+};
+
+static inline void
+stmt(struct prog *prog, uint16_t code, uint32_t k)
+{
+  prog->insns[prog->len++] = (struct sock_filter)BPF_STMT(code, k);
+}
+
+static inline void
+jump(struct prog *prog, uint16_t code, uint32_t k, uint8_t jt, uint8_t jf)
+{
+  prog->insns[prog->len++] = (struct sock_filter)BPF_JUMP(code, k, jt, jf);
+}
+
+// Drops the packet unless A == k. Keeping the drop right after the test means
+// we never need jumps longer than what fits in jt/jf.
+static void
+require_eq(struct prog *prog, uint32_t k)
+{
+  jump(prog, BPF_JMP | BPF_JEQ | BPF_K, k, 1, 0);
+  stmt(prog, BPF_RET | BPF_K, DROP);
+}
+
+// A packet must look like something we would handle: a PTPv2 header for our
+// domain, with a message type that belongs on this port.
+static void
+header_checks(struct prog *prog, uint16_t msgtype_mask)
+{
+  stmt(prog, BPF_LD | BPF_W | BPF_LEN, 0);
+  jump(prog, BPF_JMP | BPF_JGE | BPF_K, PAYLOAD_OFF + sizeof(struct ptp_header), 1, 0);
+  stmt(prog, BPF_RET | BPF_K, DROP);
+
+  stmt(prog, BPF_LD | BPF_B | BPF_ABS, PAYLOAD_OFF + offsetof(struct ptp_header, versionPTP));
+  stmt(prog, BPF_ALU | BPF_AND | BPF_K, 0x0F);
+  require_eq(prog, 0x02);
+
+  stmt(prog, BPF_LD | BPF_B | BPF_ABS, PAYLOAD_OFF + offsetof(struct ptp_header, domainNumber));
+  require_eq(prog, AIRPTP_DOMAIN);
+
+  // A = (1 << msg_type) & mask
+  stmt(prog, BPF_LD | BPF_B | BPF_ABS, PAYLOAD_OFF + offsetof(struct ptp_header, messageType));
+  stmt(prog, BPF_ALU | BPF_AND | BPF_K, 0x0F);
+  stmt(prog, BPF_MISC | BPF_TAX, 0);
+  stmt(prog, BPF_LD | BPF_IMM, 1);
+  stmt(prog, BPF_ALU | BPF_LSH | BPF_X, 0);
+  stmt(prog, BPF_ALU | BPF_AND | BPF_K, msgtype_mask);
+  jump(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1);
+  stmt(prog, BPF_RET | BPF_K, DROP);
+}
+
+static void
+allowlist4(struct prog *prog, struct airptp_peer *peers, int num_peers)
+{
+  struct in6_addr *addr6;
+  uint32_t addr;
+  int i;
+
+  // Clients send from 127.0.0.1, and must always be able to reach us
+  stmt(prog, BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_NET_OFF + 12));
+  jump(prog, BPF_JMP | BPF_JEQ | BPF_K, INADDR_LOOPBACK, 0, 1);
+  stmt(prog, BPF_RET | BPF_K, ACCEPT);
+
+  for (i = 0; i < num_peers; i++)
+    {
+      addr6 = &peers[i].naddr.sin6.sin6_addr;
+      if (peers[i].naddr.sa.sa_family == AF_INET)
+	addr = ntohl(peers[i].naddr.sin.sin_addr.s_addr);
+      else if (peers[i].naddr.sa.sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(addr6))
+	addr = ((uint32_t)addr6->s6_addr[12] << 24) | (addr6->s6_addr[13] << 16) | (addr6->s6_addr[14] << 8) | addr6->s6_addr[15];
+      else
+	continue;
+
+      jump(prog, BPF_JMP | BPF_JEQ | BPF_K, addr, 0, 1);
+      stmt(prog, BPF_RET | BPF_K, ACCEPT);
+    }
+
+  stmt(prog, BPF_RET | BPF_K, DROP);
+}
+
+// Compares the 4 words of the source address to addr, falls through to the
+// next block if there is no match
+static void
+allowlist6_match(struct prog *prog, const uint8_t *addr)
+{
+  uint32_t w;
+  int i;
+
+  for (i = 0; i < 4; i++)
+    {
+      memcpy(&w, addr + 4 * i, sizeof(w));
+      stmt(prog, BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_NET_OFF + 8 + 4 * i));
+      // Skip the remaining loads and tests plus the return
+      jump(prog, BPF_JMP | BPF_JEQ | BPF_K, ntohl(w), 0, 2 * (3 - i) + 1);
+    }
+
+  stmt(prog, BPF_RET | BPF_K, ACCEPT);
+}
+
+static void
+allowlist6(struct prog *prog, struct airptp_peer *peers, int num_peers)
+{
+  struct in6_addr *addr6;
+  int i;
+
+  allowlist6_match(prog, in6addr_loopback.s6_addr);
+
+  for (i = 0; i < num_peers; i++)
+    {
+      addr6 = &peers[i].naddr.sin6.sin6_addr;
+      if (peers[i].naddr.sa.sa_family != AF_INET6 || IN6_IS_ADDR_V4MAPPED(addr6))
+	continue;
+
+      allowlist6_match(prog, addr6->s6_addr);
+    }
+
+  stmt(prog, BPF_RET | BPF_K, DROP);
+}
+
+static int
+attach(int fd, int family, uint16_t msgtype_mask, struct airptp_peer *peers, int num_peers)
+{
+  struct prog prog = { .len = 0 };
+  struct sock_fprog fprog;
+
+  if (fd < 0)
+    return 0;
+
+  header_checks(&prog, msgtype_mask);
+
+  // Other masters must be heard even if they aren't peers, see bmca.c
+  if (peers && (msgtype_mask & (1 << PTP_MSGTYPE_ANNOUNCE)))
+    {
+      stmt(&prog, BPF_LD | BPF_B | BPF_ABS, PAYLOAD_OFF + offsetof(struct ptp_header, messageType));
+      stmt(&prog, BPF_ALU | BPF_AND | BPF_K, 0x0F);
+      jump(&prog, BPF_JMP | BPF_JEQ | BPF_K, PTP_MSGTYPE_ANNOUNCE, 0, 1);
+      stmt(&prog, BPF_RET | BPF_K, ACCEPT);
+    }
+
+  if (!peers)
+    stmt(&prog, BPF_RET | BPF_K, ACCEPT);
+  else if (family == AF_INET)
+    allowlist4(&prog, peers, num_peers);
+  else
+    allowlist6(&prog, peers, num_peers);
+
+  fprog.len = prog.len;
+  fprog.filter = prog.insns;
+
+  // Replacing an attached filter is atomic
+  return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+}
+
+int
+sockfilter_attach(struct utils_net_socket *sock, enum sockfilter_port port, struct airptp_peer *peers, int num_peers)
+{
+  uint16_t mask;
+
+  if (port == SOCKFILTER_PORT_EVENT)
+    mask = (1 << PTP_MSGTYPE_SYNC) | (1 << PTP_MSGTYPE_DELAY_REQ) | (1 << PTP_MSGTYPE_PDELAY_REQ) | (1 << PTP_MSGTYPE_PDELAY_RESP);
+  else
+    mask = (1 << PTP_MSGTYPE_FOLLOW_UP) | (1 << PTP_MSGTYPE_DELAY_RESP) | (1 << PTP_MSGTYPE_PDELAY_RESP_FOLLOW_UP) |
+           (1 << PTP_MSGTYPE_ANNOUNCE) | (1 << PTP_MSGTYPE_SIGNALING) | (1 << PTP_MSGTYPE_MANAGEMENT);
+
+  if (attach(sock->fd4, AF_INET, mask, peers, num_peers) < 0)
+    return -1;
+  if (attach(sock->fd6, AF_INET6, mask, peers, num_peers) < 0)
+    return -1;
+
+  return 0;
+}
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+// Returns the index of the socket in the group that should get the packet. The
+// sockets are indexed in the order they were bound, and index 0 is skipped.
+static int
+steer_attach(int fd, int family, int num_workers)
+{
+  struct prog prog = { .len = 0 };
+  struct sock_fprog fprog;
+  // Last word of the source address
+  uint32_t src_off = (family == AF_INET) ? 12 : 20;
+
+  if (fd < 0)
+    return 0;
+
+  stmt(&prog, BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_NET_OFF + src_off));
+  stmt(&prog, BPF_MISC | BPF_TAX, 0);
+  stmt(&prog, BPF_ALU | BPF_RSH | BPF_K, 16);
+  stmt(&prog, BPF_ALU | BPF_XOR | BPF_X, 0);
+  stmt(&prog, BPF_ALU | BPF_MOD | BPF_K, num_workers);
+  stmt(&prog, BPF_ALU | BPF_ADD | BPF_K, 1);
+  stmt(&prog, BPF_RET | BPF_A, 0);
+
+  fprog.len = prog.len;
+  fprog.filter = prog.insns;
+
+  return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog, sizeof(fprog));
+}
+
+int
+sockfilter_steer_attach(struct utils_net_socket *sock, int num_workers)
+{
+  if (steer_attach(sock->fd4, AF_INET, num_workers) < 0)
+    return -1;
+  if (steer_attach(sock->fd6, AF_INET6, num_workers) < 0)
+    return -1;
+
+  return 0;
+}
+#else
+int
+sockfilter_steer_attach(struct utils_net_socket *sock, int num_workers)
+{
+  return -1;
+}
+#endif
+
+#else
+
+int
+sockfilter_attach(struct utils_net_socket *sock, enum sockfilter_port port, struct airptp_peer *peers, int num_peers)
+{
+  return 0;
+}
+
+int
+sockfilter_steer_attach(struct utils_net_socket *sock, int num_workers)
+{
+  return -1;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef __AIRPTP_SOCKFILTER_H__
+#define __AIRPTP_SOCKFILTER_H__
+
+#include "airptp_internal.h"
+#include "utils.h"
+
+enum sockfilter_port
+{
+  SOCKFILTER_PORT_EVENT,
+  SOCKFILTER_PORT_GENERAL,
+};
+
+// Attaches a classic BPF filter to the socket(s) so that the kernel drops
+// packets that aren't PTPv2 for our domain, or that have a message type that
+// doesn't belong on the port. If peers is non-NULL, packets are also dropped
+// unless they are from 127.0.0.1, ::1 or one of the peers. Call again to replace
+// the filter when the peer list changes. Does nothing on platforms other than
+// Linux.
+int
+sockfilter_attach(struct utils_net_socket *sock, enum sockfilter_port port, struct airptp_peer *peers, int num_peers);
+
+// For a SO_REUSEPORT group where the first socket bound is sock, followed by
+// num_workers sockets. Attaches a program that spreads incoming packets over
+// the worker sockets by hash of the source address, so that the first socket
+// doesn't get any. Returns -1 if not supported, in which case the kernel's
+// default hash is used, and the first socket also gets its share.
+int
+sockfilter_steer_attach(struct utils_net_socket *sock, int num_workers);
+
+#endif // __AIRPTP_SOCKFILTER_H__
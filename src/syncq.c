@@ -0,0 +1,205 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "syncq.h"
+#include "daemon.h"
+
+// Sync quality of the peers. A peer that is synchronized to us sends Delay_Req
+// with originTimestamp set to what it thinks our time is, so with rx_ns our
+// time when we received it, and d the link delay:
+//
+//   offset = origin - (rx - d)
+//
+// Each sample is compared to the prediction from the current estimate of
+// offset and drift, and the offset is moved a fraction of the difference. The
+// drift is the slope of the filtered offset over a few seconds, since the
+// noise of single samples over the Delay_Req interval is way more than the
+// drift we want to see. Samples that are far off the prediction are outliers
+// and not used, unless there are many in a row, which means the peer stepped
+// its clock and we start over.
+
+// Samples before the estimate is trusted, and before outliers are rejected
+#define SYNCQ_WARMUP 8
+// Weight of a new value is 1/4 for the offset and the drift, 1/8 for the
+// deviation and 1/32 for the outlier rate
+#define SYNCQ_OFFSET_DIV 4
+#define SYNCQ_DRIFT_DIV 4
+#define SYNCQ_DEVIATION_DIV 8
+#define SYNCQ_OUTLIER_DIV 32
+// A sample is an outlier if it is more than 4 times the deviation from the
+// prediction, and also more than the minimum
+#define SYNCQ_OUTLIER_DEVIATIONS 4
+#define SYNCQ_OUTLIER_MIN_NS 100000
+#define SYNCQ_OUTLIER_MAX_IN_ROW 8
+// During warmup a residual beyond this means the peer isn't following our
+// clock (yet), so the estimate starts over. Also keeps the arithmetic in range.
+#define SYNCQ_STEP_NS 1000000000
+// Drift is limited to 1000 ppm
+#define SYNCQ_DRIFT_MAX_PPB 1000000
+// Period over which the drift is measured
+#define SYNCQ_DRIFT_INTERVAL_NS 2000000000LL
+// Lock when the offset is within SYNCQ_LOCK_NS for SYNCQ_WARMUP samples in a
+// row, unlock when it goes beyond SYNCQ_UNLOCK_NS
+#define SYNCQ_LOCK_NS 1000000
+#define SYNCQ_UNLOCK_NS 2000000
+
+static void
+restart(struct airptp_peer_syncq *sq, uint64_t rx_ns, int64_t offset_ns)
+{
+  sq->last_rx_ns = rx_ns;
+  sq->offset_ns = offset_ns;
+  sq->drift_ppb = 0;
+  sq->drift_from_ns = rx_ns;
+  sq->drift_from_offset_ns = offset_ns;
+  sq->drift_measurements = 0;
+  sq->in_row = 0;
+  sq->outliers_in_row = 0;
+
+  sq->result.state = AIRPTP_SYNC_UNLOCKED;
+  sq->result.deviation_ns = 0;
+}
+
+static enum airptp_sync_state
+state_get(struct airptp_peer_syncq *sq)
+{
+  int64_t offset_abs = llabs(sq->offset_ns);
+
+  if (sq->result.state == AIRPTP_SYNC_LOCKED)
+    return (offset_abs > SYNCQ_UNLOCK_NS) ? AIRPTP_SYNC_UNLOCKED : AIRPTP_SYNC_LOCKED;
+
+  return (sq->in_row >= SYNCQ_WARMUP && offset_abs <= SYNCQ_LOCK_NS) ? AIRPTP_SYNC_LOCKED : AIRPTP_SYNC_UNLOCKED;
+}
+
+static void
+drift_update(struct airptp_peer_syncq *sq, uint64_t rx_ns)
+{
+  int64_t elapsed_ns = rx_ns - sq->drift_from_ns;
+  int64_t drift_ppb;
+
+  if (elapsed_ns < SYNCQ_DRIFT_INTERVAL_NS)
+    return;
+
+  drift_ppb = (sq->offset_ns - sq->drift_from_offset_ns) * 1000000000 / elapsed_ns;
+  if (sq->drift_measurements == 0)
+    sq->drift_ppb = drift_ppb;
+  else
+    sq->drift_ppb += (drift_ppb - sq->drift_ppb) / SYNCQ_DRIFT_DIV;
+
+  if (sq->drift_ppb > SYNCQ_DRIFT_MAX_PPB)
+    sq->drift_ppb = SYNCQ_DRIFT_MAX_PPB;
+  else if (sq->drift_ppb < -SYNCQ_DRIFT_MAX_PPB)
+    sq->drift_ppb = -SYNCQ_DRIFT_MAX_PPB;
+
+  sq->drift_from_ns = rx_ns;
+  sq->drift_from_offset_ns = sq->offset_ns;
+  sq->drift_measurements++;
+}
+
+static void
+outlier_rate_add(struct airptp_peer_syncq *sq, bool is_outlier)
+{
+  int64_t target = is_outlier ? (1000 << 10) : 0;
+
+  sq->outlier_rate += (target - (int64_t)sq->outlier_rate) / SYNCQ_OUTLIER_DIV;
+  sq->result.outlier_permille = sq->outlier_rate >> 10;
+}
+
+void
+syncq_sample_add(struct airptp_daemon *daemon, struct airptp_peer *peer, uint64_t origin_ns, uint64_t rx_ns)
+{
+  struct airptp_peer_syncq *sq = &peer->syncq;
+  struct airptp_peer_sync *r = &sq->result;
+  enum airptp_sync_state prev_state = r->state;
+  int64_t sample_ns;
+  int64_t elapsed_ns;
+  int64_t predicted_ns;
+  int64_t residual_ns;
+  int64_t limit_ns;
+
+  // Not synchronized, or just doesn't fill it in
+  if (origin_ns == 0)
+    return;
+
+  sample_ns = (int64_t)(origin_ns - rx_ns);
+  if (peer->pdelay.result.samples > 0)
+    sample_ns += peer->pdelay.result.delay_ns;
+
+  r->samples++;
+
+  if (sq->last_rx_ns == 0 || rx_ns <= sq->last_rx_ns) {
+    restart(sq, rx_ns, sample_ns);
+    goto out;
+  }
+
+  elapsed_ns = rx_ns - sq->last_rx_ns;
+  predicted_ns = sq->offset_ns + sq->drift_ppb * elapsed_ns / 1000000000;
+  residual_ns = sample_ns - predicted_ns;
+
+  if (sq->in_row < SYNCQ_WARMUP && llabs(residual_ns) > SYNCQ_STEP_NS) {
+    restart(sq, rx_ns, sample_ns);
+    goto out;
+  }
+
+  limit_ns = SYNCQ_OUTLIER_DEVIATIONS * r->deviation_ns;
+  if (limit_ns < SYNCQ_OUTLIER_MIN_NS)
+    limit_ns = SYNCQ_OUTLIER_MIN_NS;
+
+  if (sq->in_row >= SYNCQ_WARMUP && llabs(residual_ns) > limit_ns) {
+    r->outliers++;
+    outlier_rate_add(sq, true);
+
+    sq->outliers_in_row++;
+    if (sq->outliers_in_row >= SYNCQ_OUTLIER_MAX_IN_ROW) {
+      airptp_logmsg("Peer %" PRIu32 " offset jumped by %" PRIi64 " ns, restarting sync estimate", peer->id, residual_ns);
+      restart(sq, rx_ns, sample_ns);
+    }
+    goto out;
+  }
+
+  outlier_rate_add(sq, false);
+
+  sq->offset_ns = predicted_ns + residual_ns / SYNCQ_OFFSET_DIV;
+  drift_update(sq, rx_ns);
+  r->deviation_ns += (llabs(residual_ns) - r->deviation_ns) / SYNCQ_DEVIATION_DIV;
+
+  sq->last_rx_ns = rx_ns;
+  sq->in_row++;
+  sq->outliers_in_row = 0;
+
+  r->state = state_get(sq);
+
+ out:
+  r->offset_ns = sq->offset_ns;
+  r->drift_ppm = sq->drift_ppb / 1000.0;
+
+  if (r->state != prev_state) {
+    airptp_logmsg("Peer %" PRIu32 " is now %s, offset %" PRIi64 " ns, drift %.3f ppm", peer->id,
+      (r->state == AIRPTP_SYNC_LOCKED) ? "locked" : "unlocked", r->offset_ns, r->drift_ppm);
+    daemon_peer_stats_publish(daemon);
+  }
+}
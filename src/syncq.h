@@ -0,0 +1,12 @@
+#ifndef __AIRPTP_SYNCQ_H__
+#define __AIRPTP_SYNCQ_H__
+
+#include "airptp_internal.h"
+
+// Adds a Delay_Req from the peer to its sync quality estimate. origin_ns is the
+// request's originTimestamp, rx_ns when we received it. Publishes to shm if the
+// peer's lock state changed.
+void
+syncq_sample_add(struct airptp_daemon *daemon, struct airptp_peer *peer, uint64_t origin_ns, uint64_t rx_ns);
+
+#endif // __AIRPTP_SYNCQ_H__
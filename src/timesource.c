@@ -0,0 +1,531 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "timesource.h"
+#include "airptp_internal.h"
+
+// The clock of the daemons' timebase, set by the first daemon to start
+static clockid_t timesource_clockid = CLOCK_MONOTONIC;
+
+// Daemons in the same process share the clock and the TSC, see
+// timesource_start(). The lock is also held while calibrating, never by
+// readers.
+static pthread_mutex_t timesource_lck = PTHREAD_MUTEX_INITIALIZER;
+static int timesource_users;
+static enum airptp_timebase timesource_timebase;
+static bool timesource_tsc_wanted;
+
+static bool
+tsc_start(void);
+
+static void
+tsc_stop(void);
+
+static int
+clockid_get(clockid_t *clockid, enum airptp_timebase timebase)
+{
+  switch (timebase)
+    {
+      case AIRPTP_TIMEBASE_MONOTONIC:
+	*clockid = CLOCK_MONOTONIC;
+	return 0;
+#ifdef CLOCK_MONOTONIC_RAW
+      case AIRPTP_TIMEBASE_MONOTONIC_RAW:
+	*clockid = CLOCK_MONOTONIC_RAW;
+	return 0;
+#endif
+#ifdef CLOCK_TAI
+      case AIRPTP_TIMEBASE_TAI:
+	*clockid = CLOCK_TAI;
+	return 0;
+#endif
+      case AIRPTP_TIMEBASE_REALTIME:
+	*clockid = CLOCK_REALTIME;
+	return 0;
+      default:
+	return -1;
+    }
+}
+
+static inline uint64_t
+clock_ns(clockid_t clockid)
+{
+  struct timespec ts;
+
+  clock_gettime(clockid, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool
+timesource_timebase_is_supported(enum airptp_timebase timebase)
+{
+  clockid_t clockid;
+
+  return (clockid_get(&clockid, timebase) == 0);
+}
+
+int
+timesource_start(enum airptp_timebase timebase, bool use_tsc)
+{
+  clockid_t clockid;
+
+  if (clockid_get(&clockid, timebase) < 0)
+    return -1;
+
+  pthread_mutex_lock(&timesource_lck);
+
+  if (timesource_users > 0) {
+    if (timebase != timesource_timebase || use_tsc != timesource_tsc_wanted) {
+      pthread_mutex_unlock(&timesource_lck);
+      return -1;
+    }
+
+    timesource_users++;
+    pthread_mutex_unlock(&timesource_lck);
+    return 0;
+  }
+
+  timesource_clockid = clockid;
+  timesource_timebase = timebase;
+  timesource_tsc_wanted = use_tsc;
+  timesource_users = 1;
+
+  // The kernel only knows the TAI offset if something like chrony or ptp4l
+  // has told it
+  if (timebase == AIRPTP_TIMEBASE_TAI && llabs(timesource_offset_get(AIRPTP_TIMEBASE_REALTIME)) < 1000000000LL)
+    airptp_logmsg("The kernel's TAI offset isn't set, so the TAI timebase is the same as UTC");
+
+  if (use_tsc)
+    tsc_start();
+
+  pthread_mutex_unlock(&timesource_lck);
+  return 0;
+}
+
+void
+timesource_stop(void)
+{
+  pthread_mutex_lock(&timesource_lck);
+
+  if (timesource_users > 0 && --timesource_users == 0)
+    tsc_stop();
+
+  pthread_mutex_unlock(&timesource_lck);
+}
+
+uint64_t
+timesource_timebase_now(enum airptp_timebase timebase)
+{
+  clockid_t clockid;
+
+  if (clockid_get(&clockid, timebase) < 0)
+    return 0;
+
+  return clock_ns(clockid);
+}
+
+int64_t
+timesource_offset_get(enum airptp_timebase other)
+{
+  clockid_t clockid;
+  uint64_t before;
+  uint64_t after;
+  uint64_t ns;
+
+  if (clockid_get(&clockid, other) < 0 || clockid == timesource_clockid)
+    return 0;
+
+  before = clock_ns(timesource_clockid);
+  ns = clock_ns(clockid);
+  after = clock_ns(timesource_clockid);
+
+  return (int64_t)(ns - (before + (after - before) / 2));
+}
+
+void
+timesource_timeline_set(struct timesource_timeline *tl, uint64_t local_ns, uint64_t ptp_ns, double rate_ppb)
+{
+  __atomic_store_n(&tl->seq, tl->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  tl->local_ns = local_ns;
+  tl->ptp_ns = ptp_ns;
+  tl->rate_ppb = rate_ppb;
+  __atomic_store_n(&tl->seq, tl->seq + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t
+timesource_timeline_map(struct timesource_timeline *tl, uint64_t ns)
+{
+  struct timesource_timeline copy;
+  int64_t elapsed_ns;
+  uint32_t seq;
+
+  do {
+    seq = __atomic_load_n(&tl->seq, __ATOMIC_ACQUIRE);
+    copy.local_ns = tl->local_ns;
+    copy.ptp_ns = tl->ptp_ns;
+    copy.rate_ppb = tl->rate_ppb;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || seq != __atomic_load_n(&tl->seq, __ATOMIC_RELAXED));
+
+  if (copy.local_ns == 0)
+    return ns;
+
+  elapsed_ns = ns - copy.local_ns;
+  return copy.ptp_ns + elapsed_ns + (int64_t)(elapsed_ns * copy.rate_ppb / 1e9);
+}
+
+void
+timesource_timeline_get(struct timesource_timeline *tl, struct timespec *ts)
+{
+  uint64_t ns;
+
+  timesource_get(ts);
+  if (!__atomic_load_n(&tl->local_ns, __ATOMIC_RELAXED))
+    return;
+
+  ns = timesource_timeline_map(tl, (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec);
+  ts->tv_sec = ns / 1000000000ULL;
+  ts->tv_nsec = ns % 1000000000ULL;
+}
+
+#if defined(__x86_64__)
+
+#include <cpuid.h>
+#include <x86intrin.h>
+
+// Converting the TSC to ns in the timebase is ns = ns_base + (tsc - tsc_base) *
+// mult >> TSC_SHIFT. The parameters are updated by timesource_calibrate() and
+// protected by a sequence count, so readers never block: they retry if the
+// count was odd (update in progress) or changed while they were reading.
+//
+// Each calibration compares the TSC conversion with clock_gettime(). The rate
+// is measured over the whole time since the last step, and the remaining error
+// is slewed away over the next interval, so the converted time stays
+// continuous and monotonic. If the error is too large to slew, we step, and if
+// that keeps happening the TSC is not stable and we fall back.
+
+#define TSC_SHIFT 32
+// How long we measure the rate for at start, done twice
+#define TSC_CALIBRATE_NS 100000000
+// Max difference between the two rates measured at start, in ppm
+#define TSC_MAX_RATE_DIFF_PPM 100
+// Errors larger than this are stepped, smaller ones are slewed at max 500 ppm
+#define TSC_MAX_SLEW_NS 500000
+#define TSC_STEP_NS 1000000
+// Fall back to clock_gettime() after this many steps in a row
+#define TSC_MAX_STEPS 3
+#define TSC_SAMPLES 5
+// Calibrations closer than this are skipped
+#define TSC_CALIBRATE_MIN_NS 900000000ULL
+
+struct tsc_params
+{
+  uint64_t tsc_base;
+  uint64_t ns_base;
+  uint64_t mult;
+};
+
+struct tsc_state
+{
+  bool is_active;
+  uint32_t seq;
+  struct tsc_params params;
+
+  // Only used by the calibrating thread. The anchor is where the rate is
+  // measured from, reset on steps.
+  uint64_t anchor_tsc;
+  uint64_t anchor_ns;
+  uint64_t rate_mult;
+  int steps;
+};
+
+static struct tsc_state tsc;
+
+// Pairs a TSC reading with the timebase's clock, taking the tightest of a few tries
+// so that being preempted doesn't skew it
+static void
+tsc_sample(uint64_t *tsc_out, uint64_t *ns_out)
+{
+  uint64_t t0;
+  uint64_t t1;
+  uint64_t ns;
+  uint64_t best = UINT64_MAX;
+  int i;
+
+  for (i = 0; i < TSC_SAMPLES; i++) {
+    t0 = __rdtsc();
+    ns = clock_ns(timesource_clockid);
+    t1 = __rdtsc();
+    if (t1 - t0 < best) {
+      best = t1 - t0;
+      *tsc_out = t0 + (t1 - t0) / 2;
+      *ns_out = ns;
+    }
+  }
+}
+
+static uint64_t
+tsc_rate_mult(uint64_t tsc_delta, uint64_t ns_delta)
+{
+  return (uint64_t)(((unsigned __int128)ns_delta << TSC_SHIFT) / tsc_delta);
+}
+
+static inline uint64_t
+tsc_convert(struct tsc_params *p, uint64_t now)
+{
+  // Readers on other CPUs may see a TSC slightly before the base
+  if (now < p->tsc_base)
+    return p->ns_base;
+
+  return p->ns_base + (uint64_t)(((unsigned __int128)(now - p->tsc_base) * p->mult) >> TSC_SHIFT);
+}
+
+static void
+tsc_params_set(struct tsc_params *p)
+{
+  __atomic_store_n(&tsc.seq, tsc.seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&tsc.params.tsc_base, p->tsc_base, __ATOMIC_RELAXED);
+  __atomic_store_n(&tsc.params.ns_base, p->ns_base, __ATOMIC_RELAXED);
+  __atomic_store_n(&tsc.params.mult, p->mult, __ATOMIC_RELAXED);
+  __atomic_store_n(&tsc.seq, tsc.seq + 1, __ATOMIC_RELEASE);
+}
+
+static void
+tsc_params_get(struct tsc_params *p)
+{
+  uint32_t seq;
+
+  for (;;) {
+    seq = __atomic_load_n(&tsc.seq, __ATOMIC_ACQUIRE);
+    p->tsc_base = __atomic_load_n(&tsc.params.tsc_base, __ATOMIC_RELAXED);
+    p->ns_base = __atomic_load_n(&tsc.params.ns_base, __ATOMIC_RELAXED);
+    p->mult = __atomic_load_n(&tsc.params.mult, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (!(seq & 1) && seq == __atomic_load_n(&tsc.seq, __ATOMIC_RELAXED))
+      return;
+  }
+}
+
+static bool
+tsc_is_invariant(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 || eax < 0x80000007)
+    return false;
+  if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0)
+    return false;
+
+  return (edx & (1 << 8)); // Invariant TSC
+}
+
+static void
+tsc_anchor_set(uint64_t t, uint64_t ns)
+{
+  struct tsc_params p = { .tsc_base = t, .ns_base = ns, .mult = tsc.rate_mult };
+
+  tsc.anchor_tsc = t;
+  tsc.anchor_ns = ns;
+  tsc_params_set(&p);
+}
+
+void
+timesource_get(struct timespec *ts)
+{
+  struct tsc_params p;
+  uint64_t ns;
+
+  if (!__atomic_load_n(&tsc.is_active, __ATOMIC_ACQUIRE)) {
+    clock_gettime(timesource_clockid, ts);
+    return;
+  }
+
+  tsc_params_get(&p);
+  ns = tsc_convert(&p, __rdtsc());
+
+  ts->tv_sec = ns / 1000000000ULL;
+  ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static bool
+tsc_start(void)
+{
+  uint64_t t[3];
+  uint64_t ns[3];
+  uint64_t mult[2];
+  uint64_t diff;
+  int i;
+
+  if (!tsc_is_invariant()) {
+    airptp_logmsg("TSC is not invariant, using clock_gettime() for timestamps");
+    return false;
+  }
+
+  tsc_sample(&t[0], &ns[0]);
+  for (i = 0; i < 2; i++) {
+    usleep(TSC_CALIBRATE_NS / 1000);
+    tsc_sample(&t[i + 1], &ns[i + 1]);
+    if (t[i + 1] <= t[i] || ns[i + 1] <= ns[i])
+      goto unstable;
+    mult[i] = tsc_rate_mult(t[i + 1] - t[i], ns[i + 1] - ns[i]);
+  }
+
+  diff = (mult[0] > mult[1]) ? mult[0] - mult[1] : mult[1] - mult[0];
+  if (diff > mult[0] / 1000000 * TSC_MAX_RATE_DIFF_PPM)
+    goto unstable;
+
+  tsc.rate_mult = tsc_rate_mult(t[2] - t[0], ns[2] - ns[0]);
+  tsc.steps = 0;
+  tsc_anchor_set(t[2], ns[2]);
+  __atomic_store_n(&tsc.is_active, true, __ATOMIC_RELEASE);
+
+  airptp_logmsg("Using the TSC for timestamps, %.3f MHz", (double)((uint64_t)1 << TSC_SHIFT) * 1000.0 / tsc.rate_mult);
+  return true;
+
+ unstable:
+  airptp_logmsg("TSC rate is not stable, using clock_gettime() for timestamps");
+  return false;
+}
+
+static void
+tsc_stop(void)
+{
+  __atomic_store_n(&tsc.is_active, false, __ATOMIC_RELEASE);
+}
+
+bool
+timesource_tsc_is_used(void)
+{
+  return __atomic_load_n(&tsc.is_active, __ATOMIC_ACQUIRE);
+}
+
+static void
+tsc_calibrate(void)
+{
+  struct tsc_params p;
+  uint64_t t;
+  uint64_t ns;
+  uint64_t est_ns;
+  int64_t err;
+
+  if (!__atomic_load_n(&tsc.is_active, __ATOMIC_RELAXED))
+    return;
+
+  tsc_sample(&t, &ns);
+  if (t <= tsc.anchor_tsc || ns <= tsc.anchor_ns)
+    goto step;
+
+  tsc_params_get(&p);
+  est_ns = tsc_convert(&p, t);
+  err = (int64_t)(ns - est_ns);
+  if (err > TSC_STEP_NS || err < -TSC_STEP_NS)
+    goto step;
+
+  tsc.steps = 0;
+  tsc.rate_mult = tsc_rate_mult(t - tsc.anchor_tsc, ns - tsc.anchor_ns);
+
+  // Continue from where the current conversion is, and aim to be on time
+  // again in a second
+  if (err > TSC_MAX_SLEW_NS)
+    err = TSC_MAX_SLEW_NS;
+  else if (err < -TSC_MAX_SLEW_NS)
+    err = -TSC_MAX_SLEW_NS;
+
+  p.tsc_base = t;
+  p.ns_base = est_ns;
+  p.mult = tsc.rate_mult + (int64_t)((__int128)tsc.rate_mult * err / 1000000000);
+  tsc_params_set(&p);
+  return;
+
+ step:
+  tsc.steps++;
+  if (tsc.steps > TSC_MAX_STEPS) {
+    airptp_logmsg("TSC is not tracking the timebase clock, falling back to clock_gettime() for timestamps");
+    tsc_stop();
+    return;
+  }
+
+  airptp_logmsg("TSC timestamps are off by %" PRIi64 " ns, stepping", (int64_t)(ns - tsc_convert(&tsc.params, t)));
+  tsc_anchor_set(t, ns);
+}
+
+void
+timesource_calibrate(void)
+{
+  static uint64_t last_ns;
+  uint64_t now_ns = clock_ns(CLOCK_MONOTONIC);
+
+  // Each daemon calls this, but the TSC should be calibrated about once a
+  // second
+  pthread_mutex_lock(&timesource_lck);
+  if (now_ns - last_ns >= TSC_CALIBRATE_MIN_NS) {
+    last_ns = now_ns;
+    tsc_calibrate();
+  }
+  pthread_mutex_unlock(&timesource_lck);
+}
+
+#else
+
+void
+timesource_get(struct timespec *ts)
+{
+  clock_gettime(timesource_clockid, ts);
+}
+
+static bool
+tsc_start(void)
+{
+  airptp_logmsg("No TSC support on this platform, using clock_gettime() for timestamps");
+  return false;
+}
+
+static void
+tsc_stop(void)
+{
+}
+
+bool
+timesource_tsc_is_used(void)
+{
+  return false;
+}
+
+void
+timesource_calibrate(void)
+{
+}
+
+#endif
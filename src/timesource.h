@@ -0,0 +1,78 @@
+#ifndef __AIRPTP_TIMESOURCE_H__
+#define __AIRPTP_TIMESOURCE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../airptp.h"
+
+// A daemon's PTP time, see timesource_timeline_set(). local_ns is 0 when
+// there is none, which is how it starts when zeroed. Protected by a sequence
+// count, so it can be read from any thread.
+struct timesource_timeline
+{
+  uint32_t seq;
+  uint64_t local_ns;
+  uint64_t ptp_ns;
+  double rate_ppb;
+};
+
+// Source of the timestamps in PTP messages, which are in the timebase given to
+// timesource_start(), CLOCK_MONOTONIC by default. The clock is read with
+// clock_gettime(), but if the TSC was requested and is usable it is read
+// instead and converted. Can be called from any thread.
+void
+timesource_get(struct timespec *ts);
+
+// Our PTP time, which is the same as timesource_get() unless a timeline was set
+void
+timesource_timeline_get(struct timesource_timeline *tl, struct timespec *ts);
+
+// Makes the PTP time ptp_ns + (t - local_ns) * (1 + rate_ppb / 1e9) for a time t
+// from timesource_get(), used to continue the timeline of a master we took over
+// from. local_ns 0 clears it. Only from the daemon's thread.
+void
+timesource_timeline_set(struct timesource_timeline *tl, uint64_t local_ns, uint64_t ptp_ns, double rate_ppb);
+
+// Maps ns in the timebase to PTP time
+uint64_t
+timesource_timeline_map(struct timesource_timeline *tl, uint64_t ns);
+
+bool
+timesource_timebase_is_supported(enum airptp_timebase timebase);
+
+// Sets the timebase and selects the TSC if use_tsc and it is invariant and its
+// rate against the timebase is stable (x86-64 only), which blocks for about
+// 200 ms while measuring. Daemons in the same process share both, so only the
+// first one sets them, and later ones must ask for the same. Returns -1 if
+// they don't, or if the platform doesn't have the clock. Must be called before
+// the daemon's other threads read timestamps, and paired with
+// timesource_stop().
+int
+timesource_start(enum airptp_timebase timebase, bool use_tsc);
+
+void
+timesource_stop(void);
+
+// Whether timestamps are currently read from the TSC
+bool
+timesource_tsc_is_used(void);
+
+// Reads the clock of a timebase directly, for processes other than the
+// daemon's. 0 if the platform doesn't have it.
+uint64_t
+timesource_timebase_now(enum airptp_timebase timebase);
+
+// What to add to a timestamp to get the time in another timebase. 0 if it is
+// the same or the platform doesn't have it.
+int64_t
+timesource_offset_get(enum airptp_timebase other);
+
+// Must be called about once per second by each daemon, calls closer than that
+// are skipped. Keeps the TSC conversion in line with the timebase, and goes
+// back to clock_gettime() if the TSC stops tracking it.
+void
+timesource_calibrate(void);
+
+#endif // __AIRPTP_TIMESOURCE_H__
@@ -0,0 +1,252 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tx_thread.h"
+#include "ptp_msg_handle.h"
+
+// The tx thread does the periodic sending of Announce, Signaling and Sync, so
+// that a large fan-out doesn't delay answering Delay_Req on the daemon thread,
+// and vice versa. It only knows the peers from the snapshots the daemon thread
+// publishes (see snapshot.c), and reports send errors back in them. The
+// message sequence numbers in struct airptp_daemon are only used by this
+// thread when it is running.
+
+static struct timeval tx_announce_tv =
+{
+  .tv_sec = AIRPTP_INTERVAL_MS_ANNOUNCE / 1000,
+  .tv_usec = (AIRPTP_INTERVAL_MS_ANNOUNCE % 1000) * 1000
+};
+static struct timeval tx_signaling_tv =
+{
+  .tv_sec = AIRPTP_INTERVAL_MS_SIGNALING / 1000,
+  .tv_usec = (AIRPTP_INTERVAL_MS_SIGNALING % 1000) * 1000
+};
+static struct timeval tx_sync_tv =
+{
+  .tv_sec = AIRPTP_INTERVAL_MS_SYNC / 1000,
+  .tv_usec = (AIRPTP_INTERVAL_MS_SYNC % 1000) * 1000
+};
+
+
+/* -------------------------------- Tx thread ------------------------------- */
+
+// Sets tx->current to the latest snapshot, returns false if there are no peers
+// to send to
+static bool
+snapshot_begin(struct airptp_tx_thread *tx, struct airptp_daemon *daemon)
+{
+  __atomic_store_n(&tx->is_reading, 1, __ATOMIC_SEQ_CST);
+  tx->current = __atomic_load_n(&daemon->snapshot, __ATOMIC_SEQ_CST);
+
+  return (tx->current && tx->current->num_tx > 0);
+}
+
+static void
+snapshot_end(struct airptp_tx_thread *tx)
+{
+  tx->current = NULL;
+  __atomic_store_n(&tx->is_reading, 0, __ATOMIC_RELEASE);
+}
+
+static void
+send_announce_cb(int fd, short what, void *arg)
+{
+  struct airptp_daemon *daemon = arg;
+  struct airptp_tx_thread *tx = &daemon->tx;
+
+  if (snapshot_begin(tx, daemon)) {
+    ptp_msg_announce_send(daemon);
+    event_add(tx->send_announce_timer, &tx_announce_tv);
+  }
+
+  snapshot_end(tx);
+}
+
+static void
+send_signaling_cb(int fd, short what, void *arg)
+{
+  struct airptp_daemon *daemon = arg;
+  struct airptp_tx_thread *tx = &daemon->tx;
+
+  if (snapshot_begin(tx, daemon)) {
+    ptp_msg_signaling_send(daemon);
+    event_add(tx->send_signaling_timer, &tx_signaling_tv);
+  }
+
+  snapshot_end(tx);
+}
+
+static void
+send_sync_cb(int fd, short what, void *arg)
+{
+  struct airptp_daemon *daemon = arg;
+  struct airptp_tx_thread *tx = &daemon->tx;
+
+  if (snapshot_begin(tx, daemon)) {
+    ptp_msg_sync_send(daemon);
+    event_add(tx->send_sync_timer, &tx_sync_tv);
+  }
+
+  snapshot_end(tx);
+}
+
+// The daemon thread has published a new snapshot. Like timers_kick() in the
+// daemon thread, we send Announce and Signaling right away if we weren't
+// already sending, but keep the rhythm of Sync.
+static void
+notify_cb(int fd, short what, void *arg)
+{
+  struct airptp_daemon *daemon = arg;
+  struct airptp_tx_thread *tx = &daemon->tx;
+  char buf[64];
+
+  while (read(fd, buf, sizeof(buf)) == sizeof(buf))
+    ; // Drain, we only need to know that there was something
+
+  if (!event_pending(tx->send_announce_timer, EV_TIMEOUT, NULL))
+    event_active(tx->send_announce_timer, 0, 0);
+  if (!event_pending(tx->send_signaling_timer, EV_TIMEOUT, NULL))
+    event_active(tx->send_signaling_timer, 0, 0);
+  if (!event_pending(tx->send_sync_timer, EV_TIMEOUT, NULL))
+    event_add(tx->send_sync_timer, &tx_sync_tv);
+}
+
+static void
+exit_cb(int fd, short what, void *arg)
+{
+  struct airptp_tx_thread *tx = arg;
+
+  event_base_loopbreak(tx->evbase);
+}
+
+static void *
+run(void *arg)
+{
+  struct airptp_daemon *daemon = arg;
+
+  airptp_callbacks_register(&daemon->cb);
+  airptp_thread_name_set("libairptp tx");
+
+  event_base_dispatch(daemon->tx.evbase);
+
+  pthread_exit(NULL);
+}
+
+
+/* ------------------------------ Daemon thread ----------------------------- */
+
+static void
+tx_cleanup(struct airptp_tx_thread *tx)
+{
+  if (tx->send_announce_timer)
+    event_free(tx->send_announce_timer);
+  if (tx->send_signaling_timer)
+    event_free(tx->send_signaling_timer);
+  if (tx->send_sync_timer)
+    event_free(tx->send_sync_timer);
+  if (tx->notify_ev)
+    event_free(tx->notify_ev);
+  if (tx->exit_ev)
+    event_free(tx->exit_ev);
+  if (tx->evbase)
+    event_base_free(tx->evbase);
+  if (tx->notify_pipe[0] > 0)
+    close(tx->notify_pipe[0]);
+  if (tx->notify_pipe[1] > 0)
+    close(tx->notify_pipe[1]);
+  if (tx->exit_pipe[0] > 0)
+    close(tx->exit_pipe[0]);
+  if (tx->exit_pipe[1] > 0)
+    close(tx->exit_pipe[1]);
+
+  memset(tx, 0, sizeof(struct airptp_tx_thread));
+}
+
+int
+tx_thread_start(struct airptp_daemon *daemon)
+{
+  struct airptp_tx_thread *tx = &daemon->tx;
+  int ret;
+
+  if (!daemon->config.tx_thread)
+    return 0;
+
+  ret = pipe(tx->exit_pipe);
+  if (ret < 0)
+    goto error;
+
+  ret = pipe(tx->notify_pipe);
+  if (ret < 0)
+    goto error;
+
+  // Neither side should ever block on the notification pipe
+  evutil_make_socket_nonblocking(tx->notify_pipe[0]);
+  evutil_make_socket_nonblocking(tx->notify_pipe[1]);
+
+  tx->evbase = event_base_new();
+  if (!tx->evbase)
+    goto error;
+
+  tx->exit_ev = event_new(tx->evbase, tx->exit_pipe[0], EV_READ, exit_cb, tx);
+  tx->notify_ev = event_new(tx->evbase, tx->notify_pipe[0], EV_READ | EV_PERSIST, notify_cb, daemon);
+  tx->send_announce_timer = evtimer_new(tx->evbase, send_announce_cb, daemon);
+  tx->send_signaling_timer = evtimer_new(tx->evbase, send_signaling_cb, daemon);
+  tx->send_sync_timer = evtimer_new(tx->evbase, send_sync_cb, daemon);
+  if (!tx->exit_ev || !tx->notify_ev || !tx->send_announce_timer || !tx->send_signaling_timer || !tx->send_sync_timer)
+    goto error;
+
+  event_add(tx->exit_ev, NULL);
+  event_add(tx->notify_ev, NULL);
+
+  ret = pthread_create(&tx->tid, NULL, run, daemon);
+  if (ret != 0)
+    goto error;
+
+  airptp_logmsg("Started tx thread");
+  return 0;
+
+ error:
+  tx_cleanup(tx);
+  return -1;
+}
+
+void
+tx_thread_stop(struct airptp_daemon *daemon)
+{
+  struct airptp_tx_thread *tx = &daemon->tx;
+  char byte = 1;
+
+  if (!tx->evbase)
+    return;
+
+  if (write(tx->exit_pipe[1], &byte, 1) == 1)
+    pthread_join(tx->tid, NULL);
+
+  tx_cleanup(tx);
+}
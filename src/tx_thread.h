@@ -0,0 +1,14 @@
+#ifndef __AIRPTP_TX_THREAD_H__
+#define __AIRPTP_TX_THREAD_H__
+
+#include "airptp_internal.h"
+
+// Both must be called from the daemon thread. Starting does nothing unless
+// enabled with AIRPTP_OPT_TX_THREAD.
+int
+tx_thread_start(struct airptp_daemon *daemon);
+
+void
+tx_thread_stop(struct airptp_daemon *daemon);
+
+#endif // __AIRPTP_TX_THREAD_H__
@@ -0,0 +1,365 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "txtime.h"
+#include "daemon.h"
+#include "ptp_msg_handle.h"
+#include "timesource.h"
+
+#ifdef HAVE_SO_TXTIME
+
+#include <sys/socket.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+// Scheduled sending of Sync. Each Sync is queued lead_us before its launch
+// time, which is on a grid of the Sync interval in the daemon's timebase, and
+// the kernel holds it until then. That requires the etf qdisc (or a NIC with
+// launch time offload) on the interface. Since etf drops packets that don't
+// have a launch time, it should only get the Sync packets, e.g. mqprio with a
+// filter on the event port. etf uses CLOCK_TAI, so that is what we give the
+// kernel.
+//
+// The Follow_Up carries the launch time, but only if the software tx timestamps
+// of the Syncs say they left at that time. If not, e.g. because there is no etf
+// qdisc and the kernel sent them right away, it carries the tx timestamp, and
+// after TXTIME_MAX_MISSES of those in a row we give up and go back to normal
+// sending.
+
+// How long after the launch time we send the Follow_Up, which is also how long
+// the tx timestamps have to come back
+#define TXTIME_FOLLOW_UP_DELAY_US 1000
+// How far from the launch time a tx timestamp may be
+#define TXTIME_MAX_ERROR_NS 200000
+#define TXTIME_MAX_MISSES 8
+
+struct txtime
+{
+  struct airptp_daemon *daemon;
+  struct event *follow_up_ev;
+  uint32_t lead_us;
+  int misses;
+
+  // About the last Sync, launch_ns and the timestamps are in the timebase
+  uint16_t sequence_id;
+  uint64_t launch_ns;
+  uint64_t realtime_offset_ns;
+  uint64_t ts_min_ns;
+  uint64_t ts_max_ns;
+  int num_ts;
+  bool has_error;
+};
+
+static inline uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+
+  timesource_get(&ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+socket_setup(int fd)
+{
+  struct sock_txtime txtime = { .clockid = CLOCK_TAI, .flags = SOF_TXTIME_REPORT_ERRORS };
+  int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+
+  if (fd < 0)
+    return 0;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) < 0)
+    return -1;
+  if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+    return -1;
+
+  return 0;
+}
+
+// The socket keeps SO_TXTIME, there is no way to turn it off, but without a
+// launch time in the message it makes no difference
+static void
+socket_reset(int fd)
+{
+  int flags = 0;
+
+  if (fd < 0)
+    return;
+
+  setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+static void
+ts_add(struct txtime *tt, struct timespec *ts)
+{
+  uint64_t ns;
+
+  ns = (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec - tt->realtime_offset_ns;
+  if (tt->num_ts == 0 || ns < tt->ts_min_ns)
+    tt->ts_min_ns = ns;
+  if (tt->num_ts == 0 || ns > tt->ts_max_ns)
+    tt->ts_max_ns = ns;
+
+  tt->num_ts++;
+}
+
+void
+txtime_errqueue_read(struct txtime *tt, int fd)
+{
+  struct scm_timestamping *tss;
+  struct sock_extended_err *serr;
+  struct cmsghdr *cmsg;
+  struct msghdr mh;
+  struct iovec iov;
+  uint8_t data[256];
+  uint8_t control[512];
+
+  for (;;) {
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    if (recvmsg(fd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+      return;
+
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+      if (!tt)
+	continue; // Just draining
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+	tss = (struct scm_timestamping *)CMSG_DATA(cmsg);
+	ts_add(tt, &tss->ts[0]);
+      }
+      else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+	serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+	if (serr->ee_origin == SO_EE_ORIGIN_TXTIME)
+	  tt->has_error = true;
+      }
+    }
+  }
+}
+
+static void
+follow_up_cb(int fd, short what, void *arg)
+{
+  struct txtime *tt = arg;
+  struct airptp_daemon *daemon = tt->daemon;
+  uint64_t ts_ns;
+  int64_t err_min;
+  int64_t err_max;
+
+  txtime_errqueue_read(tt, daemon->event_svc.socket.fd4);
+  txtime_errqueue_read(tt, daemon->event_svc.socket.fd6);
+
+  err_min = (int64_t)(tt->ts_min_ns - tt->launch_ns);
+  err_max = (int64_t)(tt->ts_max_ns - tt->launch_ns);
+
+  if (tt->num_ts > 0 && !tt->has_error && err_min >= -TXTIME_MAX_ERROR_NS && err_max <= TXTIME_MAX_ERROR_NS) {
+    ts_ns = tt->launch_ns;
+    tt->misses = 0;
+  } else {
+    // Best we can do is when the first one actually left
+    ts_ns = (tt->num_ts > 0) ? tt->ts_min_ns : tt->launch_ns - tt->lead_us * 1000ULL;
+    tt->misses++;
+    STATS_INC(daemon, tx_sync_missed);
+
+    if (tt->has_error)
+      airptp_logmsg("Kernel reported error for scheduled Sync %" PRIu16, tt->sequence_id);
+    else if (tt->num_ts == 0)
+      airptp_logmsg("No tx timestamp for scheduled Sync %" PRIu16, tt->sequence_id);
+    else
+      airptp_logmsg("Scheduled Sync %" PRIu16 " left %" PRIi64 " ns from its launch time", tt->sequence_id, err_min);
+  }
+
+  ptp_msg_sync_follow_up_send(daemon, tt->sequence_id, ts_ns);
+}
+
+int
+txtime_sync_send(struct txtime *tt)
+{
+  struct airptp_daemon *daemon = tt->daemon;
+  uint64_t interval_ns = AIRPTP_INTERVAL_MS_SYNC * 1000000ULL;
+  uint64_t lead_ns = tt->lead_us * 1000ULL;
+  uint64_t now;
+  uint64_t tai_launch_ns;
+  uint64_t next_ns;
+  struct timeval tv;
+
+  if (tt->misses >= TXTIME_MAX_MISSES) {
+    airptp_logmsg("Scheduled Syncs aren't leaving on time (no etf qdisc?), going back to normal sending");
+    return -1;
+  }
+
+  now = now_ns();
+
+  // Stale timestamps from the previous round, if any
+  txtime_errqueue_read(tt, daemon->event_svc.socket.fd4);
+  txtime_errqueue_read(tt, daemon->event_svc.socket.fd6);
+
+  tt->launch_ns = (now + lead_ns + interval_ns - 1) / interval_ns * interval_ns;
+  tt->realtime_offset_ns = timesource_offset_get(AIRPTP_TIMEBASE_REALTIME);
+  tt->num_ts = 0;
+  tt->has_error = false;
+
+  tai_launch_ns = tt->launch_ns + timesource_offset_get(AIRPTP_TIMEBASE_TAI);
+  tt->sequence_id = ptp_msg_sync_schedule(daemon, tai_launch_ns);
+
+  tv.tv_sec = 0;
+  tv.tv_usec = (tt->launch_ns - now) / 1000 + TXTIME_FOLLOW_UP_DELAY_US;
+  event_add(tt->follow_up_ev, &tv);
+
+  // Wake up lead_us before the next launch time
+  next_ns = tt->launch_ns + interval_ns - lead_ns;
+  tv.tv_sec = (next_ns - now) / 1000000000ULL;
+  tv.tv_usec = ((next_ns - now) % 1000000000ULL) / 1000;
+  event_add(daemon->send_sync_timer, &tv);
+
+  STATS_INC(daemon, tx_sync_scheduled);
+  return 0;
+}
+
+ssize_t
+txtime_sendto(struct utils_net_socket *sock, const void *buf, size_t len, union utils_net_sockaddr *addr, uint64_t launch_ns)
+{
+  uint8_t control[CMSG_SPACE(sizeof(uint64_t)) + CMSG_SPACE(sizeof(uint32_t))] = { 0 };
+  struct cmsghdr *cmsg;
+  struct msghdr mh = { 0 };
+  struct iovec iov;
+  uint32_t ts_flags = SOF_TIMESTAMPING_TX_SOFTWARE;
+
+  iov.iov_base = (void *)buf;
+  iov.iov_len = len;
+
+  mh.msg_name = &addr->sa;
+  mh.msg_namelen = (addr->sa.sa_family == AF_INET6) ? sizeof(addr->sin6) : sizeof(addr->sin);
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control;
+  mh.msg_controllen = sizeof(control);
+
+  cmsg = CMSG_FIRSTHDR(&mh);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_TXTIME;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+  memcpy(CMSG_DATA(cmsg), &launch_ns, sizeof(uint64_t));
+
+  cmsg = CMSG_NXTHDR(&mh, cmsg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SO_TIMESTAMPING;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+  memcpy(CMSG_DATA(cmsg), &ts_flags, sizeof(uint32_t));
+
+  return sendmsg((addr->sa.sa_family == AF_INET6) ? sock->fd6 : sock->fd4, &mh, 0);
+}
+
+struct txtime *
+txtime_start(struct airptp_daemon *daemon, uint32_t lead_us)
+{
+  struct txtime *tt;
+  struct utils_net_socket *sock = &daemon->event_svc.socket;
+
+  if (socket_setup(sock->fd4) < 0 || socket_setup(sock->fd6) < 0) {
+    airptp_logmsg("Could not enable SO_TXTIME or tx timestamps: %s", strerror(errno));
+    socket_reset(sock->fd4);
+    socket_reset(sock->fd6);
+    return NULL;
+  }
+
+  tt = calloc(1, sizeof(struct txtime));
+  if (!tt)
+    goto error;
+
+  tt->daemon = daemon;
+  tt->lead_us = lead_us;
+  tt->follow_up_ev = evtimer_new(daemon->evbase, follow_up_cb, tt);
+  if (!tt->follow_up_ev)
+    goto error;
+
+  airptp_logmsg("Scheduling Syncs %" PRIu32 " us ahead with SO_TXTIME", lead_us);
+  return tt;
+
+ error:
+  free(tt);
+  socket_reset(sock->fd4);
+  socket_reset(sock->fd6);
+  return NULL;
+}
+
+void
+txtime_stop(struct txtime *tt)
+{
+  if (!tt)
+    return;
+
+  event_free(tt->follow_up_ev);
+  socket_reset(tt->daemon->event_svc.socket.fd4);
+  socket_reset(tt->daemon->event_svc.socket.fd6);
+  txtime_errqueue_read(NULL, tt->daemon->event_svc.socket.fd4);
+  txtime_errqueue_read(NULL, tt->daemon->event_svc.socket.fd6);
+  free(tt);
+}
+
+#else
+
+struct txtime *
+txtime_start(struct airptp_daemon *daemon, uint32_t lead_us)
+{
+  airptp_logmsg("Not built with SO_TXTIME support, Syncs are sent the normal way");
+  return NULL;
+}
+
+void
+txtime_stop(struct txtime *tt)
+{
+}
+
+int
+txtime_sync_send(struct txtime *tt)
+{
+  return -1;
+}
+
+void
+txtime_errqueue_read(struct txtime *tt, int fd)
+{
+}
+
+ssize_t
+txtime_sendto(struct utils_net_socket *sock, const void *buf, size_t len, union utils_net_sockaddr *addr, uint64_t launch_ns)
+{
+  errno = ENOTSUP;
+  return -1;
+}
+
+#endif
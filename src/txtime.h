@@ -0,0 +1,35 @@
+#ifndef __AIRPTP_TXTIME_H__
+#define __AIRPTP_TXTIME_H__
+
+#include "airptp_internal.h"
+
+struct txtime;
+
+// Enables SO_TXTIME and software tx timestamps on the daemon's event sockets.
+// Returns NULL if the kernel doesn't support it, in which case Sync is sent the
+// normal way. Daemon thread only.
+struct txtime *
+txtime_start(struct airptp_daemon *daemon, uint32_t lead_us);
+
+void
+txtime_stop(struct txtime *tt);
+
+// Use instead of ptp_msg_sync_send() from the Sync timer. Queues a Sync with a
+// launch time on the Sync interval grid, lead_us ahead, schedules the Follow_Up
+// and rearms the Sync timer for the next one. Returns -1 if scheduled sending
+// has failed too often, then the caller should stop it and send the normal way.
+int
+txtime_sync_send(struct txtime *tt);
+
+// Reads tx timestamps and errors from the socket's error queue. Call when the
+// socket is readable but there is nothing to receive, since the error queue
+// also makes it readable. With tt NULL the queue is just drained.
+void
+txtime_errqueue_read(struct txtime *tt, int fd);
+
+// Like utils_net_sendto(), but the packet leaves at launch_ns (CLOCK_TAI) and
+// gets a tx timestamp
+ssize_t
+txtime_sendto(struct utils_net_socket *sock, const void *buf, size_t len, union utils_net_sockaddr *addr, uint64_t launch_ns);
+
+#endif // __AIRPTP_TXTIME_H__
@@ -0,0 +1,551 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "uring.h"
+#include "daemon.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+// io_uring backend for the daemon thread. The libevent loop stays, but instead
+// of readiness plus a recvfrom() per packet, each socket has a multishot
+// recvmsg that fills buffers from a provided buffer ring, and the completions
+// are reaped when the ring's eventfd fires. Sends to all peers are queued and
+// submitted with one syscall. We use the kernel interface directly, so there
+// is no dependency on liburing.
+
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 1024
+// Must be a power of two
+#define URING_BUFS 256
+#define URING_BUF_SIZE 2048
+#define URING_BGID 0
+#define URING_SEND_SLOTS 256
+#define URING_MAX_RECV 4
+// Consecutive failed receives after which we give up on io_uring
+#define URING_MAX_RECV_ERRORS 3
+
+enum uring_op
+{
+  URING_OP_RECV = 1,
+  URING_OP_SEND = 2,
+};
+
+struct uring_send_slot
+{
+  bool in_use;
+  uint32_t peer_id;
+  union utils_net_sockaddr naddr;
+  struct iovec iov;
+  struct msghdr mh;
+  uint8_t msg[256];
+};
+
+struct uring
+{
+  int fd;
+  int efd;
+  struct event *ev;
+  struct airptp_daemon *daemon;
+  uring_recv_cb recv_cb;
+
+  void *sq_ptr;
+  size_t sq_len;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned sqe_tail;
+  unsigned to_submit;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+
+  void *cq_ptr;
+  size_t cq_len;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *br;
+  size_t br_len;
+  uint16_t br_tail;
+  uint8_t *bufs;
+
+  // Template for the multishot recvmsg, tells the kernel how much room to
+  // leave for the source address in each buffer
+  struct msghdr recv_mh;
+  int recv_fds[URING_MAX_RECV];
+  int num_recv_fds;
+  int recv_errors;
+  bool is_failed;
+
+  struct uring_send_slot slots[URING_SEND_SLOTS];
+};
+
+static inline uint64_t
+user_data_make(enum uring_op op, uint32_t index)
+{
+  return ((uint64_t)op << 32) | index;
+}
+
+static struct io_uring_sqe *
+sqe_get(struct uring *u)
+{
+  struct io_uring_sqe *sqe;
+  unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  unsigned idx;
+
+  if (u->sqe_tail - head >= u->sq_entries)
+    return NULL;
+
+  idx = u->sqe_tail & *u->sq_mask;
+  sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[idx] = idx;
+  u->sqe_tail++;
+  u->to_submit++;
+
+  return sqe;
+}
+
+void
+uring_submit(struct uring *u)
+{
+  int ret;
+
+  if (u->to_submit == 0)
+    return;
+
+  __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+
+  ret = syscall(__NR_io_uring_enter, u->fd, u->to_submit, 0, 0, NULL, 0);
+  if (ret < 0) {
+    airptp_logmsg("io_uring submit failed: %s", strerror(errno));
+    return;
+  }
+
+  u->to_submit -= ret;
+}
+
+static void
+buf_recycle(struct uring *u, uint16_t bid)
+{
+  struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (URING_BUFS - 1)];
+
+  buf->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+  buf->len = URING_BUF_SIZE;
+  buf->bid = bid;
+  u->br_tail++;
+
+  __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static int
+recv_arm(struct uring *u, int index)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = sqe_get(u);
+  if (!sqe)
+    return -1;
+
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = u->recv_fds[index];
+  sqe->addr = (uint64_t)(uintptr_t)&u->recv_mh;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = user_data_make(URING_OP_RECV, index);
+
+  return 0;
+}
+
+static void
+recv_complete(struct uring *u, struct io_uring_cqe *cqe, int index)
+{
+  struct io_uring_recvmsg_out *out;
+  union utils_net_sockaddr naddr;
+  uint16_t bid;
+  uint8_t *buf;
+  uint8_t *payload;
+
+  if (cqe->res >= 0)
+    u->recv_errors = 0;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE) && !u->is_failed) {
+    // The kernel stops the multishot if e.g. it ran out of buffers, then we
+    // re-arm. Other errors would likely just repeat, so don't spin on them.
+    if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+      airptp_logmsg("io_uring receive error: %s", strerror(-cqe->res));
+      u->recv_errors++;
+    }
+    if (u->recv_errors >= URING_MAX_RECV_ERRORS)
+      u->is_failed = true;
+    else
+      recv_arm(u, index);
+  }
+
+  if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER))
+    return;
+
+  bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  buf = u->bufs + (size_t)bid * URING_BUF_SIZE;
+  out = (struct io_uring_recvmsg_out *)buf;
+  payload = buf + sizeof(*out) + u->recv_mh.msg_namelen + u->recv_mh.msg_controllen;
+
+  if (!(out->flags & MSG_TRUNC) && out->namelen <= sizeof(naddr) && out->payloadlen > 0) {
+    memset(&naddr, 0, sizeof(naddr));
+    memcpy(&naddr, buf + sizeof(*out), out->namelen);
+    u->recv_cb(u->daemon, payload, out->payloadlen, &naddr, out->namelen);
+  }
+
+  buf_recycle(u, bid);
+}
+
+static void
+send_complete(struct uring *u, struct io_uring_cqe *cqe, int index)
+{
+  struct uring_send_slot *slot = &u->slots[index];
+  struct airptp_daemon *daemon = u->daemon;
+  int i;
+
+  slot->in_use = false;
+
+  if (cqe->res < 0)
+    daemon_tx_error_count(daemon, -cqe->res);
+
+  for (i = 0; i < daemon->num_peers; i++) {
+    if (daemon->peers[i].id == slot->peer_id)
+      daemon_peer_send_result(daemon, &daemon->peers[i], (cqe->res < 0) ? -cqe->res : 0);
+  }
+}
+
+static void
+reap_cb(int fd, short what, void *arg)
+{
+  struct uring *u = arg;
+  struct io_uring_cqe *cqe;
+  uint64_t count;
+  unsigned head;
+  unsigned tail;
+
+  if (read(u->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    airptp_logmsg("io_uring eventfd read error: %s", strerror(errno));
+
+  head = *u->cq_head;
+  tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++) {
+    cqe = &u->cqes[head & *u->cq_mask];
+
+    if ((cqe->user_data >> 32) == URING_OP_RECV)
+      recv_complete(u, cqe, cqe->user_data & 0xFFFFFFFF);
+    else if ((cqe->user_data >> 32) == URING_OP_SEND)
+      send_complete(u, cqe, cqe->user_data & 0xFFFFFFFF);
+
+    // Release the slot right away, the callbacks may produce more
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+  }
+
+  if (u->is_failed) {
+    airptp_logmsg("io_uring receives keep failing, giving up on it");
+    daemon_uring_failed(u->daemon); // Frees u
+    return;
+  }
+
+  // Re-arms and sends from the callbacks
+  uring_submit(u);
+}
+
+int
+uring_sendto(struct uring *u, struct utils_net_socket *sock, const void *msg, size_t msg_len, union utils_net_sockaddr *naddr, uint32_t peer_id)
+{
+  struct uring_send_slot *slot = NULL;
+  struct io_uring_sqe *sqe;
+  int i;
+
+  // AF_XDP sends bypass the socket
+  if (sock->xsk || msg_len > sizeof(slot->msg))
+    return -1;
+
+  for (i = 0; i < URING_SEND_SLOTS; i++) {
+    if (!u->slots[i].in_use) {
+      slot = &u->slots[i];
+      break;
+    }
+  }
+
+  if (!slot)
+    return -1;
+
+  sqe = sqe_get(u);
+  if (!sqe)
+    return -1;
+
+  slot->in_use = true;
+  slot->peer_id = peer_id;
+  slot->naddr = *naddr;
+  memcpy(slot->msg, msg, msg_len);
+  slot->iov.iov_base = slot->msg;
+  slot->iov.iov_len = msg_len;
+  memset(&slot->mh, 0, sizeof(slot->mh));
+  slot->mh.msg_name = &slot->naddr;
+  slot->mh.msg_namelen = (naddr->sa.sa_family == AF_INET6) ? sizeof(naddr->sin6) : sizeof(naddr->sin);
+  slot->mh.msg_iov = &slot->iov;
+  slot->mh.msg_iovlen = 1;
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = (naddr->sa.sa_family == AF_INET6) ? sock->fd6 : sock->fd4;
+  sqe->addr = (uint64_t)(uintptr_t)&slot->mh;
+  sqe->len = 1;
+  sqe->user_data = user_data_make(URING_OP_SEND, i);
+
+  return 0;
+}
+
+static int
+ring_map(struct uring *u, struct io_uring_params *p)
+{
+  u->sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+  u->cq_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  if (p->features & IORING_FEAT_SINGLE_MMAP)
+    u->sq_len = u->cq_len = (u->sq_len > u->cq_len) ? u->sq_len : u->cq_len;
+
+  u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ptr == MAP_FAILED)
+    return -1;
+
+  if (p->features & IORING_FEAT_SINGLE_MMAP)
+    u->cq_ptr = u->sq_ptr;
+  else
+    u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+  if (u->cq_ptr == MAP_FAILED)
+    return -1;
+
+  u->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+    return -1;
+
+  u->sq_head = (unsigned *)((uint8_t *)u->sq_ptr + p->sq_off.head);
+  u->sq_tail = (unsigned *)((uint8_t *)u->sq_ptr + p->sq_off.tail);
+  u->sq_mask = (unsigned *)((uint8_t *)u->sq_ptr + p->sq_off.ring_mask);
+  u->sq_array = (unsigned *)((uint8_t *)u->sq_ptr + p->sq_off.array);
+  u->sq_entries = p->sq_entries;
+  u->sqe_tail = *u->sq_tail;
+
+  u->cq_head = (unsigned *)((uint8_t *)u->cq_ptr + p->cq_off.head);
+  u->cq_tail = (unsigned *)((uint8_t *)u->cq_ptr + p->cq_off.tail);
+  u->cq_mask = (unsigned *)((uint8_t *)u->cq_ptr + p->cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)((uint8_t *)u->cq_ptr + p->cq_off.cqes);
+
+  return 0;
+}
+
+static int
+bufs_register(struct uring *u)
+{
+  struct io_uring_buf_reg reg = { 0 };
+  int i;
+
+  u->br_len = URING_BUFS * sizeof(struct io_uring_buf);
+  u->br = mmap(NULL, u->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (u->br == MAP_FAILED)
+    return -1;
+
+  u->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+  if (!u->bufs)
+    return -1;
+
+  reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+  reg.ring_entries = URING_BUFS;
+  reg.bgid = URING_BGID;
+  if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    return -1;
+
+  for (i = 0; i < URING_BUFS; i++)
+    buf_recycle(u, i);
+
+  return 0;
+}
+
+static void
+uring_free(struct uring *u)
+{
+  if (u->ev)
+    event_free(u->ev);
+  if (u->efd >= 0)
+    close(u->efd);
+  if (u->fd >= 0)
+    close(u->fd);
+  if (u->sqes && u->sqes != MAP_FAILED)
+    munmap(u->sqes, u->sqes_len);
+  if (u->cq_ptr && u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr)
+    munmap(u->cq_ptr, u->cq_len);
+  if (u->sq_ptr && u->sq_ptr != MAP_FAILED)
+    munmap(u->sq_ptr, u->sq_len);
+  if (u->br && u->br != MAP_FAILED)
+    munmap(u->br, u->br_len);
+  free(u->bufs);
+  free(u);
+}
+
+// A kernel with buffer rings but without multishot recvmsg (5.19) fails the
+// arms right away, so check the completions of the submit for that
+static int
+recv_check(struct uring *u)
+{
+  struct io_uring_cqe *cqe;
+  unsigned head;
+  unsigned tail;
+
+  head = *u->cq_head;
+  tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++) {
+    cqe = &u->cqes[head & *u->cq_mask];
+
+    if ((cqe->user_data >> 32) == URING_OP_RECV && cqe->res < 0 && cqe->res != -ENOBUFS && !(cqe->flags & IORING_CQE_F_MORE)) {
+      errno = -cqe->res;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void
+recv_fd_add(struct uring *u, int fd)
+{
+  if (fd >= 0 && u->num_recv_fds < URING_MAX_RECV)
+    u->recv_fds[u->num_recv_fds++] = fd;
+}
+
+struct uring *
+uring_start(struct airptp_daemon *daemon, uring_recv_cb recv_cb)
+{
+  struct io_uring_params params = { 0 };
+  struct uring *u;
+  int i;
+
+  u = calloc(1, sizeof(struct uring));
+  if (!u)
+    return NULL;
+
+  u->fd = -1;
+  u->efd = -1;
+  u->daemon = daemon;
+  u->recv_cb = recv_cb;
+  u->recv_mh.msg_namelen = sizeof(union utils_net_sockaddr);
+
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = URING_CQ_ENTRIES;
+  u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (u->fd < 0)
+    goto error;
+
+  if (ring_map(u, &params) < 0 || bufs_register(u) < 0)
+    goto error;
+
+  u->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (u->efd < 0 || syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_EVENTFD, &u->efd, 1) < 0)
+    goto error;
+
+  u->ev = event_new(daemon->evbase, u->efd, EV_READ | EV_PERSIST, reap_cb, u);
+  if (!u->ev)
+    goto error;
+  event_add(u->ev, NULL);
+
+  recv_fd_add(u, daemon->event_svc.socket.fd4);
+  recv_fd_add(u, daemon->event_svc.socket.fd6);
+  recv_fd_add(u, daemon->general_svc.socket.fd4);
+  recv_fd_add(u, daemon->general_svc.socket.fd6);
+
+  for (i = 0; i < u->num_recv_fds; i++) {
+    if (recv_arm(u, i) < 0)
+      goto error;
+  }
+
+  uring_submit(u);
+  if (u->to_submit > 0 || recv_check(u) < 0)
+    goto error;
+
+  airptp_logmsg("Using io_uring for the daemon's I/O");
+  return u;
+
+ error:
+  airptp_logmsg("Could not set up io_uring: %s", strerror(errno));
+  uring_free(u);
+  return NULL;
+}
+
+void
+uring_stop(struct uring *u)
+{
+  if (!u)
+    return;
+
+  // Closing the ring cancels what is in flight
+  uring_free(u);
+}
+
+#else
+
+struct uring *
+uring_start(struct airptp_daemon *daemon, uring_recv_cb recv_cb)
+{
+  return NULL;
+}
+
+void
+uring_stop(struct uring *u)
+{
+}
+
+int
+uring_sendto(struct uring *u, struct utils_net_socket *sock, const void *msg, size_t msg_len, union utils_net_sockaddr *naddr, uint32_t peer_id)
+{
+  return -1;
+}
+
+void
+uring_submit(struct uring *u)
+{
+}
+
+#endif
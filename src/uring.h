@@ -0,0 +1,30 @@
+#ifndef __AIRPTP_URING_H__
+#define __AIRPTP_URING_H__
+
+#include "airptp_internal.h"
+
+struct uring;
+
+typedef void (*uring_recv_cb)(void *arg, uint8_t *msg, ssize_t msg_len, union utils_net_sockaddr *peer_addr, socklen_t peer_addrlen);
+
+// Starts receiving on the daemon's sockets with io_uring, calling recv_cb for
+// each message. Returns NULL if io_uring isn't available, in which case the
+// caller should use libevent for the sockets. Daemon thread only, like the
+// rest.
+struct uring *
+uring_start(struct airptp_daemon *daemon, uring_recv_cb recv_cb);
+
+void
+uring_stop(struct uring *u);
+
+// Queues a send, returns -1 if it can't, then the caller should just send
+// directly. Errors are logged and make the peer inactive, like for the direct
+// send.
+int
+uring_sendto(struct uring *u, struct utils_net_socket *sock, const void *msg, size_t msg_len, union utils_net_sockaddr *naddr, uint32_t peer_id);
+
+// Submits what has been queued
+void
+uring_submit(struct uring *u);
+
+#endif // __AIRPTP_URING_H__
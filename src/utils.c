@@ -39,11 +39,12 @@ SOFTWARE.
 #include <fcntl.h>
 
 #include "utils.h"
+#include "xdp.h"
 
 extern struct airptp_callbacks __thread airptp_cb;
 
 static int
-bind_one(const char *node, unsigned short port, int family)
+bind_one(const char *node, unsigned short port, int family, bool reuseport)
 {
   struct addrinfo hints = { 0 };
   struct addrinfo *servinfo;
@@ -71,10 +72,15 @@ bind_one(const char *node, unsigned short port, int family)
     if (fd < 0)
       continue;
 
+    // The daemon thread must never block on a full socket buffer. Note that
+    // O_CLOEXEC is a descriptor flag, so it must be set with F_SETFD.
     flags = fcntl(fd, F_GETFL, 0);
     if (flags < 0)
       continue;
-    ret = fcntl(fd, F_SETFL, flags | O_CLOEXEC);
+    ret = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if (ret < 0)
+      continue;
+    ret = fcntl(fd, F_SETFD, FD_CLOEXEC);
     if (ret < 0)
       continue;
 
@@ -84,6 +90,12 @@ bind_one(const char *node, unsigned short port, int family)
     if (ret < 0)
       continue;
 
+#ifdef SO_REUSEPORT
+    ret = reuseport ? setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) : 0;
+    if (ret < 0)
+      continue;
+#endif
+
     ret = bind(fd, ptr->ai_addr, ptr->ai_addrlen);
     if (ret < 0)
       continue;
@@ -111,13 +123,56 @@ bind_one(const char *node, unsigned short port, int family)
 int
 utils_net_bind(struct utils_net_socket *sock, const char *node, unsigned short port)
 {
-  sock->fd4 = bind_one(node, port, AF_INET);
-  sock->fd6 = bind_one(node, port, AF_INET6);
+  sock->fd4 = bind_one(node, port, AF_INET, false);
+  sock->fd6 = bind_one(node, port, AF_INET6, false);
+
+  if (sock->fd4 < 0 && sock->fd6 < 0)
+    return -1;
+
+  return 0;
+}
+
+// Like utils_net_bind(), but with SO_REUSEPORT, so that more sockets can be
+// bound to the port in the same way. Only Linux will spread incoming packets
+// over the sockets.
+int
+utils_net_bind_reuseport(struct utils_net_socket *sock, const char *node, unsigned short port)
+{
+#ifdef SO_REUSEPORT
+  sock->fd4 = bind_one(node, port, AF_INET, true);
+  sock->fd6 = bind_one(node, port, AF_INET6, true);
 
   if (sock->fd4 < 0 && sock->fd6 < 0)
     return -1;
 
   return 0;
+#else
+  return -1;
+#endif
+}
+
+// Returns a socket bound like the ones from utils_net_bind_reuseport(), but
+// connected to addr
+int
+utils_net_connect_reuseport(const char *node, unsigned short port, union utils_net_sockaddr *addr)
+{
+#ifdef SO_REUSEPORT
+  socklen_t addrlen = (addr->sa.sa_family == AF_INET6) ? sizeof(addr->sin6) : sizeof(addr->sin);
+  int fd;
+
+  fd = bind_one(node, port, addr->sa.sa_family, true);
+  if (fd < 0)
+    return -1;
+
+  if (connect(fd, &addr->sa, addrlen) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+#else
+  return -1;
+#endif
 }
 
 int
@@ -192,12 +247,37 @@ utils_net_address_is_same(union utils_net_sockaddr *a, union utils_net_sockaddr
   return (cmp == 0);
 }
 
+bool
+utils_net_address_is_loopback(union utils_net_sockaddr *naddr)
+{
+  struct in6_addr *sin6_addr = &naddr->sin6.sin6_addr;
+
+  if (naddr->sa.sa_family == AF_INET)
+    return ((ntohl(naddr->sin.sin_addr.s_addr) >> 24) == 127);
+  else if (naddr->sa.sa_family != AF_INET6)
+    return false;
+  else if (IN6_IS_ADDR_LOOPBACK(sin6_addr))
+    return true;
+  else if (IN6_IS_ADDR_V4MAPPED(sin6_addr))
+    return (((uint8_t *)sin6_addr)[12] == 127);
+
+  return false;
+}
+
 // In Linux, you just need one socket for sending both ipv4 and ipv6, but BSD
 // and Mac OS think that would be too easy. We have to go with the lowest
 // denominator.
 ssize_t
 utils_net_sendto(struct utils_net_socket *sock, const void *buf, size_t len, union utils_net_sockaddr *addr)
 {
+  ssize_t ret;
+
+  if (sock->xsk) {
+    ret = xdp_socket_sendto(sock->xsk, buf, len, addr);
+    if (ret >= 0)
+      return ret;
+  }
+
   if (addr->sa.sa_family == AF_INET6)
     return sendto(sock->fd6, buf, len, 0, &addr->sa, sizeof(addr->sin6));
   else
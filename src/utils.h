@@ -24,12 +24,16 @@
 
 #define ARRAY_SIZE(x) ((unsigned int)(sizeof(x) / sizeof((x)[0])))
 
-#define UTILS_NET_SOCKET_INIT {-1, -1}
+#define UTILS_NET_SOCKET_INIT {-1, -1, NULL}
+
+struct xdp_socket;
 
 struct utils_net_socket
 {
   int fd4;
   int fd6;
+  // If set, ipv4 is sent through this when possible, see xdp.c
+  struct xdp_socket *xsk;
 };
 
 union utils_net_sockaddr
@@ -43,6 +47,12 @@ union utils_net_sockaddr
 int
 utils_net_bind(struct utils_net_socket *sock, const char *node, unsigned short port);
 
+int
+utils_net_bind_reuseport(struct utils_net_socket *sock, const char *node, unsigned short port);
+
+int
+utils_net_connect_reuseport(const char *node, unsigned short port, union utils_net_sockaddr *addr);
+
 int
 utils_net_sockaddr_get(union utils_net_sockaddr *naddr, const char *addr, unsigned short port);
 
@@ -52,6 +62,9 @@ utils_net_address_get(char *addr, size_t addr_len, union utils_net_sockaddr *nad
 bool
 utils_net_address_is_same(union utils_net_sockaddr *a, union utils_net_sockaddr *b);
 
+bool
+utils_net_address_is_loopback(union utils_net_sockaddr *naddr);
+
 ssize_t
 utils_net_sendto(struct utils_net_socket *sock, const void *buf, size_t len, union utils_net_sockaddr *addr);
 
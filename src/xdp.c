@@ -0,0 +1,837 @@
+/*
+MIT License
+
+Copyright (c) 2026 OwnTone
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "airptp_internal.h"
+#include "xdp.h"
+
+#ifdef HAVE_AF_XDP
+
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+
+// Experimental AF_XDP transport for the event port, IPv4 only. An XDP program
+// on the interface redirects UDP packets for the event port to our socket,
+// everything else goes to the kernel stack as usual. We send by writing whole
+// Ethernet frames to the tx ring. The MAC addresses of the daemon's peers are
+// learned from the packets they send us, and until we have it the caller must
+// use the UDP socket.
+//
+// Only queue 0 is served, so the NIC must deliver PTP there (true for veth and
+// single queue NICs). The program is attached in native mode if the driver
+// supports it, otherwise (or if asked to) in generic mode.
+
+#define XDP_NUM_FRAMES 4096
+#define XDP_FRAME_SIZE 2048
+#define XDP_RING_SIZE 2048
+// First half of the frames is for rx, second half for tx
+#define XDP_TX_FRAME_FIRST (XDP_NUM_FRAMES / 2)
+// Room to spare, so the probe sequences stay short
+#define XDP_NEIGH_SIZE (2 * AIRPTP_MAX_PEERS)
+// A peer's known MAC address is only replaced after we haven't received from
+// it for this long, see neigh_learn()
+#define XDP_NEIGH_STALE_NS 5000000000ULL
+#define XDP_BIND_RETRIES 20
+
+#define ETH_HLEN 14
+#define IP_HLEN 20
+#define UDP_HLEN 8
+#define HDRS_LEN (ETH_HLEN + IP_HLEN + UDP_HLEN)
+
+struct xdp_ring
+{
+  uint32_t *producer;
+  uint32_t *consumer;
+  uint32_t *flags;
+  void *descs;
+  void *map;
+  size_t map_len;
+};
+
+// Written by the daemon thread and read by senders on other threads, so
+// protected by a sequence count like timesource.c's timeline. ip is 0 if the
+// slot is free.
+struct xdp_neigh
+{
+  uint32_t seq;
+  uint32_t ip;
+  uint8_t mac[6];
+  bool has_mac;
+
+  // Only used by the daemon thread
+  uint64_t seen_ns;
+};
+
+struct xdp_socket
+{
+  int fd;
+  int map_fd;
+  int prog_fd;
+  int link_fd;
+  unsigned short port;
+
+  uint8_t mac[6];
+  uint32_t ip;
+
+  uint8_t *umem;
+  struct xdp_ring rx;
+  struct xdp_ring tx;
+  struct xdp_ring fill;
+  struct xdp_ring comp;
+
+  // The tx side may be used by both the daemon thread and the tx thread. It
+  // belongs to whoever set tx_busy, and the other one sends with the UDP
+  // socket meanwhile, so neither has to wait.
+  bool tx_busy;
+  uint64_t tx_free[XDP_NUM_FRAMES - XDP_TX_FRAME_FIRST];
+  int num_tx_free;
+
+  // Open addressing with linear probing, replaced by xdp_socket_neighs_set()
+  struct xdp_neigh neigh[XDP_NEIGH_SIZE];
+};
+
+
+/* --------------------------------- Rings ---------------------------------- */
+
+static int
+ring_map(struct xdp_ring *ring, int fd, struct xdp_ring_offset *off, size_t desc_size, off_t pgoff)
+{
+  ring->map_len = off->desc + XDP_RING_SIZE * desc_size;
+  ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+  if (ring->map == MAP_FAILED) {
+    ring->map = NULL;
+    return -1;
+  }
+
+  ring->producer = (uint32_t *)((uint8_t *)ring->map + off->producer);
+  ring->consumer = (uint32_t *)((uint8_t *)ring->map + off->consumer);
+  ring->flags = (uint32_t *)((uint8_t *)ring->map + off->flags);
+  ring->descs = (uint8_t *)ring->map + off->desc;
+  return 0;
+}
+
+static void
+ring_unmap(struct xdp_ring *ring)
+{
+  if (ring->map)
+    munmap(ring->map, ring->map_len);
+}
+
+static int
+rings_setup(struct xdp_socket *xsk)
+{
+  struct xdp_umem_reg reg = { 0 };
+  struct xdp_mmap_offsets off;
+  socklen_t optlen = sizeof(off);
+  int size = XDP_RING_SIZE;
+  uint64_t *fill_addrs;
+  int i;
+
+  xsk->umem = mmap(NULL, (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (xsk->umem == MAP_FAILED) {
+    xsk->umem = NULL;
+    return -1;
+  }
+
+  reg.addr = (uint64_t)(uintptr_t)xsk->umem;
+  reg.len = (uint64_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE;
+  reg.chunk_size = XDP_FRAME_SIZE;
+  if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0)
+    return -1;
+
+  if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+      setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+      setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+      setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0)
+    return -1;
+
+  if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+    return -1;
+
+  if (ring_map(&xsk->rx, xsk->fd, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0 ||
+      ring_map(&xsk->tx, xsk->fd, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0 ||
+      ring_map(&xsk->fill, xsk->fd, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+      ring_map(&xsk->comp, xsk->fd, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0)
+    return -1;
+
+  // Give the kernel all the rx frames
+  fill_addrs = xsk->fill.descs;
+  for (i = 0; i < XDP_TX_FRAME_FIRST; i++)
+    fill_addrs[i] = (uint64_t)i * XDP_FRAME_SIZE;
+  __atomic_store_n(xsk->fill.producer, XDP_TX_FRAME_FIRST, __ATOMIC_RELEASE);
+
+  for (i = XDP_TX_FRAME_FIRST; i < XDP_NUM_FRAMES; i++)
+    xsk->tx_free[xsk->num_tx_free++] = (uint64_t)i * XDP_FRAME_SIZE;
+
+  return 0;
+}
+
+
+/* ----------------------------- XDP program -------------------------------- */
+
+#define INSN(c, d, s, o, i) ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+struct prog
+{
+  struct bpf_insn insns[32];
+  int len;
+  // Jumps to the XDP_PASS at the end, patched when we know where it is
+  int pass_jumps[8];
+  int num_pass_jumps;
+};
+
+static inline void
+emit(struct prog *prog, struct bpf_insn insn)
+{
+  prog->insns[prog->len++] = insn;
+}
+
+static inline void
+emit_pass_unless(struct prog *prog, uint8_t reg, int32_t imm)
+{
+  prog->pass_jumps[prog->num_pass_jumps++] = prog->len;
+  emit(prog, INSN(BPF_JMP | BPF_JNE | BPF_K, reg, 0, 0, imm));
+}
+
+// Redirects IPv4 UDP packets (without IP options) for our port to the socket
+// in the xskmap for the rx queue, passes anything else. Multi-byte fields are
+// compared with the value in network byte order, as loaded from the packet.
+static int
+prog_load(int map_fd, unsigned short port)
+{
+  union bpf_attr attr;
+  struct prog prog = { 0 };
+  char log[4096] = "";
+  int fd;
+  int i;
+
+  emit(&prog, INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0));
+  emit(&prog, INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data), 0));
+  emit(&prog, INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end), 0));
+  emit(&prog, INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0));
+  emit(&prog, INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, HDRS_LEN));
+  prog.pass_jumps[prog.num_pass_jumps++] = prog.len;
+  emit(&prog, INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0));
+
+  emit(&prog, INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0));
+  emit_pass_unless(&prog, BPF_REG_5, htons(0x0800));
+  emit(&prog, INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN, 0));
+  emit_pass_unless(&prog, BPF_REG_5, 0x45);
+  emit(&prog, INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN + 9, 0));
+  emit_pass_unless(&prog, BPF_REG_5, IPPROTO_UDP);
+  emit(&prog, INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + IP_HLEN + 2, 0));
+  emit_pass_unless(&prog, BPF_REG_5, htons(port));
+
+  // bpf_redirect_map(map, rx_queue_index, XDP_PASS), the last argument is the
+  // action if the queue has no socket
+  emit(&prog, INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index), 0));
+  emit(&prog, INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd));
+  emit(&prog, INSN(0, 0, 0, 0, 0));
+  emit(&prog, INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS));
+  emit(&prog, INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+  emit(&prog, INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+  for (i = 0; i < prog.num_pass_jumps; i++)
+    prog.insns[prog.pass_jumps[i]].off = prog.len - prog.pass_jumps[i] - 1;
+
+  emit(&prog, INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS));
+  emit(&prog, INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (uint64_t)(uintptr_t)prog.insns;
+  attr.insn_cnt = prog.len;
+  attr.license = (uint64_t)(uintptr_t)"Dual MIT/GPL";
+
+  fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+  if (fd >= 0 || errno != EACCES)
+    return fd;
+
+  // Load again to get the verifier's explanation. The log must be large enough
+  // for all of it, otherwise the load fails with ENOSPC.
+  attr.log_buf = (uint64_t)(uintptr_t)log;
+  attr.log_size = sizeof(log);
+  attr.log_level = 1;
+  if (syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr)) < 0)
+    airptp_logmsg("XDP program rejected: %s", log);
+
+  errno = EACCES;
+  return -1;
+}
+
+static int
+map_create(void)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = 1;
+
+  return syscall(__NR_bpf, BPF_MAP_CREATE, &attr, sizeof(attr));
+}
+
+static int
+map_socket_set(int map_fd, uint32_t queue, int fd)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uint64_t)(uintptr_t)&queue;
+  attr.value = (uint64_t)(uintptr_t)&fd;
+
+  return syscall(__NR_bpf, BPF_MAP_UPDATE_ELEM, &attr, sizeof(attr));
+}
+
+// The map holds a reference to the socket and is freed asynchronously, so
+// without this the queue would still be busy for a while after we close
+static void
+map_socket_clear(int map_fd, uint32_t queue)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uint64_t)(uintptr_t)&queue;
+
+  syscall(__NR_bpf, BPF_MAP_DELETE_ELEM, &attr, sizeof(attr));
+}
+
+// The program stays attached as long as the link fd is open
+static int
+prog_attach(int prog_fd, int ifindex, bool generic)
+{
+  union bpf_attr attr;
+  uint32_t modes[] = { XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE };
+  int fd = -1;
+  int i;
+
+  for (i = generic ? 1 : 0; i < ARRAY_SIZE(modes) && fd < 0; i++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = modes[i];
+
+    fd = syscall(__NR_bpf, BPF_LINK_CREATE, &attr, sizeof(attr));
+    if (fd >= 0)
+      airptp_logmsg("XDP program attached in %s mode", (modes[i] == XDP_FLAGS_DRV_MODE) ? "native" : "generic");
+  }
+
+  return fd;
+}
+
+
+/* -------------------------------- Interface ------------------------------- */
+
+static int
+interface_addrs_get(struct xdp_socket *xsk, int ifindex)
+{
+  struct ifreq ifr = { 0 };
+  int fd;
+  int ret = -1;
+
+  if (!if_indextoname(ifindex, ifr.ifr_name))
+    return -1;
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+    return -1;
+
+  if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0)
+    goto out;
+  memcpy(xsk->mac, ifr.ifr_hwaddr.sa_data, sizeof(xsk->mac));
+
+  ifr.ifr_addr.sa_family = AF_INET;
+  if (ioctl(fd, SIOCGIFADDR, &ifr) < 0)
+    goto out;
+  xsk->ip = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr;
+
+  ret = 0;
+
+ out:
+  close(fd);
+  return ret;
+}
+
+static inline int
+neigh_first(uint32_t ip)
+{
+  return utils_djb_hash(&ip, sizeof(ip)) % XDP_NEIGH_SIZE;
+}
+
+static uint64_t
+neigh_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Daemon thread only, which is the only writer, so no sequence count needed
+static struct xdp_neigh *
+neigh_find(struct xdp_neigh *table, uint32_t ip)
+{
+  struct xdp_neigh *neigh;
+  int first = neigh_first(ip);
+  int i;
+
+  for (i = 0; i < XDP_NEIGH_SIZE; i++) {
+    neigh = &table[(first + i) % XDP_NEIGH_SIZE];
+    if (neigh->ip == ip)
+      return neigh;
+    if (neigh->ip == 0)
+      return NULL;
+  }
+
+  return NULL;
+}
+
+static void
+neigh_write(struct xdp_neigh *neigh, uint32_t ip, const uint8_t *mac, bool has_mac)
+{
+  __atomic_store_n(&neigh->seq, neigh->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  neigh->ip = ip;
+  memcpy(neigh->mac, mac, sizeof(neigh->mac));
+  neigh->has_mac = has_mac;
+  __atomic_store_n(&neigh->seq, neigh->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Any thread. May miss an entry while the daemon thread replaces the table,
+// then the caller just uses the UDP socket for that send.
+static bool
+neigh_mac_get(struct xdp_socket *xsk, uint32_t ip, uint8_t *mac)
+{
+  struct xdp_neigh *neigh;
+  uint32_t seq;
+  uint32_t slot_ip;
+  bool has_mac;
+  int first = neigh_first(ip);
+  int i;
+
+  for (i = 0; i < XDP_NEIGH_SIZE; i++) {
+    neigh = &xsk->neigh[(first + i) % XDP_NEIGH_SIZE];
+
+    do {
+      seq = __atomic_load_n(&neigh->seq, __ATOMIC_ACQUIRE);
+      slot_ip = neigh->ip;
+      has_mac = neigh->has_mac;
+      memcpy(mac, neigh->mac, sizeof(neigh->mac));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&neigh->seq, __ATOMIC_RELAXED));
+
+    if (slot_ip == ip)
+      return has_mac;
+    if (slot_ip == 0)
+      return false;
+  }
+
+  return false;
+}
+
+// Only peers are learned, and a known MAC address is only replaced once it
+// has gone quiet, so a spoofed frame can't redirect a peer's traffic
+static void
+neigh_learn(struct xdp_neigh *neigh, const uint8_t *mac)
+{
+  uint64_t now_ns = neigh_now_ns();
+
+  if (neigh->has_mac && memcmp(neigh->mac, mac, sizeof(neigh->mac)) == 0) {
+    neigh->seen_ns = now_ns;
+    return;
+  }
+
+  if (neigh->has_mac && now_ns - neigh->seen_ns < XDP_NEIGH_STALE_NS)
+    return;
+
+  neigh_write(neigh, neigh->ip, mac, true);
+  neigh->seen_ns = now_ns;
+}
+
+void
+xdp_socket_neighs_set(struct xdp_socket *xsk, uint32_t *ips, int num_ips)
+{
+  struct xdp_neigh table[XDP_NEIGH_SIZE] = { 0 };
+  struct xdp_neigh *old;
+  struct xdp_neigh *neigh;
+  int first;
+  int i;
+  int j;
+
+  // Build the new table, keeping what we learned about peers that stay
+  for (i = 0; i < num_ips; i++) {
+    if (ips[i] == 0 || neigh_find(table, ips[i]))
+      continue;
+
+    first = neigh_first(ips[i]);
+    for (j = 0; j < XDP_NEIGH_SIZE; j++) {
+      neigh = &table[(first + j) % XDP_NEIGH_SIZE];
+      if (neigh->ip != 0)
+	continue;
+
+      neigh->ip = ips[i];
+      old = neigh_find(xsk->neigh, ips[i]);
+      if (old) {
+	memcpy(neigh->mac, old->mac, sizeof(neigh->mac));
+	neigh->has_mac = old->has_mac;
+	neigh->seen_ns = old->seen_ns;
+      }
+      break;
+    }
+  }
+
+  for (i = 0; i < XDP_NEIGH_SIZE; i++) {
+    if (xsk->neigh[i].ip != table[i].ip || xsk->neigh[i].has_mac != table[i].has_mac || memcmp(xsk->neigh[i].mac, table[i].mac, sizeof(table[i].mac)) != 0)
+      neigh_write(&xsk->neigh[i], table[i].ip, table[i].mac, table[i].has_mac);
+    xsk->neigh[i].seen_ns = table[i].seen_ns;
+  }
+}
+
+
+/* ---------------------------------- I/O ----------------------------------- */
+
+static uint16_t
+ip_checksum(const uint8_t *hdr)
+{
+  uint32_t sum = 0;
+  int i;
+
+  for (i = 0; i < IP_HLEN; i += 2)
+    sum += (hdr[i] << 8) | hdr[i + 1];
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+
+  return ~sum & 0xFFFF;
+}
+
+static void
+frame_handle(struct xdp_socket *xsk, uint8_t *frame, uint32_t len, xdp_recv_cb cb, void *arg)
+{
+  union utils_net_sockaddr naddr = { 0 };
+  struct xdp_neigh *neigh;
+  uint16_t udp_len;
+  uint32_t src_ip;
+
+  // Double check what the program matched, and that the lengths make sense
+  if (len < HDRS_LEN || frame[12] != 0x08 || frame[13] != 0x00 || frame[ETH_HLEN] != 0x45 || frame[ETH_HLEN + 9] != IPPROTO_UDP)
+    return;
+
+  udp_len = (frame[ETH_HLEN + IP_HLEN + 4] << 8) | frame[ETH_HLEN + IP_HLEN + 5];
+  if (udp_len < UDP_HLEN || ETH_HLEN + IP_HLEN + udp_len > len)
+    return;
+
+  memcpy(&src_ip, frame + ETH_HLEN + 12, sizeof(src_ip));
+
+  neigh = neigh_find(xsk->neigh, src_ip);
+  if (neigh)
+    neigh_learn(neigh, frame + 6);
+
+  naddr.sin.sin_family = AF_INET;
+  naddr.sin.sin_addr.s_addr = src_ip;
+  memcpy(&naddr.sin.sin_port, frame + ETH_HLEN + IP_HLEN, sizeof(naddr.sin.sin_port));
+
+  cb(arg, frame + HDRS_LEN, udp_len - UDP_HLEN, &naddr, sizeof(naddr.sin));
+}
+
+int
+xdp_socket_recv(struct xdp_socket *xsk, xdp_recv_cb cb, void *arg)
+{
+  struct xdp_desc *descs = xsk->rx.descs;
+  uint64_t *fill_addrs = xsk->fill.descs;
+  uint32_t prod = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE);
+  uint32_t cons = *xsk->rx.consumer;
+  uint32_t fill_prod = *xsk->fill.producer;
+  struct xdp_desc *desc;
+  int n;
+
+  for (n = 0; cons != prod; cons++, n++) {
+    desc = &descs[cons & (XDP_RING_SIZE - 1)];
+    frame_handle(xsk, xsk->umem + desc->addr, desc->len, cb, arg);
+
+    // Back to the kernel, we get as many frames as we give, so there is room
+    fill_addrs[fill_prod++ & (XDP_RING_SIZE - 1)] = desc->addr & ~((uint64_t)XDP_FRAME_SIZE - 1);
+  }
+
+  __atomic_store_n(xsk->rx.consumer, cons, __ATOMIC_RELEASE);
+  __atomic_store_n(xsk->fill.producer, fill_prod, __ATOMIC_RELEASE);
+
+  if (__atomic_load_n(xsk->fill.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)
+    recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+
+  return n;
+}
+
+static void
+completions_reclaim(struct xdp_socket *xsk)
+{
+  uint64_t *addrs = xsk->comp.descs;
+  uint32_t prod = __atomic_load_n(xsk->comp.producer, __ATOMIC_ACQUIRE);
+  uint32_t cons = *xsk->comp.consumer;
+
+  for (; cons != prod; cons++)
+    xsk->tx_free[xsk->num_tx_free++] = addrs[cons & (XDP_RING_SIZE - 1)];
+
+  __atomic_store_n(xsk->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+ssize_t
+xdp_socket_sendto(struct xdp_socket *xsk, const void *buf, size_t len, union utils_net_sockaddr *addr)
+{
+  struct xdp_desc *descs = xsk->tx.descs;
+  uint8_t mac[6];
+  uint32_t prod;
+  uint64_t frame_addr;
+  uint8_t *frame;
+  uint16_t ip_len = IP_HLEN + UDP_HLEN + len;
+  uint16_t csum;
+  uint16_t port_be = htons(xsk->port);
+  ssize_t ret = -1;
+
+  if (addr->sa.sa_family != AF_INET || HDRS_LEN + len > XDP_FRAME_SIZE) {
+    errno = EAFNOSUPPORT;
+    return -1;
+  }
+
+  if (!neigh_mac_get(xsk, addr->sin.sin_addr.s_addr, mac)) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+
+  if (__atomic_exchange_n(&xsk->tx_busy, true, __ATOMIC_ACQUIRE)) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  completions_reclaim(xsk);
+
+  prod = *xsk->tx.producer;
+  if (xsk->num_tx_free == 0 || prod - __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE) >= XDP_RING_SIZE) {
+    errno = ENOBUFS;
+    goto out;
+  }
+
+  frame_addr = xsk->tx_free[--xsk->num_tx_free];
+  frame = xsk->umem + frame_addr;
+
+  memcpy(frame, mac, 6);
+  memcpy(frame + 6, xsk->mac, 6);
+  frame[12] = 0x08;
+  frame[13] = 0x00;
+
+  memset(frame + ETH_HLEN, 0, IP_HLEN);
+  frame[ETH_HLEN] = 0x45;
+  frame[ETH_HLEN + 2] = ip_len >> 8;
+  frame[ETH_HLEN + 3] = ip_len & 0xFF;
+  frame[ETH_HLEN + 6] = 0x40; // Don't fragment
+  frame[ETH_HLEN + 8] = 64; // TTL
+  frame[ETH_HLEN + 9] = IPPROTO_UDP;
+  memcpy(frame + ETH_HLEN + 12, &xsk->ip, 4);
+  memcpy(frame + ETH_HLEN + 16, &addr->sin.sin_addr.s_addr, 4);
+  csum = ip_checksum(frame + ETH_HLEN);
+  frame[ETH_HLEN + 10] = csum >> 8;
+  frame[ETH_HLEN + 11] = csum & 0xFF;
+
+  // The UDP checksum is optional for IPv4, so leave it 0
+  memcpy(frame + ETH_HLEN + IP_HLEN, &port_be, 2);
+  memcpy(frame + ETH_HLEN + IP_HLEN + 2, &addr->sin.sin_port, 2);
+  frame[ETH_HLEN + IP_HLEN + 4] = (UDP_HLEN + len) >> 8;
+  frame[ETH_HLEN + IP_HLEN + 5] = (UDP_HLEN + len) & 0xFF;
+  frame[ETH_HLEN + IP_HLEN + 6] = 0;
+  frame[ETH_HLEN + IP_HLEN + 7] = 0;
+
+  memcpy(frame + HDRS_LEN, buf, len);
+
+  descs[prod & (XDP_RING_SIZE - 1)].addr = frame_addr;
+  descs[prod & (XDP_RING_SIZE - 1)].len = HDRS_LEN + len;
+  descs[prod & (XDP_RING_SIZE - 1)].options = 0;
+  __atomic_store_n(xsk->tx.producer, prod + 1, __ATOMIC_RELEASE);
+
+  if (__atomic_load_n(xsk->tx.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)
+    sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+
+  ret = len;
+
+ out:
+  __atomic_store_n(&xsk->tx_busy, false, __ATOMIC_RELEASE);
+  return ret;
+}
+
+
+/* ------------------------------ Setup/teardown ---------------------------- */
+
+int
+xdp_socket_fd(struct xdp_socket *xsk)
+{
+  return xsk->fd;
+}
+
+void
+xdp_socket_close(struct xdp_socket *xsk)
+{
+  if (!xsk)
+    return;
+
+  if (xsk->link_fd >= 0)
+    close(xsk->link_fd);
+  if (xsk->prog_fd >= 0)
+    close(xsk->prog_fd);
+  if (xsk->map_fd >= 0) {
+    map_socket_clear(xsk->map_fd, 0);
+    close(xsk->map_fd);
+  }
+  if (xsk->fd >= 0)
+    close(xsk->fd);
+
+  ring_unmap(&xsk->rx);
+  ring_unmap(&xsk->tx);
+  ring_unmap(&xsk->fill);
+  ring_unmap(&xsk->comp);
+  if (xsk->umem)
+    munmap(xsk->umem, (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE);
+
+  free(xsk);
+}
+
+struct xdp_socket *
+xdp_socket_open(int ifindex, unsigned short port, bool generic)
+{
+  struct xdp_socket *xsk;
+  struct sockaddr_xdp sxdp = { 0 };
+  int i;
+
+  xsk = calloc(1, sizeof(struct xdp_socket));
+  if (!xsk)
+    return NULL;
+
+  xsk->fd = -1;
+  xsk->map_fd = -1;
+  xsk->prog_fd = -1;
+  xsk->link_fd = -1;
+  xsk->port = port;
+
+  if (interface_addrs_get(xsk, ifindex) < 0)
+    goto error;
+
+  xsk->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+  if (xsk->fd < 0 || rings_setup(xsk) < 0)
+    goto error;
+
+  sxdp.sxdp_family = AF_XDP;
+  sxdp.sxdp_ifindex = ifindex;
+  sxdp.sxdp_queue_id = 0;
+  for (i = 0; i < XDP_BIND_RETRIES; i++) {
+    sxdp.sxdp_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0)
+      break;
+    sxdp.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0)
+      break;
+    if (errno != EBUSY)
+      goto error;
+
+    // The kernel releases a closed socket's hold on the queue asynchronously,
+    // so if we were just restarted it may still be busy
+    usleep(100000);
+  }
+  if (i == XDP_BIND_RETRIES)
+    goto error;
+
+  xsk->map_fd = map_create();
+  if (xsk->map_fd < 0 || map_socket_set(xsk->map_fd, 0, xsk->fd) < 0)
+    goto error;
+
+  xsk->prog_fd = prog_load(xsk->map_fd, port);
+  if (xsk->prog_fd < 0)
+    goto error;
+
+  xsk->link_fd = prog_attach(xsk->prog_fd, ifindex, generic);
+  if (xsk->link_fd < 0)
+    goto error;
+
+  airptp_logmsg("Using AF_XDP (%s mode) for port %hu", (sxdp.sxdp_flags & XDP_ZEROCOPY) ? "zero-copy" : "copy", port);
+  return xsk;
+
+ error:
+  airptp_logmsg("Could not set up AF_XDP on interface %d: %s", ifindex, strerror(errno));
+  xdp_socket_close(xsk);
+  return NULL;
+}
+
+#else
+
+struct xdp_socket *
+xdp_socket_open(int ifindex, unsigned short port, bool generic)
+{
+  return NULL;
+}
+
+void
+xdp_socket_close(struct xdp_socket *xsk)
+{
+}
+
+int
+xdp_socket_fd(struct xdp_socket *xsk)
+{
+  return -1;
+}
+
+int
+xdp_socket_recv(struct xdp_socket *xsk, xdp_recv_cb cb, void *arg)
+{
+  return 0;
+}
+
+ssize_t
+xdp_socket_sendto(struct xdp_socket *xsk, const void *buf, size_t len, union utils_net_sockaddr *addr)
+{
+  errno = EAFNOSUPPORT;
+  return -1;
+}
+
+void
+xdp_socket_neighs_set(struct xdp_socket *xsk, uint32_t *ips, int num_ips)
+{
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef __AIRPTP_XDP_H__
+#define __AIRPTP_XDP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "utils.h"
+
+struct xdp_socket;
+
+typedef void (*xdp_recv_cb)(void *arg, uint8_t *msg, ssize_t msg_len, union utils_net_sockaddr *peer_addr, socklen_t peer_addrlen);
+
+// Redirects UDP/IPv4 traffic to port on the interface to an AF_XDP socket.
+// Returns NULL if that isn't possible (no support, no privileges etc.). If
+// generic is false, the XDP program is attached in native mode if the driver
+// supports it.
+struct xdp_socket *
+xdp_socket_open(int ifindex, unsigned short port, bool generic);
+
+void
+xdp_socket_close(struct xdp_socket *xsk);
+
+// For polling, readable when there are received frames
+int
+xdp_socket_fd(struct xdp_socket *xsk);
+
+// Calls cb with the UDP payload of each received frame, returns the count
+int
+xdp_socket_recv(struct xdp_socket *xsk, xdp_recv_cb cb, void *arg);
+
+// Sends a UDP datagram from port. Fails if the destination isn't IPv4, if it
+// isn't a peer we have received from and so know the MAC address of, or if
+// another thread is sending, in which case the caller should send the normal
+// way.
+ssize_t
+xdp_socket_sendto(struct xdp_socket *xsk, const void *buf, size_t len, union utils_net_sockaddr *addr);
+
+// Sets the IPv4 addresses (network order) of the peers whose MAC addresses
+// should be learned and used for sending. What was learned about addresses
+// that stay is kept. Daemon thread only, like xdp_socket_recv().
+void
+xdp_socket_neighs_set(struct xdp_socket *xsk, uint32_t *ips, int num_ips);
+
+#endif // __AIRPTP_XDP_H__
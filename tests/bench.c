@@ -0,0 +1,1207 @@
+#define _GNU_SOURCE // For setns()
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "airptp.h"
+#include "src/timesource.h"
+#include "src/ptp_decode.h"
+
+// Benchmarks, run with the name of one as argument. Everything is on the
+// loopback with unprivileged ports.
+
+#define EVENT_PORT 30319
+#define GENERAL_PORT 30320
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static int
+socket_make(const char *addr, unsigned short port)
+{
+  struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons(port) };
+  int fd;
+
+  inet_pton(AF_INET, addr, &sin.sin_addr);
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+    perror("socket/bind");
+    exit(EXIT_FAILURE);
+  }
+
+  return fd;
+}
+
+static void
+delay_req_send(int fd, uint16_t seq)
+{
+  struct sockaddr_in dst = { .sin_family = AF_INET, .sin_port = htons(EVENT_PORT) };
+  uint8_t msg[44] = { 0 };
+
+  inet_pton(AF_INET, "127.0.0.1", &dst.sin_addr);
+
+  msg[0] = 0x11; // majorSdoId 1, Delay_Req
+  msg[1] = 0x02;
+  msg[3] = sizeof(msg);
+  msg[30] = seq >> 8;
+  msg[31] = seq & 0xff;
+
+  sendto(fd, msg, sizeof(msg), 0, (struct sockaddr *)&dst, sizeof(dst));
+}
+
+static struct airptp_handle *
+daemon_start(int option, int value)
+{
+  struct airptp_handle *hdl;
+
+  airptp_ports_override(EVENT_PORT, GENERAL_PORT);
+
+  hdl = airptp_daemon_bind("127.0.0.1");
+  if (!hdl)
+    goto error;
+
+  // We want to measure the daemon, not the rate limiter
+  if (airptp_daemon_option_set(hdl, AIRPTP_OPT_RATELIMIT_RATE, 0) < 0)
+    goto error;
+  if (option >= 0 && airptp_daemon_option_set(hdl, option, value) < 0)
+    goto error;
+
+  if (airptp_daemon_start(hdl, 1, false) < 0)
+    goto error;
+
+  return hdl;
+
+ error:
+  printf("bench.c error: %s\n", airptp_errmsg_get());
+  exit(EXIT_FAILURE);
+}
+
+
+/* ------------------------------- rxworkers -------------------------------- */
+
+// Each client keeps a window of Delay_Req outstanding, and sends a new one for
+// each Delay_Resp it gets. Latency is from send to receipt of the response.
+
+#define RXW_CLIENTS 8
+#define RXW_WINDOW 8
+#define RXW_MAX_SAMPLES 2000000
+
+struct rxw_client
+{
+  int fd;
+  uint64_t duration_ns;
+  uint64_t sent_ns[65536];
+  uint64_t *latency;
+  int num_latency;
+};
+
+static void *
+rxw_client_run(void *arg)
+{
+  struct rxw_client *client = arg;
+  struct pollfd pfd = { .fd = client->fd, .events = POLLIN };
+  uint8_t msg[128];
+  uint64_t start = now_ns();
+  uint64_t now;
+  uint16_t seq = 0;
+  uint16_t resp_seq;
+  ssize_t len;
+  int i;
+
+  for (i = 0; i < RXW_WINDOW; i++, seq++) {
+    client->sent_ns[seq] = now_ns();
+    delay_req_send(client->fd, seq);
+  }
+
+  while ((now = now_ns()) - start < client->duration_ns) {
+    // A lost request would shrink the window, so refill after a timeout
+    if (poll(&pfd, 1, 10) <= 0) {
+      client->sent_ns[seq] = now_ns();
+      delay_req_send(client->fd, seq++);
+      continue;
+    }
+
+    len = recv(client->fd, msg, sizeof(msg), 0);
+    if (len < 32 || (msg[0] & 0x0F) != 0x09)
+      continue;
+
+    resp_seq = (msg[30] << 8) | msg[31];
+    now = now_ns();
+    if (client->num_latency < RXW_MAX_SAMPLES / RXW_CLIENTS)
+      client->latency[client->num_latency++] = now - client->sent_ns[resp_seq];
+
+    client->sent_ns[seq] = now;
+    delay_req_send(client->fd, seq++);
+  }
+
+  return NULL;
+}
+
+static void
+rxw_run(int num_workers, int seconds)
+{
+  static struct rxw_client clients[RXW_CLIENTS];
+  struct airptp_handle *hdl;
+  pthread_t tids[RXW_CLIENTS];
+  uint64_t *all;
+  char addr[32];
+  int n;
+  int i;
+
+  hdl = daemon_start(AIRPTP_OPT_RX_WORKERS, num_workers);
+
+  all = calloc(RXW_MAX_SAMPLES, sizeof(uint64_t));
+
+  for (i = 0; i < RXW_CLIENTS; i++) {
+    snprintf(addr, sizeof(addr), "127.0.0.%d", 10 + i);
+    clients[i].fd = socket_make(addr, GENERAL_PORT);
+    clients[i].duration_ns = (uint64_t)seconds * 1000000000ULL;
+    clients[i].latency = all + i * (RXW_MAX_SAMPLES / RXW_CLIENTS);
+    clients[i].num_latency = 0;
+    pthread_create(&tids[i], NULL, rxw_client_run, &clients[i]);
+  }
+
+  for (i = 0, n = 0; i < RXW_CLIENTS; i++) {
+    pthread_join(tids[i], NULL);
+    close(clients[i].fd);
+    // Compact so all samples are in one sequence
+    memmove(all + n, clients[i].latency, clients[i].num_latency * sizeof(uint64_t));
+    n += clients[i].num_latency;
+  }
+
+  qsort(all, n, sizeof(uint64_t), cmp_u64);
+
+  printf("%7d %12.0f %9.1f %9.1f\n", num_workers, (double)n / seconds,
+    n ? all[n / 2] / 1000.0 : 0, n ? all[(uint64_t)n * 99 / 100] / 1000.0 : 0);
+
+  free(all);
+  airptp_end(hdl);
+}
+
+static void
+rxworkers(int seconds)
+{
+  int workers[] = { 0, 1, 2, 4, 8 };
+  int i;
+
+  printf("%d clients, window %d, %d s per run\n", RXW_CLIENTS, RXW_WINDOW, seconds);
+  printf("workers  Delay_Resp/s  p50 (us)  p99 (us)\n");
+
+  for (i = 0; i < sizeof(workers) / sizeof(workers[0]); i++)
+    rxw_run(workers[i], seconds);
+}
+
+
+/* -------------------------------- txthread -------------------------------- */
+
+// One client measures Delay_Req latency while the daemon does its periodic
+// sending to a number of peers, with and without the tx thread
+
+#define TXT_PEERS 16
+#define TXT_MAX_SAMPLES 1000000
+
+static void
+txt_run(bool tx_thread, int seconds)
+{
+  struct airptp_handle *hdl;
+  struct pollfd pfd;
+  uint64_t *latency;
+  uint64_t start;
+  uint64_t sent;
+  uint32_t peer_id;
+  uint8_t msg[128];
+  uint16_t seq;
+  char addr[32];
+  ssize_t len;
+  int n;
+  int i;
+
+  hdl = daemon_start(AIRPTP_OPT_TX_THREAD, tx_thread);
+
+  // The peers don't need to exist, we just want the daemon to send to them
+  for (i = 0; i < TXT_PEERS; i++) {
+    snprintf(addr, sizeof(addr), "127.0.1.%d", 1 + i);
+    airptp_peer_add(&peer_id, addr, hdl);
+  }
+
+  latency = calloc(TXT_MAX_SAMPLES, sizeof(uint64_t));
+  pfd.fd = socket_make("127.0.0.10", GENERAL_PORT);
+  pfd.events = POLLIN;
+
+  start = now_ns();
+  for (n = 0, seq = 0; n < TXT_MAX_SAMPLES && now_ns() - start < (uint64_t)seconds * 1000000000ULL; seq++) {
+    sent = now_ns();
+    delay_req_send(pfd.fd, seq);
+
+    while (poll(&pfd, 1, 50) > 0) {
+      len = recv(pfd.fd, msg, sizeof(msg), 0);
+      if (len >= 32 && (msg[0] & 0x0F) == 0x09 && ((msg[30] << 8) | msg[31]) == seq) {
+	latency[n++] = now_ns() - sent;
+	break;
+      }
+    }
+  }
+
+  qsort(latency, n, sizeof(uint64_t), cmp_u64);
+
+  printf("%-9s %10d %9.1f %9.1f %9.1f %9.1f\n", tx_thread ? "yes" : "no", n,
+    n ? latency[n / 2] / 1000.0 : 0, n ? latency[(uint64_t)n * 99 / 100] / 1000.0 : 0,
+    n ? latency[(uint64_t)n * 999 / 1000] / 1000.0 : 0, n ? latency[n - 1] / 1000.0 : 0);
+
+  close(pfd.fd);
+  free(latency);
+  airptp_end(hdl);
+}
+
+static void
+txthread(int seconds)
+{
+  printf("%d peers, %d s per run\n", TXT_PEERS, seconds);
+  printf("txthread  responses  p50 (us)  p99 (us) p999 (us)  max (us)\n");
+
+  txt_run(false, seconds);
+  txt_run(true, seconds);
+}
+
+
+/* --------------------------------- iouring -------------------------------- */
+
+// CPU used by the daemon per peer per second, with libevent and with io_uring.
+// Each peer sends Delay_Req at the Sync rate, and the first ones are also
+// registered so that the daemon has its periodic sending (the rest are like
+// receivers of other senders on the network). The daemon runs in a child
+// process, so its CPU time can be measured separately from the load generator.
+
+#define IOU_REQ_PER_PEER 8
+// The per-client quota
+#define IOU_REGISTERED 16
+
+// Sends from a peer address through a single socket, so we don't need a
+// socket per peer
+static void
+iou_delay_req_send(int fd, struct in_addr *src, uint16_t seq)
+{
+  struct sockaddr_in dst = { .sin_family = AF_INET, .sin_port = htons(EVENT_PORT) };
+  uint8_t msg[44] = { 0 };
+  char cbuf[CMSG_SPACE(sizeof(struct in_pktinfo))] = { 0 };
+  struct iovec iov = { msg, sizeof(msg) };
+  struct msghdr mh = { .msg_name = &dst, .msg_namelen = sizeof(dst), .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+  struct in_pktinfo *pi = (struct in_pktinfo *)CMSG_DATA(cmsg);
+
+  inet_pton(AF_INET, "127.0.0.1", &dst.sin_addr);
+
+  cmsg->cmsg_level = IPPROTO_IP;
+  cmsg->cmsg_type = IP_PKTINFO;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+  pi->ipi_spec_dst = *src;
+
+  msg[0] = 0x11;
+  msg[1] = 0x02;
+  msg[3] = sizeof(msg);
+  msg[30] = seq >> 8;
+  msg[31] = seq & 0xff;
+
+  sendmsg(fd, &mh, 0);
+}
+
+static void
+iou_peer_addr(struct in_addr *addr, int i)
+{
+  char str[32];
+
+  snprintf(str, sizeof(str), "127.1.%d.%d", i / 250, 1 + i % 250);
+  inet_pton(AF_INET, str, addr);
+}
+
+static uint64_t
+iou_cpu_us(void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void
+iou_daemon_run(bool io_uring, int num_peers, int ctrl_in, int ctrl_out)
+{
+  struct airptp_handle *hdl;
+  struct in_addr addr;
+  uint32_t peer_id;
+  uint64_t start;
+  uint64_t cpu;
+  char c;
+  int i;
+
+  hdl = daemon_start(AIRPTP_OPT_IO_URING, io_uring);
+
+  for (i = 0; i < num_peers && i < IOU_REGISTERED; i++) {
+    iou_peer_addr(&addr, i);
+    airptp_peer_add(&peer_id, inet_ntoa(addr), hdl);
+  }
+
+  // Ready, wait for go
+  if (write(ctrl_out, "r", 1) != 1 || read(ctrl_in, &c, 1) != 1)
+    _exit(EXIT_FAILURE);
+  start = iou_cpu_us();
+
+  // Wait for stop
+  if (read(ctrl_in, &c, 1) != 1)
+    _exit(EXIT_FAILURE);
+  cpu = iou_cpu_us() - start;
+
+  if (write(ctrl_out, &cpu, sizeof(cpu)) != sizeof(cpu))
+    _exit(EXIT_FAILURE);
+
+  airptp_end(hdl);
+  _exit(EXIT_SUCCESS);
+}
+
+static void
+iou_run(bool io_uring, int num_peers, int seconds)
+{
+  int to_child[2];
+  int from_child[2];
+  struct in_addr *addrs;
+  uint64_t rate = (uint64_t)num_peers * IOU_REQ_PER_PEER;
+  uint64_t start;
+  uint64_t now;
+  uint64_t cpu;
+  uint64_t n;
+  pid_t pid;
+  char c;
+  int fd;
+  int i;
+
+  if (pipe(to_child) < 0 || pipe(from_child) < 0) {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+
+  pid = fork();
+  if (pid == 0)
+    iou_daemon_run(io_uring, num_peers, to_child[0], from_child[1]);
+
+  if (read(from_child[0], &c, 1) != 1) {
+    printf("Daemon failed to start\n");
+    waitpid(pid, NULL, 0);
+    return;
+  }
+
+  addrs = calloc(num_peers, sizeof(struct in_addr));
+  for (i = 0; i < num_peers; i++)
+    iou_peer_addr(&addrs[i], i);
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  if (write(to_child[1], "g", 1) != 1)
+    exit(EXIT_FAILURE);
+
+  // Sending in small batches, so the daemon's receive buffer doesn't overflow
+  start = now_ns();
+  for (n = 0; (now = now_ns()) - start < (uint64_t)seconds * 1000000000ULL; ) {
+    for (; n < (now - start) * rate / 1000000000ULL; n++)
+      iou_delay_req_send(fd, &addrs[n % num_peers], n / num_peers);
+    usleep(500);
+  }
+
+  if (write(to_child[1], "s", 1) != 1 || read(from_child[0], &cpu, sizeof(cpu)) != sizeof(cpu))
+    exit(EXIT_FAILURE);
+
+  waitpid(pid, NULL, 0);
+
+  printf("%-9s %6d %12.1f %14.2f\n", io_uring ? "io_uring" : "libevent", num_peers,
+    cpu / 1000.0 / seconds, (double)cpu / seconds / num_peers);
+
+  close(fd);
+  free(addrs);
+  close(to_child[0]);
+  close(to_child[1]);
+  close(from_child[0]);
+  close(from_child[1]);
+}
+
+static void
+iouring(int seconds)
+{
+  int peers[] = { 64, 256, 1024 };
+  int i;
+
+  printf("%d Delay_Req/s per peer, %d peers registered, %d s per run\n", IOU_REQ_PER_PEER, IOU_REGISTERED, seconds);
+  printf("backend    peers  cpu (ms/s)  cpu/peer (us/s)\n");
+
+  for (i = 0; i < sizeof(peers) / sizeof(peers[0]); i++) {
+    iou_run(false, peers[i], seconds);
+    iou_run(true, peers[i], seconds);
+  }
+}
+
+
+/* ---------------------------------- xdp ----------------------------------- */
+
+// PTP offset jitter for a peer on the other end of a veth pair, with the event
+// port on UDP and on AF_XDP. The peer is in its own network namespace, so the
+// traffic really goes over the veth. Both ends use the same clock, so the true
+// offset is 0. Requires root.
+
+#define XDP_NETNS "airptp-xdp"
+#define XDP_IF_DAEMON "airptp-x0"
+#define XDP_IF_PEER "airptp-x1"
+#define XDP_ADDR_DAEMON "10.99.0.1"
+#define XDP_ADDR_PEER "10.99.0.2"
+#define XDP_MAX_SAMPLES 10000
+
+static int64_t
+xdp_ts_get(uint8_t *msg)
+{
+  uint64_t sec = 0;
+  uint32_t nsec = 0;
+  int i;
+
+  for (i = 0; i < 6; i++)
+    sec = (sec << 8) | msg[34 + i];
+  for (i = 0; i < 4; i++)
+    nsec = (nsec << 8) | msg[40 + i];
+
+  return sec * 1000000000LL + nsec;
+}
+
+static int
+xdp_setup(void)
+{
+  return system(
+    "ip netns add " XDP_NETNS " && "
+    "ip link add " XDP_IF_DAEMON " type veth peer name " XDP_IF_PEER " && "
+    "ip link set " XDP_IF_PEER " netns " XDP_NETNS " && "
+    "ip addr add " XDP_ADDR_DAEMON "/24 dev " XDP_IF_DAEMON " && "
+    "ip link set " XDP_IF_DAEMON " up && "
+    "ip -n " XDP_NETNS " addr add " XDP_ADDR_PEER "/24 dev " XDP_IF_PEER " && "
+    "ip -n " XDP_NETNS " link set " XDP_IF_PEER " up");
+}
+
+static void
+xdp_cleanup(void)
+{
+  if (system("ip link del " XDP_IF_DAEMON " 2>/dev/null; ip netns del " XDP_NETNS " 2>/dev/null") != 0)
+    printf("Cleanup of %s failed\n", XDP_NETNS);
+}
+
+// Acts as a PTP receiver: on each Sync/Follow_Up it sends a Delay_Req and
+// computes the offset when the Delay_Resp arrives
+static void
+xdp_peer_run(const char *name, int seconds)
+{
+  struct pollfd pfd[2];
+  struct sockaddr_in dst = { .sin_family = AF_INET, .sin_port = htons(EVENT_PORT) };
+  double *offsets = calloc(XDP_MAX_SAMPLES, sizeof(double));
+  double sum = 0;
+  double sum_sq = 0;
+  double sum_delay = 0;
+  double mean;
+  int64_t t1 = 0, t2 = 0, t3 = 0, t4;
+  uint16_t sync_seq = 0;
+  uint16_t req_seq = 0;
+  uint8_t msg[128] = { 0 };
+  uint64_t start;
+  ssize_t len;
+  int fd;
+  int n = 0;
+  int i;
+
+  fd = open("/run/netns/" XDP_NETNS, O_RDONLY);
+  if (fd < 0 || setns(fd, CLONE_NEWNET) < 0) {
+    perror("setns");
+    _exit(EXIT_FAILURE);
+  }
+  close(fd);
+
+  inet_pton(AF_INET, XDP_ADDR_DAEMON, &dst.sin_addr);
+  pfd[0].fd = socket_make(XDP_ADDR_PEER, EVENT_PORT);
+  pfd[1].fd = socket_make(XDP_ADDR_PEER, GENERAL_PORT);
+  pfd[0].events = pfd[1].events = POLLIN;
+
+  // Lets the daemon hear from us, with AF_XDP that is how it learns our MAC
+  msg[0] = 0x11;
+  msg[1] = 0x02;
+  msg[3] = 44;
+  sendto(pfd[0].fd, msg, 44, 0, (struct sockaddr *)&dst, sizeof(dst));
+
+  start = now_ns();
+  while (n < XDP_MAX_SAMPLES && now_ns() - start < (uint64_t)seconds * 1000000000ULL) {
+    if (poll(pfd, 2, 100) <= 0)
+      continue;
+
+    if (pfd[0].revents & POLLIN) {
+      len = recv(pfd[0].fd, msg, sizeof(msg), 0);
+      if (len >= 44 && (msg[0] & 0x0F) == 0x00) {
+	t2 = now_ns();
+	sync_seq = (msg[30] << 8) | msg[31];
+      }
+    }
+
+    if (!(pfd[1].revents & POLLIN))
+      continue;
+
+    len = recv(pfd[1].fd, msg, sizeof(msg), 0);
+    if (len >= 44 && (msg[0] & 0x0F) == 0x08 && ((msg[30] << 8) | msg[31]) == sync_seq && t2) {
+      t1 = xdp_ts_get(msg);
+
+      req_seq++;
+      memset(msg, 0, 44);
+      msg[0] = 0x11;
+      msg[1] = 0x02;
+      msg[3] = 44;
+      msg[30] = req_seq >> 8;
+      msg[31] = req_seq & 0xff;
+      t3 = now_ns();
+      sendto(pfd[0].fd, msg, 44, 0, (struct sockaddr *)&dst, sizeof(dst));
+    }
+    else if (len >= 44 && (msg[0] & 0x0F) == 0x09 && ((msg[30] << 8) | msg[31]) == req_seq && t1) {
+      t4 = xdp_ts_get(msg);
+
+      offsets[n++] = ((t2 - t1) - (t4 - t3)) / 2.0;
+      sum_delay += ((t2 - t1) + (t4 - t3)) / 2.0;
+      t1 = t2 = 0;
+    }
+  }
+
+  for (i = 0; i < n; i++)
+    sum += offsets[i];
+  mean = n ? sum / n : 0;
+  for (i = 0; i < n; i++)
+    sum_sq += (offsets[i] - mean) * (offsets[i] - mean);
+
+  printf("%-9s %8d %11.2f %11.2f %11.2f\n", name, n, mean / 1000.0,
+    n ? sqrt(sum_sq / n) / 1000.0 : 0, n ? sum_delay / n / 1000.0 : 0);
+
+  free(offsets);
+  fflush(stdout);
+  _exit(EXIT_SUCCESS);
+}
+
+enum xdp_mode
+{
+  XDP_MODE_OFF,
+  XDP_MODE_NATIVE,
+  XDP_MODE_GENERIC,
+};
+
+static void
+xdp_run(enum xdp_mode mode, int seconds)
+{
+  struct airptp_handle *hdl;
+  uint32_t peer_id;
+  pid_t pid;
+
+  airptp_ports_override(EVENT_PORT, GENERAL_PORT);
+
+  // Not binding to a specific address, since the daemon is controlled via
+  // localhost
+  hdl = airptp_daemon_bind(NULL);
+  if (!hdl ||
+      airptp_daemon_option_set(hdl, AIRPTP_OPT_XDP_IFINDEX, (mode != XDP_MODE_OFF) ? if_nametoindex(XDP_IF_DAEMON) : 0) < 0 ||
+      airptp_daemon_option_set(hdl, AIRPTP_OPT_XDP_GENERIC, mode == XDP_MODE_GENERIC) < 0 ||
+      airptp_daemon_start(hdl, 1, false) < 0 ||
+      airptp_peer_add(&peer_id, XDP_ADDR_PEER, hdl) < 0) {
+    printf("bench.c error: %s\n", airptp_errmsg_get());
+    if (hdl)
+      airptp_end(hdl);
+    return;
+  }
+
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0)
+    xdp_peer_run((mode == XDP_MODE_OFF) ? "udp" : (mode == XDP_MODE_NATIVE) ? "xdp drv" : "xdp skb", seconds);
+
+  waitpid(pid, NULL, 0);
+  airptp_end(hdl);
+}
+
+static void
+xdp(int seconds)
+{
+  if (xdp_setup() != 0) {
+    printf("Could not create veth pair in namespace %s, are you root?\n", XDP_NETNS);
+    xdp_cleanup();
+    return;
+  }
+
+  printf("Peer on a veth pair, one Delay_Req per Sync, %d s per run\n", seconds);
+  printf("transport  samples offset (us) jitter (us)  delay (us)\n");
+
+  xdp_run(XDP_MODE_OFF, seconds);
+  xdp_run(XDP_MODE_NATIVE, seconds);
+  xdp_run(XDP_MODE_GENERIC, seconds);
+
+  xdp_cleanup();
+}
+
+
+/* --------------------------------- txtime --------------------------------- */
+
+// Sync departure jitter for a peer on the other end of the veth pair from the
+// xdp benchmark, with Syncs sent the normal way and scheduled with SO_TXTIME.
+// The peer takes kernel rx timestamps and reports the jitter of the intervals
+// between Syncs, and the mean and jitter of the arrival time minus the time in
+// the Follow_Up. If the kernel has the etf qdisc it is set up for the event
+// port on the daemon's end, otherwise the txtime run shows the fallback.
+// Requires root.
+
+#define TXTIME_LEAD_US 2000
+
+static int
+txtime_etf_setup(void)
+{
+  char cmd[512];
+
+  snprintf(cmd, sizeof(cmd),
+    "tc qdisc add dev " XDP_IF_DAEMON " root handle 1: prio 2>/dev/null && "
+    "tc qdisc add dev " XDP_IF_DAEMON " parent 1:1 etf clockid CLOCK_TAI delta 200000 2>/dev/null && "
+    "tc filter add dev " XDP_IF_DAEMON " parent 1: protocol ip u32 match ip sport %d 0xffff flowid 1:1 2>/dev/null",
+    EVENT_PORT);
+
+  return system(cmd);
+}
+
+static int64_t
+txtime_rx_ts(int fd, uint8_t *msg, size_t msg_size, ssize_t *len, int64_t realtime_offset)
+{
+  uint8_t control[256];
+  struct iovec iov = { .iov_base = msg, .iov_len = msg_size };
+  struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+  struct cmsghdr *cmsg;
+  struct timespec ts;
+
+  *len = recvmsg(fd, &mh, 0);
+
+  for (cmsg = CMSG_FIRSTHDR(&mh); *len > 0 && cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec - realtime_offset;
+    }
+  }
+
+  return now_ns();
+}
+
+static void
+txtime_stats(double *v, int n, double *mean, double *sd)
+{
+  double sum = 0;
+  double sum_sq = 0;
+  int i;
+
+  for (i = 0; i < n; i++)
+    sum += v[i];
+  *mean = n ? sum / n : 0;
+  for (i = 0; i < n; i++)
+    sum_sq += (v[i] - *mean) * (v[i] - *mean);
+  *sd = n ? sqrt(sum_sq / n) : 0;
+}
+
+static void
+txtime_peer_run(const char *name, int seconds)
+{
+  struct pollfd pfd[2];
+  struct sockaddr_in dst = { .sin_family = AF_INET, .sin_port = htons(EVENT_PORT) };
+  struct timespec rt;
+  double *intervals = calloc(XDP_MAX_SAMPLES, sizeof(double));
+  double *transits = calloc(XDP_MAX_SAMPLES, sizeof(double));
+  double interval_mean, interval_sd, transit_mean, transit_sd;
+  int64_t realtime_offset;
+  int64_t arrival = 0;
+  int64_t last_arrival = 0;
+  uint16_t sync_seq = 0;
+  uint8_t msg[128] = { 0 };
+  uint64_t start;
+  ssize_t len;
+  int on = 1;
+  int n_intervals = 0;
+  int n_transits = 0;
+  int fd;
+
+  fd = open("/run/netns/" XDP_NETNS, O_RDONLY);
+  if (fd < 0 || setns(fd, CLONE_NEWNET) < 0) {
+    perror("setns");
+    _exit(EXIT_FAILURE);
+  }
+  close(fd);
+
+  inet_pton(AF_INET, XDP_ADDR_DAEMON, &dst.sin_addr);
+  pfd[0].fd = socket_make(XDP_ADDR_PEER, EVENT_PORT);
+  pfd[1].fd = socket_make(XDP_ADDR_PEER, GENERAL_PORT);
+  pfd[0].events = pfd[1].events = POLLIN;
+  setsockopt(pfd[0].fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+
+  clock_gettime(CLOCK_REALTIME, &rt);
+  realtime_offset = (int64_t)rt.tv_sec * 1000000000LL + rt.tv_nsec - (int64_t)now_ns();
+
+  msg[0] = 0x11;
+  msg[1] = 0x02;
+  msg[3] = 44;
+  sendto(pfd[0].fd, msg, 44, 0, (struct sockaddr *)&dst, sizeof(dst));
+
+  start = now_ns();
+  while (n_transits < XDP_MAX_SAMPLES && now_ns() - start < (uint64_t)seconds * 1000000000ULL) {
+    if (poll(pfd, 2, 100) <= 0)
+      continue;
+
+    if (pfd[0].revents & POLLIN) {
+      arrival = txtime_rx_ts(pfd[0].fd, msg, sizeof(msg), &len, realtime_offset);
+      if (len >= 44 && (msg[0] & 0x0F) == 0x00) {
+	sync_seq = (msg[30] << 8) | msg[31];
+	if (last_arrival && n_intervals < XDP_MAX_SAMPLES)
+	  intervals[n_intervals++] = arrival - last_arrival;
+	last_arrival = arrival;
+      }
+    }
+
+    if (!(pfd[1].revents & POLLIN))
+      continue;
+
+    len = recv(pfd[1].fd, msg, sizeof(msg), 0);
+    if (len >= 44 && (msg[0] & 0x0F) == 0x08 && ((msg[30] << 8) | msg[31]) == sync_seq && last_arrival)
+      transits[n_transits++] = last_arrival - xdp_ts_get(msg);
+  }
+
+  txtime_stats(intervals, n_intervals, &interval_mean, &interval_sd);
+  txtime_stats(transits, n_transits, &transit_mean, &transit_sd);
+
+  printf("%-7s %8d %21.2f %13.2f %20.2f\n", name, n_transits, interval_sd / 1000.0, transit_mean / 1000.0, transit_sd / 1000.0);
+
+  free(intervals);
+  free(transits);
+  fflush(stdout);
+  _exit(EXIT_SUCCESS);
+}
+
+static void
+txtime_run(int lead_us, int seconds)
+{
+  struct airptp_handle *hdl;
+  struct airptp_stats stats;
+  uint32_t peer_id;
+  pid_t pid;
+
+  airptp_ports_override(EVENT_PORT, GENERAL_PORT);
+
+  hdl = airptp_daemon_bind(NULL);
+  if (!hdl ||
+      airptp_daemon_option_set(hdl, AIRPTP_OPT_TXTIME, lead_us) < 0 ||
+      airptp_daemon_start(hdl, 1, false) < 0 ||
+      airptp_peer_add(&peer_id, XDP_ADDR_PEER, hdl) < 0) {
+    printf("bench.c error: %s\n", airptp_errmsg_get());
+    if (hdl)
+      airptp_end(hdl);
+    return;
+  }
+
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0)
+    txtime_peer_run(lead_us ? "txtime" : "normal", seconds);
+
+  waitpid(pid, NULL, 0);
+
+  if (lead_us && airptp_stats_get(&stats, hdl) == 0)
+    printf("        scheduled %" PRIu64 ", missed %" PRIu64 "\n", stats.tx_sync_scheduled, stats.tx_sync_missed);
+
+  airptp_end(hdl);
+}
+
+static void
+txtime(int seconds)
+{
+  if (xdp_setup() != 0) {
+    printf("Could not create veth pair in namespace %s, are you root?\n", XDP_NETNS);
+    xdp_cleanup();
+    return;
+  }
+
+  if (txtime_etf_setup() != 0)
+    printf("No etf qdisc, scheduled Syncs should fall back to normal sending\n");
+
+  printf("Peer on a veth pair, %d s per run\n", seconds);
+  printf("mode     samples  interval jitter (us)  transit (us)  transit jitter (us)\n");
+
+  txtime_run(0, seconds);
+  txtime_run(TXTIME_LEAD_US, seconds);
+
+  xdp_cleanup();
+}
+
+
+/* -------------------------------- connected ------------------------------- */
+
+// Cost of sending to many peers from one unconnected socket, like the daemon
+// does by default, versus from a connected socket per peer, like with
+// AIRPTP_OPT_CONNECTED_PEERS. This measures just the sending, since the daemon
+// itself is limited to a few peers. The peers are loopback addresses, and a
+// single socket receives for all of them without reading, so the kernel just
+// drops the packets.
+
+#define CON_PORT 30400
+
+static void
+con_peer_addr(struct sockaddr_in *sin, int i)
+{
+  char addr[32];
+
+  snprintf(addr, sizeof(addr), "127.2.%d.%d", i / 250, 1 + i % 250);
+  sin->sin_family = AF_INET;
+  sin->sin_port = htons(CON_PORT);
+  inet_pton(AF_INET, addr, &sin->sin_addr);
+}
+
+static double
+con_run(bool connected, int num_peers, int seconds)
+{
+  struct sockaddr_in *addrs;
+  uint8_t msg[44] = { 0x10, 0x02, 0, 44 };
+  uint64_t start;
+  uint64_t elapsed;
+  uint64_t n;
+  int *fds;
+  int fd;
+  int i;
+
+  addrs = calloc(num_peers, sizeof(struct sockaddr_in));
+  fds = calloc(num_peers, sizeof(int));
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  for (i = 0; i < num_peers; i++) {
+    con_peer_addr(&addrs[i], i);
+    if (!connected)
+      continue;
+
+    fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fds[i] < 0 || connect(fds[i], (struct sockaddr *)&addrs[i], sizeof(addrs[i])) < 0) {
+      perror("socket/connect");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  start = now_ns();
+  for (n = 0; (elapsed = now_ns() - start) < (uint64_t)seconds * 1000000000ULL; ) {
+    // Like a Sync round, to all peers
+    for (i = 0; i < num_peers; i++, n++) {
+      if (connected)
+	send(fds[i], msg, sizeof(msg), 0);
+      else
+	sendto(fd, msg, sizeof(msg), 0, (struct sockaddr *)&addrs[i], sizeof(addrs[i]));
+    }
+  }
+
+  for (i = 0; connected && i < num_peers; i++)
+    close(fds[i]);
+  close(fd);
+  free(fds);
+  free(addrs);
+
+  return (double)elapsed / n;
+}
+
+static void
+connected(int seconds)
+{
+  int peers[] = { 16, 64, 256, 1024, 4096 };
+  struct rlimit rl;
+  double unconnected_ns;
+  double connected_ns;
+  int sink;
+  int i;
+
+  // Enough fds for a socket per peer
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+
+  sink = socket_make("0.0.0.0", CON_PORT);
+
+  printf("%d s per run\n", seconds);
+  printf("peers  unconnected (ns/send)  connected (ns/send)\n");
+
+  for (i = 0; i < sizeof(peers) / sizeof(peers[0]); i++) {
+    if (peers[i] + 16 > rl.rlim_cur)
+      break;
+
+    unconnected_ns = con_run(false, peers[i], seconds);
+    connected_ns = con_run(true, peers[i], seconds);
+    printf("%5d %22.0f %20.0f\n", peers[i], unconnected_ns, connected_ns);
+  }
+
+  close(sink);
+}
+
+/* ------------------------------- timesource ------------------------------- */
+
+// Cost of reading a timestamp with clock_gettime() and with the TSC, and how
+// far the TSC timestamps are from CLOCK_MONOTONIC while being calibrated once
+// per second like the daemon does. The error includes the cost of the
+// clock_gettime() it is compared with, so about half of that is noise.
+
+#define TS_READS 2000000
+#define TS_ERR_INTERVAL_US 1000
+
+static double
+ts_read_cost(bool use_tsc)
+{
+  struct timespec ts;
+  uint64_t start;
+  int i;
+
+  start = now_ns();
+  for (i = 0; i < TS_READS; i++) {
+    if (use_tsc)
+      timesource_get(&ts);
+    else
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+  }
+
+  return (double)(now_ns() - start) / TS_READS;
+}
+
+static void
+timesource(int seconds)
+{
+  struct timespec ts;
+  uint64_t *errs;
+  uint64_t before;
+  uint64_t after;
+  uint64_t tsc_ns;
+  uint64_t mid;
+  uint64_t next_calibrate;
+  double sum = 0;
+  int n;
+  int max_n;
+
+  printf("clock_gettime: %.1f ns/read\n", ts_read_cost(false));
+
+  timesource_start(AIRPTP_TIMEBASE_MONOTONIC, true);
+  if (!timesource_tsc_is_used()) {
+    printf("TSC not usable here\n");
+    timesource_stop();
+    return;
+  }
+
+  printf("tsc:           %.1f ns/read\n", ts_read_cost(true));
+
+  max_n = seconds * (1000000 / TS_ERR_INTERVAL_US);
+  errs = calloc(max_n, sizeof(uint64_t));
+  next_calibrate = now_ns() + 1000000000ULL;
+
+  for (n = 0; n < max_n; n++) {
+    if (now_ns() > next_calibrate) {
+      timesource_calibrate();
+      next_calibrate += 1000000000ULL;
+    }
+
+    before = now_ns();
+    timesource_get(&ts);
+    after = now_ns();
+
+    tsc_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    mid = before + (after - before) / 2;
+    errs[n] = (tsc_ns > mid) ? tsc_ns - mid : mid - tsc_ns;
+    sum += errs[n];
+
+    usleep(TS_ERR_INTERVAL_US);
+  }
+
+  timesource_stop();
+
+  qsort(errs, n, sizeof(uint64_t), cmp_u64);
+  printf("error vs CLOCK_MONOTONIC over %d s: mean %.0f ns, p50 %" PRIu64 " ns, p99 %" PRIu64 " ns, max %" PRIu64 " ns\n",
+    seconds, sum / n, errs[n / 2], errs[n * 99 / 100], errs[n - 1]);
+
+  free(errs);
+}
+
+#define DECODE_ROUNDS 2000000
+
+static volatile uint64_t decode_sink;
+
+// Packets as they come in: Delay_Req from the peers and now and then something
+// else, plus some garbage
+static int
+decode_packets_make(uint8_t packets[][128], size_t *lens, bool with_invalid)
+{
+  uint8_t types[] = { PTP_MSGTYPE_DELAY_REQ, PTP_MSGTYPE_DELAY_REQ, PTP_MSGTYPE_DELAY_REQ, PTP_MSGTYPE_SYNC,
+                      PTP_MSGTYPE_FOLLOW_UP, PTP_MSGTYPE_DELAY_REQ, PTP_MSGTYPE_ANNOUNCE, PTP_MSGTYPE_SIGNALING };
+  int n = ARRAY_SIZE(types);
+  uint16_t len;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    len = ptp_decode_min_len(types[i]);
+    memset(packets[i], 0, 128);
+    packets[i][0] = types[i];
+    packets[i][1] = 0x02;
+    packets[i][2] = len >> 8;
+    packets[i][3] = len & 0xff;
+    packets[i][31] = i;
+    lens[i] = len;
+  }
+
+  if (with_invalid) {
+    packets[1][1] = 0x01; // PTPv1
+    packets[5][4] = 0x2a; // Other domain
+    lens[3] = 20; // Short
+  }
+
+  return n;
+}
+
+// The fields the Delay_Req handler uses, read like the handlers did before:
+// the header copied to a struct and byte swapped
+static uint64_t
+decode_copy(uint8_t *msg, size_t len)
+{
+  struct ptp_header hdr;
+  struct ptp_timestamp ts;
+  uint64_t sec;
+
+  if (len < sizeof(struct ptp_header))
+    return 0;
+
+  memcpy(&hdr, msg, sizeof(hdr));
+  hdr.messageLength = be16toh(hdr.messageLength);
+  hdr.flags = be16toh(hdr.flags);
+  hdr.correctionField = be64toh(hdr.correctionField);
+  hdr.sequenceId = be16toh(hdr.sequenceId);
+
+  if ((msg[0] & 0x0F) != PTP_MSGTYPE_DELAY_REQ)
+    return hdr.sequenceId;
+  if (len < sizeof(struct ptp_delay_req_message))
+    return 0;
+
+  memcpy(&ts, msg + sizeof(struct ptp_header), sizeof(ts));
+  sec = ((uint64_t)be16toh(ts.seconds_hi) << 32) | be32toh(ts.seconds_low);
+  return hdr.sequenceId + sec * 1000000000ULL + be32toh(ts.nanoseconds);
+}
+
+static uint64_t
+decode_view(uint8_t *msg, size_t len)
+{
+  struct ptp_msg_view view;
+
+  if (ptp_decode(&view, msg, len) < 0)
+    return 0;
+
+  if (view.type != PTP_MSGTYPE_DELAY_REQ)
+    return ptp_view_sequence_id(&view);
+
+  return ptp_view_sequence_id(&view) + ptp_view_timestamp_ns(&view, offsetof(struct ptp_delay_req_message, originTimestamp));
+}
+
+static double
+decode_rate(uint64_t (*fn)(uint8_t *, size_t), bool with_invalid)
+{
+  uint8_t packets[8][128];
+  size_t lens[8];
+  uint64_t sum = 0;
+  uint64_t start;
+  int n;
+  int i;
+
+  n = decode_packets_make(packets, lens, with_invalid);
+
+  start = now_ns();
+  for (i = 0; i < DECODE_ROUNDS; i++)
+    sum += fn(packets[i % n], lens[i % n]);
+  decode_sink = sum;
+
+  return DECODE_ROUNDS / ((now_ns() - start) / 1e9);
+}
+
+static void
+decode(int seconds)
+{
+  struct ptp_msg_view view;
+  uint8_t packets[8][128];
+  size_t lens[8];
+  int rejected = 0;
+  int n;
+  int i;
+
+  n = decode_packets_make(packets, lens, true);
+  for (i = 0; i < n; i++)
+    rejected += (ptp_decode(&view, packets[i], lens[i]) < 0);
+
+  printf("header copy:       %6.1f Mpackets/s per core\n", decode_rate(decode_copy, false) / 1e6);
+  printf("view:              %6.1f Mpackets/s per core\n", decode_rate(decode_view, false) / 1e6);
+  printf("view, %d/%d invalid: %6.1f Mpackets/s per core\n", rejected, n, decode_rate(decode_view, true) / 1e6);
+}
+
+
+int
+main(int argc, char * argv[])
+{
+  int seconds = (argc > 2) ? atoi(argv[2]) : 2;
+
+  if (argc > 1 && strcmp(argv[1], "rxworkers") == 0)
+    rxworkers(seconds);
+  else if (argc > 1 && strcmp(argv[1], "txthread") == 0)
+    txthread(seconds);
+  else if (argc > 1 && strcmp(argv[1], "iouring") == 0)
+    iouring(seconds);
+  else if (argc > 1 && strcmp(argv[1], "xdp") == 0)
+    xdp(seconds);
+  else if (argc > 1 && strcmp(argv[1], "connected") == 0)
+    connected(seconds);
+  else if (argc > 1 && strcmp(argv[1], "txtime") == 0)
+    txtime(seconds);
+  else if (argc > 1 && strcmp(argv[1], "timesource") == 0)
+    timesource(seconds);
+  else if (argc > 1 && strcmp(argv[1], "decode") == 0)
+    decode(seconds);
+  else {
+    printf("Usage: %s <benchmark> [seconds]\n\n", argv[0]);
+    printf("Benchmarks:\n");
+    printf("  rxworkers       Delay_Resp throughput and latency against number of rx workers\n");
+    printf("  txthread        Delay_Resp latency during periodic sending, with and without tx thread\n");
+    printf("  iouring         Daemon CPU per peer with libevent and with io_uring\n");
+    printf("  xdp             Offset jitter over a veth pair with UDP and with AF_XDP (root)\n");
+    printf("  connected       Send cost to many peers, unconnected socket vs connected per peer\n");
+    printf("  txtime          Sync departure jitter over a veth pair, normal and with SO_TXTIME (root)\n");
+    printf("  timesource      Timestamp read cost and TSC error against CLOCK_MONOTONIC\n");
+    printf("  decode          Message decoding rate, header copy vs the validating decoder\n");
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
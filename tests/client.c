@@ -77,6 +77,36 @@ main(int argc, char * argv[])
 
   printf("client.c found clock_id=%" PRIx64 "\n", clock_id);
 
+  struct airptp_timebase_info tbinfo;
+  ret = airptp_timebase_get(&tbinfo, hdl);
+  if (ret < 0)
+    goto error;
+
+  printf("client.c daemon timebase=%d, offsets to monotonic=%" PRIi64 " raw=%" PRIi64 " tai=%" PRIi64 " realtime=%" PRIi64 "\n",
+    tbinfo.timebase, tbinfo.offset_ns[AIRPTP_TIMEBASE_MONOTONIC], tbinfo.offset_ns[AIRPTP_TIMEBASE_MONOTONIC_RAW],
+    tbinfo.offset_ns[AIRPTP_TIMEBASE_TAI], tbinfo.offset_ns[AIRPTP_TIMEBASE_REALTIME]);
+
+  struct airptp_port_info pinfo;
+  ret = airptp_port_info_get(&pinfo, hdl);
+  if (ret < 0)
+    goto error;
+
+  printf("client.c daemon is %s, %d foreign masters\n",
+    (pinfo.state == AIRPTP_PORT_MASTER) ? "master" : (pinfo.state == AIRPTP_PORT_SLAVE) ? "slave" : "passive", pinfo.num_foreign_masters);
+
+  struct airptp_slave_info sinfo;
+  uint64_t ptp_ns;
+  if (pinfo.state == AIRPTP_PORT_SLAVE && airptp_slave_info_get(&sinfo, hdl) == 0)
+    printf("client.c following master %" PRIx64 ", servo state=%d, offset=%" PRIi64 " ns, path delay=%" PRIi64 " ns, freq=%.1f ppb, steps=%" PRIu32 "\n",
+      sinfo.master_clock_id, sinfo.state, sinfo.offset_ns, sinfo.path_delay_ns, sinfo.freq_ppb, sinfo.steps);
+  if (airptp_ptp_time_get(&ptp_ns, hdl) == 0)
+    printf("client.c PTP time is %" PRIu64 " ns\n", ptp_ns);
+
+  uint64_t event_pos;
+  ret = airptp_event_position_get(&event_pos, hdl);
+  if (ret < 0)
+    goto error;
+
   ret = airptp_peer_add(&peer_id, "192.168.1.10", hdl);
   if (ret < 0)
     goto error;
@@ -95,6 +125,37 @@ main(int argc, char * argv[])
 
   printf("client.c added peer_id=%" PRIu32 "\n", peer_id);
 
+  uint32_t group_id;
+  ret = airptp_group_add(&group_id, "livingroom", hdl);
+  if (ret < 0)
+    goto error;
+
+  printf("client.c added group_id=%" PRIu32 "\n", group_id);
+
+  ret = airptp_group_peer_add(&peer_id, "192.168.1.11", group_id, hdl);
+  if (ret < 0)
+    goto error;
+
+  printf("client.c added peer_id=%" PRIu32 " to group\n", peer_id);
+
+  ret = airptp_group_start(group_id, 10, hdl);
+  if (ret < 0)
+    goto error;
+
+  printf("client.c started group_id=%" PRIu32 "\n", group_id);
+
+  // Whatever the daemon saw while we were adding, e.g. send errors, and then
+  // until it has been quiet for 2 seconds
+  struct airptp_event event;
+  uint64_t expected = event_pos;
+  while (airptp_event_read(&event, &event_pos, 2000, hdl) == 1) {
+    if (event.seq != expected)
+      printf("client.c fell behind, lost %" PRIu64 " events\n", event.seq - expected);
+    expected = event_pos;
+    printf("client.c event seq=%" PRIu64 " type=%" PRIu16 " peer_id=%" PRIu32 " clock_id=%" PRIx64 " value=%" PRIi32 "\n",
+      event.seq, event.type, event.peer_id, event.clock_id, event.value);
+  }
+
   airptp_end(hdl);
 
   return 0;
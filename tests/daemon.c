@@ -55,12 +55,22 @@ logmsg(const char *fmt, ...) {
   printf("\n");
 }
 
+// Must not block, since it runs on the daemon thread
+static void
+apple_clock_id_tlv(uint32_t org, uint32_t subtype, uint64_t clock_id, const uint8_t *data, size_t data_len, void *arg)
+{
+  int *count = arg;
+
+  if ((*count)++ == 0)
+    printf("daemon.c got Apple clock ID TLV from %" PRIx64 ", length %zu\n", clock_id, data_len);
+}
 
 int
 main(int argc, char * argv[])
 {
   struct airptp_handle *hdl;
   struct airptp_callbacks cb = { .hexdump = hexdump, .logmsg = logmsg, };
+  int apple_tlvs = 0;
   int ret;
 
   airptp_callbacks_register(&cb);
@@ -70,6 +80,10 @@ main(int argc, char * argv[])
   if (!hdl)
     goto error;
 
+  ret = airptp_tlv_handler_register(0x000D93, 0x000004, apple_clock_id_tlv, &apple_tlvs, hdl);
+  if (ret < 0)
+    goto error;
+
   ret = airptp_daemon_start(hdl, 1, true);
   if (ret < 0)
     goto error;
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "src/ptp_decode.h"
+
+// Fuzz target for the message decoder. Built as a normal program it replays
+// the files or directories given as arguments, e.g. tests/corpus/decode. With
+// libFuzzer, after configure:
+//
+//   clang -g -fsanitize=fuzzer,address -DAIRPTP_LIBFUZZER -DHAVE_CONFIG_H -I. -Isrc
+//     tests/fuzz_decode.c src/ptp_decode.c -o fuzz_decode
+//   ./fuzz_decode tests/corpus/decode
+
+static volatile uint64_t sink;
+
+// Reads what the handlers may read without further checks, i.e. everything up
+// to the minimum size of the type, and walks the TLVs after it
+static void
+view_read(struct ptp_msg_view *view)
+{
+  struct ptp_tlv_view tlv;
+  uint16_t min_len = ptp_decode_min_len(view->type);
+  size_t offset;
+  uint64_t sum = 0;
+
+  assert(min_len >= sizeof(struct ptp_header));
+  assert(view->len >= min_len);
+
+  sum += ptp_view_flags(view) + ptp_view_correction_ns(view) + ptp_view_clock_id(view);
+  sum += ptp_view_sequence_id(view) + ptp_view_log_interval(view);
+  if (min_len >= sizeof(struct ptp_header) + sizeof(struct ptp_timestamp))
+    sum += ptp_view_timestamp_ns(view, sizeof(struct ptp_header));
+  for (offset = 0; offset < min_len; offset++)
+    sum += ptp_view_u8(view, offset);
+
+  // Only signaling and management have TLVs that we parse
+  offset = (view->type == PTP_MSGTYPE_MANAGEMENT) ? sizeof(struct ptp_management_message) : min_len;
+  while (ptp_view_tlv_next(&tlv, view, &offset) > 0)
+    {
+      assert(tlv.data + tlv.len <= view->msg + view->len);
+      assert(offset <= view->len);
+      sum += tlv.type;
+      if (tlv.len > 0)
+	sum += tlv.data[tlv.len - 1];
+    }
+
+  sink = sum;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  struct ptp_msg_view view;
+  uint8_t *msg;
+
+  // A copy of exactly the input size, so that reads past it are caught
+  msg = malloc(size ? size : 1);
+  memcpy(msg, data, size);
+
+  if (ptp_decode(&view, msg, size) == 0)
+    {
+      assert(view.msg == msg && view.len <= size);
+      view_read(&view);
+    }
+
+  free(msg);
+  return 0;
+}
+
+#ifndef AIRPTP_LIBFUZZER
+static int
+file_run(const char *path)
+{
+  struct ptp_msg_view view;
+  uint8_t buf[2048];
+  size_t len;
+  FILE *f;
+  int ret;
+
+  f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+
+  len = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+
+  LLVMFuzzerTestOneInput(buf, len);
+
+  ret = ptp_decode(&view, buf, len);
+  printf("%-40s %4zu bytes  %-22s %s\n", path, len, (ret == 0) ? ptp_decode_type_name(view.type) : "-", ptp_decode_error_str(ret));
+  return 0;
+}
+
+static int
+path_run(const char *path)
+{
+  struct dirent *de;
+  struct stat sb;
+  char file[1024];
+  DIR *dir;
+  int ret = 0;
+
+  if (stat(path, &sb) < 0) {
+    perror(path);
+    return -1;
+  }
+
+  if (!S_ISDIR(sb.st_mode))
+    return file_run(path);
+
+  dir = opendir(path);
+  if (!dir) {
+    perror(path);
+    return -1;
+  }
+
+  while ((de = readdir(dir)))
+    {
+      if (de->d_name[0] == '.')
+	continue;
+
+      snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+      if (file_run(file) < 0)
+	ret = -1;
+    }
+
+  closedir(dir);
+  return ret;
+}
+
+int
+main(int argc, char * argv[])
+{
+  int ret = 0;
+  int i;
+
+  if (argc < 2) {
+    printf("Usage: %s <corpus file or dir>...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  for (i = 1; i < argc; i++)
+    {
+      if (path_run(argv[i]) < 0)
+	ret = -1;
+    }
+
+  return (ret < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "airptp.h"
+
+// Hands a running shared daemon over to a new one while a receiver watches
+// the Syncs, which should go on without a gap in sequenceId or timing. Runs on
+// the loopback with unprivileged ports:
+//
+//   old daemon (child)  ->  new daemon (child), taking over after 1 s
+//   client (us)         adds the receiver as peer and counts its Syncs
+
+#define EVENT_PORT 30319
+#define GENERAL_PORT 30320
+#define PEER_PORT 30419
+
+#define SYNC_INTERVAL_MS 125
+#define MAX_SYNCS 256
+
+struct sync_rx
+{
+  uint16_t seq;
+  uint64_t clock_id;
+  uint64_t ts_ns;
+};
+
+static int handed_over_pipe[2];
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+handed_over(void)
+{
+  if (write(handed_over_pipe[1], "h", 1) != 1)
+    exit(EXIT_FAILURE);
+}
+
+// Old daemon, runs until the new one has taken over
+static void
+old_daemon_run(int ready_fd)
+{
+  struct airptp_callbacks cb = { .handed_over = handed_over };
+  struct airptp_handle *hdl;
+  char c;
+
+  airptp_callbacks_register(&cb);
+
+  hdl = airptp_daemon_bind(NULL);
+  if (!hdl || airptp_daemon_start(hdl, 0x1234, true) < 0) {
+    printf("Old daemon failed: %s\n", airptp_errmsg_get());
+    exit(EXIT_FAILURE);
+  }
+
+  if (write(ready_fd, "r", 1) != 1 || read(handed_over_pipe[0], &c, 1) != 1)
+    exit(EXIT_FAILURE);
+
+  airptp_end(hdl);
+  exit(EXIT_SUCCESS);
+}
+
+// New daemon, runs for seconds after taking over
+static void
+new_daemon_run(int seconds)
+{
+  struct airptp_handle *hdl;
+
+  hdl = airptp_daemon_takeover();
+  if (!hdl || airptp_daemon_start(hdl, 0x5678, true) < 0) {
+    printf("Takeover failed: %s\n", airptp_errmsg_get());
+    exit(EXIT_FAILURE);
+  }
+
+  sleep(seconds);
+
+  airptp_end(hdl);
+  exit(EXIT_SUCCESS);
+}
+
+static int
+syncs_receive(struct sync_rx *syncs, int num, int fd, uint64_t until_ns)
+{
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  uint8_t msg[128];
+  ssize_t len;
+
+  while (num < MAX_SYNCS && now_ns() < until_ns)
+    {
+      if (poll(&pfd, 1, 10) <= 0)
+	continue;
+
+      len = recv(fd, msg, sizeof(msg), 0);
+      if (len < 44 || (msg[0] & 0x0F) != 0) // Only Sync
+	continue;
+
+      syncs[num].seq = (msg[30] << 8) | msg[31];
+      memcpy(&syncs[num].clock_id, msg + 20, sizeof(uint64_t));
+      syncs[num].ts_ns = now_ns();
+      num++;
+    }
+
+  return num;
+}
+
+int
+main(int argc, char * argv[])
+{
+  struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons(PEER_PORT) };
+  struct sync_rx syncs[MAX_SYNCS];
+  struct airptp_handle *client;
+  uint32_t peer_id;
+  uint64_t interval_ms;
+  uint64_t max_interval_ms = 0;
+  int ready[2];
+  pid_t old_pid;
+  pid_t new_pid;
+  int status;
+  int errors = 0;
+  int num;
+  int fd;
+  int i;
+  char c;
+
+  airptp_ports_override(EVENT_PORT, GENERAL_PORT);
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  inet_pton(AF_INET, "127.0.0.1", &sin.sin_addr);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+    perror("socket/bind");
+    return EXIT_FAILURE;
+  }
+
+  if (pipe(ready) < 0 || pipe(handed_over_pipe) < 0) {
+    perror("pipe");
+    return EXIT_FAILURE;
+  }
+
+  old_pid = fork();
+  if (old_pid == 0)
+    old_daemon_run(ready[1]);
+
+  if (read(ready[0], &c, 1) != 1) {
+    printf("Old daemon failed to start\n");
+    return EXIT_FAILURE;
+  }
+
+  client = airptp_daemon_find();
+  if (!client || airptp_peer_add_port(&peer_id, "127.0.0.1", PEER_PORT, client) < 0) {
+    printf("Client failed: %s\n", airptp_errmsg_get());
+    return EXIT_FAILURE;
+  }
+
+  num = syncs_receive(syncs, 0, fd, now_ns() + 1000000000ULL);
+
+  new_pid = fork();
+  if (new_pid == 0)
+    new_daemon_run(3);
+
+  num = syncs_receive(syncs, num, fd, now_ns() + 2000000000ULL);
+
+  waitpid(old_pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    printf("Old daemon did not exit after handing over\n");
+    errors++;
+  }
+
+  for (i = 1; i < num; i++)
+    {
+      interval_ms = (syncs[i].ts_ns - syncs[i - 1].ts_ns) / 1000000;
+      if (interval_ms > max_interval_ms)
+	max_interval_ms = interval_ms;
+
+      if (syncs[i].seq != (uint16_t)(syncs[i - 1].seq + 1)) {
+	printf("Sequence jumps from %hu to %hu\n", syncs[i - 1].seq, syncs[i].seq);
+	errors++;
+      }
+      if (syncs[i].clock_id != syncs[0].clock_id) {
+	printf("Clock id changed at sequence %hu\n", syncs[i].seq);
+	errors++;
+      }
+      if (interval_ms > SYNC_INTERVAL_MS * 3 / 2) {
+	printf("Interval of %" PRIu64 " ms before sequence %hu\n", interval_ms, syncs[i].seq);
+	errors++;
+      }
+    }
+
+  // 3 s of Syncs, with some slack for the start
+  if (num < 3000 / SYNC_INTERVAL_MS * 8 / 10) {
+    printf("Only %d Syncs received\n", num);
+    errors++;
+  }
+
+  printf("%d Syncs, sequence %hu to %hu, max interval %" PRIu64 " ms: %s\n",
+    num, num ? syncs[0].seq : 0, num ? syncs[num - 1].seq : 0, max_interval_ms, errors ? "FAIL" : "OK");
+
+  waitpid(new_pid, NULL, 0);
+  airptp_end(client);
+  close(fd);
+
+  return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "airptp.h"
+
+// Measures how a daemon answers a registered peer while an unregistered source
+// floods it with Delay_Req. All addresses are on the loopback, so no privileges
+// are needed. The daemon binds 127.0.0.1, the peer is 127.0.0.2 and the flood
+// comes from 127.0.0.3.
+
+#define EVENT_PORT 30319
+#define GENERAL_PORT 30320
+#define PEER_ADDR "127.0.0.2"
+#define ATTACKER_ADDR "127.0.0.3"
+#define NUM_REQUESTS 2000
+
+static volatile bool attack_stop;
+static uint64_t attack_sent;
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+socket_make(const char *addr, unsigned short port)
+{
+  struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons(port) };
+  int fd;
+
+  inet_pton(AF_INET, addr, &sin.sin_addr);
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+    perror("socket/bind");
+    exit(EXIT_FAILURE);
+  }
+
+  return fd;
+}
+
+static void
+delay_req_send(int fd, uint16_t seq)
+{
+  struct sockaddr_in dst = { .sin_family = AF_INET, .sin_port = htons(EVENT_PORT) };
+  uint8_t msg[44] = { 0 };
+
+  inet_pton(AF_INET, "127.0.0.1", &dst.sin_addr);
+
+  msg[0] = 0x11; // majorSdoId 1, Delay_Req
+  msg[1] = 0x02;
+  msg[2] = 0;
+  msg[3] = sizeof(msg);
+  msg[30] = seq >> 8;
+  msg[31] = seq & 0xff;
+
+  sendto(fd, msg, sizeof(msg), 0, (struct sockaddr *)&dst, sizeof(dst));
+}
+
+// Waits for the Delay_Resp with sequence id seq, returns false on timeout
+static bool
+delay_resp_wait(int fd, uint16_t seq, int timeout_ms)
+{
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  uint8_t msg[128];
+  ssize_t len;
+
+  while (poll(&pfd, 1, timeout_ms) > 0) {
+    len = recv(fd, msg, sizeof(msg), 0);
+    if (len >= 32 && (msg[0] & 0x0F) == 0x09 && ((msg[30] << 8) | msg[31]) == seq)
+      return true;
+  }
+
+  return false;
+}
+
+static void *
+attack(void *arg)
+{
+  int fd = *(int *)arg;
+  uint16_t seq = 0;
+
+  while (!attack_stop) {
+    delay_req_send(fd, seq++);
+    attack_sent++;
+  }
+
+  return NULL;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void
+measure(const char *label, int fd)
+{
+  static uint64_t latency[NUM_REQUESTS];
+  uint64_t start;
+  int answered = 0;
+  int i;
+
+  for (i = 0; i < NUM_REQUESTS; i++) {
+    start = now_ns();
+    delay_req_send(fd, i);
+    if (!delay_resp_wait(fd, i, 50))
+      continue;
+
+    latency[answered++] = now_ns() - start;
+  }
+
+  qsort(latency, answered, sizeof(uint64_t), cmp_u64);
+
+  printf("%-16s answered %d/%d, p50 %" PRIu64 " us, p99 %" PRIu64 " us\n", label, answered, NUM_REQUESTS,
+    answered ? latency[answered / 2] / 1000 : 0, answered ? latency[answered * 99 / 100] / 1000 : 0);
+}
+
+static void
+stats_print(struct airptp_handle *hdl)
+{
+  struct airptp_stats stats;
+
+  if (airptp_stats_get(&stats, hdl) < 0)
+    return;
+
+  printf("rx_packets=%" PRIu64 " dropped: invalid=%" PRIu64 " ratelimit=%" PRIu64 " unregistered=%" PRIu64 " ctrl=%" PRIu64 "\n",
+    stats.rx_packets, stats.rx_dropped_invalid, stats.rx_dropped_ratelimit, stats.rx_dropped_unregistered, stats.rx_dropped_ctrl);
+}
+
+int
+main(int argc, char * argv[])
+{
+  struct airptp_handle *hdl;
+  pthread_t tid;
+  uint32_t peer_id;
+  bool peers_only = (argc > 1 && strcmp(argv[1], "-P") == 0);
+  int peer_fd;
+  int attacker_fd;
+  int ret;
+
+  airptp_ports_override(EVENT_PORT, GENERAL_PORT);
+
+  hdl = airptp_daemon_bind("127.0.0.1");
+  if (!hdl)
+    goto error;
+
+  if (peers_only && airptp_daemon_option_set(hdl, AIRPTP_OPT_PEERS_ONLY, 1) < 0)
+    goto error;
+
+  ret = airptp_daemon_start(hdl, 1, false);
+  if (ret < 0)
+    goto error;
+
+  ret = airptp_peer_add(&peer_id, PEER_ADDR, hdl);
+  if (ret < 0)
+    goto error;
+
+  peer_fd = socket_make(PEER_ADDR, GENERAL_PORT);
+  attacker_fd = socket_make(ATTACKER_ADDR, GENERAL_PORT);
+
+  measure("idle", peer_fd);
+
+  pthread_create(&tid, NULL, attack, &attacker_fd);
+  measure("under attack", peer_fd);
+  attack_stop = true;
+  pthread_join(tid, NULL);
+
+  printf("attacker sent %" PRIu64 " requests\n", attack_sent);
+  stats_print(hdl);
+
+  close(peer_fd);
+  close(attacker_fd);
+  airptp_end(hdl);
+
+  return 0;
+
+ error:
+  printf("loadgen.c error: %s\n", airptp_errmsg_get());
+  return -1;
+}
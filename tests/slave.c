@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "airptp.h"
+
+// Runs a master and a slave in this process on the loopback, each with its own
+// unprivileged ports, and prints the slave's servo once per second:
+//
+//   master (30319)  ->  slave (30329)
+//
+// The slave should lock onto the master within a few seconds. Both use the
+// same clock, so the offset should end up close to 0. The servo only says it
+// is locked after a run of samples within 100 us, single samples may be
+// further off.
+//
+// With "standby" the slave is a hot standby, and the master is ended once the
+// standby has locked. The standby should then become master within
+// STANDBY_MS plus a bit, and continue the timeline without a jump.
+//
+// With "boundary" there is a boundary clock in between:
+//
+//   master (30319)  ->  boundary (30329)  ->  slave (30339)
+//
+// The slave only hears the boundary clock, so it should follow that, but end
+// up on the master's time.
+
+#define MASTER_PORT 30319
+#define SLAVE_PORT 30329
+#define BOUNDARY_SLAVE_PORT 30339
+
+#define RUN_SECONDS 10
+#define LOCK_SECONDS 8
+
+#define STANDBY_MS 500
+#define MAX_TAKEOVER_MS (STANDBY_MS + 500)
+#define MAX_JUMP_NS 1000000
+
+// Two servos in a row, each with the bias of software timestamps, which on
+// the loopback tends to make the slave run behind
+#define MAX_CHAIN_OFFSET_NS 500000
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const char *
+servo_state_str(enum airptp_servo_state state)
+{
+  switch (state)
+    {
+      case AIRPTP_SERVO_NONE:
+	return "none";
+      case AIRPTP_SERVO_UNLOCKED:
+	return "unlocked";
+      case AIRPTP_SERVO_LOCKED:
+	return "locked";
+    }
+
+  return "?";
+}
+
+// Ports are taken from airptp_ports_override() when binding. The mode option is
+// only set if mode_value isn't 0.
+static struct airptp_handle *
+daemon_run(const char *name, unsigned short port, uint64_t seed, uint8_t priority1, enum airptp_daemon_option mode, int mode_value)
+{
+  struct airptp_handle *hdl;
+
+  airptp_ports_override(port, port + 1);
+
+  hdl = airptp_daemon_bind(NULL);
+  if (!hdl) {
+    printf("%s: bind failed: %s\n", name, airptp_errmsg_get());
+    exit(EXIT_FAILURE);
+  }
+
+  airptp_daemon_option_set(hdl, AIRPTP_OPT_PRIORITY1, priority1);
+  if (mode_value)
+    airptp_daemon_option_set(hdl, mode, mode_value);
+
+  if (airptp_daemon_start(hdl, seed, false) < 0) {
+    printf("%s: start failed: %s\n", name, airptp_errmsg_get());
+    exit(EXIT_FAILURE);
+  }
+
+  return hdl;
+}
+
+static void
+peer_add(struct airptp_handle *hdl, unsigned short port)
+{
+  uint32_t peer_id;
+
+  if (airptp_peer_add_port(&peer_id, "127.0.0.1", port, hdl) < 0) {
+    printf("Adding peer failed: %s\n", airptp_errmsg_get());
+    exit(EXIT_FAILURE);
+  }
+}
+
+// True if the servo is locked
+static bool
+servo_print(const char *name, struct airptp_handle *hdl, int second)
+{
+  struct airptp_slave_info sinfo;
+
+  if (airptp_slave_info_get(&sinfo, hdl) < 0) {
+    printf("%2d s %-8s no slave info: %s\n", second, name, airptp_errmsg_get());
+    return false;
+  }
+
+  printf("%2d s %-8s %-8s offset %8" PRIi64 " ns, path delay %6" PRIi64 " ns, freq %8.1f ppb, steps %u, samples %u\n",
+    second, name, servo_state_str(sinfo.state), sinfo.offset_ns, sinfo.path_delay_ns, sinfo.freq_ppb, sinfo.steps, sinfo.samples);
+
+  return (sinfo.state == AIRPTP_SERVO_LOCKED);
+}
+
+// Prints the servo each second until it has locked, returns the second or -1
+static int
+lock_wait(const char *name, struct airptp_handle *hdl)
+{
+  int i;
+
+  for (i = 1; i <= LOCK_SECONDS; i++)
+    {
+      sleep(1);
+      if (servo_print(name, hdl, i))
+	return i;
+    }
+
+  return -1;
+}
+
+static int
+slave_test(void)
+{
+  struct airptp_handle *master;
+  struct airptp_handle *slave;
+  int locked_at;
+  int errors = 0;
+  int i;
+
+  master = daemon_run("master", MASTER_PORT, 0x1234, 100, AIRPTP_OPT_SLAVE, 0);
+  slave = daemon_run("slave", SLAVE_PORT, 0x5678, 200, AIRPTP_OPT_SLAVE, 1);
+
+  peer_add(master, SLAVE_PORT);
+
+  locked_at = lock_wait("slave", slave);
+  if (locked_at < 0) {
+    printf("Slave did not lock within %d s\n", LOCK_SECONDS);
+    errors++;
+  }
+
+  // Should stay locked
+  for (i = (locked_at < 0) ? LOCK_SECONDS + 1 : locked_at + 1; i <= RUN_SECONDS; i++)
+    {
+      sleep(1);
+      if (!servo_print("slave", slave, i))
+	errors++;
+    }
+
+  printf("Slave locked after %d s: %s\n", locked_at, errors ? "FAIL" : "OK");
+
+  airptp_end(slave);
+  airptp_end(master);
+
+  return errors;
+}
+
+static int
+standby_test(void)
+{
+  struct airptp_handle *master;
+  struct airptp_handle *standby;
+  struct airptp_port_info pinfo;
+  uint64_t ptp_before_ns;
+  uint64_t ptp_after_ns;
+  uint64_t before_ns;
+  uint64_t ended_ns;
+  uint64_t after_ns;
+  int64_t jump_ns;
+  int takeover_ms = -1;
+  int locked_at;
+  int errors = 0;
+
+  master = daemon_run("master", MASTER_PORT, 0x1234, 100, AIRPTP_OPT_SLAVE, 0);
+  standby = daemon_run("standby", SLAVE_PORT, 0x5678, 200, AIRPTP_OPT_STANDBY, STANDBY_MS);
+
+  peer_add(master, SLAVE_PORT);
+
+  locked_at = lock_wait("standby", standby);
+  if (locked_at < 0) {
+    printf("Standby did not lock within %d s\n", LOCK_SECONDS);
+    airptp_end(standby);
+    airptp_end(master);
+    return 1;
+  }
+
+  before_ns = now_ns();
+  if (airptp_ptp_time_get(&ptp_before_ns, standby) < 0) {
+    printf("No PTP time from standby\n");
+    errors++;
+  }
+
+  airptp_end(master);
+  ended_ns = now_ns();
+
+  while (now_ns() - ended_ns < 2 * (uint64_t)MAX_TAKEOVER_MS * 1000000ULL)
+    {
+      usleep(10000);
+      if (airptp_port_info_get(&pinfo, standby) == 0 && pinfo.state == AIRPTP_PORT_MASTER) {
+	takeover_ms = (now_ns() - ended_ns) / 1000000;
+	break;
+      }
+    }
+
+  if (takeover_ms < 0 || takeover_ms > MAX_TAKEOVER_MS) {
+    printf("Standby took over after %d ms, expected at most %d ms\n", takeover_ms, MAX_TAKEOVER_MS);
+    errors++;
+  }
+
+  // The timeline should have gone on at the same pace across the takeover
+  after_ns = now_ns();
+  if (airptp_ptp_time_get(&ptp_after_ns, standby) < 0) {
+    printf("No PTP time from standby after takeover\n");
+    errors++;
+  }
+
+  jump_ns = (int64_t)(ptp_after_ns - ptp_before_ns) - (int64_t)(after_ns - before_ns);
+  if (llabs(jump_ns) > MAX_JUMP_NS) {
+    printf("Timeline jumped by %" PRIi64 " ns at the takeover\n", jump_ns);
+    errors++;
+  }
+
+  printf("Standby took over after %d ms, timeline off by %" PRIi64 " ns: %s\n", takeover_ms, jump_ns, errors ? "FAIL" : "OK");
+
+  airptp_end(standby);
+
+  return errors;
+}
+
+static int
+boundary_test(void)
+{
+  struct airptp_handle *master;
+  struct airptp_handle *boundary;
+  struct airptp_handle *slave;
+  struct airptp_slave_info sinfo;
+  uint64_t boundary_clock_id;
+  uint64_t master_ns;
+  uint64_t slave_ns;
+  int64_t diff_ns = 0;
+  int locked_at;
+  int errors = 0;
+
+  master = daemon_run("master", MASTER_PORT, 0x1234, 100, AIRPTP_OPT_SLAVE, 0);
+  boundary = daemon_run("boundary", SLAVE_PORT, 0x5678, 150, AIRPTP_OPT_BOUNDARY, 1);
+  slave = daemon_run("slave", BOUNDARY_SLAVE_PORT, 0x9abc, 200, AIRPTP_OPT_SLAVE, 1);
+
+  peer_add(master, SLAVE_PORT);
+  peer_add(boundary, BOUNDARY_SLAVE_PORT);
+
+  locked_at = lock_wait("boundary", boundary);
+  if (locked_at < 0) {
+    printf("Boundary clock did not lock within %d s\n", LOCK_SECONDS);
+    errors++;
+  }
+
+  locked_at = lock_wait("slave", slave);
+  if (locked_at < 0) {
+    printf("Slave did not lock within %d s\n", LOCK_SECONDS);
+    errors++;
+  }
+
+  airptp_clock_id_get(&boundary_clock_id, boundary);
+  if (airptp_slave_info_get(&sinfo, slave) < 0 || sinfo.master_clock_id != boundary_clock_id) {
+    printf("Slave follows %" PRIx64 ", not the boundary clock %" PRIx64 "\n", sinfo.master_clock_id, boundary_clock_id);
+    errors++;
+  }
+
+  if (airptp_ptp_time_get(&master_ns, master) < 0 || airptp_ptp_time_get(&slave_ns, slave) < 0) {
+    printf("No PTP time from master or slave\n");
+    errors++;
+  }
+  else {
+    diff_ns = (int64_t)(slave_ns - master_ns);
+    if (llabs(diff_ns) > MAX_CHAIN_OFFSET_NS) {
+      printf("Slave is %" PRIi64 " ns off the master's time\n", diff_ns);
+      errors++;
+    }
+  }
+
+  printf("Slave is %" PRIi64 " ns off the master through the boundary clock: %s\n", diff_ns, errors ? "FAIL" : "OK");
+
+  airptp_end(slave);
+  airptp_end(boundary);
+  airptp_end(master);
+
+  return errors;
+}
+
+int
+main(int argc, char * argv[])
+{
+  int errors;
+
+  if (argc > 1 && strcmp(argv[1], "standby") == 0)
+    errors = standby_test();
+  else if (argc > 1 && strcmp(argv[1], "boundary") == 0)
+    errors = boundary_test();
+  else if (argc > 1) {
+    printf("Usage: %s [standby|boundary]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  else
+    errors = slave_test();
+
+  return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}